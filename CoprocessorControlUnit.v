@@ -3,7 +3,9 @@
 
 `timescale 1ns / 1ps
 
-module CoprocessorControlUnit (
+module CoprocessorControlUnit #(
+    parameter NUM_VM_SLOTS = 8 // VM slots, 1-64
+) (
     // AXI4-Lite Slave Interface (for CPU commands/status)
     input  wire         s_axi_aclk,
     input  wire         s_axi_aresetn,
@@ -23,6 +25,24 @@ module CoprocessorControlUnit (
     input  wire         s_axi_rready,
     // ... (bresp, rresp signals as needed)
 
+    // AXI4-Lite Slave Interface for the slot memory window (NUM_VM_SLOTS * 16 KB)
+    input  wire [31:0]  s_axi_mem_awaddr,
+    input  wire         s_axi_mem_awvalid,
+    output wire         s_axi_mem_awready,
+    input  wire [31:0]  s_axi_mem_wdata,
+    input  wire         s_axi_mem_wvalid,
+    output wire         s_axi_mem_wready,
+    output wire [1:0]   s_axi_mem_bresp,
+    output wire         s_axi_mem_bvalid,
+    input  wire         s_axi_mem_bready,
+    input  wire [31:0]  s_axi_mem_araddr,
+    input  wire         s_axi_mem_arvalid,
+    output wire         s_axi_mem_arready,
+    output wire [31:0]  s_axi_mem_rdata,
+    output wire [1:0]   s_axi_mem_rresp,
+    output wire         s_axi_mem_rvalid,
+    input  wire         s_axi_mem_rready,
+
 
     // AXI4 Master Interface (for DMA to main memory - conceptual)
     // Connections to the m_axi ports of the KeystoneCoprocessor
@@ -34,6 +54,9 @@ module CoprocessorControlUnit (
     output wire         m_axi_wlast,
     output wire         m_axi_wvalid,
     input  wire         m_axi_wready,
+    input  wire [1:0]   m_axi_bresp,
+    input  wire         m_axi_bvalid,
+    output wire         m_axi_bready,
     // ... (other master AXI signals as needed for DMA write/read)
     output wire [31:0]  m_axi_araddr,
     output wire         m_axi_arvalid,
@@ -45,9 +68,9 @@ module CoprocessorControlUnit (
 
 
     // VM Control Outputs (for 8 eBPF_VM_Slots)
-    output wire [7:0]   vm_start,                // Per VM start signal
-    output wire [7:0]   vm_stop,                 // Per VM stop signal
-    output wire [7:0]   vm_reset,                // Per VM reset signal
+    output wire [NUM_VM_SLOTS-1:0] vm_start,     // Per VM start signal
+    output wire [NUM_VM_SLOTS-1:0] vm_stop,      // Per VM stop signal
+    output wire [NUM_VM_SLOTS-1:0] vm_reset,     // Per VM reset signal
     output wire [31:0]  vm_load_program_addr [NUM_VM_SLOTS-1:0], // Not directly used by VM, but CCU uses info
     output wire [31:0]  vm_data_in_addr [NUM_VM_SLOTS-1:0],      // Not directly used by VM, but CCU uses info
 
@@ -56,6 +79,24 @@ module CoprocessorControlUnit (
     output wire [DATA_WIDTH_AXI-1:0]         vm_wr_prog_data [NUM_VM_SLOTS-1:0],
     output wire [NUM_VM_SLOTS-1:0]             vm_wr_prog_en,
 
+    // VM Program Memory Read Interface (slot memory window); one address for all slots
+    output wire [VM_PROG_MEM_ADDR_WIDTH-1:0] vm_rd_prog_addr,
+    input  wire [DATA_WIDTH_AXI-1:0]         vm_rd_prog_data [NUM_VM_SLOTS-1:0],
+
+    // VM Data Memory Read Interface (output write-back, slot memory window); one address for all slots
+    output wire [VM_DATA_MEM_ADDR_WIDTH-1:0] vm_rd_data_addr,
+    output wire                              vm_rd_data_bank,   // Stack memory bank the read comes from
+    input  wire [DATA_WIDTH_AXI-1:0]         vm_rd_data [NUM_VM_SLOTS-1:0],
+
+    // VM Data Memory Write Interface (LOAD_DATA_IN and batch records); one address for all slots
+    output wire [VM_DATA_MEM_ADDR_WIDTH-1:0] vm_wr_data_addr,
+    output wire [DATA_WIDTH_AXI-1:0]         vm_wr_data_data,
+    output wire [NUM_VM_SLOTS-1:0]           vm_wr_data_en,
+    output wire                              vm_wr_data_bank,   // Stack memory bank the write goes to
+    // Double-buffered data-in: each slot's active bank, and a swap with its start
+    input  wire [NUM_VM_SLOTS-1:0]           vm_data_bank,
+    output wire [NUM_VM_SLOTS-1:0]           vm_data_swap,
+
     // VM Mailbox Interface with CCU (PicoRV32 access)
     // VM writes to its OUT mailbox (which CPU reads from CCU)
     input  wire [$clog2(NUM_MAILBOX_REGS)-1:0]    vm_mailbox_out_idx_i [NUM_VM_SLOTS-1:0],
@@ -64,13 +105,17 @@ module CoprocessorControlUnit (
     // VM reads from its IN mailbox (which CPU writes to CCU)
     input  wire [$clog2(NUM_MAILBOX_REGS)-1:0]    vm_mailbox_in_idx_i [NUM_VM_SLOTS-1:0],
     output wire [DATA_WIDTH_AXI-1:0]              vm_mailbox_in_rdata_o [NUM_VM_SLOTS-1:0],
+    // Mailbox FIFO mode: the VM consumed the IN word it read; {OUT free, IN count} for the VM
+    input  wire                                 vm_mailbox_in_pop_i [NUM_VM_SLOTS-1:0],
+    output wire [DATA_WIDTH_AXI-1:0]              vm_mailbox_status_o [NUM_VM_SLOTS-1:0],
     // output wire                               vm_mailbox_in_valid_o [NUM_VM_SLOTS-1:0], // Optional for now
 
     // VM Status Inputs (from 8 eBPF_VM_Slots)
-    input  wire [7:0]   vm_ready,                // Per VM ready signal
-    input  wire [7:0]   vm_done,                 // Per VM done signal
-    input  wire [7:0]   vm_error,                // Per VM error signal
-    input  wire [31:0]  vm_data_out_addr [7:0],   // Per VM output data address
+    input  wire [NUM_VM_SLOTS-1:0] vm_ready,     // Per VM ready signal
+    input  wire [NUM_VM_SLOTS-1:0] vm_done,      // Per VM done signal
+    input  wire [NUM_VM_SLOTS-1:0] vm_error,     // Per VM error signal
+    input  wire [DATA_WIDTH_AXI-1:0] vm_retval [NUM_VM_SLOTS-1:0], // Per VM low word of R0, valid when done rises
+    input  wire [31:0]  vm_data_out_addr [NUM_VM_SLOTS-1:0], // Per VM output data address
 
     // Interrupt Output to KeystoneCoprocessor
     output wire         interrupt_out,
@@ -81,10 +126,23 @@ module CoprocessorControlUnit (
 );
 
     // Parameters
-    localparam NUM_VM_SLOTS = 8;
-    localparam ADDR_WIDTH_CPU_IF_AXI = 8; // Address width for AXI interface (e.g., 8 bits for 256 bytes)
+    localparam VM_ID_WIDTH = (NUM_VM_SLOTS > 1) ? $clog2(NUM_VM_SLOTS) : 1;
+    localparam LEGACY_SLOTS = (NUM_VM_SLOTS < 8) ? NUM_VM_SLOTS : 8; // Slots in INT_STATUS_REG and COPRO_STATUS_REG
+    // Address width for AXI interface: 4 KB of global CSRs and the first eight
+    // per-VM pages, then one more page per slot from VM_XPAGE_BASE on
+    localparam ADDR_WIDTH_CPU_IF_AXI = (NUM_VM_SLOTS <= 8) ? 12 : 16;
+
+    // VM_SELECT_REG, the VM interrupt block and the page map stop at 64 slots
+    generate
+        if (NUM_VM_SLOTS < 1 || NUM_VM_SLOTS > 64) begin : num_vm_slots_check
+            $error("CoprocessorControlUnit: NUM_VM_SLOTS must be 1-64");
+        end
+    endgenerate
     localparam DATA_WIDTH_AXI = 32;
     localparam VM_PROG_MEM_ADDR_WIDTH = 11; // $clog2(2048 words for prog_mem in eBPF_VM_Slot)
+    localparam VM_DATA_MEM_ADDR_WIDTH = 10; // $clog2(1024 words for stack_mem in eBPF_VM_Slot)
+    localparam VM_DATA_MEM_BYTES      = 4096;
+    localparam VM_PROG_MEM_BYTES      = 8192;
 
     // Memory Map Address Parameters
     localparam ADDR_COPRO_CMD_REG                = 8'h00;
@@ -102,18 +160,154 @@ module CoprocessorControlUnit (
     localparam ADDR_SELECTED_VM_STATUS_REG       = 8'h30;
     localparam ADDR_SELECTED_VM_PC_REG           = 8'h34;
     localparam ADDR_SELECTED_VM_DATA_OUT_ADDR_REG = 8'h38;
+    localparam ADDR_SELECTED_VM_RETVAL_REG       = 8'h3C;
+    localparam ADDR_DMA_RING_BASE_LOW_REG        = 8'h40;
+    localparam ADDR_DMA_RING_BASE_HIGH_REG       = 8'h44;
+    localparam ADDR_DMA_RING_SIZE_REG            = 8'h48;
+    localparam ADDR_DMA_RING_HEAD_REG            = 8'h4C; // Read-only, advanced by the DMA engine
+    localparam ADDR_DMA_RING_TAIL_REG            = 8'h50; // Doorbell
+    localparam ADDR_SQ_BASE_LOW_REG              = 8'h54;
+    localparam ADDR_SQ_BASE_HIGH_REG             = 8'h58;
+    localparam ADDR_CQ_BASE_LOW_REG              = 8'h5C;
+    localparam ADDR_CQ_BASE_HIGH_REG             = 8'h60;
+    localparam ADDR_QUEUE_SIZE_REG               = 8'h64;
+    localparam ADDR_SQ_TAIL_REG                  = 8'h68; // Doorbell
+    localparam ADDR_SQ_HEAD_REG                  = 8'h6C; // Read-only
+    localparam ADDR_CQ_HEAD_REG                  = 8'h70;
+    localparam ADDR_CQ_TAIL_REG                  = 8'h74; // Read-only
+    localparam ADDR_SELECTED_VM_PROG_HANDLE_REG  = 8'h78; // Read-only, 0: no program cache in hardware
+    localparam ADDR_DATA_OUT_LEN_REG             = 8'h7C;
     localparam ADDR_MAILBOX_DATA_IN_0_REG        = 8'h80; // Start of Mailbox IN regs
+    localparam ADDR_MBOX_FIFO_CTRL_REG           = 8'h90;
+    localparam ADDR_MBOX_FIFO_STATUS_REG         = 8'h94; // Read-only
+    localparam ADDR_MBOX_IRQ_STATUS_REG          = 8'h98; // Read-only, level
+    localparam ADDR_MBOX_IRQ_ENABLE_REG          = 8'h9C;
     localparam ADDR_MAILBOX_DATA_OUT_0_REG       = 8'hA0; // Start of Mailbox OUT regs
+    localparam ADDR_IRQ_MOD_VM_DONE_REG          = 8'hC0;
+    localparam ADDR_IRQ_MOD_VM_ERROR_REG         = 8'hC4;
+    localparam ADDR_IRQ_MOD_DMA_REG              = 8'hC8;
+    localparam ADDR_IRQ_MOD_CTRL_REG             = 8'hCC;
+    // Program cache (host model only): capacity, hits and misses all read 0 here
+    localparam ADDR_PROG_CACHE_STATUS_REG        = 8'hD0;
+    localparam ADDR_PROG_CACHE_HITS_REG          = 8'hD4;
+    localparam ADDR_PROG_CACHE_MISSES_REG        = 8'hD8;
+    localparam ADDR_SELECTED_VM_DATA_OUT_LEN_REG = 8'hDC; // Read-only
     localparam ADDR_COPRO_VERSION_REG            = 8'hFC;
 
+    // Per-VM register pages: VM n's page starts at (n + 1) * 256 and repeats the
+    // per-VM registers (COPRO_CMD, address/length, SELECTED_VM_*, mailboxes) at
+    // their offsets above, for that VM only. VM_SELECT_REG is not involved.
+    localparam VM_PAGE_SHIFT                     = 8;
+    localparam VM_XPAGE_BASE                     = 16'h1000; // Page of slot 8; slots 9 and up follow
+    // Batch record mode (START_BATCH), page-only
+    localparam ADDR_VM_BATCH_REC_SIZE_REG        = 8'h44;
+    localparam ADDR_VM_BATCH_COUNT_REG           = 8'h48;
+    localparam ADDR_VM_BATCH_OUT_STRIDE_REG      = 8'h4C;
+    localparam ADDR_VM_BATCH_DONE_REG            = 8'h50; // Read-only
+    localparam BATCH_MAX_RECORDS                 = 65536;
+    // Double-buffered data-in, page-only: [0] PINGPONG, [1] ACTIVE (bank 1), [2] READY
+    localparam ADDR_VM_DATA_BUF_REG              = 8'h54;
+    // Page-only, read-only: [7:0] LOAD_PROG/LOAD_DATA_IN requests queued, [8] LOADING
+    localparam ADDR_VM_DMA_QUEUE_REG             = 8'h58;
+    // Slot memory window, page-only: lengths of what was stored through it, and
+    // MEM_CTRL [0] WRITE_LOCK (program and active data buffer read-only during a run)
+    localparam ADDR_VM_MEM_PROG_LEN_REG          = 8'h28;
+    localparam ADDR_VM_MEM_DATA_LEN_REG          = 8'h2C;
+    localparam ADDR_VM_MEM_CTRL_REG              = 8'h40;
+
+    // Performance counters: 64-bit, read as LOW (+0) then HIGH (+4); reading
+    // LOW latches the upper half for HIGH. Global ones in their own block,
+    // per-VM ones at the end of each VM page.
+    localparam [11:0] ADDR_PERF_CTRL_REG         = 12'h900; // [0] W: clear all counters
+    localparam [11:0] ADDR_PERF_DMA_BYTES_REG    = 12'h908;
+    localparam [11:0] ADDR_PERF_DMA_BUSY_NS_REG  = 12'h910;
+    localparam [11:0] ADDR_PERF_DMA_XFERS_REG    = 12'h918;
+    localparam [11:0] ADDR_PERF_CMD_REJECTED_REG = 12'h920;
+    localparam [11:0] ADDR_PERF_IRQ_EVENTS_REG   = 12'h928;
+    localparam [11:0] ADDR_PERF_IRQ_ASSERTS_REG  = 12'h930;
+    localparam [11:0] ADDR_PERF_DMA_QUEUED_REG   = 12'h938;
+    localparam [11:0] ADDR_PERF_DMA_QUEUE_WAIT_NS_REG = 12'h940;
+    localparam [11:0] ADDR_PERF_DMA_QUEUE_PEAK_REG    = 12'h948;
+    localparam [11:0] ADDR_PERF_DMA_CHAN_BUSY_NS_REG  = 12'h980; // Channel c at +8c; only channel 0 here
+    localparam [11:0] PERF_BLOCK_END             = 12'hA00;
+    localparam ADDR_VM_PERF_RUNS_REG             = 8'hE0; // Page offsets
+
+    // VM interrupt block: 64-bit LOW (slots 31:0) / HIGH (slots 63:32) views of
+    // every slot's VMi_DONE/VMi_ERROR status and enable bits and of the active
+    // mask. INT_STATUS_REG/INT_ENABLE_REG only show slots 0-7.
+    localparam [11:0] ADDR_VM_CONFIG_REG         = 12'hA00; // [6:0] NUM_SLOTS
+    localparam [11:0] ADDR_VM_DONE_STATUS_REG    = 12'hA08; // W1C
+    localparam [11:0] ADDR_VM_ERROR_STATUS_REG   = 12'hA10; // W1C
+    localparam [11:0] ADDR_VM_DONE_ENABLE_REG    = 12'hA18;
+    localparam [11:0] ADDR_VM_ERROR_ENABLE_REG   = 12'hA20;
+    localparam [11:0] ADDR_VM_ACTIVE_MASK_REG    = 12'hA28;
+    localparam ADDR_VM_PERF_INSNS_REG            = 8'hE8; // Reads 0: the slot firmware does not report retired instructions
+    localparam ADDR_VM_PERF_ERRORS_REG           = 8'hF0;
+    localparam ADDR_VM_PERF_DMA_BYTES_REG        = 8'hF8;
+
     localparam NUM_MAILBOX_REGS = 4; // Example: 4 mailbox registers (16 bytes)
 
+    // Mailbox FIFO mode (see AXI_Lite_Memory_Map.txt). MBOX_FIFO_CTRL_REG: [0] EN,
+    // [11:8] DEPTH_LOG2, [23:16] IN_WMARK, [31:24] OUT_WMARK. With EN set, writes to
+    // any IN mailbox offset push the IN FIFO, reads of any OUT offset pop the OUT
+    // FIFO, and the slot's mailbox port pushes/pops the other ends. FIFOs here
+    // hold at most 2^MBOX_FIFO_MAX_LOG2 words; DEPTH_LOG2 is clamped to that.
+    localparam MBOX_FIFO_MAX_LOG2    = 4;
+    localparam MBOX_FIFO_MAX_DEPTH   = 1 << MBOX_FIFO_MAX_LOG2;
+    localparam [31:0] MBOX_FIFO_CTRL_MASK = 32'hFFFF0F01;
+
+    // DMA descriptor ring (see AXI_Lite_Memory_Map.txt). 32-byte descriptors:
+    // word 0 = {sg_count[31:16], op[15:8], vm_id[7:0]}, words 2-3 = SG list address,
+    // words 4-5 = driver cookie, word 6 = len and word 7 = status (written back).
+    // 16-byte SG entries: words 0-1 = buffer address, word 2 = length in bytes.
+    localparam DMA_RING_MAX_ENTRIES = 4096;
+    localparam DMA_MAX_SG           = 64;
+    localparam DMA_OP_PROG          = 8'd1;
+    localparam DMA_OP_DATA_IN       = 8'd2;
+    localparam DMA_OP_DATA_OUT      = 8'd3; // Not streamed by the ring engine; rejected for now
+    localparam DMA_DESC_OK          = 32'd1;
+    localparam DMA_DESC_ERR_DESC    = 32'd2;
+    localparam DMA_DESC_ERR_BUS     = 32'd3;
+    localparam DMA_DESC_ERR_BUSY    = 32'd4;
+
+    // DMA channels (see AXI_Lite_Memory_Map.txt). This CCU has one channel, the
+    // one AXI master state machine; LOAD_PROG and LOAD_DATA_IN queue per slot
+    // and the idle engine picks round-robin among the slot queues and the ring.
+    localparam [11:0] ADDR_DMA_CHAN_CONFIG_REG   = 12'hB40; // [3:0] channels, [15:8] queue depth
+    localparam [11:0] ADDR_DMA_CHAN_BUSY_REG     = 12'hB44;
+    localparam [11:0] ADDR_DMA_CHAN_DONE_REG     = 12'hB48; // W1C
+    localparam [11:0] ADDR_DMA_CHAN_ERROR_REG    = 12'hB4C; // W1C
+    localparam DMA_QUEUE_DEPTH      = 4;
+
+    // Submission/completion queue pair (see AXI_Lite_Memory_Map.txt). Only the
+    // register file is implemented here; the sequencer that fetches SQ entries,
+    // starts the slots and posts CQ entries is modelled in QEMU so far, so
+    // SQ_HEAD and CQ_TAIL stay at 0.
+    localparam QUEUE_MAX_ENTRIES    = 4096;
+
+    // Interrupt moderation classes (see AXI_Lite_Memory_Map.txt). IRQ_MOD_<class>_REG:
+    // [15:0] event count, [31:16] timeout in microseconds after the first event.
+    localparam IRQ_NUM_CLASSES        = 3;
+    // Interrupt sources as one vector: VMi_DONE at [i], VMi_ERROR at
+    // [NUM_VM_SLOTS + i], then DMA_DONE, DMA_ERROR, CQ and MBOX. With 8 slots
+    // this is the INT_STATUS_REG layout.
+    localparam IRQ_VEC_W         = 2 * NUM_VM_SLOTS + 4;
+    localparam IRQ_DMA_DONE_BIT  = 2 * NUM_VM_SLOTS;
+    localparam IRQ_DMA_ERROR_BIT = 2 * NUM_VM_SLOTS + 1;
+    localparam IRQ_MBOX_BIT      = 2 * NUM_VM_SLOTS + 3;
+    localparam [IRQ_VEC_W-1:0] IRQ_CLASS_VM_DONE_MASK  = {4'b1100, {NUM_VM_SLOTS{1'b0}}, {NUM_VM_SLOTS{1'b1}}}; // VMi_DONE, CQ, MBOX
+    localparam [IRQ_VEC_W-1:0] IRQ_CLASS_VM_ERROR_MASK = {4'b0000, {NUM_VM_SLOTS{1'b1}}, {NUM_VM_SLOTS{1'b0}}}; // VMi_ERROR
+    localparam [IRQ_VEC_W-1:0] IRQ_CLASS_DMA_MASK      = {4'b0011, {(2*NUM_VM_SLOTS){1'b0}}};                // DMA_DONE, DMA_ERROR
+    localparam [IRQ_VEC_W-1:0] IRQ_ERROR_MASK          = {4'b0010, {NUM_VM_SLOTS{1'b1}}, {NUM_VM_SLOTS{1'b0}}}; // Bypass moderation when IRQ_MOD_CTRL[0] is set
+    localparam IRQ_MOD_CLKS_PER_US    = 100;               // s_axi_aclk cycles per microsecond (100 MHz)
+    localparam PERF_NS_PER_CLK        = 1000 / IRQ_MOD_CLKS_PER_US; // PERF_DMA_BUSY_NS step
+
     // Internal Registers
     reg [DATA_WIDTH_AXI-1:0] copro_cmd_reg_r;
-    reg [2:0]                vm_select_id_r; // VM_ID is bits [2:0]
+    reg [VM_ID_WIDTH-1:0]    vm_select_id_r;
     // COPRO_STATUS_REG: [0] BUSY, [15:8] ACTIVE_VM_MASK (Read-Only by CPU)
     reg                      copro_busy_status_r; // Internal signal driving COPRO_STATUS_REG[0]
-    reg [NUM_VM_SLOTS-1:0]   active_vm_mask_r;  // Internal signal driving COPRO_STATUS_REG[15:8]
+    reg [NUM_VM_SLOTS-1:0]   active_vm_mask_r;  // Internal signal driving COPRO_STATUS_REG[15:8] (slots 0-7)
     reg [DATA_WIDTH_AXI-1:0] prog_addr_low_reg_r;
     reg [DATA_WIDTH_AXI-1:0] prog_addr_high_reg_r;
     reg [DATA_WIDTH_AXI-1:0] data_in_addr_low_reg_r;
@@ -121,8 +315,63 @@ module CoprocessorControlUnit (
     reg [DATA_WIDTH_AXI-1:0] data_out_addr_low_reg_r;
     reg [DATA_WIDTH_AXI-1:0] data_out_addr_high_reg_r;
     reg [DATA_WIDTH_AXI-1:0] data_len_reg_r;
-    reg [DATA_WIDTH_AXI-1:0] int_status_reg_r;    // Bits [17:0] used
-    reg [DATA_WIDTH_AXI-1:0] int_enable_reg_r;    // Bits [17:0] used
+    reg [DATA_WIDTH_AXI-1:0] data_out_len_reg_r;
+    reg [IRQ_VEC_W-1:0]      int_status_reg_r;    // MBOX bit unused: it is the level mbox_irq_w
+    reg [IRQ_VEC_W-1:0]      int_enable_reg_r;
+    reg [DATA_WIDTH_AXI-1:0] dma_ring_base_low_r;
+    reg [DATA_WIDTH_AXI-1:0] dma_ring_base_high_r; // Stored for software; the AXI master is 32-bit
+    reg [DATA_WIDTH_AXI-1:0] dma_ring_size_r;      // Entries: 0 (disabled) or a power of two
+    reg [DATA_WIDTH_AXI-1:0] dma_ring_head_r;      // Owned by the DMA state machine
+    reg [DATA_WIDTH_AXI-1:0] dma_ring_tail_r;
+    reg [DATA_WIDTH_AXI-1:0] sq_base_low_r;
+    reg [DATA_WIDTH_AXI-1:0] sq_base_high_r;
+    reg [DATA_WIDTH_AXI-1:0] cq_base_low_r;
+    reg [DATA_WIDTH_AXI-1:0] cq_base_high_r;
+    reg [DATA_WIDTH_AXI-1:0] queue_size_r;         // Entries per queue: 0 (disabled) or a power of two
+    reg [DATA_WIDTH_AXI-1:0] sq_head_r;            // Owned by the queue sequencer
+    reg [DATA_WIDTH_AXI-1:0] sq_tail_r;
+    reg [DATA_WIDTH_AXI-1:0] cq_head_r;
+    reg [DATA_WIDTH_AXI-1:0] cq_tail_r;            // Owned by the queue sequencer
+    reg [DATA_WIDTH_AXI-1:0] irq_mod_reg_r [IRQ_NUM_CLASSES-1:0];
+    reg                      irq_mod_err_bypass_r; // IRQ_MOD_CTRL_REG[0]
+    // Per-VM page copies of the address/length registers
+    reg [DATA_WIDTH_AXI-1:0] page_prog_addr_low_r     [NUM_VM_SLOTS-1:0];
+    reg [DATA_WIDTH_AXI-1:0] page_prog_addr_high_r    [NUM_VM_SLOTS-1:0];
+    reg [DATA_WIDTH_AXI-1:0] page_data_in_addr_low_r  [NUM_VM_SLOTS-1:0];
+    reg [DATA_WIDTH_AXI-1:0] page_data_in_addr_high_r [NUM_VM_SLOTS-1:0];
+    reg [DATA_WIDTH_AXI-1:0] page_data_out_addr_low_r [NUM_VM_SLOTS-1:0];
+    reg [DATA_WIDTH_AXI-1:0] page_data_out_addr_high_r[NUM_VM_SLOTS-1:0];
+    reg [DATA_WIDTH_AXI-1:0] page_data_len_r          [NUM_VM_SLOTS-1:0];
+    reg [DATA_WIDTH_AXI-1:0] page_data_out_len_r      [NUM_VM_SLOTS-1:0];
+    reg [DATA_WIDTH_AXI-1:0] page_batch_rec_size_r    [NUM_VM_SLOTS-1:0];
+    reg [DATA_WIDTH_AXI-1:0] page_batch_count_r       [NUM_VM_SLOTS-1:0];
+    reg [DATA_WIDTH_AXI-1:0] page_batch_stride_r      [NUM_VM_SLOTS-1:0];
+    reg [NUM_VM_SLOTS-1:0]   page_data_pingpong_r;     // DATA_BUF_REG PINGPONG
+    reg [NUM_VM_SLOTS-1:0]   page_mem_lock_r;          // VM_MEM_CTRL_REG WRITE_LOCK
+    reg [NUM_VM_SLOTS-1:0]   vm_mem_locked_r;          // WRITE_LOCK taken at the last start
+    reg [DATA_WIDTH_AXI-1:0] vm_mem_prog_len_r        [NUM_VM_SLOTS-1:0]; // VM_MEM_PROG_LEN_REG (DMA block)
+    reg [DATA_WIDTH_AXI-1:0] vm_mem_data_len_r        [NUM_VM_SLOTS-1:0]; // VM_MEM_DATA_LEN_REG (DMA block)
+    // Output write-back destination latched by START_VM (length in bytes, 0: off)
+    reg [DATA_WIDTH_AXI-1:0] vm_out_addr_r            [NUM_VM_SLOTS-1:0];
+    reg [DATA_WIDTH_AXI-1:0] vm_out_max_r             [NUM_VM_SLOTS-1:0];
+    // Performance counters
+    reg [63:0] perf_dma_bytes_r;
+    reg [63:0] perf_dma_busy_ns_r;
+    reg [63:0] perf_dma_xfers_r;
+    reg [63:0] perf_cmd_rejected_r;
+    reg [63:0] perf_irq_events_r;
+    reg [63:0] perf_irq_asserts_r;
+    reg [63:0] perf_dma_queued_r;
+    reg [63:0] perf_dma_queue_wait_ns_r;
+    reg [63:0] perf_dma_queue_peak_r;
+    reg [63:0] perf_vm_runs_r      [NUM_VM_SLOTS-1:0];
+    reg [63:0] perf_vm_errors_r    [NUM_VM_SLOTS-1:0];
+    reg [63:0] perf_vm_dma_bytes_r [NUM_VM_SLOTS-1:0];
+    reg [63:0] perf_rd_snap_r;      // Counter addressed by the read in progress
+    reg [31:0] perf_high_r;         // Upper half latched by the last LOW read
+    reg [IRQ_VEC_W-1:0] perf_int_status_prev_r;
+    reg        perf_irq_prev_r;
+    reg [NUM_VM_SLOTS-1:0] perf_vm_error_prev_r;
 
     // Per-VM status registers are read-only by CPU and reflect internal state based on vm_select_id_r
     // These are not directly writable registers but muxed outputs.
@@ -166,31 +415,115 @@ module CoprocessorControlUnit (
     reg [DATA_WIDTH_AXI-1:0] vm_status_regs_array_r [NUM_VM_SLOTS-1:0];
     reg [DATA_WIDTH_AXI-1:0] vm_pc_regs_array_r [NUM_VM_SLOTS-1:0];
     reg [DATA_WIDTH_AXI-1:0] vm_data_out_addr_regs_array_r [NUM_VM_SLOTS-1:0];
+    reg [DATA_WIDTH_AXI-1:0] vm_retval_regs_array_r [NUM_VM_SLOTS-1:0]; // Low word of R0 at EXIT
+    reg [NUM_VM_SLOTS-1:0]   vm_done_prev_r;       // For the done edge that latches the return value
 
     // Placeholder for VM control signals (driven by CCU internal logic)
     reg [NUM_VM_SLOTS-1:0]   internal_vm_start_r; // These become the pulsed outputs
     reg [NUM_VM_SLOTS-1:0]   internal_vm_stop_r;  // These become the pulsed outputs
     reg [NUM_VM_SLOTS-1:0]   internal_vm_reset_r; // These become the pulsed outputs
+    reg [NUM_VM_SLOTS-1:0]   vm_data_swap_r;      // With internal_vm_start_r: run on the filled bank
+    reg [NUM_VM_SLOTS-1:0]   vm_data_ready_r;     // The free bank was filled since the last swap (DMA block)
 
     wire dma_busy_actual_w; // Actual DMA busy signal
     assign dma_busy_placeholder_w = dma_busy_actual_w; // Connect actual to placeholder for now
 
     // DMA State Machine
-    localparam DMA_IDLE        = 3'd0;
-    localparam DMA_START_REQ   = 3'd1; // Check request and latch parameters
-    localparam DMA_CALC_BURST  = 3'd2; // Calculate burst parameters
-    localparam DMA_INIT_READ   = 3'd3; // Assert ARVALID
-    localparam DMA_READ_BURST  = 3'd4; // Wait for RVALID, RLAST
-    localparam DMA_DONE        = 3'd5;
-    localparam DMA_ERROR       = 3'd6;
-    reg [2:0] dma_state_r;
+    localparam DMA_IDLE        = 5'd0;
+    localparam DMA_START_REQ   = 5'd1; // Check request and latch parameters
+    localparam DMA_CALC_BURST  = 5'd2; // Calculate burst parameters
+    localparam DMA_INIT_READ   = 5'd3; // Assert ARVALID
+    localparam DMA_READ_BURST  = 5'd4; // Wait for RVALID, RLAST
+    localparam DMA_DONE        = 5'd5;
+    localparam DMA_ERROR       = 5'd6;
+    // Descriptor ring: fetch descriptor, then per SG entry fetch it and run
+    // CALC_BURST..READ_BURST, then write len/status back and advance the head
+    localparam DMA_DESC_FETCH  = 5'd7;
+    localparam DMA_DESC_READ   = 5'd8;
+    localparam DMA_SG_FETCH    = 5'd9;
+    localparam DMA_SG_READ     = 5'd10;
+    localparam DMA_DESC_WB_ADDR = 5'd11;
+    localparam DMA_DESC_WB_DATA = 5'd12;
+    localparam DMA_DESC_WB_RESP = 5'd13;
+    localparam DMA_DESC_NEXT   = 5'd14;
+    // Output write-back after a run: one single-beat write per data memory word
+    localparam DMA_OUT_ADDR    = 5'd15;
+    localparam DMA_OUT_DATA    = 5'd16;
+    localparam DMA_OUT_RESP    = 5'd17;
+    // Batch result: R0 to the record's entry in the result array
+    localparam DMA_BATCH_WB_ADDR = 5'd18;
+    localparam DMA_BATCH_WB_DATA = 5'd19;
+    localparam DMA_BATCH_WB_RESP = 5'd20;
+    reg [4:0] dma_state_r;
 
     // DMA Internal Configuration Registers
     reg [DATA_WIDTH_AXI-1:0] dma_addr_r;         // Current DMA address (from CPU regs)
     reg [DATA_WIDTH_AXI-1:0] dma_len_bytes_r;    // Total length in bytes (from CPU regs)
-    reg [2:0]                dma_target_vm_id_r; // Selected VM for this DMA op
+    reg [VM_ID_WIDTH-1:0]    dma_target_vm_id_r; // Selected VM for this DMA op
     reg                      dma_op_is_prog_load_r; // True if program load, false if data_in load
 
+    // Descriptor ring processing state
+    reg                      dma_from_ring_r;      // Current transfer belongs to the descriptor at the ring head
+    reg [DATA_WIDTH_AXI-1:0] dma_desc_addr_r;
+    reg [DATA_WIDTH_AXI-1:0] dma_desc_word0_r;     // {sg_count, op, vm_id}
+    reg [DATA_WIDTH_AXI-1:0] dma_sg_list_addr_r;
+    reg [15:0]               dma_sg_index_r;
+    reg [DATA_WIDTH_AXI-1:0] dma_sg_addr_r;
+    reg [DATA_WIDTH_AXI-1:0] dma_sg_len_r;
+    reg [DATA_WIDTH_AXI-1:0] dma_desc_len_r;       // Bytes moved so far, written back as len
+    reg [DATA_WIDTH_AXI-1:0] dma_desc_status_r;
+    reg [2:0]                dma_beat_r;           // Beat index within a descriptor/SG fetch
+    reg                      dma_beat_err_r;       // Error response seen during the current fetch
+    reg                      dma_wb_word_r;        // 0: writing len, 1: writing status
+
+    // Output write-back state
+    reg [NUM_VM_SLOTS-1:0]   dma_out_pending_r;    // Run finished with write-back to do; DONE held back
+    reg [VM_ID_WIDTH-1:0]    dma_out_vm_r;
+    reg [VM_DATA_MEM_ADDR_WIDTH:0] dma_out_word_r;  // Next data memory word to write
+    reg [VM_DATA_MEM_ADDR_WIDTH:0] dma_out_words_r; // Words to write
+    reg [DATA_WIDTH_AXI-1:0] vm_out_len_r [NUM_VM_SLOTS-1:0]; // Bytes the last run wrote back
+    reg [NUM_VM_SLOTS-1:0]   vm_out_err_r;         // Last write-back failed: ERROR_CODE 7
+
+    // Batch record sequencer (START_BATCH), one batch at a time. Per record:
+    // LOAD (record DMA into data memory), RUN (slot started, wait for DONE or
+    // ERROR), STORE (result written), NEXT. XFER while the DMA engine works
+    // on a record or result for it.
+    localparam BATCH_LOAD  = 3'd0;
+    localparam BATCH_XFER  = 3'd1;
+    localparam BATCH_RUN   = 3'd2;
+    localparam BATCH_STORE = 3'd3;
+    localparam BATCH_NEXT  = 3'd4;
+    reg                      batch_active_r;
+    reg [2:0]                batch_phase_r;
+    reg [VM_ID_WIDTH-1:0]    batch_vm_r;
+    reg [DATA_WIDTH_AXI-1:0] batch_in_addr_r;      // Next record
+    reg [DATA_WIDTH_AXI-1:0] batch_out_addr_r;     // Next result entry
+    reg [DATA_WIDTH_AXI-1:0] batch_rec_size_r;
+    reg [DATA_WIDTH_AXI-1:0] batch_stride_r;
+    reg [16:0]               batch_left_r;         // Records not finished yet
+    reg                      batch_start_r;        // Pulse: start the slot on the record just loaded
+    reg                      batch_end_r;          // Pulse: the batch is over, the slot goes idle
+    reg                      batch_vm_done_prev_r; // For edges of the batch slot's done/error
+    reg                      batch_vm_error_prev_r;
+    reg                      dma_for_batch_r;      // The DMA engine is moving a record or result
+    reg [16:0]               vm_batch_done_r [NUM_VM_SLOTS-1:0]; // BATCH_DONE_REG
+    reg [NUM_VM_SLOTS-1:0]   vm_batch_err_r;       // A record or result transfer failed: ERROR_CODE 8
+
+    // Per-slot LOAD_PROG/LOAD_DATA_IN queues, served in order; the ring takes
+    // a turn in the round-robin after slot NUM_VM_SLOTS - 1
+    reg [DATA_WIDTH_AXI-1:0] dma_q_addr_r [NUM_VM_SLOTS-1:0][DMA_QUEUE_DEPTH-1:0];
+    reg [DATA_WIDTH_AXI-1:0] dma_q_len_r  [NUM_VM_SLOTS-1:0][DMA_QUEUE_DEPTH-1:0];
+    reg [DMA_QUEUE_DEPTH-1:0] dma_q_prog_r [NUM_VM_SLOTS-1:0];
+    reg [$clog2(DMA_QUEUE_DEPTH)-1:0] dma_q_head_r  [NUM_VM_SLOTS-1:0];
+    reg [$clog2(DMA_QUEUE_DEPTH):0]   dma_q_count_r [NUM_VM_SLOTS-1:0];
+    reg [VM_ID_WIDTH:0]      dma_rr_r;             // Last requester served: slot, or NUM_VM_SLOTS for the ring
+    reg                      dma_chan_done_r;      // DMA_CHAN_DONE_REG bit 0
+    reg                      dma_chan_error_r;     // DMA_CHAN_ERROR_REG bit 0
+
+    wire dma_ring_busy_w;    // Descriptors outstanding (HEAD != TAIL)
+    wire dma_ring_size_ok_w; // Write data is a valid DMA_RING_SIZE
+    wire dma_ring_reset_w;   // Accepted DMA_RING_SIZE write: head and tail return to 0
+
     // AXI Master Read Channel Internal Signals (registers to drive m_axi_ar*)
     reg [DATA_WIDTH_AXI-1:0] m_axi_araddr_r;
     reg [7:0]                m_axi_arlen_r;    // Burst length (number of transfers - 1)
@@ -199,6 +532,13 @@ module CoprocessorControlUnit (
     reg                      m_axi_arvalid_r;
     reg                      m_axi_rready_r;   // DMA ready to accept read data
 
+    // AXI Master Write Channel Internal Signals (descriptor write-back only, single beats)
+    reg [DATA_WIDTH_AXI-1:0] m_axi_awaddr_r;
+    reg                      m_axi_awvalid_r;
+    reg [DATA_WIDTH_AXI-1:0] m_axi_wdata_r;
+    reg                      m_axi_wvalid_r;
+    reg                      m_axi_bready_r;
+
     // DMA operation tracking
     reg [DATA_WIDTH_AXI-1:0] dma_bytes_transferred_r;
     reg [DATA_WIDTH_AXI-1:0] dma_current_burst_len_bytes_r; // Length of current AXI burst in bytes
@@ -211,6 +551,12 @@ module CoprocessorControlUnit (
     reg [NUM_VM_SLOTS-1:0]             vm_wr_prog_en_r;
     reg [VM_PROG_MEM_ADDR_WIDTH-1:0] dma_vm_prog_mem_wr_addr_r; // Write address counter for VM's prog mem
 
+    // Internal registers for VM Data Memory Write
+    reg [VM_DATA_MEM_ADDR_WIDTH-1:0] vm_wr_data_addr_r;
+    reg [DATA_WIDTH_AXI-1:0]         vm_wr_data_data_r;
+    reg [NUM_VM_SLOTS-1:0]           vm_wr_data_en_r;
+    reg [VM_DATA_MEM_ADDR_WIDTH:0]   dma_vm_data_mem_wr_addr_r; // Write address counter for VM's data mem
+
     // Internal Mailbox Storage for each VM
     reg [DATA_WIDTH_AXI-1:0] vm_mailboxes_in[NUM_VM_SLOTS-1:0][NUM_MAILBOX_REGS-1:0];
     reg [DATA_WIDTH_AXI-1:0] vm_mailboxes_out[NUM_VM_SLOTS-1:0][NUM_MAILBOX_REGS-1:0];
@@ -219,12 +565,36 @@ module CoprocessorControlUnit (
     wire [DATA_WIDTH_AXI-1:0] vm_mailbox_in_rdata_internal [NUM_VM_SLOTS-1:0];
     assign vm_mailbox_in_rdata_o = vm_mailbox_in_rdata_internal;
 
+    // Mailbox FIFOs, one IN (CPU -> VM) and one OUT (VM -> CPU) per VM; free-running pointers
+    reg [DATA_WIDTH_AXI-1:0]   mbox_fifo_ctrl_r   [NUM_VM_SLOTS-1:0];
+    reg [1:0]                  mbox_irq_enable_r  [NUM_VM_SLOTS-1:0];
+    reg [NUM_VM_SLOTS-1:0]     mbox_in_overflow_r;
+    reg [DATA_WIDTH_AXI-1:0]   mbox_in_fifo_r     [NUM_VM_SLOTS-1:0][MBOX_FIFO_MAX_DEPTH-1:0];
+    reg [DATA_WIDTH_AXI-1:0]   mbox_out_fifo_r    [NUM_VM_SLOTS-1:0][MBOX_FIFO_MAX_DEPTH-1:0];
+    reg [MBOX_FIFO_MAX_LOG2:0] mbox_in_head_r     [NUM_VM_SLOTS-1:0];
+    reg [MBOX_FIFO_MAX_LOG2:0] mbox_in_tail_r     [NUM_VM_SLOTS-1:0];
+    reg [MBOX_FIFO_MAX_LOG2:0] mbox_out_head_r    [NUM_VM_SLOTS-1:0];
+    reg [MBOX_FIFO_MAX_LOG2:0] mbox_out_tail_r    [NUM_VM_SLOTS-1:0];
+    wire [MBOX_FIFO_MAX_LOG2:0] mbox_in_count_w   [NUM_VM_SLOTS-1:0];
+    wire [MBOX_FIFO_MAX_LOG2:0] mbox_out_count_w  [NUM_VM_SLOTS-1:0];
+    wire [MBOX_FIFO_MAX_LOG2:0] mbox_depth_w      [NUM_VM_SLOTS-1:0];
+    wire [1:0]                 mbox_cond_w        [NUM_VM_SLOTS-1:0]; // MBOX_IRQ_STATUS: [0] IN_SPACE, [1] OUT_READY
+    wire [NUM_VM_SLOTS-1:0]    mbox_pending_w;
+    wire                       mbox_irq_w = |mbox_pending_w; // INT_STATUS bit 19
+    // Interrupt sources pending, enabled or not
+    wire [IRQ_VEC_W-1:0]       irq_pending_w = int_status_reg_r | (IRQ_VEC_W'(mbox_irq_w) << IRQ_MBOX_BIT);
+
     // Command Signals (pulsed for one clock cycle)
     wire start_vm_cmd_w;
     wire stop_vm_cmd_w;
     wire reset_vm_cmd_w;
     wire load_prog_cmd_w;
     wire load_data_in_cmd_w;
+    wire load_prog_handle_cmd_w;
+    wire start_batch_cmd_w;
+    wire cmd_batch_ok_w;        // START_BATCH settings valid and the sequencer free
+    reg  [VM_ID_WIDTH-1:0] cmd_vm_r; // Target VM: VM_SELECT_REG, or the page the command was written to
+    reg        cmd_from_page_r; // Loads take address/length from the VM's page
 
     //--------------------------------------------------------------------------
     // AXI4-Lite Slave Interface Logic
@@ -243,11 +613,32 @@ module CoprocessorControlUnit (
     assign axi_awaddr_internal = s_axi_awaddr[ADDR_WIDTH_CPU_IF_AXI-1:0];
     assign axi_araddr_internal = s_axi_araddr[ADDR_WIDTH_CPU_IF_AXI-1:0];
 
+    // Per-VM page decode, {hit, VM}: pages 1-8 select slots 0-7, pages from
+    // VM_XPAGE_BASE on slots 8 and up
+    function automatic [VM_ID_WIDTH:0] vm_page_decode(input [ADDR_WIDTH_CPU_IF_AXI-1:0] addr);
+        automatic integer page = addr >> VM_PAGE_SHIFT;
+        automatic integer vm   = (page >= (VM_XPAGE_BASE >> VM_PAGE_SHIFT)) ?
+                                 page - (VM_XPAGE_BASE >> VM_PAGE_SHIFT) + 8 : page - 1;
+        vm_page_decode = {page != 0 && (page <= 8 || page >= (VM_XPAGE_BASE >> VM_PAGE_SHIFT)) && vm < NUM_VM_SLOTS,
+                          VM_ID_WIDTH'(vm)};
+    endfunction
+    wire [VM_ID_WIDTH:0]   aw_page_dec_w = vm_page_decode(awaddr_latched_r);
+    wire [VM_ID_WIDTH:0]   ar_page_dec_w = vm_page_decode(araddr_latched_r);
+    wire                   aw_page_hit_w = aw_page_dec_w[VM_ID_WIDTH];
+    wire                   ar_page_hit_w = ar_page_dec_w[VM_ID_WIDTH];
+    wire [VM_ID_WIDTH-1:0] aw_page_vm_w  = aw_page_dec_w[VM_ID_WIDTH-1:0];
+    wire [VM_ID_WIDTH-1:0] ar_page_vm_w  = ar_page_dec_w[VM_ID_WIDTH-1:0];
+    wire [7:0] aw_page_reg_w = awaddr_latched_r[VM_PAGE_SHIFT-1:0];
+    wire [7:0] ar_page_reg_w = araddr_latched_r[VM_PAGE_SHIFT-1:0];
+    // Performance counter LOW/HIGH registers, global block or VM page
+    wire       ar_perf_hit_w = (araddr_latched_r >= ADDR_PERF_DMA_BYTES_REG && araddr_latched_r < PERF_BLOCK_END) ||
+                               (ar_page_hit_w && ar_page_reg_w >= ADDR_VM_PERF_RUNS_REG);
+
     // Write Address/Data/Response Channels using state machine
     always @(posedge s_axi_aclk or posedge reset) begin
         if (reset) begin
             axi_awready_r <= 1'b0;
-            awaddr_latched_r <= 8'b0;
+            awaddr_latched_r <= {ADDR_WIDTH_CPU_IF_AXI{1'b0}};
             write_state_r <= WRITE_IDLE;
             axi_wready_r <= 1'b0;
             axi_bvalid_r <= 1'b0;
@@ -295,7 +686,7 @@ module CoprocessorControlUnit (
     always @(posedge s_axi_aclk or posedge reset) begin
         if (reset) begin
             axi_arready_r <= 1'b0;
-            araddr_latched_r <= 8'b0;
+            araddr_latched_r <= {ADDR_WIDTH_CPU_IF_AXI{1'b0}};
             axi_rvalid_r  <= 1'b0;
             axi_rresp_r   <= 2'b00;
             axi_rdata_r   <= 32'b0; // Reset read data output
@@ -328,6 +719,63 @@ module CoprocessorControlUnit (
         end
     end
 
+    // MBOX_FIFO_STATUS_REG: [15:0] IN count, [30:16] OUT count, [31] IN_OVERFLOW; 0 in register mode
+    function automatic [DATA_WIDTH_AXI-1:0] mbox_status_w(input [VM_ID_WIDTH-1:0] vm);
+        mbox_status_w = mbox_fifo_ctrl_r[vm][0] ?
+                        {mbox_in_overflow_r[vm], 15'(mbox_out_count_w[vm]), 16'(mbox_in_count_w[vm])} : 32'b0;
+    endfunction
+
+    // FIFO mode CPU reads: OUT offsets return the word they pop (0 if empty), IN offsets read 0
+    function automatic [DATA_WIDTH_AXI-1:0] mbox_fifo_rdata_w(input [VM_ID_WIDTH-1:0] vm, input [7:0] reg_off);
+        if (reg_off >= ADDR_MAILBOX_DATA_OUT_0_REG && mbox_out_count_w[vm] != 0)
+            mbox_fifo_rdata_w = mbox_out_fifo_r[vm][mbox_out_head_r[vm][MBOX_FIFO_MAX_LOG2-1:0]];
+        else
+            mbox_fifo_rdata_w = 32'b0;
+    endfunction
+
+    // A failed output write-back reports ERROR with ERROR_CODE 7 until the next START_VM/RESET_VM,
+    // a failed batch transfer ERROR_CODE 8 until the next START_BATCH/RESET_VM
+    function automatic [DATA_WIDTH_AXI-1:0] vm_status_w(input [VM_ID_WIDTH-1:0] vm);
+        vm_status_w = vm_batch_err_r[vm] ? 32'h00000088 :
+                      vm_out_err_r[vm]   ? 32'h00000078 : vm_status_regs_array_r[vm];
+    endfunction
+
+    // INT_STATUS_REG/INT_ENABLE_REG layout of an interrupt vector: slots 0-7 and the global bits
+    function automatic [DATA_WIDTH_AXI-1:0] irq_legacy_view(input [IRQ_VEC_W-1:0] v);
+        irq_legacy_view = 32'b0;
+        for (integer i = 0; i < LEGACY_SLOTS; i = i + 1) begin
+            irq_legacy_view[i]     = v[i];
+            irq_legacy_view[i + 8] = v[i + NUM_VM_SLOTS];
+        end
+        irq_legacy_view[19:16] = v[IRQ_VEC_W-1 -: 4];
+    endfunction
+
+    // The interrupt vector bits an INT_STATUS_REG/INT_ENABLE_REG value stands for
+    function automatic [IRQ_VEC_W-1:0] irq_from_legacy(input [DATA_WIDTH_AXI-1:0] value);
+        irq_from_legacy = {IRQ_VEC_W{1'b0}};
+        for (integer i = 0; i < LEGACY_SLOTS; i = i + 1) begin
+            irq_from_legacy[i]                = value[i];
+            irq_from_legacy[i + NUM_VM_SLOTS] = value[i + 8];
+        end
+        irq_from_legacy[IRQ_VEC_W-1 -: 4] = value[19:16];
+    endfunction
+
+    // VM interrupt block: LOW (slots 31:0) or HIGH (slots 63:32) half of a per-slot vector
+    function automatic [DATA_WIDTH_AXI-1:0] vm_bits_half(input [NUM_VM_SLOTS-1:0] bits, input hi);
+        automatic logic [63:0] wide = 64'(bits);
+        vm_bits_half = hi ? wide[63:32] : wide[31:0];
+    endfunction
+
+    // The slots a write to one half stands for
+    function automatic [NUM_VM_SLOTS-1:0] vm_bits_from_half(input [DATA_WIDTH_AXI-1:0] value, input hi);
+        vm_bits_from_half = NUM_VM_SLOTS'(hi ? {value, 32'b0} : {32'b0, value});
+    endfunction
+
+    // The DMA engine is moving a load, ring transfer or batch record into the slot
+    function automatic dma_slot_loading_w(input [VM_ID_WIDTH-1:0] vm);
+        dma_slot_loading_w = dma_state_r != DMA_IDLE && dma_target_vm_id_r == vm;
+    endfunction
+
     //--------------------------------------------------------------------------
     // Register Read Logic Mux (combinatorial based on latched read address)
     //--------------------------------------------------------------------------
@@ -338,8 +786,8 @@ module CoprocessorControlUnit (
 
         case (araddr_latched_r) // Use latched address for read data path
             ADDR_COPRO_CMD_REG: rdata_async = copro_cmd_reg_r;
-            ADDR_VM_SELECT_REG: rdata_async = {29'b0, vm_select_id_r};
-            ADDR_COPRO_STATUS_REG: rdata_async = {16'b0, active_vm_mask_r, 7'b0, copro_busy_status_r};
+            ADDR_VM_SELECT_REG: rdata_async = 32'(vm_select_id_r);
+            ADDR_COPRO_STATUS_REG: rdata_async = {16'b0, 8'(active_vm_mask_r[LEGACY_SLOTS-1:0]), 7'b0, copro_busy_status_r};
             ADDR_PROG_ADDR_LOW_REG: rdata_async = prog_addr_low_reg_r;
             ADDR_PROG_ADDR_HIGH_REG: rdata_async = prog_addr_high_reg_r;
             ADDR_DATA_IN_ADDR_LOW_REG: rdata_async = data_in_addr_low_reg_r;
@@ -347,14 +795,61 @@ module CoprocessorControlUnit (
             ADDR_DATA_OUT_ADDR_LOW_REG: rdata_async = data_out_addr_low_reg_r;
             ADDR_DATA_OUT_ADDR_HIGH_REG: rdata_async = data_out_addr_high_reg_r;
             ADDR_DATA_LEN_REG: rdata_async = data_len_reg_r;
-            ADDR_INT_STATUS_REG: rdata_async = int_status_reg_r;
-            ADDR_INT_ENABLE_REG: rdata_async = int_enable_reg_r;
-            ADDR_SELECTED_VM_STATUS_REG: rdata_async = vm_status_regs_array_r[vm_select_id_r];
+            ADDR_INT_STATUS_REG: rdata_async = irq_legacy_view(irq_pending_w);
+            ADDR_INT_ENABLE_REG: rdata_async = irq_legacy_view(int_enable_reg_r);
+            ADDR_MBOX_FIFO_CTRL_REG: rdata_async = mbox_fifo_ctrl_r[vm_select_id_r];
+            ADDR_MBOX_FIFO_STATUS_REG: rdata_async = mbox_status_w(vm_select_id_r);
+            ADDR_MBOX_IRQ_STATUS_REG: rdata_async = {30'b0, mbox_cond_w[vm_select_id_r]};
+            ADDR_MBOX_IRQ_ENABLE_REG: rdata_async = {30'b0, mbox_irq_enable_r[vm_select_id_r]};
+            ADDR_SELECTED_VM_STATUS_REG: rdata_async = vm_status_w(vm_select_id_r);
             ADDR_SELECTED_VM_PC_REG: rdata_async = vm_pc_regs_array_r[vm_select_id_r];
-            ADDR_SELECTED_VM_DATA_OUT_ADDR_REG: rdata_async = vm_data_out_addr_regs_array_r[vm_select_id_r];
+            ADDR_SELECTED_VM_DATA_OUT_ADDR_REG: rdata_async = vm_out_len_r[vm_select_id_r] ? vm_out_addr_r[vm_select_id_r] : 32'b0;
+            ADDR_SELECTED_VM_RETVAL_REG: rdata_async = vm_retval_regs_array_r[vm_select_id_r];
+            ADDR_DMA_RING_BASE_LOW_REG: rdata_async = dma_ring_base_low_r;
+            ADDR_DMA_RING_BASE_HIGH_REG: rdata_async = dma_ring_base_high_r;
+            ADDR_DMA_RING_SIZE_REG: rdata_async = dma_ring_size_r;
+            ADDR_DMA_RING_HEAD_REG: rdata_async = dma_ring_head_r;
+            ADDR_DMA_RING_TAIL_REG: rdata_async = dma_ring_tail_r;
+            ADDR_SQ_BASE_LOW_REG: rdata_async = sq_base_low_r;
+            ADDR_SQ_BASE_HIGH_REG: rdata_async = sq_base_high_r;
+            ADDR_CQ_BASE_LOW_REG: rdata_async = cq_base_low_r;
+            ADDR_CQ_BASE_HIGH_REG: rdata_async = cq_base_high_r;
+            ADDR_QUEUE_SIZE_REG: rdata_async = queue_size_r;
+            ADDR_SQ_TAIL_REG: rdata_async = sq_tail_r;
+            ADDR_SQ_HEAD_REG: rdata_async = sq_head_r;
+            ADDR_CQ_HEAD_REG: rdata_async = cq_head_r;
+            ADDR_CQ_TAIL_REG: rdata_async = cq_tail_r;
+            ADDR_DATA_OUT_LEN_REG: rdata_async = data_out_len_reg_r;
+            ADDR_SELECTED_VM_DATA_OUT_LEN_REG: rdata_async = vm_out_len_r[vm_select_id_r];
+            ADDR_IRQ_MOD_VM_DONE_REG: rdata_async = irq_mod_reg_r[0];
+            ADDR_IRQ_MOD_VM_ERROR_REG: rdata_async = irq_mod_reg_r[1];
+            ADDR_IRQ_MOD_DMA_REG: rdata_async = irq_mod_reg_r[2];
+            ADDR_IRQ_MOD_CTRL_REG: rdata_async = {31'b0, irq_mod_err_bypass_r};
+            ADDR_SELECTED_VM_PROG_HANDLE_REG,
+            ADDR_PROG_CACHE_STATUS_REG,
+            ADDR_PROG_CACHE_HITS_REG,
+            ADDR_PROG_CACHE_MISSES_REG: rdata_async = 32'b0;
             ADDR_COPRO_VERSION_REG: rdata_async = COPRO_VERSION;
+            ADDR_VM_CONFIG_REG: rdata_async = NUM_VM_SLOTS;
+            ADDR_VM_DONE_STATUS_REG, ADDR_VM_DONE_STATUS_REG + 12'h4:
+                rdata_async = vm_bits_half(int_status_reg_r[NUM_VM_SLOTS-1:0], araddr_latched_r[2]);
+            ADDR_VM_ERROR_STATUS_REG, ADDR_VM_ERROR_STATUS_REG + 12'h4:
+                rdata_async = vm_bits_half(int_status_reg_r[2*NUM_VM_SLOTS-1:NUM_VM_SLOTS], araddr_latched_r[2]);
+            ADDR_VM_DONE_ENABLE_REG, ADDR_VM_DONE_ENABLE_REG + 12'h4:
+                rdata_async = vm_bits_half(int_enable_reg_r[NUM_VM_SLOTS-1:0], araddr_latched_r[2]);
+            ADDR_VM_ERROR_ENABLE_REG, ADDR_VM_ERROR_ENABLE_REG + 12'h4:
+                rdata_async = vm_bits_half(int_enable_reg_r[2*NUM_VM_SLOTS-1:NUM_VM_SLOTS], araddr_latched_r[2]);
+            ADDR_VM_ACTIVE_MASK_REG, ADDR_VM_ACTIVE_MASK_REG + 12'h4:
+                rdata_async = vm_bits_half(active_vm_mask_r, araddr_latched_r[2]);
+            ADDR_DMA_CHAN_CONFIG_REG: rdata_async = {16'b0, 8'(DMA_QUEUE_DEPTH), 8'd1};
+            ADDR_DMA_CHAN_BUSY_REG: rdata_async = {31'b0, dma_busy_actual_w};
+            ADDR_DMA_CHAN_DONE_REG: rdata_async = {31'b0, dma_chan_done_r};
+            ADDR_DMA_CHAN_ERROR_REG: rdata_async = {31'b0, dma_chan_error_r};
             default: begin
-                if (araddr_latched_r >= ADDR_MAILBOX_DATA_IN_0_REG && araddr_latched_r < (ADDR_MAILBOX_DATA_IN_0_REG + NUM_MAILBOX_REGS*4)) begin
+                if (mbox_fifo_ctrl_r[vm_select_id_r][0] && araddr_latched_r >= ADDR_MAILBOX_DATA_IN_0_REG &&
+                    araddr_latched_r < (ADDR_MAILBOX_DATA_OUT_0_REG + NUM_MAILBOX_REGS*4)) begin
+                    rdata_async = mbox_fifo_rdata_w(vm_select_id_r, araddr_latched_r[7:0]);
+                end else if (araddr_latched_r >= ADDR_MAILBOX_DATA_IN_0_REG && araddr_latched_r < (ADDR_MAILBOX_DATA_IN_0_REG + NUM_MAILBOX_REGS*4)) begin
                     // CPU reads its own IN mailboxes (which are VM's OUT mailboxes from VM perspective)
                     // This path should read from vm_mailboxes_in (data CPU wrote for VM to read)
                     automatic logic [$clog2(NUM_MAILBOX_REGS)-1:0] mailbox_idx_r;
@@ -379,6 +874,58 @@ module CoprocessorControlUnit (
                 end
             end
         endcase
+
+        // Per-VM pages (no legacy register matches these addresses)
+        if (ar_page_hit_w) begin
+            case (ar_page_reg_w)
+                ADDR_COPRO_CMD_REG: rdata_async = 32'b0; // Command bits self-clear
+                ADDR_PROG_ADDR_LOW_REG: rdata_async = page_prog_addr_low_r[ar_page_vm_w];
+                ADDR_PROG_ADDR_HIGH_REG: rdata_async = page_prog_addr_high_r[ar_page_vm_w];
+                ADDR_DATA_IN_ADDR_LOW_REG: rdata_async = page_data_in_addr_low_r[ar_page_vm_w];
+                ADDR_DATA_IN_ADDR_HIGH_REG: rdata_async = page_data_in_addr_high_r[ar_page_vm_w];
+                ADDR_DATA_OUT_ADDR_LOW_REG: rdata_async = page_data_out_addr_low_r[ar_page_vm_w];
+                ADDR_DATA_OUT_ADDR_HIGH_REG: rdata_async = page_data_out_addr_high_r[ar_page_vm_w];
+                ADDR_DATA_LEN_REG: rdata_async = page_data_len_r[ar_page_vm_w];
+                ADDR_DATA_OUT_LEN_REG: rdata_async = page_data_out_len_r[ar_page_vm_w];
+                ADDR_VM_BATCH_REC_SIZE_REG: rdata_async = page_batch_rec_size_r[ar_page_vm_w];
+                ADDR_VM_BATCH_COUNT_REG: rdata_async = page_batch_count_r[ar_page_vm_w];
+                ADDR_VM_BATCH_OUT_STRIDE_REG: rdata_async = page_batch_stride_r[ar_page_vm_w];
+                ADDR_VM_BATCH_DONE_REG: rdata_async = {15'b0, vm_batch_done_r[ar_page_vm_w]};
+                ADDR_VM_DATA_BUF_REG: rdata_async = {29'b0, vm_data_ready_r[ar_page_vm_w], vm_data_bank[ar_page_vm_w],
+                                                     page_data_pingpong_r[ar_page_vm_w]};
+                ADDR_VM_DMA_QUEUE_REG: rdata_async = {23'b0, dma_slot_loading_w(ar_page_vm_w),
+                                                      8'(dma_q_count_r[ar_page_vm_w])};
+                ADDR_VM_MEM_PROG_LEN_REG: rdata_async = vm_mem_prog_len_r[ar_page_vm_w];
+                ADDR_VM_MEM_DATA_LEN_REG: rdata_async = vm_mem_data_len_r[ar_page_vm_w];
+                ADDR_VM_MEM_CTRL_REG: rdata_async = {31'b0, page_mem_lock_r[ar_page_vm_w]};
+                ADDR_SELECTED_VM_STATUS_REG: rdata_async = vm_status_w(ar_page_vm_w);
+                ADDR_SELECTED_VM_PC_REG: rdata_async = vm_pc_regs_array_r[ar_page_vm_w];
+                ADDR_SELECTED_VM_DATA_OUT_ADDR_REG: rdata_async = vm_out_len_r[ar_page_vm_w] ? vm_out_addr_r[ar_page_vm_w] : 32'b0;
+                ADDR_SELECTED_VM_DATA_OUT_LEN_REG: rdata_async = vm_out_len_r[ar_page_vm_w];
+                ADDR_SELECTED_VM_RETVAL_REG: rdata_async = vm_retval_regs_array_r[ar_page_vm_w];
+                ADDR_SELECTED_VM_PROG_HANDLE_REG: rdata_async = 32'b0;
+                ADDR_MBOX_FIFO_CTRL_REG: rdata_async = mbox_fifo_ctrl_r[ar_page_vm_w];
+                ADDR_MBOX_FIFO_STATUS_REG: rdata_async = mbox_status_w(ar_page_vm_w);
+                ADDR_MBOX_IRQ_STATUS_REG: rdata_async = {30'b0, mbox_cond_w[ar_page_vm_w]};
+                ADDR_MBOX_IRQ_ENABLE_REG: rdata_async = {30'b0, mbox_irq_enable_r[ar_page_vm_w]};
+                default: begin
+                    if (mbox_fifo_ctrl_r[ar_page_vm_w][0] && ar_page_reg_w >= ADDR_MAILBOX_DATA_IN_0_REG &&
+                        ar_page_reg_w < (ADDR_MAILBOX_DATA_OUT_0_REG + NUM_MAILBOX_REGS*4))
+                        rdata_async = mbox_fifo_rdata_w(ar_page_vm_w, ar_page_reg_w);
+                    else if (ar_page_reg_w >= ADDR_MAILBOX_DATA_IN_0_REG && ar_page_reg_w < (ADDR_MAILBOX_DATA_IN_0_REG + NUM_MAILBOX_REGS*4))
+                        rdata_async = vm_mailboxes_in[ar_page_vm_w][(ar_page_reg_w - ADDR_MAILBOX_DATA_IN_0_REG) / 4];
+                    else if (ar_page_reg_w >= ADDR_MAILBOX_DATA_OUT_0_REG && ar_page_reg_w < (ADDR_MAILBOX_DATA_OUT_0_REG + NUM_MAILBOX_REGS*4))
+                        rdata_async = vm_mailboxes_out[ar_page_vm_w][(ar_page_reg_w - ADDR_MAILBOX_DATA_OUT_0_REG) / 4];
+                    else
+                        rdata_async = 32'hDEADBEEF; // Unmapped address
+                end
+            endcase
+        end
+        // Performance counters: LOW is the value snapshotted when the read started
+        if (araddr_latched_r == ADDR_PERF_CTRL_REG)
+            rdata_async = 32'b0;
+        else if (ar_perf_hit_w)
+            rdata_async = araddr_latched_r[2] ? perf_high_r : perf_rd_snap_r[31:0];
         axi_rdata_r = rdata_async; // Assign to the output register used by the read state machine
     end
 
@@ -388,7 +935,7 @@ module CoprocessorControlUnit (
     always @(posedge s_axi_aclk or posedge reset) begin
         if (reset) begin
             copro_cmd_reg_r         <= 32'b0;
-            vm_select_id_r          <= 3'b0;
+            vm_select_id_r          <= {VM_ID_WIDTH{1'b0}};
             prog_addr_low_reg_r     <= 32'b0;
             prog_addr_high_reg_r    <= 32'b0;
             data_in_addr_low_reg_r  <= 32'b0;
@@ -396,8 +943,24 @@ module CoprocessorControlUnit (
             data_out_addr_low_reg_r <= 32'b0;
             data_out_addr_high_reg_r<= 32'b0;
             data_len_reg_r          <= 32'b0;
-            int_status_reg_r        <= 32'b0; 
-            int_enable_reg_r        <= 32'b0;
+            data_out_len_reg_r      <= 32'b0;
+            int_status_reg_r        <= {IRQ_VEC_W{1'b0}};
+            int_enable_reg_r        <= {IRQ_VEC_W{1'b0}};
+            dma_ring_base_low_r     <= 32'b0;
+            dma_ring_base_high_r    <= 32'b0;
+            dma_ring_size_r         <= 32'b0;
+            dma_ring_tail_r         <= 32'b0;
+            sq_base_low_r           <= 32'b0;
+            sq_base_high_r          <= 32'b0;
+            cq_base_low_r           <= 32'b0;
+            cq_base_high_r          <= 32'b0;
+            queue_size_r            <= 32'b0;
+            sq_head_r               <= 32'b0;
+            sq_tail_r               <= 32'b0;
+            cq_head_r               <= 32'b0;
+            cq_tail_r               <= 32'b0;
+            for (integer c = 0; c < IRQ_NUM_CLASSES; c = c + 1) irq_mod_reg_r[c] <= 32'b0;
+            irq_mod_err_bypass_r    <= 1'b1;
             // mailbox_data_in_regs_r is replaced by vm_mailboxes_in
             // mailbox_data_out_regs_r is replaced by vm_mailboxes_out
             for (integer i = 0; i < NUM_VM_SLOTS; i = i + 1) begin
@@ -405,15 +968,39 @@ module CoprocessorControlUnit (
                     vm_mailboxes_in[i][j] <= 32'b0;
                     vm_mailboxes_out[i][j] <= 32'b0;
                 end
+                mbox_fifo_ctrl_r[i]  <= 32'b0;
+                mbox_irq_enable_r[i] <= 2'b0;
+                mbox_in_overflow_r[i] <= 1'b0;
+                mbox_in_head_r[i]    <= 0;
+                mbox_in_tail_r[i]    <= 0;
+                mbox_out_head_r[i]   <= 0;
+                mbox_out_tail_r[i]   <= 0;
                 vm_status_regs_array_r[i] <= 32'b0; // Example: VM ready
                 vm_pc_regs_array_r[i] <= 32'b0;
                 vm_data_out_addr_regs_array_r[i] <= 32'b0;
+                vm_retval_regs_array_r[i] <= 32'b0;
+                page_prog_addr_low_r[i]      <= 32'b0;
+                page_prog_addr_high_r[i]     <= 32'b0;
+                page_data_in_addr_low_r[i]   <= 32'b0;
+                page_data_in_addr_high_r[i]  <= 32'b0;
+                page_data_out_addr_low_r[i]  <= 32'b0;
+                page_data_out_addr_high_r[i] <= 32'b0;
+                page_data_len_r[i]           <= 32'b0;
+                page_data_out_len_r[i]       <= 32'b0;
+                page_batch_rec_size_r[i]     <= 32'b0;
+                page_batch_count_r[i]        <= 32'b0;
+                page_batch_stride_r[i]       <= 32'b0;
                 internal_vm_start_r[i] <= 1'b0;
                 internal_vm_stop_r[i] <= 1'b0;
                 internal_vm_reset_r[i] <= 1'b0;
             end
+            page_data_pingpong_r <= {NUM_VM_SLOTS{1'b0}};
+            page_mem_lock_r      <= {NUM_VM_SLOTS{1'b0}};
+            vm_mem_locked_r      <= {NUM_VM_SLOTS{1'b0}};
+            vm_data_swap_r       <= {NUM_VM_SLOTS{1'b0}};
             copro_busy_status_r <= 1'b0;
-            active_vm_mask_r    <= 8'b0;
+            active_vm_mask_r    <= {NUM_VM_SLOTS{1'b0}};
+            vm_done_prev_r      <= {NUM_VM_SLOTS{1'b0}};
 
         end else begin
             // Register writes occur when write FSM is in WRITE_DATA and wvalid is high
@@ -424,7 +1011,9 @@ module CoprocessorControlUnit (
                         copro_cmd_reg_r <= s_axi_wdata; 
                     end
                     ADDR_VM_SELECT_REG: begin
-                        vm_select_id_r <= s_axi_wdata[2:0]; 
+                        // IDs past the last slot are ignored
+                        if (s_axi_wdata[5:0] < NUM_VM_SLOTS)
+                            vm_select_id_r <= s_axi_wdata[VM_ID_WIDTH-1:0];
                     end
                     ADDR_PROG_ADDR_LOW_REG: prog_addr_low_reg_r <= s_axi_wdata;
                     ADDR_PROG_ADDR_HIGH_REG: prog_addr_high_reg_r <= s_axi_wdata;
@@ -433,13 +1022,67 @@ module CoprocessorControlUnit (
                     ADDR_DATA_OUT_ADDR_LOW_REG: data_out_addr_low_reg_r <= s_axi_wdata;
                     ADDR_DATA_OUT_ADDR_HIGH_REG: data_out_addr_high_reg_r <= s_axi_wdata;
                     ADDR_DATA_LEN_REG: data_len_reg_r <= s_axi_wdata;
-                    ADDR_INT_ENABLE_REG: int_enable_reg_r <= s_axi_wdata & 32'h0003FFFF;
+                    ADDR_INT_ENABLE_REG: int_enable_reg_r <= (int_enable_reg_r & ~irq_from_legacy(32'h000FFFFF)) | irq_from_legacy(s_axi_wdata);
+                    ADDR_MBOX_FIFO_CTRL_REG: mbox_set_ctrl(vm_select_id_r, s_axi_wdata);
+                    ADDR_MBOX_IRQ_ENABLE_REG: mbox_irq_enable_r[vm_select_id_r] <= s_axi_wdata[1:0];
                     ADDR_INT_STATUS_REG: begin 
                         // Allow W1C (Write-1-to-Clear) for INT_STATUS_REG
-                        int_status_reg_r <= int_status_reg_r & ~s_axi_wdata;
+                        int_status_reg_r <= int_status_reg_r & ~irq_from_legacy(s_axi_wdata);
+                    end
+                    ADDR_VM_DONE_STATUS_REG, ADDR_VM_DONE_STATUS_REG + 12'h4:
+                        int_status_reg_r[NUM_VM_SLOTS-1:0] <= int_status_reg_r[NUM_VM_SLOTS-1:0] &
+                                                              ~vm_bits_from_half(s_axi_wdata, awaddr_latched_r[2]);
+                    ADDR_VM_ERROR_STATUS_REG, ADDR_VM_ERROR_STATUS_REG + 12'h4:
+                        int_status_reg_r[2*NUM_VM_SLOTS-1:NUM_VM_SLOTS] <= int_status_reg_r[2*NUM_VM_SLOTS-1:NUM_VM_SLOTS] &
+                                                                           ~vm_bits_from_half(s_axi_wdata, awaddr_latched_r[2]);
+                    ADDR_VM_DONE_ENABLE_REG, ADDR_VM_DONE_ENABLE_REG + 12'h4:
+                        int_enable_reg_r[NUM_VM_SLOTS-1:0] <= (int_enable_reg_r[NUM_VM_SLOTS-1:0] &
+                                                               ~vm_bits_from_half(32'hFFFFFFFF, awaddr_latched_r[2])) |
+                                                              vm_bits_from_half(s_axi_wdata, awaddr_latched_r[2]);
+                    ADDR_VM_ERROR_ENABLE_REG, ADDR_VM_ERROR_ENABLE_REG + 12'h4:
+                        int_enable_reg_r[2*NUM_VM_SLOTS-1:NUM_VM_SLOTS] <= (int_enable_reg_r[2*NUM_VM_SLOTS-1:NUM_VM_SLOTS] &
+                                                                            ~vm_bits_from_half(32'hFFFFFFFF, awaddr_latched_r[2])) |
+                                                                           vm_bits_from_half(s_axi_wdata, awaddr_latched_r[2]);
+                    // Ring geometry only changes while no descriptors are outstanding
+                    ADDR_DMA_RING_BASE_LOW_REG: if (!dma_ring_busy_w) dma_ring_base_low_r <= s_axi_wdata;
+                    ADDR_DMA_RING_BASE_HIGH_REG: if (!dma_ring_busy_w) dma_ring_base_high_r <= s_axi_wdata;
+                    ADDR_DMA_RING_SIZE_REG: begin
+                        if (dma_ring_reset_w) begin
+                            dma_ring_size_r <= s_axi_wdata;
+                            dma_ring_tail_r <= 32'b0; // Head is cleared by the DMA block
+                        end
                     end
+                    ADDR_DMA_RING_TAIL_REG: begin
+                        // Doorbell; out-of-range values (and any write while disabled) are ignored
+                        if (s_axi_wdata < dma_ring_size_r) dma_ring_tail_r <= s_axi_wdata;
+                    end
+                    // Queue geometry only changes while no submissions are outstanding
+                    ADDR_SQ_BASE_LOW_REG: if (sq_head_r == sq_tail_r) sq_base_low_r <= s_axi_wdata;
+                    ADDR_SQ_BASE_HIGH_REG: if (sq_head_r == sq_tail_r) sq_base_high_r <= s_axi_wdata;
+                    ADDR_CQ_BASE_LOW_REG: if (sq_head_r == sq_tail_r) cq_base_low_r <= s_axi_wdata;
+                    ADDR_CQ_BASE_HIGH_REG: if (sq_head_r == sq_tail_r) cq_base_high_r <= s_axi_wdata;
+                    ADDR_QUEUE_SIZE_REG: begin
+                        if (sq_head_r == sq_tail_r && ((s_axi_wdata & (s_axi_wdata - 1)) == 32'b0) &&
+                            s_axi_wdata <= QUEUE_MAX_ENTRIES) begin
+                            queue_size_r <= s_axi_wdata;
+                            sq_head_r    <= 32'b0;
+                            sq_tail_r    <= 32'b0;
+                            cq_head_r    <= 32'b0;
+                            cq_tail_r    <= 32'b0;
+                        end
+                    end
+                    ADDR_SQ_TAIL_REG: if (s_axi_wdata < queue_size_r) sq_tail_r <= s_axi_wdata;
+                    ADDR_CQ_HEAD_REG: if (s_axi_wdata < queue_size_r) cq_head_r <= s_axi_wdata;
+                    ADDR_IRQ_MOD_VM_DONE_REG: irq_mod_reg_r[0] <= s_axi_wdata;
+                    ADDR_IRQ_MOD_VM_ERROR_REG: irq_mod_reg_r[1] <= s_axi_wdata;
+                    ADDR_IRQ_MOD_DMA_REG: irq_mod_reg_r[2] <= s_axi_wdata;
+                    ADDR_IRQ_MOD_CTRL_REG: irq_mod_err_bypass_r <= s_axi_wdata[0];
+                    ADDR_DATA_OUT_LEN_REG: data_out_len_reg_r <= s_axi_wdata;
                     default: begin
-                        if (awaddr_latched_r >= ADDR_MAILBOX_DATA_IN_0_REG && awaddr_latched_r < (ADDR_MAILBOX_DATA_IN_0_REG + NUM_MAILBOX_REGS*4)) begin
+                        if (mbox_fifo_ctrl_r[vm_select_id_r][0] && awaddr_latched_r >= ADDR_MAILBOX_DATA_IN_0_REG &&
+                            awaddr_latched_r < (ADDR_MAILBOX_DATA_IN_0_REG + NUM_MAILBOX_REGS*4)) begin
+                            mbox_cpu_push(vm_select_id_r, s_axi_wdata);
+                        end else if (awaddr_latched_r >= ADDR_MAILBOX_DATA_IN_0_REG && awaddr_latched_r < (ADDR_MAILBOX_DATA_IN_0_REG + NUM_MAILBOX_REGS*4)) begin
                             // Assuming full word writes, s_axi_wstrb can be used for byte-level control if needed
                             automatic logic [$clog2(NUM_MAILBOX_REGS)-1:0] mailbox_idx_w;
                             mailbox_idx_w = (awaddr_latched_r - ADDR_MAILBOX_DATA_IN_0_REG) / 4;
@@ -454,6 +1097,40 @@ module CoprocessorControlUnit (
                         // Writes to read-only registers are ignored (e.g. COPRO_STATUS_REG, SELECTED_VM_*, COPRO_VERSION_REG)
                     end
                 endcase
+
+                // Per-VM pages; COPRO_CMD writes are picked up by the command snapshot
+                if (aw_page_hit_w) begin
+                    case (aw_page_reg_w)
+                        ADDR_PROG_ADDR_LOW_REG: page_prog_addr_low_r[aw_page_vm_w] <= s_axi_wdata;
+                        ADDR_PROG_ADDR_HIGH_REG: page_prog_addr_high_r[aw_page_vm_w] <= s_axi_wdata;
+                        ADDR_DATA_IN_ADDR_LOW_REG: page_data_in_addr_low_r[aw_page_vm_w] <= s_axi_wdata;
+                        ADDR_DATA_IN_ADDR_HIGH_REG: page_data_in_addr_high_r[aw_page_vm_w] <= s_axi_wdata;
+                        ADDR_DATA_OUT_ADDR_LOW_REG: page_data_out_addr_low_r[aw_page_vm_w] <= s_axi_wdata;
+                        ADDR_DATA_OUT_ADDR_HIGH_REG: page_data_out_addr_high_r[aw_page_vm_w] <= s_axi_wdata;
+                        ADDR_DATA_LEN_REG: page_data_len_r[aw_page_vm_w] <= s_axi_wdata;
+                        ADDR_DATA_OUT_LEN_REG: page_data_out_len_r[aw_page_vm_w] <= s_axi_wdata;
+                        ADDR_VM_BATCH_REC_SIZE_REG: page_batch_rec_size_r[aw_page_vm_w] <= s_axi_wdata;
+                        ADDR_VM_BATCH_COUNT_REG: page_batch_count_r[aw_page_vm_w] <= s_axi_wdata;
+                        ADDR_VM_BATCH_OUT_STRIDE_REG: page_batch_stride_r[aw_page_vm_w] <= s_axi_wdata;
+                        ADDR_VM_DATA_BUF_REG: begin
+                            // Ignored while the slot runs, the DMA engine works for it or loads for it are queued
+                            if (!active_vm_mask_r[aw_page_vm_w] && !dma_slot_loading_w(aw_page_vm_w) &&
+                                dma_q_count_r[aw_page_vm_w] == 0)
+                                page_data_pingpong_r[aw_page_vm_w] <= s_axi_wdata[0];
+                        end
+                        ADDR_VM_MEM_CTRL_REG: page_mem_lock_r[aw_page_vm_w] <= s_axi_wdata[0];
+                        // VM_MEM_PROG_LEN_REG/VM_MEM_DATA_LEN_REG are taken by the DMA block
+                        ADDR_MBOX_FIFO_CTRL_REG: mbox_set_ctrl(aw_page_vm_w, s_axi_wdata);
+                        ADDR_MBOX_IRQ_ENABLE_REG: mbox_irq_enable_r[aw_page_vm_w] <= s_axi_wdata[1:0];
+                        default: begin
+                            if (mbox_fifo_ctrl_r[aw_page_vm_w][0] && aw_page_reg_w >= ADDR_MAILBOX_DATA_IN_0_REG &&
+                                aw_page_reg_w < (ADDR_MAILBOX_DATA_IN_0_REG + NUM_MAILBOX_REGS*4))
+                                mbox_cpu_push(aw_page_vm_w, s_axi_wdata);
+                            else if (aw_page_reg_w >= ADDR_MAILBOX_DATA_IN_0_REG && aw_page_reg_w < (ADDR_MAILBOX_DATA_IN_0_REG + NUM_MAILBOX_REGS*4))
+                                vm_mailboxes_in[aw_page_vm_w][(aw_page_reg_w - ADDR_MAILBOX_DATA_IN_0_REG) / 4] <= s_axi_wdata;
+                        end
+                    endcase
+                end
             end
 
             // Handle Self-Clearing (SC) bits for COPRO_CMD_REG after command pulse generation
@@ -462,13 +1139,15 @@ module CoprocessorControlUnit (
             if (reset_vm_cmd_w) copro_cmd_reg_r[2] <= 1'b0;
             if (load_prog_cmd_w) copro_cmd_reg_r[3] <= 1'b0;
             if (load_data_in_cmd_w) copro_cmd_reg_r[4] <= 1'b0;
+            if (load_prog_handle_cmd_w) copro_cmd_reg_r[5] <= 1'b0;
+            if (start_batch_cmd_w) copro_cmd_reg_r[6] <= 1'b0;
 
             // Handle Read-Clear (RC) for INT_STATUS_REG
             // Clears bits that were read in the previous cycle when read FSM was in READ_DATA and master was ready
             if (read_state_r == READ_IDLE && axi_rvalid_r && s_axi_rready && araddr_latched_r == ADDR_INT_STATUS_REG) begin
                  // We check READ_IDLE because read_state_r transitions to IDLE when s_axi_rready is high in READ_DATA
                  // axi_rdata_r still holds the value that was read out
-                int_status_reg_r <= int_status_reg_r & ~axi_rdata_r; 
+                int_status_reg_r <= int_status_reg_r & ~irq_from_legacy(axi_rdata_r);
             end
 
             // VM Control Logic: Pulsing internal_vm_* signals based on commands
@@ -477,36 +1156,84 @@ module CoprocessorControlUnit (
                 internal_vm_start_r[i] <= 1'b0;
                 internal_vm_stop_r[i]  <= 1'b0;
                 internal_vm_reset_r[i] <= 1'b0;
+                vm_data_swap_r[i]      <= 1'b0;
             end
 
-            if (start_vm_cmd_w)    internal_vm_start_r[vm_select_id_r] <= 1'b1;
-            if (stop_vm_cmd_w)     internal_vm_stop_r[vm_select_id_r]  <= 1'b1;
-            if (reset_vm_cmd_w)    internal_vm_reset_r[vm_select_id_r] <= 1'b1;
+            if (start_vm_cmd_w) begin
+                internal_vm_start_r[cmd_vm_r] <= 1'b1;
+                vm_data_swap_r[cmd_vm_r]      <= page_data_pingpong_r[cmd_vm_r] && vm_data_ready_r[cmd_vm_r];
+            end
+            if (start_vm_cmd_w || (start_batch_cmd_w && cmd_batch_ok_w))
+                vm_mem_locked_r[cmd_vm_r] <= page_mem_lock_r[cmd_vm_r];
+            if (stop_vm_cmd_w)     internal_vm_stop_r[cmd_vm_r]  <= 1'b1;
+            if (reset_vm_cmd_w)    internal_vm_reset_r[cmd_vm_r] <= 1'b1;
+            if (batch_start_r)     internal_vm_start_r[batch_vm_r] <= 1'b1; // Next batch record loaded
             
-            // Update active_vm_mask_r based on VM lifecycle events
+            // Update active_vm_mask_r based on VM lifecycle events; a batch slot stays active
+            // from START_BATCH until the sequencer lets go of it
             for (integer i = 0; i < NUM_VM_SLOTS; i = i + 1) begin
-                if (internal_vm_start_r[i]) begin // VM starts
+                if (internal_vm_start_r[i] || (start_batch_cmd_w && cmd_batch_ok_w && cmd_vm_r == i)) begin // VM starts
                     active_vm_mask_r[i] <= 1'b1;
-                end else if (internal_vm_stop_r[i] || vm_done[i] || vm_error[i]) begin // VM stops, completes, or errors
+                end else if (batch_active_r && batch_vm_r == i) begin
+                    // Between records
+                end else if (internal_vm_stop_r[i] || vm_done[i] || vm_error[i] ||
+                             (batch_end_r && batch_vm_r == i)) begin // VM stops, completes, or errors
                     active_vm_mask_r[i] <= 1'b0;
                 end
             end
             
+            // Latch R0 when a run ends; in a batch this lands before BATCH_STORE reads it
+            for (integer i = 0; i < NUM_VM_SLOTS; i = i + 1) begin
+                if (vm_done[i] && !vm_done_prev_r[i]) vm_retval_regs_array_r[i] <= vm_retval[i];
+            end
+            vm_done_prev_r <= vm_done;
+
             // Update INT_STATUS_REG from VM status inputs (vm_done, vm_error)
             for (integer i = 0; i < NUM_VM_SLOTS; i = i + 1) begin
-                if (vm_done[i]) begin
-                    int_status_reg_r[i] <= 1'b1; // VMi_DONE_IRQ (Bits 0-7)
+                // With write-back or in a batch, DONE is set by the DMA block
+                if (vm_done[i] && vm_out_max_r[i][31:2] == 0 && !(batch_active_r && batch_vm_r == i)) begin
+                    int_status_reg_r[i] <= 1'b1; // VMi_DONE_IRQ
                 end
                 if (vm_error[i]) begin
-                    int_status_reg_r[i + NUM_VM_SLOTS] <= 1'b1; // VMi_ERROR_IRQ (Bits 8-15)
+                    int_status_reg_r[i + NUM_VM_SLOTS] <= 1'b1; // VMi_ERROR_IRQ
                 end
             end
-            // Note: DMA_DONE_IRQ (Bit 16) and DMA_ERROR_IRQ (Bit 17) in int_status_reg_r
+            // Note: DMA_DONE_IRQ and DMA_ERROR_IRQ in int_status_reg_r
             // are to be set by DMA logic, not covered here.
 
+            // FIFO mode: a completed CPU read of an OUT offset pops the word it returned
+            if (read_state_r == READ_DATA && axi_rvalid_r && s_axi_rready) begin
+                if (ar_page_hit_w && mbox_fifo_ctrl_r[ar_page_vm_w][0] && ar_page_reg_w >= ADDR_MAILBOX_DATA_OUT_0_REG &&
+                    ar_page_reg_w < (ADDR_MAILBOX_DATA_OUT_0_REG + NUM_MAILBOX_REGS*4) && mbox_out_count_w[ar_page_vm_w] != 0)
+                    mbox_out_head_r[ar_page_vm_w] <= mbox_out_head_r[ar_page_vm_w] + 1;
+                else if (!ar_page_hit_w && mbox_fifo_ctrl_r[vm_select_id_r][0] && araddr_latched_r >= ADDR_MAILBOX_DATA_OUT_0_REG &&
+                         araddr_latched_r < (ADDR_MAILBOX_DATA_OUT_0_REG + NUM_MAILBOX_REGS*4) && mbox_out_count_w[vm_select_id_r] != 0)
+                    mbox_out_head_r[vm_select_id_r] <= mbox_out_head_r[vm_select_id_r] + 1;
+            end
+
+            for (integer i = 0; i < NUM_VM_SLOTS; i = i + 1) begin
+                // FIFO mode, slot side: pop IN on a consumed read, push OUT on a write (dropped when full)
+                if (mbox_fifo_ctrl_r[i][0]) begin
+                    if (vm_mailbox_in_pop_i[i] && mbox_in_count_w[i] != 0)
+                        mbox_in_head_r[i] <= mbox_in_head_r[i] + 1;
+                    if (vm_mailbox_out_wen_i[i] && mbox_out_count_w[i] < mbox_depth_w[i]) begin
+                        mbox_out_fifo_r[i][mbox_out_tail_r[i][MBOX_FIFO_MAX_LOG2-1:0]] <= vm_mailbox_out_wdata_i[i];
+                        mbox_out_tail_r[i] <= mbox_out_tail_r[i] + 1;
+                    end
+                end
+                // RESET_VM empties the FIFOs and keeps the mode
+                if (internal_vm_reset_r[i]) begin
+                    mbox_in_head_r[i]     <= 0;
+                    mbox_in_tail_r[i]     <= 0;
+                    mbox_out_head_r[i]    <= 0;
+                    mbox_out_tail_r[i]    <= 0;
+                    mbox_in_overflow_r[i] <= 1'b0;
+                end
+            end
+
             // Handle VM writes to their OUT mailboxes (data to be read by CPU)
             for (integer i = 0; i < NUM_VM_SLOTS; i = i + 1) begin
-                if (vm_mailbox_out_wen_i[i]) begin
+                if (vm_mailbox_out_wen_i[i] && !mbox_fifo_ctrl_r[i][0]) begin
                     if (vm_mailbox_out_idx_i[i] < NUM_MAILBOX_REGS) begin
                         vm_mailboxes_out[i][vm_mailbox_out_idx_i[i]] <= vm_mailbox_out_wdata_i[i];
                     end
@@ -517,6 +1244,30 @@ module CoprocessorControlUnit (
         end
     end
 
+    // MBOX_FIFO_CTRL_REG write: ignored while the VM runs, as it owns the FIFOs; empties both
+    task automatic mbox_set_ctrl(input [VM_ID_WIDTH-1:0] vm, input [DATA_WIDTH_AXI-1:0] value);
+        if (!active_vm_mask_r[vm]) begin
+            mbox_fifo_ctrl_r[vm] <= {value[31:12] & MBOX_FIFO_CTRL_MASK[31:12],
+                                     (value[11:8] > MBOX_FIFO_MAX_LOG2) ? 4'(MBOX_FIFO_MAX_LOG2) : value[11:8],
+                                     value[7:0] & MBOX_FIFO_CTRL_MASK[7:0]};
+            mbox_in_head_r[vm]     <= 0;
+            mbox_in_tail_r[vm]     <= 0;
+            mbox_out_head_r[vm]    <= 0;
+            mbox_out_tail_r[vm]    <= 0;
+            mbox_in_overflow_r[vm] <= 1'b0;
+        end
+    endtask
+
+    // CPU push to the IN FIFO; a push to a full FIFO is dropped and latches IN_OVERFLOW
+    task automatic mbox_cpu_push(input [VM_ID_WIDTH-1:0] vm, input [DATA_WIDTH_AXI-1:0] value);
+        if (mbox_in_count_w[vm] < mbox_depth_w[vm]) begin
+            mbox_in_fifo_r[vm][mbox_in_tail_r[vm][MBOX_FIFO_MAX_LOG2-1:0]] <= value;
+            mbox_in_tail_r[vm] <= mbox_in_tail_r[vm] + 1;
+        end else begin
+            mbox_in_overflow_r[vm] <= 1'b1;
+        end
+    endtask
+
     // Combinatorial assignment for copro_busy_status_r
     assign copro_busy_status_r = |active_vm_mask_r | dma_busy_placeholder_w;
 
@@ -525,26 +1276,48 @@ module CoprocessorControlUnit (
     genvar k_ccu_mbox; 
     generate
         for (k_ccu_mbox = 0; k_ccu_mbox < NUM_VM_SLOTS; k_ccu_mbox = k_ccu_mbox + 1) begin : vm_mailbox_read_gen_ccu
+            // FIFO mode: the IN head, or all ones when empty (MBOX_READ's -1)
             assign vm_mailbox_in_rdata_internal[k_ccu_mbox] = 
+                mbox_fifo_ctrl_r[k_ccu_mbox][0] ?
+                (mbox_in_count_w[k_ccu_mbox] != 0 ?
+                 mbox_in_fifo_r[k_ccu_mbox][mbox_in_head_r[k_ccu_mbox][MBOX_FIFO_MAX_LOG2-1:0]] : 32'hFFFFFFFF) :
                 (vm_mailbox_in_idx_i[k_ccu_mbox] < NUM_MAILBOX_REGS) ? 
                 vm_mailboxes_in[k_ccu_mbox][vm_mailbox_in_idx_i[k_ccu_mbox]] : 
                 32'hBADADD03; // Indicate read error (index out of bounds for specific VM)
+
+            assign mbox_in_count_w[k_ccu_mbox]  = mbox_in_tail_r[k_ccu_mbox] - mbox_in_head_r[k_ccu_mbox];
+            assign mbox_out_count_w[k_ccu_mbox] = mbox_out_tail_r[k_ccu_mbox] - mbox_out_head_r[k_ccu_mbox];
+            assign mbox_depth_w[k_ccu_mbox]     = 1 << mbox_fifo_ctrl_r[k_ccu_mbox][11:8];
+            // Watermarks of 0 mean 1
+            assign mbox_cond_w[k_ccu_mbox] = {2{mbox_fifo_ctrl_r[k_ccu_mbox][0]}} & {
+                mbox_out_count_w[k_ccu_mbox] >= ((mbox_fifo_ctrl_r[k_ccu_mbox][31:24] == 8'b0) ? 8'd1 : mbox_fifo_ctrl_r[k_ccu_mbox][31:24]),
+                (mbox_depth_w[k_ccu_mbox] - mbox_in_count_w[k_ccu_mbox]) >=
+                    ((mbox_fifo_ctrl_r[k_ccu_mbox][23:16] == 8'b0) ? 8'd1 : mbox_fifo_ctrl_r[k_ccu_mbox][23:16])};
+            assign mbox_pending_w[k_ccu_mbox] = |(mbox_cond_w[k_ccu_mbox] & mbox_irq_enable_r[k_ccu_mbox]);
+            // Slot view (its MBOX_STATUS CSR): [15:0] IN count, [31:16] OUT free
+            assign vm_mailbox_status_o[k_ccu_mbox] = mbox_fifo_ctrl_r[k_ccu_mbox][0] ?
+                {16'(mbox_depth_w[k_ccu_mbox] - mbox_out_count_w[k_ccu_mbox]), 16'(mbox_in_count_w[k_ccu_mbox])} : 32'b0;
         end
     endgenerate
 
     //--------------------------------------------------------------------------
     // Command Signal Generation (Pulsed for one cycle)
     //--------------------------------------------------------------------------
-    reg [4:0] cmd_reg_written_snapshot_r; // Snapshot of command bits when written
+    reg [6:0] cmd_reg_written_snapshot_r; // Snapshot of command bits when written
 
     always @(posedge s_axi_aclk or posedge reset) begin
         if (reset) begin
-            cmd_reg_written_snapshot_r <= 5'b0;
+            cmd_reg_written_snapshot_r <= 7'b0;
+            cmd_vm_r <= {VM_ID_WIDTH{1'b0}};
+            cmd_from_page_r <= 1'b0;
         end else begin
-            if (write_state_r == WRITE_DATA && s_axi_wvalid && axi_wready_r && awaddr_latched_r == ADDR_COPRO_CMD_REG) begin
-                cmd_reg_written_snapshot_r <= s_axi_wdata[4:0]; // Capture command bits on write
+            if (write_state_r == WRITE_DATA && s_axi_wvalid && axi_wready_r &&
+                (awaddr_latched_r == ADDR_COPRO_CMD_REG || (aw_page_hit_w && aw_page_reg_w == ADDR_COPRO_CMD_REG))) begin
+                cmd_reg_written_snapshot_r <= s_axi_wdata[6:0]; // Capture command bits on write
+                cmd_vm_r <= aw_page_hit_w ? aw_page_vm_w : vm_select_id_r;
+                cmd_from_page_r <= aw_page_hit_w;
             end else begin
-                cmd_reg_written_snapshot_r <= 5'b0; // Clear in the next cycle to ensure one-cycle pulse
+                cmd_reg_written_snapshot_r <= 7'b0; // Clear in the next cycle to ensure one-cycle pulse
             end
         end
     end
@@ -554,6 +1327,26 @@ module CoprocessorControlUnit (
     assign reset_vm_cmd_w     = cmd_reg_written_snapshot_r[2];
     assign load_prog_cmd_w    = cmd_reg_written_snapshot_r[3];
     assign load_data_in_cmd_w = cmd_reg_written_snapshot_r[4];
+    assign load_prog_handle_cmd_w = cmd_reg_written_snapshot_r[5];
+    assign start_batch_cmd_w  = cmd_reg_written_snapshot_r[6];
+
+    // DMA source and length for the load command in flight
+    wire [63:0] cmd_prog_addr_w    = cmd_from_page_r ? {page_prog_addr_high_r[cmd_vm_r], page_prog_addr_low_r[cmd_vm_r]}
+                                                     : {prog_addr_high_reg_r, prog_addr_low_reg_r};
+    wire [63:0] cmd_data_in_addr_w = cmd_from_page_r ? {page_data_in_addr_high_r[cmd_vm_r], page_data_in_addr_low_r[cmd_vm_r]}
+                                                     : {data_in_addr_high_reg_r, data_in_addr_low_reg_r};
+    wire [31:0] cmd_data_len_w     = cmd_from_page_r ? page_data_len_r[cmd_vm_r] : data_len_reg_r;
+    // Output write-back destination for START_VM
+    wire [63:0] cmd_data_out_addr_w = cmd_from_page_r ? {page_data_out_addr_high_r[cmd_vm_r], page_data_out_addr_low_r[cmd_vm_r]}
+                                                      : {data_out_addr_high_reg_r, data_out_addr_low_reg_r};
+    wire [31:0] cmd_data_out_len_w  = cmd_from_page_r ? page_data_out_len_r[cmd_vm_r] : data_out_len_reg_r;
+    // START_BATCH: records are whole words here, as the DMA engine moves words. A result
+    // transfer of the previous batch may still be in flight.
+    assign cmd_batch_ok_w = !batch_active_r && !dma_for_batch_r && !active_vm_mask_r[cmd_vm_r] &&
+                            page_batch_rec_size_r[cmd_vm_r] != 0 && page_batch_rec_size_r[cmd_vm_r] <= VM_DATA_MEM_BYTES &&
+                            page_batch_rec_size_r[cmd_vm_r][1:0] == 2'b00 &&
+                            page_batch_count_r[cmd_vm_r] != 0 && page_batch_count_r[cmd_vm_r] <= BATCH_MAX_RECORDS &&
+                            (page_batch_stride_r[cmd_vm_r] == 0 || page_batch_stride_r[cmd_vm_r] >= 8);
 
     //--------------------------------------------------------------------------
     // VM Control Signal Assignments from internal registers
@@ -569,9 +1362,72 @@ module CoprocessorControlUnit (
     //--------------------------------------------------------------------------
     // Interrupt Logic
     //--------------------------------------------------------------------------
-    wire [DATA_WIDTH_AXI-1:0] active_interrupts;
-    assign active_interrupts = int_status_reg_r & int_enable_reg_r;
-    assign interrupt_out = |active_interrupts[17:0]; // Consider only relevant 18 bits for interrupt
+    wire [IRQ_VEC_W-1:0] active_interrupts;
+    assign active_interrupts = irq_pending_w & int_enable_reg_r;
+
+    //--------------------------------------------------------------------------
+    // Interrupt Moderation
+    //--------------------------------------------------------------------------
+    // A class counts one event per cycle in which one of its active bits rises
+    // (active bits with no counted event count as one). It fires once COUNT
+    // events are in, TIMEOUT microseconds after the first, or at once for an
+    // error with bypass set, and re-arms when all its active bits are cleared.
+    // The reset values (COUNT 0, TIMEOUT 0) fire on every event.
+    reg  [IRQ_VEC_W-1:0] irq_active_prev_r;
+    reg  [15:0] irq_mod_count_r [IRQ_NUM_CLASSES-1:0];
+    reg  [15:0] irq_mod_us_r    [IRQ_NUM_CLASSES-1:0]; // Microseconds since the class was armed
+    reg  [IRQ_NUM_CLASSES-1:0] irq_mod_fired_r;
+    reg  [$clog2(IRQ_MOD_CLKS_PER_US)-1:0] irq_mod_prescale_r;
+    wire        irq_mod_us_tick_w = (irq_mod_prescale_r == IRQ_MOD_CLKS_PER_US - 1);
+    wire [IRQ_VEC_W-1:0] irq_rise_w = active_interrupts & ~irq_active_prev_r;
+
+    function automatic [IRQ_VEC_W-1:0] irq_class_mask(input integer c);
+        case (c)
+            0:       irq_class_mask = IRQ_CLASS_VM_DONE_MASK;
+            1:       irq_class_mask = IRQ_CLASS_VM_ERROR_MASK;
+            default: irq_class_mask = IRQ_CLASS_DMA_MASK;
+        endcase
+    endfunction
+
+    always @(posedge s_axi_aclk or posedge reset) begin
+        if (reset) begin
+            irq_active_prev_r  <= {IRQ_VEC_W{1'b0}};
+            irq_mod_fired_r    <= {IRQ_NUM_CLASSES{1'b0}};
+            irq_mod_prescale_r <= 0;
+            for (integer c = 0; c < IRQ_NUM_CLASSES; c = c + 1) begin
+                irq_mod_count_r[c] <= 16'b0;
+                irq_mod_us_r[c]    <= 16'b0;
+            end
+        end else begin
+            irq_active_prev_r  <= active_interrupts;
+            irq_mod_prescale_r <= irq_mod_us_tick_w ? 0 : irq_mod_prescale_r + 1;
+            for (integer c = 0; c < IRQ_NUM_CLASSES; c = c + 1) begin
+                automatic logic [IRQ_VEC_W-1:0] bits_w;
+                automatic logic [15:0] count_w;
+                automatic logic [15:0] limit_w;
+                bits_w  = active_interrupts & irq_class_mask(c);
+                count_w = irq_mod_count_r[c];
+                if (bits_w == {IRQ_VEC_W{1'b0}}) begin
+                    irq_mod_count_r[c] <= 16'b0;
+                    irq_mod_us_r[c]    <= 16'b0;
+                    irq_mod_fired_r[c] <= 1'b0;
+                end else begin
+                    if (((irq_rise_w & irq_class_mask(c)) != {IRQ_VEC_W{1'b0}} || count_w == 16'b0) && count_w != 16'hFFFF)
+                        count_w = count_w + 1;
+                    irq_mod_count_r[c] <= count_w;
+                    if (irq_mod_us_tick_w && irq_mod_us_r[c] != 16'hFFFF)
+                        irq_mod_us_r[c] <= irq_mod_us_r[c] + 1;
+                    limit_w = (irq_mod_reg_r[c][15:0] == 16'b0) ? 16'd1 : irq_mod_reg_r[c][15:0];
+                    if (count_w >= limit_w ||
+                        (irq_mod_reg_r[c][31:16] != 16'b0 && irq_mod_us_r[c] >= irq_mod_reg_r[c][31:16]) ||
+                        (irq_mod_err_bypass_r && (bits_w & IRQ_ERROR_MASK) != {IRQ_VEC_W{1'b0}}))
+                        irq_mod_fired_r[c] <= 1'b1;
+                end
+            end
+        end
+    end
+
+    assign interrupt_out = |irq_mod_fired_r;
 
 
     //--------------------------------------------------------------------------
@@ -589,28 +1445,183 @@ module CoprocessorControlUnit (
     assign m_axi_arvalid = m_axi_arvalid_r;
     assign m_axi_rready  = m_axi_rready_r;
 
-    // Connect internal registers to VM Program Memory Write Interface Outputs
-    assign vm_wr_prog_addr = vm_wr_prog_addr_r;
-    assign vm_wr_prog_data = vm_wr_prog_data_r;
-    assign vm_wr_prog_en   = vm_wr_prog_en_r;
+    //--------------------------------------------------------------------------
+    // Slot memory window: a second AXI4-Lite slave onto the slots' memory ports.
+    // Slot n's window is at n * 0x4000: program memory (8 KB), then data buffer A
+    // (bank 0) at +0x2000 and buffer B (bank 1) at +0x3000, 4 KB each. Accesses
+    // wait while the DMA engine uses the ports; stores to a locked region are
+    // dropped, and addresses past the last slot read 0.
+    //--------------------------------------------------------------------------
+    localparam MEM_WIN_ADDR_WIDTH = VM_ID_WIDTH + 14;
+    localparam MEM_WIN_IDLE = 3'd0, MEM_WIN_WRITE = 3'd1, MEM_WIN_WRESP = 3'd2,
+               MEM_WIN_READ = 3'd3, MEM_WIN_RRESP = 3'd4;
+    reg [2:0]                    mem_win_state_r;
+    reg [MEM_WIN_ADDR_WIDTH-1:0] mem_win_addr_r;
+    reg [DATA_WIDTH_AXI-1:0]     mem_win_wdata_r;
+    reg [DATA_WIDTH_AXI-1:0]     mem_win_rdata_r;
+    reg                          mem_win_wready_r;    // AW and W are taken together
+    reg                          mem_win_arready_r;
+    reg [NUM_VM_SLOTS-1:0]       mem_win_prog_en_r;
+    reg [NUM_VM_SLOTS-1:0]       mem_win_data_en_r;
+
+    wire [VM_ID_WIDTH-1:0] mem_win_vm_w   = mem_win_addr_r[MEM_WIN_ADDR_WIDTH-1:14];
+    wire                   mem_win_hit_w  = mem_win_vm_w < NUM_VM_SLOTS;
+    wire                   mem_win_prog_w = !mem_win_addr_r[13];
+    wire                   mem_win_bank_w = mem_win_addr_r[12];
+    // WRITE_LOCK: a running slot's program and active data buffer are read-only
+    wire                   mem_win_locked_w = active_vm_mask_r[mem_win_vm_w] && vm_mem_locked_r[mem_win_vm_w] &&
+                                              (mem_win_prog_w || mem_win_bank_w == vm_data_bank[mem_win_vm_w]);
+    // DMA loads drive the write ports from DMA_READ_BURST, the write-back reads during DMA_OUT_*
+    wire                   mem_win_port_free_w = dma_state_r != DMA_READ_BURST && dma_state_r != DMA_OUT_ADDR &&
+                                                 dma_state_r != DMA_OUT_DATA && dma_state_r != DMA_OUT_RESP;
+    wire                   mem_win_rd_w = mem_win_state_r == MEM_WIN_READ && mem_win_port_free_w;
+
+    always @(posedge s_axi_aclk or posedge reset) begin
+        if (reset) begin
+            mem_win_state_r   <= MEM_WIN_IDLE;
+            mem_win_addr_r    <= {MEM_WIN_ADDR_WIDTH{1'b0}};
+            mem_win_wdata_r   <= 32'b0;
+            mem_win_rdata_r   <= 32'b0;
+            mem_win_wready_r  <= 1'b0;
+            mem_win_arready_r <= 1'b0;
+            mem_win_prog_en_r <= {NUM_VM_SLOTS{1'b0}};
+            mem_win_data_en_r <= {NUM_VM_SLOTS{1'b0}};
+        end else begin
+            mem_win_wready_r  <= 1'b0;
+            mem_win_arready_r <= 1'b0;
+            mem_win_prog_en_r <= {NUM_VM_SLOTS{1'b0}}; // One-cycle write pulses
+            mem_win_data_en_r <= {NUM_VM_SLOTS{1'b0}};
+            case (mem_win_state_r)
+                MEM_WIN_IDLE: begin
+                    if (s_axi_mem_awvalid && s_axi_mem_wvalid) begin
+                        mem_win_wready_r <= 1'b1;
+                        mem_win_addr_r   <= s_axi_mem_awaddr[MEM_WIN_ADDR_WIDTH-1:0];
+                        mem_win_wdata_r  <= s_axi_mem_wdata;
+                        mem_win_state_r  <= MEM_WIN_WRITE;
+                    end else if (s_axi_mem_arvalid) begin
+                        mem_win_arready_r <= 1'b1;
+                        mem_win_addr_r    <= s_axi_mem_araddr[MEM_WIN_ADDR_WIDTH-1:0];
+                        mem_win_state_r   <= MEM_WIN_READ;
+                    end
+                end
+                MEM_WIN_WRITE: begin
+                    // The pulse lands next cycle, when the DMA engine cannot be writing
+                    if (mem_win_port_free_w) begin
+                        if (mem_win_hit_w && !mem_win_locked_w) begin
+                            if (mem_win_prog_w) mem_win_prog_en_r[mem_win_vm_w] <= 1'b1;
+                            else                mem_win_data_en_r[mem_win_vm_w] <= 1'b1;
+                        end
+                        mem_win_state_r <= MEM_WIN_WRESP;
+                    end
+                end
+                MEM_WIN_WRESP: begin
+                    if (s_axi_mem_bready) mem_win_state_r <= MEM_WIN_IDLE;
+                end
+                MEM_WIN_READ: begin
+                    if (mem_win_port_free_w) begin
+                        mem_win_rdata_r <= !mem_win_hit_w ? 32'b0 :
+                                           mem_win_prog_w ? vm_rd_prog_data[mem_win_vm_w] : vm_rd_data[mem_win_vm_w];
+                        mem_win_state_r <= MEM_WIN_RRESP;
+                    end
+                end
+                MEM_WIN_RRESP: begin
+                    if (s_axi_mem_rready) mem_win_state_r <= MEM_WIN_IDLE;
+                end
+                default: mem_win_state_r <= MEM_WIN_IDLE;
+            endcase
+        end
+    end
 
-    // Tie off AXI Master Write interface (not used in this subtask)
-    assign m_axi_awaddr = 32'b0;
-    assign m_axi_awvalid = 1'b0;
-    assign m_axi_wdata = 32'b0;
-    assign m_axi_wlast = 1'b0;
-    assign m_axi_wvalid = 1'b0;
-    // assign m_axi_bready will be tied or handled if writes were implemented
+    assign s_axi_mem_awready = mem_win_wready_r;
+    assign s_axi_mem_wready  = mem_win_wready_r;
+    assign s_axi_mem_bresp   = 2'b00; // OKAY, also for a dropped store
+    assign s_axi_mem_bvalid  = mem_win_state_r == MEM_WIN_WRESP;
+    assign s_axi_mem_arready = mem_win_arready_r;
+    assign s_axi_mem_rdata   = mem_win_rdata_r;
+    assign s_axi_mem_rresp   = 2'b00; // OKAY
+    assign s_axi_mem_rvalid  = mem_win_state_r == MEM_WIN_RRESP;
+
+    // Connect internal registers to VM Program Memory Write Interface Outputs;
+    // a window store takes the slot's port for its one-cycle pulse
+    genvar k_ccu_wr;
+    generate
+        for (k_ccu_wr = 0; k_ccu_wr < NUM_VM_SLOTS; k_ccu_wr = k_ccu_wr + 1) begin : vm_wr_prog_gen_ccu
+            assign vm_wr_prog_addr[k_ccu_wr] = mem_win_prog_en_r[k_ccu_wr] ? mem_win_addr_r[12:2] : vm_wr_prog_addr_r[k_ccu_wr];
+            assign vm_wr_prog_data[k_ccu_wr] = mem_win_prog_en_r[k_ccu_wr] ? mem_win_wdata_r : vm_wr_prog_data_r[k_ccu_wr];
+        end
+    endgenerate
+    assign vm_wr_prog_en   = vm_wr_prog_en_r | mem_win_prog_en_r;
+
+    // Data-in beats go to the target slot's data memory
+    assign vm_wr_data_addr = |mem_win_data_en_r ? mem_win_addr_r[11:2] : vm_wr_data_addr_r;
+    assign vm_wr_data_data = |mem_win_data_en_r ? mem_win_wdata_r : vm_wr_data_data_r;
+    assign vm_wr_data_en   = vm_wr_data_en_r | mem_win_data_en_r;
+    // With PINGPONG, data-in fills the bank the slot does not run on; batch records go to the active one
+    assign vm_wr_data_bank = |mem_win_data_en_r ? mem_win_bank_w :
+                             vm_data_bank[dma_target_vm_id_r] ^
+                             (page_data_pingpong_r[dma_target_vm_id_r] && !dma_for_batch_r);
+    assign vm_data_swap    = vm_data_swap_r;
+
+    // Slot memories are read combinationally: the word being written back, or a window read
+    assign vm_rd_prog_addr = mem_win_addr_r[12:2];
+    assign vm_rd_data_addr = mem_win_rd_w ? mem_win_addr_r[11:2] : dma_out_word_r[VM_DATA_MEM_ADDR_WIDTH-1:0];
+    assign vm_rd_data_bank = mem_win_rd_w ? mem_win_bank_w : vm_data_bank[dma_out_vm_r];
+
+    // AXI Master Write interface: ring descriptor and output write-back, single beats
+    assign m_axi_awaddr  = m_axi_awaddr_r;
+    assign m_axi_awvalid = m_axi_awvalid_r;
+    assign m_axi_wdata   = m_axi_wdata_r;
+    assign m_axi_wlast   = m_axi_wvalid_r; // Every write is a single beat
+    assign m_axi_wvalid  = m_axi_wvalid_r;
+    assign m_axi_bready  = m_axi_bready_r;
 
     assign dma_busy_actual_w = (dma_state_r != DMA_IDLE);
 
+    assign dma_ring_busy_w    = (dma_ring_head_r != dma_ring_tail_r);
+    assign dma_ring_size_ok_w = ((s_axi_wdata & (s_axi_wdata - 1)) == 32'b0) && (s_axi_wdata <= DMA_RING_MAX_ENTRIES);
+    assign dma_ring_reset_w   = write_state_r == WRITE_DATA && s_axi_wvalid && axi_wready_r &&
+                                awaddr_latched_r == ADDR_DMA_RING_SIZE_REG && !dma_ring_busy_w && dma_ring_size_ok_w;
+    wire dma_csr_wr_w         = write_state_r == WRITE_DATA && s_axi_wvalid && axi_wready_r;
+
+    // VM_MEM_PROG_LEN_REG/VM_MEM_DATA_LEN_REG: refused while the VM runs (a data length
+    // is a PINGPONG fill of the free buffer then) or for a bad length
+    wire mem_len_wr_w   = dma_csr_wr_w && aw_page_hit_w &&
+                          (aw_page_reg_w == ADDR_VM_MEM_PROG_LEN_REG || aw_page_reg_w == ADDR_VM_MEM_DATA_LEN_REG);
+    wire mem_len_prog_w = aw_page_reg_w == ADDR_VM_MEM_PROG_LEN_REG;
+    wire mem_len_ok_w   = (!active_vm_mask_r[aw_page_vm_w] || (!mem_len_prog_w && page_data_pingpong_r[aw_page_vm_w])) &&
+                          (mem_len_prog_w ? s_axi_wdata <= VM_PROG_MEM_BYTES && s_axi_wdata[2:0] == 3'b000 :
+                                            s_axi_wdata <= VM_DATA_MEM_BYTES);
+
+    // LOAD_PROG/LOAD_DATA_IN go to the slot's queue; a full queue refuses them with DMA_ERROR
+    wire dma_q_full_w = dma_q_count_r[cmd_vm_r] == DMA_QUEUE_DEPTH;
+    wire dma_q_push_w = (load_prog_cmd_w || load_data_in_cmd_w) && !dma_q_full_w;
+
+    // Round-robin pick among the slot queues and the ring, starting after the last one served
+    reg                 dma_pick_valid_w;
+    reg [VM_ID_WIDTH:0] dma_pick_w;
+    always @(*) begin
+        dma_pick_valid_w = 1'b0;
+        dma_pick_w       = {(VM_ID_WIDTH+1){1'b0}};
+        for (integer k = 1; k <= NUM_VM_SLOTS + 1; k = k + 1) begin
+            automatic integer r = (dma_rr_r + k) % (NUM_VM_SLOTS + 1);
+            if (!dma_pick_valid_w && (r == NUM_VM_SLOTS ? dma_ring_busy_w : dma_q_count_r[r] != 0)) begin
+                dma_pick_valid_w = 1'b1;
+                dma_pick_w       = r;
+            end
+        end
+    end
+    // Handle misses, batch records and output write-back are served ahead of the round-robin
+    wire dma_q_pop_w = dma_state_r == DMA_IDLE && !load_prog_handle_cmd_w &&
+                       !(batch_active_r && (batch_phase_r == BATCH_LOAD || batch_phase_r == BATCH_STORE)) &&
+                       dma_out_pending_r == 0 && dma_pick_valid_w && dma_pick_w != NUM_VM_SLOTS;
+
     // DMA Controller State Machine Logic
     always @(posedge s_axi_aclk or posedge reset) begin
         if (reset) begin
             dma_state_r <= DMA_IDLE;
             dma_addr_r <= 32'b0;
             dma_len_bytes_r <= 32'b0;
-            dma_target_vm_id_r <= 3'b0;
+            dma_target_vm_id_r <= {VM_ID_WIDTH{1'b0}};
             dma_op_is_prog_load_r <= 1'b0;
             dma_bytes_transferred_r <= 32'b0;
             dma_current_burst_len_bytes_r <= 32'b0;
@@ -622,39 +1633,324 @@ module CoprocessorControlUnit (
             m_axi_arburst_r <= 2'b01;  // Default to INCR
             m_axi_arvalid_r <= 1'b0;
             m_axi_rready_r  <= 1'b0;
+            m_axi_awaddr_r  <= 32'b0;
+            m_axi_awvalid_r <= 1'b0;
+            m_axi_wdata_r   <= 32'b0;
+            m_axi_wvalid_r  <= 1'b0;
+            m_axi_bready_r  <= 1'b0;
+
+            dma_ring_head_r    <= 32'b0;
+            dma_from_ring_r    <= 1'b0;
+            dma_desc_addr_r    <= 32'b0;
+            dma_desc_word0_r   <= 32'b0;
+            dma_sg_list_addr_r <= 32'b0;
+            dma_sg_index_r     <= 16'b0;
+            dma_sg_addr_r      <= 32'b0;
+            dma_sg_len_r       <= 32'b0;
+            dma_desc_len_r     <= 32'b0;
+            dma_desc_status_r  <= 32'b0;
+            dma_beat_r         <= 3'b0;
+            dma_beat_err_r     <= 1'b0;
+            dma_wb_word_r      <= 1'b0;
+            dma_out_pending_r  <= {NUM_VM_SLOTS{1'b0}};
+            dma_out_vm_r       <= {VM_ID_WIDTH{1'b0}};
+            dma_out_word_r     <= 0;
+            dma_out_words_r    <= 0;
+            vm_out_err_r       <= {NUM_VM_SLOTS{1'b0}};
+            batch_active_r     <= 1'b0;
+            batch_phase_r      <= BATCH_LOAD;
+            batch_vm_r         <= {VM_ID_WIDTH{1'b0}};
+            batch_in_addr_r    <= 32'b0;
+            batch_out_addr_r   <= 32'b0;
+            batch_rec_size_r   <= 32'b0;
+            batch_stride_r     <= 32'b0;
+            batch_left_r       <= 17'b0;
+            batch_start_r      <= 1'b0;
+            batch_end_r        <= 1'b0;
+            batch_vm_done_prev_r  <= 1'b0;
+            batch_vm_error_prev_r <= 1'b0;
+            dma_for_batch_r    <= 1'b0;
+            vm_batch_err_r     <= {NUM_VM_SLOTS{1'b0}};
             
             dma_vm_prog_mem_wr_addr_r <= 0;
+            dma_vm_data_mem_wr_addr_r <= 0;
+            vm_wr_data_addr_r <= 0;
+            vm_wr_data_data_r <= 32'b0;
+            vm_wr_data_en_r   <= {NUM_VM_SLOTS{1'b0}};
+            vm_data_ready_r   <= {NUM_VM_SLOTS{1'b0}};
+            dma_rr_r          <= NUM_VM_SLOTS;
+            dma_chan_done_r   <= 1'b0;
+            dma_chan_error_r  <= 1'b0;
             for (integer i = 0; i < NUM_VM_SLOTS; i = i + 1) begin
+                dma_q_prog_r[i]  <= {DMA_QUEUE_DEPTH{1'b0}};
+                dma_q_head_r[i]  <= 0;
+                dma_q_count_r[i] <= 0;
                 vm_wr_prog_en_r[i] <= 1'b0;
                 // vm_wr_prog_addr_r and vm_wr_prog_data_r don't need reset here, driven by logic.
+                vm_mem_prog_len_r[i] <= 32'b0;
+                vm_mem_data_len_r[i] <= 32'b0;
+                vm_out_addr_r[i] <= 32'b0;
+                vm_out_max_r[i]  <= 32'b0;
+                vm_out_len_r[i]  <= 32'b0;
+                vm_batch_done_r[i] <= 17'b0;
             end
         end else begin
             // Default de-assertion for one-cycle pulse behavior of vm_wr_prog_en
             for (integer i = 0; i < NUM_VM_SLOTS; i = i + 1) begin
                 vm_wr_prog_en_r[i] <= 1'b0;
             end
+            vm_wr_data_en_r <= {NUM_VM_SLOTS{1'b0}};
+            batch_start_r   <= 1'b0;
+            // A swap consumes the filled bank; without PINGPONG nothing waits
+            vm_data_ready_r <= vm_data_ready_r & ~vm_data_swap_r & page_data_pingpong_r;
+            batch_end_r     <= 1'b0;
+
+            if (dma_ring_reset_w) dma_ring_head_r <= 32'b0;
+            // Stored through the window: a data length fills a PINGPONG slot's free buffer
+            if (mem_len_wr_w && mem_len_ok_w) begin
+                if (mem_len_prog_w) begin
+                    vm_mem_prog_len_r[aw_page_vm_w] <= s_axi_wdata;
+                end else begin
+                    vm_mem_data_len_r[aw_page_vm_w] <= s_axi_wdata;
+                    if (page_data_pingpong_r[aw_page_vm_w]) vm_data_ready_r[aw_page_vm_w] <= 1'b1;
+                end
+            end
+            if (dma_csr_wr_w && awaddr_latched_r == ADDR_DMA_CHAN_DONE_REG)
+                dma_chan_done_r <= dma_chan_done_r & ~s_axi_wdata[0];
+            if (dma_csr_wr_w && awaddr_latched_r == ADDR_DMA_CHAN_ERROR_REG)
+                dma_chan_error_r <= dma_chan_error_r & ~s_axi_wdata[0];
+
+            // Slot queues: this cycle's load goes in at the tail, DMA_IDLE takes the head
+            if ((load_prog_cmd_w || load_data_in_cmd_w) && dma_q_full_w)
+                int_status_reg_r[IRQ_DMA_ERROR_BIT] <= 1'b1; // DMA_ERROR_IRQ
+            for (integer i = 0; i < NUM_VM_SLOTS; i = i + 1) begin
+                automatic logic push_w = dma_q_push_w && cmd_vm_r == i;
+                automatic logic pop_w  = dma_q_pop_w && dma_pick_w == i;
+                automatic logic [$clog2(DMA_QUEUE_DEPTH)-1:0] tail_w =
+                    dma_q_head_r[i] + dma_q_count_r[i][$clog2(DMA_QUEUE_DEPTH)-1:0];
+                if (push_w) begin
+                    dma_q_addr_r[i][tail_w] <= load_prog_cmd_w ? cmd_prog_addr_w[31:0] : cmd_data_in_addr_w[31:0];
+                    dma_q_len_r[i][tail_w]  <= cmd_data_len_w;
+                    dma_q_prog_r[i][tail_w] <= load_prog_cmd_w;
+                end
+                if (pop_w) dma_q_head_r[i] <= dma_q_head_r[i] + 1;
+                dma_q_count_r[i] <= dma_q_count_r[i] + push_w - pop_w;
+            end
+
+            // START_VM latches the output destination; write-back is queued when the run completes
+            if (start_vm_cmd_w) begin
+                vm_out_addr_r[cmd_vm_r] <= cmd_data_out_addr_w[31:0];
+                vm_out_max_r[cmd_vm_r]  <= (cmd_data_out_len_w > VM_DATA_MEM_BYTES) ? VM_DATA_MEM_BYTES : cmd_data_out_len_w;
+                vm_out_len_r[cmd_vm_r]  <= 32'b0;
+                vm_out_err_r[cmd_vm_r]  <= 1'b0;
+            end
+            for (integer i = 0; i < NUM_VM_SLOTS; i = i + 1) begin
+                if (vm_done[i] && vm_out_max_r[i][31:2] != 0) dma_out_pending_r[i] <= 1'b1;
+            end
+            if (reset_vm_cmd_w) begin
+                vm_out_addr_r[cmd_vm_r]      <= 32'b0;
+                vm_out_max_r[cmd_vm_r]       <= 32'b0;
+                vm_out_len_r[cmd_vm_r]       <= 32'b0;
+                vm_out_err_r[cmd_vm_r]       <= 1'b0;
+                dma_out_pending_r[cmd_vm_r]  <= 1'b0;
+                vm_batch_err_r[cmd_vm_r]     <= 1'b0;
+                vm_batch_done_r[cmd_vm_r]    <= 17'b0;
+                vm_mem_prog_len_r[cmd_vm_r]  <= 32'b0;
+                vm_mem_data_len_r[cmd_vm_r]  <= 32'b0;
+            end
+
+            // START_BATCH: latch the arrays and settings; records are fetched from DMA_IDLE.
+            // No DATA_OUT write-back for the records.
+            if (start_batch_cmd_w && cmd_batch_ok_w) begin
+                batch_active_r   <= 1'b1;
+                batch_phase_r    <= BATCH_LOAD;
+                batch_vm_r       <= cmd_vm_r;
+                batch_in_addr_r  <= cmd_data_in_addr_w[31:0];
+                batch_out_addr_r <= cmd_data_out_addr_w[31:0];
+                batch_rec_size_r <= page_batch_rec_size_r[cmd_vm_r];
+                batch_stride_r   <= page_batch_stride_r[cmd_vm_r];
+                batch_left_r     <= page_batch_count_r[cmd_vm_r][16:0];
+                vm_batch_done_r[cmd_vm_r] <= 17'b0;
+                vm_batch_err_r[cmd_vm_r]  <= 1'b0;
+                vm_out_max_r[cmd_vm_r]    <= 32'b0;
+                vm_out_len_r[cmd_vm_r]    <= 32'b0;
+                vm_out_err_r[cmd_vm_r]    <= 1'b0;
+            end else if (batch_active_r && (stop_vm_cmd_w || reset_vm_cmd_w) && cmd_vm_r == batch_vm_r) begin
+                // STOP_VM/RESET_VM end the batch; a transfer in flight completes unused
+                batch_active_r <= 1'b0;
+                batch_end_r    <= 1'b1;
+            end else if (batch_active_r) begin
+                case (batch_phase_r)
+                    BATCH_RUN: begin
+                        if (vm_error[batch_vm_r] && !batch_vm_error_prev_r) begin
+                            // VMi_ERROR is raised from vm_error; the batch stops at this record
+                            batch_active_r <= 1'b0;
+                            batch_end_r    <= 1'b1;
+                        end else if (vm_done[batch_vm_r] && !batch_vm_done_prev_r) begin
+                            batch_phase_r <= (batch_stride_r != 0) ? BATCH_STORE : BATCH_NEXT;
+                        end
+                    end
+                    BATCH_NEXT: begin
+                        vm_batch_done_r[batch_vm_r] <= vm_batch_done_r[batch_vm_r] + 1;
+                        batch_in_addr_r  <= batch_in_addr_r + batch_rec_size_r;
+                        batch_out_addr_r <= batch_out_addr_r + batch_stride_r;
+                        batch_left_r     <= batch_left_r - 1;
+                        if (batch_left_r == 17'd1) begin
+                            int_status_reg_r[batch_vm_r] <= 1'b1; // VMi_DONE_IRQ, once per batch
+                            batch_active_r <= 1'b0;
+                            batch_end_r    <= 1'b1;
+                        end else begin
+                            batch_phase_r <= BATCH_LOAD;
+                        end
+                    end
+                    default: ; // LOAD and STORE are picked up by DMA_IDLE
+                endcase
+            end
+            batch_vm_done_prev_r  <= vm_done[batch_vm_r];
+            batch_vm_error_prev_r <= vm_error[batch_vm_r];
 
             case (dma_state_r)
                 DMA_IDLE: begin
                     m_axi_arvalid_r <= 1'b0;
                     m_axi_rready_r  <= 1'b0;
-                    if (load_prog_cmd_w || load_data_in_cmd_w) begin
+                    if (load_prog_handle_cmd_w) begin
+                        // No program cache to hit: report the miss so the driver falls back to LOAD_PROG
+                        dma_state_r <= DMA_ERROR;
+                    end else if (batch_active_r && batch_phase_r == BATCH_LOAD) begin
+                        // Next batch record into the start of the slot's data memory
+                        dma_for_batch_r           <= 1'b1;
+                        dma_op_is_prog_load_r     <= 1'b0;
+                        dma_target_vm_id_r        <= batch_vm_r;
+                        dma_addr_r                <= batch_in_addr_r;
+                        dma_len_bytes_r           <= batch_rec_size_r;
+                        dma_bytes_transferred_r   <= 32'b0;
+                        dma_vm_data_mem_wr_addr_r <= 0;
+                        batch_phase_r             <= BATCH_XFER;
+                        dma_state_r               <= DMA_CALC_BURST;
+                    end else if (batch_active_r && batch_phase_r == BATCH_STORE) begin
+                        dma_for_batch_r <= 1'b1;
+                        dma_wb_word_r   <= 1'b0;
+                        batch_phase_r   <= BATCH_XFER;
+                        dma_state_r     <= DMA_BATCH_WB_ADDR;
+                    end else if (dma_out_pending_r != 0) begin
+                        // Output write-back for the lowest-numbered finished slot
+                        automatic logic [VM_ID_WIDTH-1:0] out_vm_w;
+                        out_vm_w = {VM_ID_WIDTH{1'b0}};
+                        for (integer i = NUM_VM_SLOTS - 1; i >= 0; i = i - 1)
+                            if (dma_out_pending_r[i]) out_vm_w = i;
+                        dma_out_pending_r[out_vm_w] <= 1'b0;
+                        dma_out_vm_r    <= out_vm_w;
+                        dma_out_word_r  <= 0;
+                        dma_out_words_r <= vm_out_max_r[out_vm_w][31:2];
+                        dma_state_r     <= DMA_OUT_ADDR;
+                    end else if (dma_q_pop_w) begin
+                        // Head of the picked slot's queue
+                        automatic logic [VM_ID_WIDTH-1:0] q_vm_w = dma_pick_w[VM_ID_WIDTH-1:0];
+                        automatic logic [DATA_WIDTH_AXI-1:0] q_len_w = dma_q_len_r[q_vm_w][dma_q_head_r[q_vm_w]];
+                        dma_rr_r                  <= dma_pick_w;
                         dma_vm_prog_mem_wr_addr_r <= 0; // Reset for new DMA operation
-                        dma_op_is_prog_load_r <= load_prog_cmd_w; // True if prog load
-                        dma_target_vm_id_r    <= vm_select_id_r;
-                        if (load_prog_cmd_w) begin
-                            dma_addr_r <= {prog_addr_high_reg_r[31:0], prog_addr_low_reg_r[31:0]}; // Assuming 64-bit if available, else just low
-                        end else begin // data_in_cmd_w
-                            dma_addr_r <= {data_in_addr_high_reg_r[31:0], data_in_addr_low_reg_r[31:0]};
-                        end
-                        dma_len_bytes_r <= data_len_reg_r;
-                        dma_bytes_transferred_r <= 32'b0;
-                        
-                        if (data_len_reg_r == 0 || (data_len_reg_r % 4 != 0) ) begin // Length 0 or not word aligned is error for simple DMA
+                        dma_vm_data_mem_wr_addr_r <= 0;
+                        dma_op_is_prog_load_r     <= dma_q_prog_r[q_vm_w][dma_q_head_r[q_vm_w]];
+                        dma_target_vm_id_r        <= q_vm_w;
+                        dma_addr_r                <= dma_q_addr_r[q_vm_w][dma_q_head_r[q_vm_w]];
+                        dma_len_bytes_r           <= q_len_w;
+                        dma_bytes_transferred_r   <= 32'b0;
+                        if (q_len_w == 0 || q_len_w[1:0] != 2'b00) begin // Length 0 or not word aligned is error for simple DMA
                             dma_state_r <= DMA_ERROR;
                         end else begin
                             dma_state_r <= DMA_CALC_BURST;
                         end
+                    end else if (dma_pick_valid_w) begin
+                        // Next ring descriptor: one 8-beat burst
+                        dma_rr_r        <= NUM_VM_SLOTS;
+                        dma_from_ring_r <= 1'b1;
+                        dma_desc_addr_r <= dma_ring_base_low_r + (dma_ring_head_r << 5);
+                        m_axi_araddr_r  <= dma_ring_base_low_r + (dma_ring_head_r << 5);
+                        m_axi_arlen_r   <= 8'd7;
+                        m_axi_arsize_r  <= 3'b010;
+                        m_axi_arburst_r <= 2'b01;
+                        dma_beat_r      <= 3'b0;
+                        dma_beat_err_r  <= 1'b0;
+                        dma_state_r     <= DMA_DESC_FETCH;
+                    end
+                end
+
+                DMA_DESC_FETCH, DMA_SG_FETCH: begin
+                    m_axi_arvalid_r <= 1'b1;
+                    if (m_axi_arvalid_r && m_axi_arready) begin
+                        m_axi_arvalid_r <= 1'b0;
+                        dma_state_r     <= (dma_state_r == DMA_DESC_FETCH) ? DMA_DESC_READ : DMA_SG_READ;
+                    end
+                end
+
+                DMA_DESC_READ: begin
+                    m_axi_rready_r <= 1'b1;
+                    if (m_axi_rvalid) begin
+                        if (m_axi_rresp != 2'b00) dma_beat_err_r <= 1'b1;
+                        if (dma_beat_r == 3'd0) dma_desc_word0_r   <= m_axi_rdata;
+                        if (dma_beat_r == 3'd2) dma_sg_list_addr_r <= m_axi_rdata;
+                        dma_beat_r <= dma_beat_r + 1;
+                        if (m_axi_rlast) begin
+                            m_axi_rready_r <= 1'b0;
+                            dma_sg_index_r <= 16'b0;
+                            dma_desc_len_r <= 32'b0;
+                            dma_wb_word_r  <= 1'b0;
+                            dma_vm_prog_mem_wr_addr_r <= 0;
+                            dma_vm_data_mem_wr_addr_r <= 0;
+                            dma_target_vm_id_r    <= dma_desc_word0_r[VM_ID_WIDTH-1:0];
+                            dma_op_is_prog_load_r <= (dma_desc_word0_r[15:8] == DMA_OP_PROG);
+                            if (dma_beat_err_r || m_axi_rresp != 2'b00) begin
+                                // Nowhere to write a status to; just skip the descriptor
+                                dma_desc_status_r <= DMA_DESC_ERR_BUS;
+                                dma_state_r       <= DMA_DESC_NEXT;
+                            end else if (dma_desc_word0_r[7:0] >= NUM_VM_SLOTS ||
+                                         (dma_desc_word0_r[15:8] != DMA_OP_PROG && dma_desc_word0_r[15:8] != DMA_OP_DATA_IN) ||
+                                         dma_desc_word0_r[31:16] > DMA_MAX_SG) begin
+                                dma_desc_status_r <= DMA_DESC_ERR_DESC;
+                                dma_state_r       <= DMA_DESC_WB_ADDR;
+                            end else if (active_vm_mask_r[dma_desc_word0_r[VM_ID_WIDTH-1:0]]) begin
+                                dma_desc_status_r <= DMA_DESC_ERR_BUSY;
+                                dma_state_r       <= DMA_DESC_WB_ADDR;
+                            end else if (dma_desc_word0_r[31:16] == 16'b0) begin
+                                dma_desc_status_r <= DMA_DESC_OK;
+                                dma_state_r       <= DMA_DESC_WB_ADDR;
+                            end else begin
+                                m_axi_araddr_r  <= dma_sg_list_addr_r;
+                                m_axi_arlen_r   <= 8'd3;
+                                dma_beat_r      <= 3'b0;
+                                dma_beat_err_r  <= 1'b0;
+                                dma_state_r     <= DMA_SG_FETCH;
+                            end
+                        end
+                    end
+                end
+
+                // SG entries are streamed one at a time, so unlike the QEMU model an
+                // oversized list is only caught when the slot memory bound is hit
+                DMA_SG_READ: begin
+                    m_axi_rready_r <= 1'b1;
+                    if (m_axi_rvalid) begin
+                        if (m_axi_rresp != 2'b00) dma_beat_err_r <= 1'b1;
+                        if (dma_beat_r == 3'd0) dma_sg_addr_r <= m_axi_rdata;
+                        if (dma_beat_r == 3'd2) dma_sg_len_r  <= m_axi_rdata;
+                        dma_beat_r <= dma_beat_r + 1;
+                        if (m_axi_rlast) begin
+                            m_axi_rready_r <= 1'b0;
+                            dma_addr_r              <= dma_sg_addr_r;
+                            dma_len_bytes_r         <= dma_sg_len_r;
+                            dma_bytes_transferred_r <= 32'b0;
+                            if (dma_beat_err_r || m_axi_rresp != 2'b00) begin
+                                dma_desc_status_r <= DMA_DESC_ERR_BUS;
+                                dma_state_r       <= DMA_DESC_WB_ADDR;
+                            end else if (dma_sg_len_r % 4 != 0) begin
+                                dma_desc_status_r <= DMA_DESC_ERR_DESC;
+                                dma_state_r       <= DMA_DESC_WB_ADDR;
+                            end else if (dma_sg_len_r == 0) begin
+                                dma_state_r <= DMA_DONE; // Empty entry: straight to the next one
+                            end else begin
+                                dma_state_r <= DMA_CALC_BURST;
+                            end
+                        end
                     end
                 end
 
@@ -714,8 +2010,18 @@ module CoprocessorControlUnit (
                                     dma_state_r <= DMA_ERROR;
                                     m_axi_rready_r <= 1'b0; 
                                 end
+                            end else if (dma_vm_data_mem_wr_addr_r < (1 << VM_DATA_MEM_ADDR_WIDTH)) begin
+                                // LOAD_DATA_IN or a batch record: into the slot's data memory
+                                vm_wr_data_data_r <= m_axi_rdata;
+                                vm_wr_data_addr_r <= dma_vm_data_mem_wr_addr_r[VM_DATA_MEM_ADDR_WIDTH-1:0];
+                                vm_wr_data_en_r[dma_target_vm_id_r] <= 1'b1;
+                                dma_vm_data_mem_wr_addr_r <= dma_vm_data_mem_wr_addr_r + 1;
+                                // Being overwritten: a start now must not swap to it
+                                if (!dma_for_batch_r) vm_data_ready_r[dma_target_vm_id_r] <= 1'b0;
+                            end else begin
+                                dma_state_r <= DMA_ERROR;
+                                m_axi_rready_r <= 1'b0;
                             end
-                            // For LOAD_DATA_IN, data is in dma_temp_rdata_r, can be processed later or passed to VM via another mechanism.
 
                             dma_bytes_transferred_r <= dma_bytes_transferred_r + 4; // Assuming ARSIZE is 4 bytes
 
@@ -740,21 +2046,345 @@ module CoprocessorControlUnit (
                 end
 
                 DMA_DONE: begin
-                    int_status_reg_r[16] <= 1'b1; // Set DMA_DONE_IRQ
                     m_axi_rready_r  <= 1'b0;
-                    dma_state_r <= DMA_IDLE;
+                    // A complete data-in fill of a PINGPONG slot waits for the next START_VM
+                    if (!dma_op_is_prog_load_r && !dma_for_batch_r && page_data_pingpong_r[dma_target_vm_id_r] &&
+                        (!dma_from_ring_r || dma_sg_index_r + 1 >= dma_desc_word0_r[31:16]))
+                        vm_data_ready_r[dma_target_vm_id_r] <= 1'b1;
+                    if (dma_from_ring_r) begin
+                        // SG entry finished: fetch the next one or complete the descriptor
+                        dma_desc_len_r <= dma_desc_len_r + dma_len_bytes_r;
+                        dma_sg_index_r <= dma_sg_index_r + 1;
+                        if (dma_sg_index_r + 1 < dma_desc_word0_r[31:16]) begin
+                            m_axi_araddr_r <= dma_sg_list_addr_r + ((dma_sg_index_r + 1) << 4);
+                            m_axi_arlen_r  <= 8'd3;
+                            dma_beat_r     <= 3'b0;
+                            dma_beat_err_r <= 1'b0;
+                            dma_state_r    <= DMA_SG_FETCH;
+                        end else begin
+                            dma_desc_status_r <= DMA_DESC_OK;
+                            dma_state_r       <= DMA_DESC_WB_ADDR;
+                        end
+                    end else if (dma_for_batch_r) begin
+                        // Record loaded: run it, unless the batch was stopped meanwhile
+                        dma_for_batch_r <= 1'b0;
+                        if (batch_active_r) begin
+                            batch_start_r <= 1'b1;
+                            batch_phase_r <= BATCH_RUN;
+                        end
+                        dma_state_r <= DMA_IDLE;
+                    end else begin
+                        int_status_reg_r[IRQ_DMA_DONE_BIT] <= 1'b1; // Set DMA_DONE_IRQ
+                        dma_chan_done_r   <= 1'b1;
+                        if (dma_op_is_prog_load_r) vm_mem_prog_len_r[dma_target_vm_id_r] <= dma_len_bytes_r;
+                        else                       vm_mem_data_len_r[dma_target_vm_id_r] <= dma_len_bytes_r;
+                        dma_state_r <= DMA_IDLE;
+                    end
                 end
 
                 DMA_ERROR: begin
-                    int_status_reg_r[17] <= 1'b1; // Set DMA_ERROR_IRQ
                     m_axi_rready_r  <= 1'b0;
-                    dma_state_r <= DMA_IDLE;
+                    if (dma_from_ring_r) begin
+                        dma_desc_status_r <= DMA_DESC_ERR_BUS; // Reported through the descriptor
+                        dma_state_r       <= DMA_DESC_WB_ADDR;
+                    end else if (dma_for_batch_r) begin
+                        dma_for_batch_r <= 1'b0;
+                        if (batch_active_r) begin
+                            batch_fail();
+                        end
+                        dma_state_r <= DMA_IDLE;
+                    end else begin
+                        int_status_reg_r[IRQ_DMA_ERROR_BIT] <= 1'b1; // Set DMA_ERROR_IRQ
+                        dma_chan_error_r  <= 1'b1;
+                        dma_state_r <= DMA_IDLE;
+                    end
+                end
+
+                // Write len (word 6), then status (word 7), so software that sees
+                // the status also sees the length
+                DMA_DESC_WB_ADDR: begin
+                    m_axi_awaddr_r  <= dma_desc_addr_r + 32'd24 + {dma_wb_word_r, 2'b00};
+                    m_axi_wdata_r   <= dma_wb_word_r ? dma_desc_status_r : dma_desc_len_r;
+                    m_axi_awvalid_r <= 1'b1;
+                    if (m_axi_awvalid_r && m_axi_awready) begin
+                        m_axi_awvalid_r <= 1'b0;
+                        m_axi_wvalid_r  <= 1'b1;
+                        dma_state_r     <= DMA_DESC_WB_DATA;
+                    end
+                end
+
+                DMA_DESC_WB_DATA: begin
+                    if (m_axi_wready) begin
+                        m_axi_wvalid_r <= 1'b0;
+                        m_axi_bready_r <= 1'b1;
+                        dma_state_r    <= DMA_DESC_WB_RESP;
+                    end
+                end
+
+                DMA_DESC_WB_RESP: begin
+                    if (m_axi_bvalid) begin
+                        m_axi_bready_r <= 1'b0;
+                        if (m_axi_bresp != 2'b00) dma_beat_err_r <= 1'b1;
+                        if (!dma_wb_word_r) begin
+                            dma_wb_word_r <= 1'b1;
+                            dma_state_r   <= DMA_DESC_WB_ADDR;
+                        end else begin
+                            dma_state_r   <= DMA_DESC_NEXT;
+                        end
+                    end
+                end
+
+                DMA_DESC_NEXT: begin
+                    dma_ring_head_r <= (dma_ring_head_r + 1) & (dma_ring_size_r - 1);
+                    if (dma_desc_status_r != DMA_DESC_OK || dma_beat_err_r) begin
+                        int_status_reg_r[IRQ_DMA_ERROR_BIT] <= 1'b1; // DMA_ERROR_IRQ for any failed descriptor
+                        dma_chan_error_r  <= 1'b1;
+                    end else begin
+                        dma_chan_done_r   <= 1'b1;
+                    end
+                    if (((dma_ring_head_r + 1) & (dma_ring_size_r - 1)) == dma_ring_tail_r) begin
+                        int_status_reg_r[IRQ_DMA_DONE_BIT] <= 1'b1; // DMA_DONE_IRQ once per drained batch
+                    end
+                    dma_from_ring_r <= 1'b0;
+                    dma_state_r     <= DMA_IDLE;
+                end
+
+                // Output write-back: word by word from slot data memory to DATA_OUT_ADDR.
+                // VMi_DONE (or VMi_ERROR on a bus error) is raised once the last write lands.
+                DMA_OUT_ADDR: begin
+                    m_axi_awaddr_r  <= vm_out_addr_r[dma_out_vm_r] + {dma_out_word_r, 2'b00};
+                    m_axi_wdata_r   <= vm_rd_data[dma_out_vm_r];
+                    m_axi_awvalid_r <= 1'b1;
+                    if (m_axi_awvalid_r && m_axi_awready) begin
+                        m_axi_awvalid_r <= 1'b0;
+                        m_axi_wvalid_r  <= 1'b1;
+                        dma_state_r     <= DMA_OUT_DATA;
+                    end
+                end
+
+                DMA_OUT_DATA: begin
+                    if (m_axi_wready) begin
+                        m_axi_wvalid_r <= 1'b0;
+                        m_axi_bready_r <= 1'b1;
+                        dma_state_r    <= DMA_OUT_RESP;
+                    end
+                end
+
+                DMA_OUT_RESP: begin
+                    if (m_axi_bvalid) begin
+                        m_axi_bready_r <= 1'b0;
+                        if (m_axi_bresp != 2'b00) begin
+                            vm_out_err_r[dma_out_vm_r]                    <= 1'b1;
+                            int_status_reg_r[dma_out_vm_r + NUM_VM_SLOTS] <= 1'b1; // VMi_ERROR_IRQ
+                            dma_state_r                                   <= DMA_IDLE;
+                        end else if (dma_out_word_r + 1 == dma_out_words_r) begin
+                            vm_out_len_r[dma_out_vm_r]     <= {dma_out_words_r, 2'b00};
+                            int_status_reg_r[dma_out_vm_r] <= 1'b1; // VMi_DONE_IRQ
+                            dma_state_r                    <= DMA_IDLE;
+                        end else begin
+                            dma_out_word_r <= dma_out_word_r + 1;
+                            dma_state_r    <= DMA_OUT_ADDR;
+                        end
+                    end
+                end
+
+                // Batch result: the low word of R0, then a zero upper word (the slot reports 32 bits)
+                DMA_BATCH_WB_ADDR: begin
+                    m_axi_awaddr_r  <= batch_out_addr_r + {dma_wb_word_r, 2'b00};
+                    m_axi_wdata_r   <= dma_wb_word_r ? 32'b0 : vm_retval_regs_array_r[batch_vm_r];
+                    m_axi_awvalid_r <= 1'b1;
+                    if (m_axi_awvalid_r && m_axi_awready) begin
+                        m_axi_awvalid_r <= 1'b0;
+                        m_axi_wvalid_r  <= 1'b1;
+                        dma_state_r     <= DMA_BATCH_WB_DATA;
+                    end
+                end
+
+                DMA_BATCH_WB_DATA: begin
+                    if (m_axi_wready) begin
+                        m_axi_wvalid_r <= 1'b0;
+                        m_axi_bready_r <= 1'b1;
+                        dma_state_r    <= DMA_BATCH_WB_RESP;
+                    end
+                end
+
+                DMA_BATCH_WB_RESP: begin
+                    if (m_axi_bvalid) begin
+                        m_axi_bready_r <= 1'b0;
+                        if (m_axi_bresp != 2'b00) begin
+                            dma_for_batch_r <= 1'b0;
+                            if (batch_active_r) batch_fail();
+                            dma_state_r <= DMA_IDLE;
+                        end else if (!dma_wb_word_r) begin
+                            dma_wb_word_r <= 1'b1;
+                            dma_state_r   <= DMA_BATCH_WB_ADDR;
+                        end else begin
+                            dma_for_batch_r <= 1'b0;
+                            if (batch_active_r) batch_phase_r <= BATCH_NEXT;
+                            dma_state_r <= DMA_IDLE;
+                        end
+                    end
                 end
                 default: dma_state_r <= DMA_IDLE;
             endcase
         end
     end
 
+    // A record or result transfer of the running batch failed: VMi_ERROR with ERROR_CODE 8
+    task automatic batch_fail();
+        vm_batch_err_r[batch_vm_r]                    <= 1'b1;
+        int_status_reg_r[batch_vm_r + NUM_VM_SLOTS]   <= 1'b1; // VMi_ERROR_IRQ
+        batch_active_r                                <= 1'b0;
+        batch_end_r                                   <= 1'b1;
+    endtask
+
+    //--------------------------------------------------------------------------
+    // Performance Counters
+    //--------------------------------------------------------------------------
+    // Same events as the QEMU model, except that INSNS reads 0 and the DMA
+    // counters see the RTL's transfers (no SQ engine, output write-back word
+    // by word).
+    wire perf_clear_w  = write_state_r == WRITE_DATA && s_axi_wvalid && axi_wready_r &&
+                         awaddr_latched_r == ADDR_PERF_CTRL_REG && s_axi_wdata[0];
+    wire perf_rd_start_w = read_state_r == READ_IDLE && axi_arready_r; // araddr_latched_r is valid
+
+    reg [63:0] perf_sel_w;
+    always @(*) begin
+        perf_sel_w = 64'b0;
+        if (ar_page_hit_w) begin
+            case ({ar_page_reg_w[7:3], 3'b000})
+                ADDR_VM_PERF_RUNS_REG:      perf_sel_w = perf_vm_runs_r[ar_page_vm_w];
+                ADDR_VM_PERF_ERRORS_REG:    perf_sel_w = perf_vm_errors_r[ar_page_vm_w];
+                ADDR_VM_PERF_DMA_BYTES_REG: perf_sel_w = perf_vm_dma_bytes_r[ar_page_vm_w];
+                default:                    perf_sel_w = 64'b0; // INSNS
+            endcase
+        end else begin
+            case ({araddr_latched_r[ADDR_WIDTH_CPU_IF_AXI-1:3], 3'b000})
+                ADDR_PERF_DMA_BYTES_REG:    perf_sel_w = perf_dma_bytes_r;
+                ADDR_PERF_DMA_BUSY_NS_REG:  perf_sel_w = perf_dma_busy_ns_r;
+                ADDR_PERF_DMA_XFERS_REG:    perf_sel_w = perf_dma_xfers_r;
+                ADDR_PERF_CMD_REJECTED_REG: perf_sel_w = perf_cmd_rejected_r;
+                ADDR_PERF_IRQ_EVENTS_REG:   perf_sel_w = perf_irq_events_r;
+                ADDR_PERF_IRQ_ASSERTS_REG:  perf_sel_w = perf_irq_asserts_r;
+                ADDR_PERF_DMA_QUEUED_REG:   perf_sel_w = perf_dma_queued_r;
+                ADDR_PERF_DMA_QUEUE_WAIT_NS_REG: perf_sel_w = perf_dma_queue_wait_ns_r;
+                ADDR_PERF_DMA_QUEUE_PEAK_REG:    perf_sel_w = perf_dma_queue_peak_r;
+                ADDR_PERF_DMA_CHAN_BUSY_NS_REG:  perf_sel_w = perf_dma_busy_ns_r; // The one channel is the engine
+                default:                    perf_sel_w = 64'b0;
+            endcase
+        end
+    end
+
+    // Events, one cycle each
+    wire dma_rd_beat_w  = dma_state_r == DMA_READ_BURST && m_axi_rvalid && m_axi_rresp == 2'b00;
+    wire dma_out_beat_w = dma_state_r == DMA_OUT_RESP && m_axi_bvalid && m_axi_bresp == 2'b00;
+    wire dma_out_err_w  = dma_state_r == DMA_OUT_RESP && m_axi_bvalid && m_axi_bresp != 2'b00;
+    wire dma_batch_beat_w = dma_state_r == DMA_BATCH_WB_RESP && m_axi_bvalid && m_axi_bresp == 2'b00;
+    wire batch_err_w    = batch_active_r && dma_for_batch_r &&
+                          (dma_state_r == DMA_ERROR ||
+                           (dma_state_r == DMA_BATCH_WB_RESP && m_axi_bvalid && m_axi_bresp != 2'b00));
+    wire dma_xfer_end_w = ((dma_state_r == DMA_DONE || dma_state_r == DMA_ERROR) && !dma_from_ring_r) ||
+                          dma_state_r == DMA_DESC_NEXT;
+    // Loads refused by a full queue or with a bad length, handle loads (no cache), starts of a
+    // running VM, START_BATCH the sequencer refuses and refused window lengths
+    wire [2:0] cmd_rejected_w =
+        ((load_prog_cmd_w || load_data_in_cmd_w) &&
+         (dma_q_full_w || cmd_data_len_w == 0 || cmd_data_len_w[1:0] != 2'b00)) +
+        load_prog_handle_cmd_w + (start_vm_cmd_w && active_vm_mask_r[cmd_vm_r]) +
+        (start_batch_cmd_w && !cmd_batch_ok_w) + (mem_len_wr_w && !mem_len_ok_w);
+
+    // Loads waiting in the slot queues; each adds a clock of PERF_DMA_QUEUE_WAIT_NS per cycle
+    reg [$clog2(NUM_VM_SLOTS * DMA_QUEUE_DEPTH + 1)-1:0] dma_q_total_w;
+    always @(*) begin
+        dma_q_total_w = 0;
+        for (integer i = 0; i < NUM_VM_SLOTS; i = i + 1)
+            dma_q_total_w = dma_q_total_w + dma_q_count_r[i];
+    end
+
+    always @(posedge s_axi_aclk or posedge reset) begin
+        if (reset) begin
+            perf_dma_bytes_r    <= 64'b0;
+            perf_dma_busy_ns_r  <= 64'b0;
+            perf_dma_xfers_r    <= 64'b0;
+            perf_cmd_rejected_r <= 64'b0;
+            perf_irq_events_r   <= 64'b0;
+            perf_irq_asserts_r  <= 64'b0;
+            perf_dma_queued_r        <= 64'b0;
+            perf_dma_queue_wait_ns_r <= 64'b0;
+            perf_dma_queue_peak_r    <= 64'b0;
+            for (integer i = 0; i < NUM_VM_SLOTS; i = i + 1) begin
+                perf_vm_runs_r[i]      <= 64'b0;
+                perf_vm_errors_r[i]    <= 64'b0;
+                perf_vm_dma_bytes_r[i] <= 64'b0;
+            end
+            perf_rd_snap_r         <= 64'b0;
+            perf_high_r            <= 32'b0;
+            perf_int_status_prev_r <= {IRQ_VEC_W{1'b0}};
+            perf_irq_prev_r        <= 1'b0;
+            perf_vm_error_prev_r   <= {NUM_VM_SLOTS{1'b0}};
+        end else begin
+            perf_int_status_prev_r <= irq_pending_w;
+            perf_irq_prev_r        <= interrupt_out;
+            perf_vm_error_prev_r   <= vm_error;
+
+            if (perf_rd_start_w) begin
+                perf_rd_snap_r <= perf_sel_w;
+                if (ar_perf_hit_w && !araddr_latched_r[2]) perf_high_r <= perf_sel_w[63:32];
+            end
+
+            if (dma_busy_actual_w) perf_dma_busy_ns_r <= perf_dma_busy_ns_r + PERF_NS_PER_CLK;
+            if (dma_rd_beat_w) begin
+                perf_dma_bytes_r <= perf_dma_bytes_r + 4;
+                perf_vm_dma_bytes_r[dma_target_vm_id_r] <= perf_vm_dma_bytes_r[dma_target_vm_id_r] + 4;
+            end else if (dma_out_beat_w) begin
+                perf_dma_bytes_r <= perf_dma_bytes_r + 4;
+                perf_vm_dma_bytes_r[dma_out_vm_r] <= perf_vm_dma_bytes_r[dma_out_vm_r] + 4;
+            end else if (dma_batch_beat_w) begin
+                perf_dma_bytes_r <= perf_dma_bytes_r + 4;
+                perf_vm_dma_bytes_r[batch_vm_r] <= perf_vm_dma_bytes_r[batch_vm_r] + 4;
+            end
+            if (dma_xfer_end_w) perf_dma_xfers_r <= perf_dma_xfers_r + 1;
+            perf_cmd_rejected_r <= perf_cmd_rejected_r + cmd_rejected_w;
+            perf_irq_events_r   <= perf_irq_events_r + $countones(irq_pending_w & ~perf_int_status_prev_r);
+            if (interrupt_out && !perf_irq_prev_r) perf_irq_asserts_r <= perf_irq_asserts_r + 1;
+            // A load waits if the engine is busy or its slot has loads ahead
+            if (dma_q_push_w && (dma_state_r != DMA_IDLE || dma_q_count_r[cmd_vm_r] != 0)) begin
+                perf_dma_queued_r <= perf_dma_queued_r + 1;
+                if (dma_q_count_r[cmd_vm_r] + 1 > perf_dma_queue_peak_r)
+                    perf_dma_queue_peak_r <= dma_q_count_r[cmd_vm_r] + 1;
+            end
+            perf_dma_queue_wait_ns_r <= perf_dma_queue_wait_ns_r + dma_q_total_w * PERF_NS_PER_CLK;
+
+            // A batch counts as one run
+            if ((start_vm_cmd_w && !active_vm_mask_r[cmd_vm_r]) || (start_batch_cmd_w && cmd_batch_ok_w))
+                perf_vm_runs_r[cmd_vm_r] <= perf_vm_runs_r[cmd_vm_r] + 1;
+            for (integer i = 0; i < NUM_VM_SLOTS; i = i + 1) begin
+                if ((vm_error[i] && !perf_vm_error_prev_r[i]) || (dma_out_err_w && dma_out_vm_r == i) ||
+                    (batch_err_w && batch_vm_r == i))
+                    perf_vm_errors_r[i] <= perf_vm_errors_r[i] + 1;
+            end
+
+            // PERF_CTRL_REG CLEAR wins over this cycle's events
+            if (perf_clear_w) begin
+                perf_dma_bytes_r    <= 64'b0;
+                perf_dma_busy_ns_r  <= 64'b0;
+                perf_dma_xfers_r    <= 64'b0;
+                perf_cmd_rejected_r <= 64'b0;
+                perf_irq_events_r   <= 64'b0;
+                perf_irq_asserts_r  <= 64'b0;
+                perf_dma_queued_r        <= 64'b0;
+                perf_dma_queue_wait_ns_r <= 64'b0;
+                perf_dma_queue_peak_r    <= 64'b0;
+                for (integer i = 0; i < NUM_VM_SLOTS; i = i + 1) begin
+                    perf_vm_runs_r[i]      <= 64'b0;
+                    perf_vm_errors_r[i]    <= 64'b0;
+                    perf_vm_dma_bytes_r[i] <= 64'b0;
+                end
+                perf_high_r <= 32'b0;
+            end
+        end
+    end
+
     // Unused VM input placeholders (will be used for status updates to CCU)
     // input  wire [7:0]   vm_ready;
     // input  wire [7:0]   vm_done;
@@ -3,7 +3,9 @@
 
 `timescale 1ns / 1ps
 
-module KeystoneCoprocessor (
+module KeystoneCoprocessor #(
+    parameter NUM_VM_SLOTS = 8 // VM slots, 1-64
+) (
     // AXI4-Lite Slave Interface (for CPU commands/status)
     input  wire         s_axi_aclk,
     input  wire         s_axi_aresetn,
@@ -27,6 +29,24 @@ module KeystoneCoprocessor (
     output wire         s_axi_rvalid,
     input  wire         s_axi_rready,
 
+    // AXI4-Lite Slave Interface for the slot memory window (NUM_VM_SLOTS * 16 KB)
+    input  wire [31:0]  s_axi_mem_awaddr,
+    input  wire         s_axi_mem_awvalid,
+    output wire         s_axi_mem_awready,
+    input  wire [31:0]  s_axi_mem_wdata,
+    input  wire         s_axi_mem_wvalid,
+    output wire         s_axi_mem_wready,
+    output wire [1:0]   s_axi_mem_bresp,
+    output wire         s_axi_mem_bvalid,
+    input  wire         s_axi_mem_bready,
+    input  wire [31:0]  s_axi_mem_araddr,
+    input  wire         s_axi_mem_arvalid,
+    output wire         s_axi_mem_arready,
+    output wire [31:0]  s_axi_mem_rdata,
+    output wire [1:0]   s_axi_mem_rresp,
+    output wire         s_axi_mem_rvalid,
+    input  wire         s_axi_mem_rready,
+
     // AXI4 Master Interface (for DMA to main memory)
     input  wire         m_axi_aclk,
     input  wire         m_axi_aresetn,
@@ -61,8 +81,8 @@ module KeystoneCoprocessor (
 );
 
     // Parameters
-    localparam NUM_VM_SLOTS = 8;
     localparam VM_PROG_MEM_ADDR_WIDTH = 11; // For eBPF_VM_Slot prog_mem (2048 words)
+    localparam VM_DATA_MEM_ADDR_WIDTH = 10; // For eBPF_VM_Slot stack_mem (1024 words)
     localparam DATA_WIDTH_AXI = 32;       // Should match CCU's DATA_WIDTH_AXI
     localparam NUM_MAILBOX_REGS_TOP = 4;  // Should match NUM_MAILBOX_REGS in CCU and NUM_MAILBOX_REGS_VM in Slot
 
@@ -72,12 +92,27 @@ module KeystoneCoprocessor (
     wire [DATA_WIDTH_AXI-1:0]         vm_wr_prog_data_w [NUM_VM_SLOTS-1:0];
     wire [NUM_VM_SLOTS-1:0]             vm_wr_prog_en_w;
 
+    // Connections from VM Slots to CCU for output write-back and the slot memory window (Memory Read)
+    wire [VM_PROG_MEM_ADDR_WIDTH-1:0] vm_rd_prog_addr_w;
+    wire [DATA_WIDTH_AXI-1:0]         vm_rd_prog_data_w [NUM_VM_SLOTS-1:0];
+    wire [VM_DATA_MEM_ADDR_WIDTH-1:0] vm_rd_data_addr_w;
+    wire                              vm_rd_data_bank_w;
+    wire [DATA_WIDTH_AXI-1:0]         vm_rd_data_w [NUM_VM_SLOTS-1:0];
+    wire [VM_DATA_MEM_ADDR_WIDTH-1:0] vm_wr_data_addr_w;
+    wire [DATA_WIDTH_AXI-1:0]         vm_wr_data_data_w;
+    wire [NUM_VM_SLOTS-1:0]           vm_wr_data_en_w;
+    wire                              vm_wr_data_bank_w;
+    wire [NUM_VM_SLOTS-1:0]           vm_data_bank_w;
+    wire [NUM_VM_SLOTS-1:0]           vm_data_swap_w;
+
     // CCU <-> VM Slot Mailbox Connections
     wire [$clog2(NUM_MAILBOX_REGS_TOP)-1:0] vm_mailbox_out_idx_ks_w [NUM_VM_SLOTS-1:0];
     wire [DATA_WIDTH_AXI-1:0]              vm_mailbox_out_wdata_ks_w [NUM_VM_SLOTS-1:0];
     wire [NUM_VM_SLOTS-1:0]                  vm_mailbox_out_wen_ks_w;
     wire [$clog2(NUM_MAILBOX_REGS_TOP)-1:0] vm_mailbox_in_idx_ks_w [NUM_VM_SLOTS-1:0];
     wire [DATA_WIDTH_AXI-1:0]              vm_mailbox_in_rdata_ks_w [NUM_VM_SLOTS-1:0];
+    wire [NUM_VM_SLOTS-1:0]                  vm_mailbox_in_pop_ks_w;
+    wire [DATA_WIDTH_AXI-1:0]              vm_mailbox_status_ks_w [NUM_VM_SLOTS-1:0];
 
     // Other CCU <-> VM Slot connections (lifecycle, status)
     wire [NUM_VM_SLOTS-1:0] vm_start_w;
@@ -86,11 +121,14 @@ module KeystoneCoprocessor (
     wire [NUM_VM_SLOTS-1:0] vm_ready_w;
     wire [NUM_VM_SLOTS-1:0] vm_done_w;
     wire [NUM_VM_SLOTS-1:0] vm_error_w;
+    wire [DATA_WIDTH_AXI-1:0] vm_retval_w [NUM_VM_SLOTS-1:0];
     // vm_load_program_addr and vm_data_in_addr are informational for CCU, not direct VM connections.
     // vm_data_out_addr from VM to CCU.
 
     // Instantiate CoprocessorControlUnit (CCU)
-    CoprocessorControlUnit ccu_inst (
+    CoprocessorControlUnit #(
+        .NUM_VM_SLOTS(NUM_VM_SLOTS)
+    ) ccu_inst (
         // AXI-Lite Slave Interface for commands
         .s_axi_aclk(s_axi_aclk),
         .s_axi_aresetn(s_axi_aresetn),
@@ -112,6 +150,24 @@ module KeystoneCoprocessor (
         .s_axi_rvalid(s_axi_rvalid),
         .s_axi_rready(s_axi_rready),
 
+        // AXI-Lite Slave Interface for the slot memory window
+        .s_axi_mem_awaddr(s_axi_mem_awaddr),
+        .s_axi_mem_awvalid(s_axi_mem_awvalid),
+        .s_axi_mem_awready(s_axi_mem_awready),
+        .s_axi_mem_wdata(s_axi_mem_wdata),
+        .s_axi_mem_wvalid(s_axi_mem_wvalid),
+        .s_axi_mem_wready(s_axi_mem_wready),
+        .s_axi_mem_bresp(s_axi_mem_bresp),
+        .s_axi_mem_bvalid(s_axi_mem_bvalid),
+        .s_axi_mem_bready(s_axi_mem_bready),
+        .s_axi_mem_araddr(s_axi_mem_araddr),
+        .s_axi_mem_arvalid(s_axi_mem_arvalid),
+        .s_axi_mem_arready(s_axi_mem_arready),
+        .s_axi_mem_rdata(s_axi_mem_rdata),
+        .s_axi_mem_rresp(s_axi_mem_rresp),
+        .s_axi_mem_rvalid(s_axi_mem_rvalid),
+        .s_axi_mem_rready(s_axi_mem_rready),
+
         // AXI Master Interface for DMA
         .m_axi_aclk(m_axi_aclk),
         .m_axi_aresetn(m_axi_aresetn),
@@ -124,9 +180,9 @@ module KeystoneCoprocessor (
         .m_axi_wlast(m_axi_wlast),
         .m_axi_wvalid(m_axi_wvalid),
         .m_axi_wready(m_axi_wready),
-        // .m_axi_bresp(m_axi_bresp),   // CCU receives this
-        // .m_axi_bvalid(m_axi_bvalid), // CCU receives this
-        // .m_axi_bready(m_axi_bready), // CCU drives this
+        .m_axi_bresp(m_axi_bresp),     // CCU receives this (descriptor and output write-back)
+        .m_axi_bvalid(m_axi_bvalid),   // CCU receives this
+        .m_axi_bready(m_axi_bready),   // CCU drives this
         .m_axi_araddr(m_axi_araddr),
         // .m_axi_arprot(m_axi_arprot), // CCU does not drive this directly
         .m_axi_arvalid(m_axi_arvalid),
@@ -146,11 +202,23 @@ module KeystoneCoprocessor (
         .vm_wr_prog_addr(vm_wr_prog_addr_w),
         .vm_wr_prog_data(vm_wr_prog_data_w),
         .vm_wr_prog_en(vm_wr_prog_en_w),
+        .vm_rd_prog_addr(vm_rd_prog_addr_w),
+        .vm_rd_prog_data(vm_rd_prog_data_w),
+        .vm_rd_data_addr(vm_rd_data_addr_w),
+        .vm_rd_data_bank(vm_rd_data_bank_w),
+        .vm_rd_data(vm_rd_data_w),
+        .vm_wr_data_addr(vm_wr_data_addr_w),
+        .vm_wr_data_data(vm_wr_data_data_w),
+        .vm_wr_data_en(vm_wr_data_en_w),
+        .vm_wr_data_bank(vm_wr_data_bank_w),
+        .vm_data_bank(vm_data_bank_w),
+        .vm_data_swap(vm_data_swap_w),
 
         // VM Status Inputs
         .vm_ready(vm_ready_w),
         .vm_done(vm_done_w),
         .vm_error(vm_error_w),
+        .vm_retval(vm_retval_w),
         // .vm_data_out_addr(), // Input to CCU from VMs
 
         // VM Mailbox Interface with CCU
@@ -159,6 +227,8 @@ module KeystoneCoprocessor (
         .vm_mailbox_out_wen_i(vm_mailbox_out_wen_ks_w),
         .vm_mailbox_in_idx_i(vm_mailbox_in_idx_ks_w),
         .vm_mailbox_in_rdata_o(vm_mailbox_in_rdata_ks_w),
+        .vm_mailbox_in_pop_i(vm_mailbox_in_pop_ks_w),
+        .vm_mailbox_status_o(vm_mailbox_status_ks_w),
 
         // Interrupt Output
         .interrupt_out(interrupt_out),
@@ -186,6 +256,7 @@ module KeystoneCoprocessor (
                 .ready(vm_ready_w[i]),
                 .done(vm_done_w[i]),
                 .error(vm_error_w[i]),
+                .retval(vm_retval_w[i]),
                 // .data_out_available_address(), // Connect this if/when CCU needs it
 
                 // Memory Write Interface (for CCU DMA to write to VM's Program Memory)
@@ -193,14 +264,23 @@ module KeystoneCoprocessor (
                 .write_prog_mem_data_i(vm_wr_prog_data_w[i]),
                 .write_prog_mem_en_i(vm_wr_prog_en_w[i]),
 
-                // Stack memory write and all read interfaces are for internal VM use or later features
-                // .write_stack_mem_addr_i(),
-                // .write_stack_mem_data_i(),
-                // .write_stack_mem_en_i(),
-                // .read_prog_mem_addr_i(),  // Driven by VM's internal PC
-                // .prog_mem_data_o(),       // Read by VM's fetch stage
-                // .read_stack_mem_addr_i(), // Driven by VM's internal SP/FP
-                // .stack_mem_data_o(),      // Read by VM's execution stage
+                // Stack memory read port (for CCU output write-back from the VM's data memory,
+                // and host reads through the slot memory window)
+                .read_stack_mem_addr_i(vm_rd_data_addr_w),
+                .read_stack_mem_bank_i(vm_rd_data_bank_w),
+                .stack_mem_data_o(vm_rd_data_w[i]),
+
+                // Stack memory write port (for CCU DMA of LOAD_DATA_IN and batch records)
+                .write_stack_mem_addr_i(vm_wr_data_addr_w),
+                .write_stack_mem_data_i(vm_wr_data_data_w),
+                .write_stack_mem_en_i(vm_wr_data_en_w[i]),
+                .write_stack_mem_bank_i(vm_wr_data_bank_w),
+                .swap_data_bank_i(vm_data_swap_w[i]),
+                .data_bank_o(vm_data_bank_w[i]),
+
+                // Program memory read port (for host reads through the slot memory window)
+                .read_prog_mem_addr_i(vm_rd_prog_addr_w),
+                .prog_mem_data_o(vm_rd_prog_data_w[i]),
 
                 // Mailbox Interface
                 .vm_mailbox_out_idx_o(vm_mailbox_out_idx_ks_w[i]),
@@ -208,6 +288,8 @@ module KeystoneCoprocessor (
                 .vm_mailbox_out_wen_o(vm_mailbox_out_wen_ks_w[i]),
                 .vm_mailbox_in_idx_o(vm_mailbox_in_idx_ks_w[i]),
                 .vm_mailbox_in_rdata_i(vm_mailbox_in_rdata_ks_w[i]),
+                .vm_mailbox_in_pop_o(vm_mailbox_in_pop_ks_w[i]),
+                .vm_mailbox_status_i(vm_mailbox_status_ks_w[i]),
 
                 // Global clock and reset
                 .clk(clk), // Assuming all VMs and CCU share the same main clock 'clk'
@@ -247,6 +247,23 @@ module SoC_Top (
         .s_axi_rresp(S1_AXI_RRESP),
         .s_axi_rvalid(S1_AXI_RVALID),
         .s_axi_rready(S1_AXI_RREADY),
+        // Slot memory window: not on the interconnect yet, tied idle
+        .s_axi_mem_awaddr(32'b0),
+        .s_axi_mem_awvalid(1'b0),
+        .s_axi_mem_awready(),
+        .s_axi_mem_wdata(32'b0),
+        .s_axi_mem_wvalid(1'b0),
+        .s_axi_mem_wready(),
+        .s_axi_mem_bresp(),
+        .s_axi_mem_bvalid(),
+        .s_axi_mem_bready(1'b1),
+        .s_axi_mem_araddr(32'b0),
+        .s_axi_mem_arvalid(1'b0),
+        .s_axi_mem_arready(),
+        .s_axi_mem_rdata(),
+        .s_axi_mem_rresp(),
+        .s_axi_mem_rvalid(),
+        .s_axi_mem_rready(1'b1),
         // AXI4 Master Interface for DMA (M1 on Interconnect)
         .m_axi_aclk(clk),
         .m_axi_aresetn(resetn),
@@ -16,6 +16,7 @@ module eBPF_VM_Slot (
     output wire         ready,                   // VM is ready to receive a program/start
     output wire         done,                    // VM has finished execution (or hit a breakpoint)
     output wire         error,                   // VM encountered an error (e.g., invalid instruction)
+    output wire [31:0]  retval,                  // Low 32 bits of R0, written by the firmware at EXIT
     output wire [31:0]  data_out_available_address, // Address of output data in shared memory (written by VM)
                                                 // or direct output data if interface supports it
 
@@ -55,18 +56,26 @@ module eBPF_VM_Slot (
     input  wire         clk,
     input  wire         reset,
 
-    // Memory Write Interface (from CCU/DMA)
+    // Memory Write Interface (from CCU DMA and slot memory window)
     input  wire [PROG_MEM_ADDR_WIDTH-1:0] write_prog_mem_addr_i,
     input  wire [31:0]                    write_prog_mem_data_i,
     input  wire                           write_prog_mem_en_i,
     input  wire [STACK_MEM_ADDR_WIDTH-1:0]write_stack_mem_addr_i,
     input  wire [31:0]                    write_stack_mem_data_i,
     input  wire                           write_stack_mem_en_i,
-
-    // Memory Read Interface (for eBPF interpreter)
-    input  wire [PROG_MEM_ADDR_WIDTH-1:0] read_prog_mem_addr_i,  // From internal PC
+    // Double-buffered data-in: stack memory has two banks. The VM uses the
+    // active one; CCU writes go to the bank selected here, CCU reads to the one
+    // on read_stack_mem_bank_i, and start_vm with swap_data_bank_i makes the
+    // other bank active.
+    input  wire                           write_stack_mem_bank_i,
+    input  wire                           swap_data_bank_i,
+    output wire                           data_bank_o,
+
+    // Memory Read Interface (CCU output write-back and slot memory window)
+    input  wire [PROG_MEM_ADDR_WIDTH-1:0] read_prog_mem_addr_i,
     output wire [31:0]                    prog_mem_data_o,
-    input  wire [STACK_MEM_ADDR_WIDTH-1:0]read_stack_mem_addr_i, // From internal SP/FP
+    input  wire [STACK_MEM_ADDR_WIDTH-1:0]read_stack_mem_addr_i,
+    input  wire                           read_stack_mem_bank_i, // Stack memory bank the read comes from
     output wire [31:0]                    stack_mem_data_o,
 
     // Mailbox Interface with CCU (PicoRV32 is the master of this interface from VM side)
@@ -76,7 +85,11 @@ module eBPF_VM_Slot (
     output wire                                  vm_mailbox_out_wen_o,
     // For PicoRV32 to read from its IN Mailbox (data comes from CCU's vm_mailboxes_in)
     output wire [$clog2(NUM_MAILBOX_REGS_VM)-1:0] vm_mailbox_in_idx_o,
-    input  wire [31:0]                             vm_mailbox_in_rdata_i
+    input  wire [31:0]                             vm_mailbox_in_rdata_i,
+    // Mailbox FIFO mode: pulsed when PicoRV32 has read the IN mailbox, so the CCU pops it;
+    // {OUT free, IN count} from the CCU, 0 in register mode
+    output wire                                  vm_mailbox_in_pop_o,
+    input  wire [31:0]                             vm_mailbox_status_i
     // input wire                               vm_mailbox_in_valid_i; // Optional, from CCU
 );
 
@@ -126,8 +139,10 @@ module eBPF_VM_Slot (
     // Control/Status Registers for PicoRV32 interaction
     localparam NANO_CTRL_CSR_BASE        = 32'h0000_3000;
     localparam ADDR_NANO_CTRL_STATUS_REG  = NANO_CTRL_CSR_BASE + 32'h00; // For done/error flags
+    localparam ADDR_NANO_CTRL_RETVAL_REG  = NANO_CTRL_CSR_BASE + 32'h04; // Low word of R0, written before DONE
     localparam EBPF_MAILBOX_IN_BASE_ADDR  = NANO_CTRL_CSR_BASE + 32'h0010; // Offset 16B from CSR base
     localparam EBPF_MAILBOX_IN_END_ADDR    = EBPF_MAILBOX_IN_BASE_ADDR + (NUM_MAILBOX_REGS_VM * 4) - 1;
+    localparam EBPF_MAILBOX_STATUS_ADDR   = NANO_CTRL_CSR_BASE + 32'h0020; // MBOX_STATUS helper: [15:0] IN count, [31:16] OUT free
     localparam EBPF_MAILBOX_OUT_BASE_ADDR = NANO_CTRL_CSR_BASE + 32'h0030; // Offset 48B from CSR base (allows for 4 IN regs + spacing)
     localparam EBPF_MAILBOX_OUT_END_ADDR   = EBPF_MAILBOX_OUT_BASE_ADDR + (NUM_MAILBOX_REGS_VM * 4) - 1;
     // Add other CSRs here if needed: e.g., input data mailbox, output data mailbox addresses
@@ -145,24 +160,30 @@ module eBPF_VM_Slot (
     // Status registers written by PicoRV32, driving module outputs
     reg done_reg_r;
     reg error_reg_r;
+    reg [31:0] retval_reg_r;
 
     // Internal registers for mailbox interface driving outputs to CCU
     reg [$clog2(NUM_MAILBOX_REGS_VM)-1:0] vm_mailbox_out_idx_o_r;
     reg [31:0]                             vm_mailbox_out_wdata_o_r;
     reg                                  vm_mailbox_out_wen_o_r;
     reg [$clog2(NUM_MAILBOX_REGS_VM)-1:0] vm_mailbox_in_idx_o_r; // For PicoRV32 to select which IN mailbox reg to read
+    reg                                  vm_mailbox_in_pop_o_r;
 
     assign vm_mailbox_out_idx_o   = vm_mailbox_out_idx_o_r;
     assign vm_mailbox_out_wdata_o = vm_mailbox_out_wdata_o_r;
     assign vm_mailbox_out_wen_o   = vm_mailbox_out_wen_o_r;
     assign vm_mailbox_in_idx_o    = vm_mailbox_in_idx_o_r;
+    assign vm_mailbox_in_pop_o    = vm_mailbox_in_pop_o_r;
 
     assign done = done_reg_r;
     assign error = error_reg_r;
+    assign retval = retval_reg_r;
 
     // Internal Memory Blocks
     reg [31:0] prog_mem [0:PROG_MEM_DEPTH_32BIT-1];
-    reg [31:0] stack_mem [0:STACK_MEM_DEPTH_32BIT-1];
+    reg [31:0] stack_mem [0:STACK_MEM_DEPTH_32BIT-1];   // Bank 0 (buffer A)
+    reg [31:0] stack_mem_b [0:STACK_MEM_DEPTH_32BIT-1]; // Bank 1 (buffer B)
+    reg        data_bank_r;                             // Active stack memory bank
 
     // Nano-controller Instruction ROM and Data RAM
     reg [31:0] nano_ctrl_instr_rom [0:NANO_CTRL_ROM_WORDS_32BIT-1];
@@ -187,20 +208,28 @@ module eBPF_VM_Slot (
     //  - start_vm_internal_r (latched start) is not active
     assign pico_resetn = !reset_vm && !stop_vm && start_vm_internal_r;
 
+    assign data_bank_o = data_bank_r;
+
     always @(posedge clk or posedge reset_vm) begin
         if (reset_vm) begin
             start_vm_internal_r <= 1'b0;
+            data_bank_r <= 1'b0;
             vm_mailbox_out_wen_o_r <= 1'b0;
             vm_mailbox_out_idx_o_r <= 0;
             vm_mailbox_out_wdata_o_r <= 0;
             vm_mailbox_in_idx_o_r <= 0; // Reset this here
+            vm_mailbox_in_pop_o_r <= 1'b0;
         end else begin
             // Default assignments for pulsed/updated signals
             vm_mailbox_out_wen_o_r <= 1'b0;
+            // One pop per completed IN mailbox load; the CCU ignores it in register mode
+            vm_mailbox_in_pop_o_r <= pico_mem_valid && pico_mem_ready && !pico_mem_instr && !(|pico_mem_wstrb) &&
+                                     pico_mem_addr >= EBPF_MAILBOX_IN_BASE_ADDR && pico_mem_addr <= EBPF_MAILBOX_IN_END_ADDR;
             // vm_mailbox_in_idx_o_r retains its value unless Pico accesses IN mailbox
 
             if (start_vm) begin
                 start_vm_internal_r <= 1'b1;
+                if (swap_data_bank_i) data_bank_r <= !data_bank_r; // Run on the bank just filled
             end else if (stop_vm) begin // stop_vm also clears the latched start
                 start_vm_internal_r <= 1'b0;
             end
@@ -285,6 +314,7 @@ module eBPF_VM_Slot (
             done_reg_r <= 1'b0;
             error_reg_r <= 1'b0;
         end
+        if (reset_vm) retval_reg_r <= 32'b0;
 
         // Writes from CCU DMA to eBPF Program Memory
         if (write_prog_mem_en_i) begin
@@ -292,10 +322,11 @@ module eBPF_VM_Slot (
                 prog_mem[write_prog_mem_addr_i] <= write_prog_mem_data_i;
             end
         end
-        // Writes from CCU DMA to eBPF Stack Memory (if ever implemented, currently not used by CCU)
+        // Writes from CCU DMA to eBPF Stack Memory (LOAD_DATA_IN, batch records), into either bank
         if (write_stack_mem_en_i) begin
             if (write_stack_mem_addr_i < STACK_MEM_DEPTH_32BIT) begin 
-                stack_mem[write_stack_mem_addr_i] <= write_stack_mem_data_i;
+                if (write_stack_mem_bank_i) stack_mem_b[write_stack_mem_addr_i] <= write_stack_mem_data_i;
+                else                        stack_mem[write_stack_mem_addr_i]   <= write_stack_mem_data_i;
             end
         end
 
@@ -316,11 +347,16 @@ module eBPF_VM_Slot (
             else if (pico_mem_addr >= EBPF_STACK_MEM_BASE_ADDR && pico_mem_addr <= EBPF_STACK_MEM_END_ADDR) begin
                 automatic logic [STACK_MEM_ADDR_WIDTH-1:0] stack_addr_offset_w;
                 stack_addr_offset_w = (pico_mem_addr - EBPF_STACK_MEM_BASE_ADDR) >> 2;
-                if (stack_addr_offset_w < STACK_MEM_DEPTH_32BIT) begin
+                if (stack_addr_offset_w < STACK_MEM_DEPTH_32BIT && !data_bank_r) begin
                     if (pico_mem_wstrb[0]) stack_mem[stack_addr_offset_w][7:0]   <= pico_mem_wdata[7:0];
                     if (pico_mem_wstrb[1]) stack_mem[stack_addr_offset_w][15:8]  <= pico_mem_wdata[15:8];
                     if (pico_mem_wstrb[2]) stack_mem[stack_addr_offset_w][23:16] <= pico_mem_wdata[23:16];
                     if (pico_mem_wstrb[3]) stack_mem[stack_addr_offset_w][31:24] <= pico_mem_wdata[31:24];
+                end else if (stack_addr_offset_w < STACK_MEM_DEPTH_32BIT) begin
+                    if (pico_mem_wstrb[0]) stack_mem_b[stack_addr_offset_w][7:0]   <= pico_mem_wdata[7:0];
+                    if (pico_mem_wstrb[1]) stack_mem_b[stack_addr_offset_w][15:8]  <= pico_mem_wdata[15:8];
+                    if (pico_mem_wstrb[2]) stack_mem_b[stack_addr_offset_w][23:16] <= pico_mem_wdata[23:16];
+                    if (pico_mem_wstrb[3]) stack_mem_b[stack_addr_offset_w][31:24] <= pico_mem_wdata[31:24];
                 end
             end
             // Status Register Write
@@ -331,6 +367,13 @@ module eBPF_VM_Slot (
                     error_reg_r <= pico_mem_wdata[1];
                 end
             end
+            // Return Value Register Write (R0 at EXIT; the CCU latches it when DONE rises)
+            else if (pico_mem_addr == ADDR_NANO_CTRL_RETVAL_REG) begin
+                if (pico_mem_wstrb[0]) retval_reg_r[7:0]   <= pico_mem_wdata[7:0];
+                if (pico_mem_wstrb[1]) retval_reg_r[15:8]  <= pico_mem_wdata[15:8];
+                if (pico_mem_wstrb[2]) retval_reg_r[23:16] <= pico_mem_wdata[23:16];
+                if (pico_mem_wstrb[3]) retval_reg_r[31:24] <= pico_mem_wdata[31:24];
+            end
             // eBPF OUT Mailbox Write (PicoRV32 writes to CCU)
             else if (pico_mem_addr >= EBPF_MAILBOX_OUT_BASE_ADDR && pico_mem_addr <= EBPF_MAILBOX_OUT_END_ADDR) begin
                 automatic logic [$clog2(NUM_MAILBOX_REGS_VM)-1:0] mailbox_idx_clk;
@@ -399,7 +442,7 @@ module eBPF_VM_Slot (
                 automatic logic [STACK_MEM_ADDR_WIDTH-1:0] stack_mem_offset_c;
                 stack_mem_offset_c = (pico_mem_addr - EBPF_STACK_MEM_BASE_ADDR) >> 2;
                 if (stack_mem_offset_c < STACK_MEM_DEPTH_32BIT) begin
-                    pico_mem_rdata_comb = stack_mem[stack_mem_offset_c];
+                    pico_mem_rdata_comb = data_bank_r ? stack_mem_b[stack_mem_offset_c] : stack_mem[stack_mem_offset_c];
                     pico_mem_ready_comb = 1'b1;
                 end else {
                     pico_mem_rdata_comb = 32'hDEADBEEF;
@@ -411,6 +454,16 @@ module eBPF_VM_Slot (
                 pico_mem_rdata_comb = {30'b0, error_reg_r, done_reg_r};
                 pico_mem_ready_comb = 1'b1;
             end
+            // Return Value Register Read
+            else if (pico_mem_addr == ADDR_NANO_CTRL_RETVAL_REG) begin
+                pico_mem_rdata_comb = retval_reg_r;
+                pico_mem_ready_comb = 1'b1;
+            end
+            // Mailbox FIFO occupancy
+            else if (pico_mem_addr == EBPF_MAILBOX_STATUS_ADDR) begin
+                pico_mem_rdata_comb = vm_mailbox_status_i;
+                pico_mem_ready_comb = 1'b1;
+            end
             // eBPF IN Mailbox Read (PicoRV32 reads from CCU)
             else if (pico_mem_addr >= EBPF_MAILBOX_IN_BASE_ADDR && pico_mem_addr <= EBPF_MAILBOX_IN_END_ADDR) begin
                 calculated_vm_mailbox_in_idx_comb = (pico_mem_addr - EBPF_MAILBOX_IN_BASE_ADDR) >> 2;
@@ -440,14 +493,12 @@ module eBPF_VM_Slot (
     assign pico_mem_ready = pico_mem_ready_comb;
     assign pico_mem_rdata = pico_mem_rdata_comb;
 
-    // Memory Read Logic (for eBPF interpreter - these ports become unused by external, now used by Pico)
-    // The PicoRV32 directly accesses prog_mem and stack_mem via its memory bus.
-    // The ports read_prog_mem_addr_i, prog_mem_data_o, etc. are thus not needed for PicoRV32 operation.
-    // If these ports were intended for debugging or external access while PicoRV32 is halted,
-    // then additional muxing logic would be required. For now, they are effectively superseded.
-    // To avoid synthesis warnings about undriven outputs if they were part of an interface,
-    // we can assign them default values, but they are not functionally used by PicoRV32.
-    assign prog_mem_data_o = 32'h0; // Or connect to a debug/test interface if needed
-    assign stack_mem_data_o = 32'h0; // Or connect to a debug/test interface if needed
+    // Memory Read Logic (external ports; the PicoRV32 directly accesses prog_mem and
+    // stack_mem via its memory bus). The CCU reads the active bank for its output
+    // write-back, which runs after the VM is done, and any bank for host reads
+    // through its slot memory window.
+    assign prog_mem_data_o = (read_prog_mem_addr_i >= PROG_MEM_DEPTH_32BIT) ? 32'h0 : prog_mem[read_prog_mem_addr_i];
+    assign stack_mem_data_o = (read_stack_mem_addr_i >= STACK_MEM_DEPTH_32BIT) ? 32'h0 :
+                              read_stack_mem_bank_i ? stack_mem_b[read_stack_mem_addr_i] : stack_mem[read_stack_mem_addr_i];
 
 endmodule
@@ -1,378 +1,2915 @@
 #include "qemu/osdep.h"
 #include "qemu/log.h"
 #include "qemu/timer.h"
+#include "qemu/main-loop.h"
+#include "qemu/atomic.h"
+#include "qemu/host-utils.h"
+#include "qemu/bitops.h"
+#include "qemu/bswap.h"
+#include "qemu/error-report.h"
 #include "hw/sysbus.h"
 #include "hw/hw.h" // For hwaddr
+#include "hw/core/cpu.h" // For halting harts in BPF.VM.WAIT
+#include "sysemu/sysemu.h" // For qemu_add_exit_notifier
 #include "migration/vmstate.h"
+#include "migration/register.h"
+#include "migration/qemu-file-types.h"
 #include "qom/object.h"
-#include "exec/address-spaces.h" // For cpu_physical_memory_read/write
+#include "qapi/error.h"
+#include "hw/qdev-properties.h"
+#include "exec/address-spaces.h" // For get_system_memory() fallback
+#include "sysemu/dma.h"          // For dma_memory_map/unmap on the device AddressSpace
 
 #include "qemu_keystone_copro.h"
+#include "trace.h"
 
 #define KS_COPRO_LOG(fmt, ...) \
     qemu_log_mask(LOG_GUEST_ERROR, "[%s] " fmt "\n", \
                   TYPE_KEYSTONE_COPRO, ## __VA_ARGS__)
 
+#define KS_CMD_SC_MASK (CMD_START_VM | CMD_STOP_VM | CMD_RESET_VM | CMD_LOAD_PROG | CMD_LOAD_DATA_IN | \
+                        CMD_LOAD_PROG_HANDLE | CMD_START_BATCH)
+
 // Forward declarations for static functions
 static void ks_copro_update_irq(KeystoneCoproState *s);
-static void ks_copro_handle_load_prog_cmd(KeystoneCoproState *s);
-static void ks_copro_handle_load_data_in_cmd(KeystoneCoproState *s);
-static void ks_copro_handle_start_vm_cmd(KeystoneCoproState *s);
-static void ks_copro_handle_stop_vm_cmd(KeystoneCoproState *s);
-static void ks_copro_handle_reset_vm_cmd(KeystoneCoproState *s);
+static void ks_copro_raise_irq(KeystoneCoproState *s, uint32_t bits);
+static void ks_copro_raise_vm_irq(KeystoneCoproState *s, unsigned vm_id, bool error);
+static void ks_vm_wait_wake(KeystoneCoproState *s, uint64_t slots);
+static void ks_irq_mod_event(KeystoneCoproState *s, int c);
+static int ks_copro_handle_load_prog_cmd(KeystoneCoproState *s, unsigned vm_id, uint64_t addr, uint32_t len);
+static int ks_copro_handle_load_prog_handle_cmd(KeystoneCoproState *s, unsigned vm_id, uint32_t handle);
+static int ks_copro_handle_load_data_in_cmd(KeystoneCoproState *s, unsigned vm_id, uint64_t addr, uint32_t len);
+static int ks_copro_handle_start_vm_cmd(KeystoneCoproState *s, unsigned vm_id, uint64_t out_addr, uint32_t out_len);
+static int ks_copro_handle_start_batch_cmd(KeystoneCoproState *s, unsigned vm_id, uint64_t in_addr, uint64_t out_addr);
+static int ks_copro_handle_stop_vm_cmd(KeystoneCoproState *s, unsigned vm_id);
+static int ks_copro_handle_reset_vm_cmd(KeystoneCoproState *s, unsigned vm_id);
+static void ks_copro_vm_start(KeystoneCoproState *s, unsigned vm_id);
+static void ks_copro_vm_exec(KeystoneCoproState *s, unsigned vm_id);
+static void ks_copro_vm_finish(KeystoneCoproState *s, unsigned vm_id);
+static bool ks_copro_vm_quiesce(KeystoneCoproState *s, unsigned vm_id);
+static void ks_copro_vm_drop_prog(KeystoneVMContext *vm);
+static void ks_prog_cache_flush(KeystoneCoproState *s);
+static void ks_copro_vm_loaded(KeystoneCoproState *s, unsigned vm_id, bool is_prog, uint32_t len);
 static void ks_dma_complete_cb(void *opaque);
+static bool ks_dma_read_to_slot(KeystoneCoproState *s, uint64_t addr, uint8_t *dst, uint32_t len);
+static bool ks_dma_write_from_slot(KeystoneCoproState *s, uint64_t addr, const uint8_t *src, uint32_t len);
+static void ks_dma_ring_setup_write(KeystoneCoproState *s, hwaddr offset, uint32_t value);
+static void ks_dma_kick(KeystoneCoproState *s);
+static bool ks_dma_slot_held(KeystoneCoproState *s, unsigned vm_id);
+static uint32_t ks_dma_busy_mask(KeystoneCoproState *s);
+static void ks_queue_setup_write(KeystoneCoproState *s, hwaddr offset, uint32_t value);
+static void ks_sq_complete(KeystoneCoproState *s, unsigned vm_id, uint8_t status, uint64_t retval);
 
+QEMU_BUILD_BUG_ON(sizeof(KsDmaDesc) != 32);
+QEMU_BUILD_BUG_ON(sizeof(KsDmaSgEntry) != 16);
+QEMU_BUILD_BUG_ON(sizeof(KsSqEntry) != 32);
+QEMU_BUILD_BUG_ON(sizeof(KsCqEntry) != 16);
 
-uint64_t keystone_copro_read(void *opaque, hwaddr offset, unsigned size) {
-    KeystoneCoproState *s = KEYSTONE_COPRO(opaque);
-    uint64_t val = 0;
+// prog_mem or data_mem of a slot changed (BQL held); migration resends it
+static void ks_vm_mem_dirty(KeystoneCoproState *s, unsigned vm_id, bool prog) {
+    qatomic_or(prog ? &s->mem_dirty_prog : &s->mem_dirty_data, 1ULL << vm_id);
+}
 
-    // KS_COPRO_LOG("CSR Read: offset=0x%02lx, size=%u", offset, size);
+// Fold guest stores through the slot memory window into the dirty masks
+// (BQL held). A store to prog_mem also leaves the prepared program stale.
+static void ks_vm_mem_sync(KeystoneCoproState *s, unsigned vm_id) {
+    KeystoneVMContext *vm = &s->vm_contexts[vm_id];
 
-    switch (offset) {
-        case ADDR_COPRO_CMD_REG:
-            val = s->copro_cmd_reg; // SC bits are already cleared by write logic conceptually
-            break;
-        case ADDR_VM_SELECT_REG:
-            val = s->vm_select_id;
-            break;
-        case ADDR_COPRO_STATUS_REG:
-            // Reconstruct on read
-            s->active_vm_mask = 0;
-            for (int i = 0; i < NUM_VM_SLOTS_QEMU; i++) {
-                if (s->vm_contexts[i].running) {
-                    s->active_vm_mask |= (1 << i);
-                }
-            }
-            s->copro_busy_status = s->dma_active || (s->active_vm_mask != 0);
-            val = (s->active_vm_mask << 8) | (s->copro_busy_status & 0x1);
-            break;
-        case ADDR_PROG_ADDR_LOW_REG:
-            val = s->prog_addr_low_reg;
-            break;
-        case ADDR_PROG_ADDR_HIGH_REG:
-            val = s->prog_addr_high_reg;
-            break;
-        case ADDR_DATA_IN_ADDR_LOW_REG:
-            val = s->data_in_addr_low_reg;
-            break;
-        case ADDR_DATA_IN_ADDR_HIGH_REG:
-            val = s->data_in_addr_high_reg;
+    if (memory_region_test_and_clear_dirty(&vm->prog_mr, 0, KS_VM_PROG_MEM_SIZE, DIRTY_MEMORY_VGA)) {
+        vm->prog_stale = true;
+        ks_vm_mem_dirty(s, vm_id, true);
+    }
+    // Both data buffers migrate together
+    if (memory_region_test_and_clear_dirty(&vm->data_mr, 0, KS_VM_DATA_MEM_SIZE, DIRTY_MEMORY_VGA) |
+        memory_region_test_and_clear_dirty(&vm->data_b_mr, 0, KS_VM_DATA_MEM_SIZE, DIRTY_MEMORY_VGA)) {
+        ks_vm_mem_dirty(s, vm_id, false);
+    }
+}
+
+// MEM_CTRL WRITE_LOCK: the window onto a running slot's memories is
+// read-only, except for the data buffer not in use
+static void ks_vm_mem_lock(KeystoneCoproState *s, unsigned vm_id, bool lock) {
+    KeystoneVMContext *vm = &s->vm_contexts[vm_id];
+
+    if (vm->mem_locked == lock) {
+        return;
+    }
+    memory_region_transaction_begin();
+    memory_region_set_readonly(&vm->prog_mr, lock);
+    memory_region_set_readonly(&vm->data_mr, lock && vm->data_active == 0);
+    memory_region_set_readonly(&vm->data_b_mr, lock && vm->data_active == 1);
+    memory_region_transaction_commit();
+    vm->mem_locked = lock;
+}
+
+// With PINGPONG, data-in goes to the buffer the slot does not run on, so it
+// may be filled while the slot runs
+static bool ks_vm_data_pingpong(KeystoneVMContext *vm) {
+    return vm->data_buf_ctrl & KS_VM_DATA_BUF_PINGPONG;
+}
+
+static uint8_t *ks_vm_data_fill_buf(KeystoneVMContext *vm) {
+    return ks_vm_data_pingpong(vm) ? vm->data_bufs[!vm->data_active] : vm->data_mem;
+}
+
+// Back to buffer A, empty (slot idle)
+static void ks_vm_data_bufs_reset(KeystoneVMContext *vm) {
+    memset(vm->data_bufs[0], 0, KS_VM_DATA_MEM_SIZE);
+    memset(vm->data_bufs[1], 0, KS_VM_DATA_MEM_SIZE);
+    vm->data_active = 0;
+    vm->data_mem = vm->data_bufs[0];
+    vm->data_ready = false;
+    vm->data_fill_len = 0;
+}
+
+// Bits of the slots that exist
+static uint64_t ks_slot_mask(KeystoneCoproState *s) {
+    return MAKE_64BIT_MASK(0, s->num_slots);
+}
+
+static uint64_t ks_active_vm_mask(KeystoneCoproState *s) {
+    s->active_vm_mask = 0;
+    for (int i = 0; i < s->num_slots; i++) {
+        if (s->vm_contexts[i].running) {
+            s->active_vm_mask |= 1ULL << i;
+        }
+    }
+    return s->active_vm_mask;
+}
+
+// INT_STATUS_REG / INT_ENABLE_REG: the global bits, with slots 0-7 of the VM interrupt block below them
+static uint32_t ks_int_status(KeystoneCoproState *s) {
+    return s->int_status_reg | (s->mbox_pending ? IRQ_MBOX : 0) | (s->vm_done_status & IRQ_VM_DONE_MASK) |
+           (s->vm_error_status << IRQ_VM_ERROR_SHIFT & IRQ_VM_ERROR_MASK);
+}
+
+static uint32_t ks_int_enable(KeystoneCoproState *s) {
+    return s->int_enable_reg | (s->vm_done_enable & IRQ_VM_DONE_MASK) |
+           (s->vm_error_enable << IRQ_VM_ERROR_SHIFT & IRQ_VM_ERROR_MASK);
+}
+
+
+// Mailbox FIFO mode, see KS_MBOX_FIFO_EN. MBOX_IRQ_STATUS of a slot, from any thread.
+static uint32_t ks_mbox_cond(KsVmMbox *mb) {
+    uint32_t in_wmark = MAX((mb->ctrl >> KS_MBOX_FIFO_IN_WMARK_SHIFT) & 0xFF, 1);
+    uint32_t out_wmark = MAX((mb->ctrl >> KS_MBOX_FIFO_OUT_WMARK_SHIFT) & 0xFF, 1);
+    uint32_t cond = 0;
+
+    if (!(mb->ctrl & KS_MBOX_FIFO_EN)) {
+        return 0;
+    }
+    if (mb->in.depth - ks_mbox_fifo_count(&mb->in) >= in_wmark) {
+        cond |= KS_MBOX_IRQ_IN_SPACE;
+    }
+    if (ks_mbox_fifo_count(&mb->out) >= out_wmark) {
+        cond |= KS_MBOX_IRQ_OUT_READY;
+    }
+    return cond;
+}
+
+// Fold a slot's MBOX_IRQ_STATUS into mbox_pending; the caller updates the line
+static void ks_mbox_update(KeystoneCoproState *s, unsigned vm_id) {
+    KsVmMbox *mb = &s->vm_mbox[vm_id];
+    uint64_t bit = 1ULL << vm_id;
+    uint32_t cond;
+
+    // Re-checked after the store so that a concurrent ks_mbox_kick cannot be lost
+    do {
+        cond = ks_mbox_cond(mb);
+        qatomic_set(&mb->cond, cond);
+        smp_mb();
+    } while (cond != ks_mbox_cond(mb));
+    if (!(cond & mb->irq_enable)) {
+        s->mbox_pending &= ~bit;
+    } else if (!(s->mbox_pending & bit)) {
+        s->mbox_pending |= bit;
+        s->perf.irq_events++;
+        if (s->int_enable_reg & IRQ_MBOX) {
+            ks_irq_mod_event(s, KS_IRQ_CLASS_VM_DONE);
+        }
+    }
+}
+
+// KsEbpfRunCtx.fifo_kick, on the run's thread: wake mbox_bh if the VM changed MBOX_IRQ_STATUS
+static void ks_mbox_kick(void *opaque) {
+    KsVmMbox *mb = opaque;
+    uint32_t cond = ks_mbox_cond(mb);
+
+    if (cond != qatomic_read(&mb->cond)) {
+        qatomic_set(&mb->cond, cond);
+        qemu_bh_schedule(mb->owner->mbox_bh);
+    }
+}
+
+static void ks_mbox_bh(void *opaque) {
+    KeystoneCoproState *s = opaque;
+
+    for (int i = 0; i < s->num_slots; i++) {
+        ks_mbox_update(s, i);
+    }
+    ks_copro_update_irq(s);
+}
+
+// MBOX_FIFO_CTRL_REG: enter or leave FIFO mode with both FIFOs empty
+static void ks_mbox_set_ctrl(KeystoneCoproState *s, unsigned vm_id, uint32_t value) {
+    KsVmMbox *mb = &s->vm_mbox[vm_id];
+    uint32_t depth_log2 = MIN((value >> KS_MBOX_FIFO_DEPTH_SHIFT) & KS_MBOX_FIFO_DEPTH_MASK,
+                              KS_MBOX_FIFO_MAX_LOG2);
+
+    mb->ctrl = (value & KS_MBOX_FIFO_CTRL_MASK & ~(KS_MBOX_FIFO_DEPTH_MASK << KS_MBOX_FIFO_DEPTH_SHIFT)) |
+               depth_log2 << KS_MBOX_FIFO_DEPTH_SHIFT;
+    mb->in_overflow = false;
+    mb->in.depth = mb->out.depth = 1u << depth_log2;
+    mb->in.head = mb->in.tail = 0;
+    mb->out.head = mb->out.tail = 0;
+    ks_mbox_update(s, vm_id);
+}
+
+/*
+ * Registers that exist once per slot: reached through VM_SELECT_REG at their
+ * legacy offsets, or directly in the slot's page. reg is the offset within
+ * either.
+ */
+static uint8_t ks_copro_vm_status_byte(KeystoneVMContext *vm) {
+    uint8_t status_byte = 0;
+
+    if (vm->running) status_byte |= (1 << 1);
+    if (vm->done) status_byte |= (1 << 2);
+    if (vm->error_state) status_byte |= (1 << 3) | ((vm->error_code & 0xF) << 4);
+    // Bit 0 (READY) can be assumed true if not running/error.
+    if (!vm->running && !vm->error_state) status_byte |= (1 << 0);
+    return status_byte;
+}
+
+static uint64_t ks_copro_vm_reg_read(KeystoneCoproState *s, unsigned vm_id, hwaddr reg) {
+    KeystoneVMContext *vm = &s->vm_contexts[vm_id];
+    KsVmMbox *mb = &s->vm_mbox[vm_id];
+    uint64_t val = 0;
+
+    switch (reg) {
+        case ADDR_SELECTED_VM_STATUS_REG:
+            val = ks_copro_vm_status_byte(vm);
             break;
-        case ADDR_DATA_OUT_ADDR_LOW_REG:
-            val = s->data_out_addr_low_reg;
+        case ADDR_SELECTED_VM_PC_REG:
+            // Follows a profiled run through its samples
+            val = vm->running && vm->run.prof ? qatomic_read(&vm->run.prof_pc) : vm->pc;
             break;
-        case ADDR_DATA_OUT_ADDR_HIGH_REG:
-            val = s->data_out_addr_high_reg;
+        case ADDR_SELECTED_VM_DATA_OUT_ADDR_REG:
+            // Where the last run wrote its output, if it wrote any
+            val = vm->out_len ? (uint32_t)vm->out_addr : 0;
             break;
-        case ADDR_DATA_LEN_REG:
-            val = s->data_len_reg;
+        case ADDR_SELECTED_VM_DATA_OUT_LEN_REG:
+            val = vm->out_len;
             break;
-        case ADDR_INT_STATUS_REG:
-            val = s->int_status_reg;
-            // RC behavior: reading clears the readable bits that were set
-            // Assuming CPU reads the register and then writes back to clear specific bits.
-            // True RC (clear on read) means after this read, bits should be cleared.
-            // However, typical implementations require a write-to-clear for specific bits.
-            // For now, we model W1C in the write function. If pure RC is needed:
-            // s->int_status_reg = 0; // Or clear only bits that were read (val)
-            // ks_copro_update_irq(s);
+        case ADDR_SELECTED_VM_RETVAL_REG:
+            val = (uint32_t)vm->retval;
             break;
-        case ADDR_INT_ENABLE_REG:
-            val = s->int_enable_reg;
+        case ADDR_SELECTED_VM_PROG_HANDLE_REG:
+            val = vm->prog_entry ? vm->prog_entry->handle : 0;
             break;
-        case ADDR_SELECTED_VM_STATUS_REG:
-            if (s->vm_select_id < NUM_VM_SLOTS_QEMU) {
-                KeystoneVMContext *vm = &s->vm_contexts[s->vm_select_id];
-                uint8_t status_byte = 0;
-                if (vm->running) status_byte |= (1 << 1);
-                if (vm->error_state) status_byte |= (1 << 3) | ((vm->error_code & 0xF) << 4);
-                // Bit 2 (DONE) would be set by the VM model when it finishes.
-                // Bit 0 (READY) can be assumed true if not running/error.
-                if (!vm->running && !vm->error_state) status_byte |= (1 << 0);
-                val = status_byte;
-            } else {
-                val = 0; // Or error value
-            }
+        case ADDR_MBOX_FIFO_CTRL_REG:
+            val = mb->ctrl;
             break;
-        case ADDR_SELECTED_VM_PC_REG:
-             if (s->vm_select_id < NUM_VM_SLOTS_QEMU) {
-                val = s->vm_contexts[s->vm_select_id].pc;
-            } else {
-                val = 0;
+        case ADDR_MBOX_FIFO_STATUS_REG:
+            if (mb->ctrl & KS_MBOX_FIFO_EN) {
+                val = ks_mbox_fifo_count(&mb->in) |
+                      ks_mbox_fifo_count(&mb->out) << KS_MBOX_STATUS_OUT_SHIFT |
+                      (mb->in_overflow ? KS_MBOX_STATUS_IN_OVERFLOW : 0);
             }
             break;
-        case ADDR_SELECTED_VM_DATA_OUT_ADDR_REG:
-            // This would be an address in main memory where VM wrote output,
-            // needs to be set by the VM model if it performs DMA itself.
-            // For now, returns 0.
-            val = 0;
+        case ADDR_MBOX_IRQ_STATUS_REG:
+            val = ks_mbox_cond(mb);
             break;
-        case ADDR_COPRO_VERSION_REG:
-            val = 0x00010000; // Example Version 1.0.0
+        case ADDR_MBOX_IRQ_ENABLE_REG:
+            val = mb->irq_enable;
             break;
         default:
-            if (offset >= ADDR_MAILBOX_DATA_IN_0_REG && offset < (ADDR_MAILBOX_DATA_IN_0_REG + NUM_MAILBOX_REGS_QEMU * 4)) {
-                unsigned mbox_idx = (offset - ADDR_MAILBOX_DATA_IN_0_REG) / 4;
-                if (s->vm_select_id < NUM_VM_SLOTS_QEMU && mbox_idx < NUM_MAILBOX_REGS_QEMU) {
-                    val = s->vm_mailboxes_in[s->vm_select_id][mbox_idx];
-                } else {
-                    KS_COPRO_LOG("Read from invalid IN Mailbox: vm_id %u, idx %u", s->vm_select_id, mbox_idx);
-                }
-            } else if (offset >= ADDR_MAILBOX_DATA_OUT_0_REG && offset < (ADDR_MAILBOX_DATA_OUT_0_REG + NUM_MAILBOX_REGS_QEMU * 4)) {
-                unsigned mbox_idx = (offset - ADDR_MAILBOX_DATA_OUT_0_REG) / 4;
-                 if (s->vm_select_id < NUM_VM_SLOTS_QEMU && mbox_idx < NUM_MAILBOX_REGS_QEMU) {
-                    val = s->vm_mailboxes_out[s->vm_select_id][mbox_idx];
-                } else {
-                    KS_COPRO_LOG("Read from invalid OUT Mailbox: vm_id %u, idx %u", s->vm_select_id, mbox_idx);
+            if ((mb->ctrl & KS_MBOX_FIFO_EN) && reg >= ADDR_MAILBOX_DATA_OUT_0_REG &&
+                reg < (ADDR_MAILBOX_DATA_OUT_0_REG + NUM_MAILBOX_REGS_QEMU * 4)) {
+                uint32_t word;
+
+                // Pop port; the IN offsets are push-only and read 0
+                if (ks_mbox_fifo_pop(&mb->out, &word)) {
+                    val = word;
+                    ks_mbox_update(s, vm_id);
+                    ks_copro_update_irq(s);
                 }
+            } else if ((mb->ctrl & KS_MBOX_FIFO_EN) && reg >= ADDR_MAILBOX_DATA_IN_0_REG &&
+                       reg < (ADDR_MAILBOX_DATA_IN_0_REG + NUM_MAILBOX_REGS_QEMU * 4)) {
+                val = 0;
+            } else if (reg >= ADDR_MAILBOX_DATA_IN_0_REG && reg < (ADDR_MAILBOX_DATA_IN_0_REG + NUM_MAILBOX_REGS_QEMU * 4)) {
+                val = qatomic_read(&s->vm_mailboxes_in[vm_id][(reg - ADDR_MAILBOX_DATA_IN_0_REG) / 4]);
+            } else if (reg >= ADDR_MAILBOX_DATA_OUT_0_REG && reg < (ADDR_MAILBOX_DATA_OUT_0_REG + NUM_MAILBOX_REGS_QEMU * 4)) {
+                val = qatomic_read(&s->vm_mailboxes_out[vm_id][(reg - ADDR_MAILBOX_DATA_OUT_0_REG) / 4]);
             } else {
-                KS_COPRO_LOG("Read from undefined CSR offset 0x%02lx", offset);
+                KS_COPRO_LOG("Read from undefined CSR offset 0x%02lx (VM %u)", reg, vm_id);
                 // qemu_log_mask(LOG_GUEST_ERROR, ...) is preferred
             }
             break;
     }
-    // KS_COPRO_LOG("Read value 0x%08x from offset 0x%02lx", (unsigned)val, offset);
     return val;
 }
 
-void keystone_copro_write(void *opaque, hwaddr offset, uint64_t val, unsigned size) {
-    KeystoneCoproState *s = KEYSTONE_COPRO(opaque);
-    uint32_t value = val; // Assuming 32-bit writes
+static void ks_copro_vm_reg_write(KeystoneCoproState *s, unsigned vm_id, hwaddr reg, uint32_t value) {
+    KsVmMbox *mb = &s->vm_mbox[vm_id];
 
-    // KS_COPRO_LOG("CSR Write: offset=0x%02lx, value=0x%08x, size=%u", offset, value, size);
+    if (reg == ADDR_MBOX_FIFO_CTRL_REG) {
+        // The running VM holds the FIFOs
+        if (s->vm_contexts[vm_id].running) {
+            KS_COPRO_LOG("MBOX_FIFO_CTRL: VM %u is running", vm_id);
+            s->perf.cmd_rejected++;
+            return;
+        }
+        ks_mbox_set_ctrl(s, vm_id, value);
+        ks_copro_update_irq(s);
+    } else if (reg == ADDR_MBOX_IRQ_ENABLE_REG) {
+        mb->irq_enable = value & KS_MBOX_IRQ_MASK;
+        ks_mbox_update(s, vm_id);
+        ks_copro_update_irq(s);
+    } else if ((mb->ctrl & KS_MBOX_FIFO_EN) && reg >= ADDR_MAILBOX_DATA_IN_0_REG &&
+               reg < (ADDR_MAILBOX_DATA_IN_0_REG + NUM_MAILBOX_REGS_QEMU * 4)) {
+        // Push port; the VM sees the word on its next MBOX_READ
+        if (!ks_mbox_fifo_push(&mb->in, value)) {
+            KS_COPRO_LOG("VM%u IN FIFO full, 0x%x dropped", vm_id, value);
+            mb->in_overflow = true;
+            return;
+        }
+        ks_mbox_update(s, vm_id);
+        ks_copro_update_irq(s);
+    } else if (reg >= ADDR_MAILBOX_DATA_IN_0_REG && reg < (ADDR_MAILBOX_DATA_IN_0_REG + NUM_MAILBOX_REGS_QEMU * 4)) {
+        unsigned mbox_idx = (reg - ADDR_MAILBOX_DATA_IN_0_REG) / 4;
+        qatomic_set(&s->vm_mailboxes_in[vm_id][mbox_idx], value);
+        KS_COPRO_LOG("CPU wrote 0x%x to VM%u IN Mailbox[%u]", value, vm_id, mbox_idx);
+    } else if (reg >= ADDR_MAILBOX_DATA_OUT_0_REG && reg < (ADDR_MAILBOX_DATA_OUT_0_REG + NUM_MAILBOX_REGS_QEMU * 4)) {
+        // CPU typically does not write to OUT mailboxes. This is where VM writes.
+        KS_COPRO_LOG("CPU attempted write to OUT Mailbox offset 0x%02lx (ignored)", reg);
+    } else {
+        // SELECTED_VM_* registers are Read-Only by CPU
+        KS_COPRO_LOG("Write to undefined CSR offset 0x%02lx (VM %u), value 0x%08x", reg, vm_id, value);
+    }
+}
 
-    switch (offset) {
-        case ADDR_COPRO_CMD_REG:
-            s->copro_cmd_reg = value; // Store written value
-            if (value & CMD_LOAD_PROG) {
-                ks_copro_handle_load_prog_cmd(s);
-                s->copro_cmd_reg &= ~CMD_LOAD_PROG; // SC behavior
-            }
-            if (value & CMD_LOAD_DATA_IN) {
-                ks_copro_handle_load_data_in_cmd(s);
-                s->copro_cmd_reg &= ~CMD_LOAD_DATA_IN; // SC behavior
-            }
-            if (value & CMD_START_VM) {
-                ks_copro_handle_start_vm_cmd(s);
-                s->copro_cmd_reg &= ~CMD_START_VM; // SC behavior
-            }
-            if (value & CMD_STOP_VM) {
-                ks_copro_handle_stop_vm_cmd(s);
-                s->copro_cmd_reg &= ~CMD_STOP_VM; // SC behavior
-            }
-            if (value & CMD_RESET_VM) {
-                ks_copro_handle_reset_vm_cmd(s);
-                s->copro_cmd_reg &= ~CMD_RESET_VM; // SC behavior
-            }
-            // Other bits in command_reg are not SC and remain until changed.
+// Pass a command handler's result through, counting refused commands
+static int ks_perf_cmd(KeystoneCoproState *s, int ret) {
+    if (ret < 0) {
+        s->perf.cmd_rejected++;
+    }
+    return ret;
+}
+
+// COPRO_CMD bits against one slot; loads and starts take their addresses and lengths from the caller
+static void ks_copro_run_cmd(KeystoneCoproState *s, unsigned vm_id, uint32_t value,
+                             uint64_t prog_addr, uint64_t data_in_addr, uint32_t len,
+                             uint64_t data_out_addr, uint32_t data_out_len) {
+    if (value & CMD_LOAD_PROG) {
+        ks_perf_cmd(s, ks_copro_handle_load_prog_cmd(s, vm_id, prog_addr, len));
+    }
+    if (value & CMD_LOAD_PROG_HANDLE) {
+        ks_perf_cmd(s, ks_copro_handle_load_prog_handle_cmd(s, vm_id, (uint32_t)prog_addr));
+    }
+    if (value & CMD_LOAD_DATA_IN) {
+        ks_perf_cmd(s, ks_copro_handle_load_data_in_cmd(s, vm_id, data_in_addr, len));
+    }
+    if (value & CMD_START_VM) {
+        ks_perf_cmd(s, ks_copro_handle_start_vm_cmd(s, vm_id, data_out_addr, data_out_len));
+    }
+    if (value & CMD_START_BATCH) {
+        ks_perf_cmd(s, ks_copro_handle_start_batch_cmd(s, vm_id, data_in_addr, data_out_addr));
+    }
+    if (value & CMD_STOP_VM) {
+        ks_perf_cmd(s, ks_copro_handle_stop_vm_cmd(s, vm_id));
+    }
+    if (value & CMD_RESET_VM) {
+        ks_perf_cmd(s, ks_copro_handle_reset_vm_cmd(s, vm_id));
+    }
+}
+
+// One half of a counter's LOW/HIGH pair; LOW latches the upper half for HIGH
+static uint32_t ks_perf_read_half(KeystoneCoproState *s, uint64_t ctr, hwaddr offset) {
+    if (offset & 4) {
+        return s->perf_high;
+    }
+    s->perf_high = ctr >> 32;
+    return ctr;
+}
+
+static uint64_t ks_perf_read(KeystoneCoproState *s, hwaddr offset) {
+    uint64_t ctr;
+
+    switch (offset & ~(hwaddr)4) {
+        case ADDR_PERF_CTRL_REG:
+            return 0;
+        case ADDR_PERF_DMA_BYTES_REG:
+            ctr = s->perf.dma_bytes;
             break;
-        case ADDR_VM_SELECT_REG:
-            s->vm_select_id = value & 0x7; // Only 3 bits for VM ID
+        case ADDR_PERF_DMA_BUSY_NS_REG:
+            ctr = s->perf.dma_busy_ns;
             break;
-        // COPRO_STATUS_REG is Read-Only
+        case ADDR_PERF_DMA_XFERS_REG:
+            ctr = s->perf.dma_xfers;
+            break;
+        case ADDR_PERF_CMD_REJECTED_REG:
+            ctr = s->perf.cmd_rejected;
+            break;
+        case ADDR_PERF_IRQ_EVENTS_REG:
+            ctr = s->perf.irq_events;
+            break;
+        case ADDR_PERF_IRQ_ASSERTS_REG:
+            ctr = s->perf.irq_asserts;
+            break;
+        case ADDR_PERF_DMA_QUEUED_REG:
+            ctr = s->perf.dma_queued;
+            break;
+        case ADDR_PERF_DMA_QUEUE_WAIT_NS_REG:
+            ctr = s->perf.dma_queue_wait_ns;
+            break;
+        case ADDR_PERF_DMA_QUEUE_PEAK_REG:
+            ctr = s->perf.dma_queue_peak;
+            break;
+        default:
+            if (offset >= ADDR_PERF_DMA_CHAN_BUSY_NS_REG &&
+                offset < ADDR_PERF_DMA_CHAN_BUSY_NS_REG + KS_DMA_MAX_CHANNELS * 8) {
+                ctr = s->perf.dma_chan_busy_ns[(offset - ADDR_PERF_DMA_CHAN_BUSY_NS_REG) / 8];
+                break;
+            }
+            KS_COPRO_LOG("Read from undefined CSR offset 0x%03lx", offset);
+            return 0;
+    }
+    return ks_perf_read_half(s, ctr, offset);
+}
+
+static void ks_perf_clear(KeystoneCoproState *s) {
+    memset(&s->perf, 0, sizeof(s->perf));
+    memset(s->vm_perf, 0, sizeof(s->vm_perf));
+    s->perf_high = 0;
+}
+
+static void ks_perf_write(KeystoneCoproState *s, hwaddr offset, uint32_t value) {
+    if (offset != ADDR_PERF_CTRL_REG) {
+        KS_COPRO_LOG("Write to read-only counter offset 0x%03lx ignored", offset);
+        return;
+    }
+    if (value & KS_PERF_CTRL_CLEAR) {
+        ks_perf_clear(s);
+    }
+}
+
+/*
+ * MEM_PROG_LEN / MEM_DATA_LEN: take len bytes the guest stored in the slot's
+ * memory through the window, as a LOAD_PROG / LOAD_DATA_IN of that length
+ * would have left them. A program is prepared now, so a verifier rejection
+ * shows at once.
+ */
+static int ks_vm_mem_set_len(KeystoneCoproState *s, unsigned vm_id, bool is_prog, uint32_t len) {
+    if (s->vm_contexts[vm_id].running && (is_prog || !ks_vm_data_pingpong(&s->vm_contexts[vm_id]))) {
+        KS_COPRO_LOG("MEM_%s_LEN: VM %u is running", is_prog ? "PROG" : "DATA", vm_id);
+        return -EBUSY;
+    }
+    if (is_prog ? len > KS_VM_PROG_MEM_SIZE || len % KS_VM_INSN_SIZE : len > KS_VM_DATA_MEM_SIZE) {
+        KS_COPRO_LOG("MEM_%s_LEN: Invalid length %u for VM %u", is_prog ? "PROG" : "DATA", len, vm_id);
+        return -EINVAL;
+    }
+    ks_copro_vm_loaded(s, vm_id, is_prog, len);
+    return 0;
+}
+
+// DATA_BUF_REG: PINGPONG decides which buffer a fill goes to, so it stays put while one may be under way
+static int ks_vm_data_buf_set(KeystoneCoproState *s, unsigned vm_id, uint32_t value) {
+    KeystoneVMContext *vm = &s->vm_contexts[vm_id];
+
+    if (vm->running || ks_dma_slot_held(s, vm_id)) {
+        KS_COPRO_LOG("DATA_BUF: VM %u is running or being loaded", vm_id);
+        return -EBUSY;
+    }
+    vm->data_buf_ctrl = value & KS_VM_DATA_BUF_PINGPONG;
+    if (!ks_vm_data_pingpong(vm)) {
+        vm->data_ready = false;
+    }
+    return 0;
+}
+
+// Slot page: the slot's own copy of the per-VM registers, no VM_SELECT_REG involved
+static uint64_t ks_vm_page_read(KeystoneCoproState *s, unsigned vm_id, hwaddr reg) {
+    KsVmPageRegs *page = &s->vm_pages[vm_id];
+
+    switch (reg) {
+        case ADDR_COPRO_CMD_REG:
+            return 0; // All command bits self-clear
         case ADDR_PROG_ADDR_LOW_REG:
-            s->prog_addr_low_reg = value;
+            return page->prog_addr_low;
+        case ADDR_PROG_ADDR_HIGH_REG:
+            return page->prog_addr_high;
+        case ADDR_DATA_IN_ADDR_LOW_REG:
+            return page->data_in_addr_low;
+        case ADDR_DATA_IN_ADDR_HIGH_REG:
+            return page->data_in_addr_high;
+        case ADDR_DATA_OUT_ADDR_LOW_REG:
+            return page->data_out_addr_low;
+        case ADDR_DATA_OUT_ADDR_HIGH_REG:
+            return page->data_out_addr_high;
+        case ADDR_DATA_LEN_REG:
+            return page->data_len;
+        case ADDR_DATA_OUT_LEN_REG:
+            return page->data_out_len;
+        case ADDR_VM_MEM_PROG_LEN_REG:
+            return s->vm_contexts[vm_id].prog_len;
+        case ADDR_VM_MEM_DATA_LEN_REG:
+            return s->vm_contexts[vm_id].data_len;
+        case ADDR_VM_MEM_CTRL_REG:
+            return s->vm_contexts[vm_id].mem_ctrl;
+        case ADDR_VM_BATCH_REC_SIZE_REG:
+            return page->batch_rec_size;
+        case ADDR_VM_BATCH_COUNT_REG:
+            return page->batch_count;
+        case ADDR_VM_BATCH_OUT_STRIDE_REG:
+            return page->batch_out_stride;
+        case ADDR_VM_BATCH_DONE_REG:
+            return qatomic_read(&s->vm_contexts[vm_id].batch_done); // Progress while the batch runs
+        case ADDR_VM_DATA_BUF_REG: {
+            KeystoneVMContext *vm = &s->vm_contexts[vm_id];
+
+            return vm->data_buf_ctrl | (vm->data_active ? KS_VM_DATA_BUF_ACTIVE : 0) |
+                   (vm->data_ready ? KS_VM_DATA_BUF_READY : 0);
+        }
+        case ADDR_VM_DMA_QUEUE_REG:
+            return s->vm_contexts[vm_id].dma_queue_count |
+                   (ks_dma_slot_held(s, vm_id) ? KS_VM_DMA_QUEUE_LOADING : 0);
+        case ADDR_VM_PERF_RUNS_REG:
+        case ADDR_VM_PERF_RUNS_REG + 4:
+            return ks_perf_read_half(s, s->vm_perf[vm_id].runs, reg);
+        case ADDR_VM_PERF_INSNS_REG:
+        case ADDR_VM_PERF_INSNS_REG + 4:
+            return ks_perf_read_half(s, s->vm_perf[vm_id].insns, reg);
+        case ADDR_VM_PERF_ERRORS_REG:
+        case ADDR_VM_PERF_ERRORS_REG + 4:
+            return ks_perf_read_half(s, s->vm_perf[vm_id].errors, reg);
+        case ADDR_VM_PERF_DMA_BYTES_REG:
+        case ADDR_VM_PERF_DMA_BYTES_REG + 4:
+            return ks_perf_read_half(s, s->vm_perf[vm_id].dma_bytes, reg);
+        default:
+            return ks_copro_vm_reg_read(s, vm_id, reg);
+    }
+}
+
+static void ks_vm_page_write(KeystoneCoproState *s, unsigned vm_id, hwaddr reg, uint32_t value) {
+    KsVmPageRegs *page = &s->vm_pages[vm_id];
+
+    switch (reg) {
+        case ADDR_COPRO_CMD_REG:
+            ks_copro_run_cmd(s, vm_id, value,
+                             ((uint64_t)page->prog_addr_high << 32) | page->prog_addr_low,
+                             ((uint64_t)page->data_in_addr_high << 32) | page->data_in_addr_low,
+                             page->data_len,
+                             ((uint64_t)page->data_out_addr_high << 32) | page->data_out_addr_low,
+                             page->data_out_len);
+            break;
+        case ADDR_PROG_ADDR_LOW_REG:
+            page->prog_addr_low = value;
             break;
         case ADDR_PROG_ADDR_HIGH_REG:
-            s->prog_addr_high_reg = value;
+            page->prog_addr_high = value;
             break;
         case ADDR_DATA_IN_ADDR_LOW_REG:
-            s->data_in_addr_low_reg = value;
+            page->data_in_addr_low = value;
             break;
         case ADDR_DATA_IN_ADDR_HIGH_REG:
-            s->data_in_addr_high_reg = value;
+            page->data_in_addr_high = value;
             break;
         case ADDR_DATA_OUT_ADDR_LOW_REG:
-            s->data_out_addr_low_reg = value;
+            page->data_out_addr_low = value;
             break;
         case ADDR_DATA_OUT_ADDR_HIGH_REG:
-            s->data_out_addr_high_reg = value;
+            page->data_out_addr_high = value;
             break;
         case ADDR_DATA_LEN_REG:
-            s->data_len_reg = value;
+            page->data_len = value;
             break;
-        case ADDR_INT_STATUS_REG:
-            // W1C (Write-1-to-Clear) behavior
-            s->int_status_reg &= ~value;
-            ks_copro_update_irq(s);
+        case ADDR_DATA_OUT_LEN_REG:
+            page->data_out_len = value;
             break;
-        case ADDR_INT_ENABLE_REG:
-            s->int_enable_reg = value & 0x0003FFFF; // Mask to relevant 18 bits
-            ks_copro_update_irq(s);
+        case ADDR_VM_MEM_PROG_LEN_REG:
+        case ADDR_VM_MEM_DATA_LEN_REG:
+            ks_perf_cmd(s, ks_vm_mem_set_len(s, vm_id, reg == ADDR_VM_MEM_PROG_LEN_REG, value));
+            break;
+        case ADDR_VM_MEM_CTRL_REG:
+            // Taken at the next START_VM
+            s->vm_contexts[vm_id].mem_ctrl = value & KS_VM_MEM_CTRL_WRITE_LOCK;
+            break;
+        case ADDR_VM_BATCH_REC_SIZE_REG:
+            page->batch_rec_size = value;
+            break;
+        case ADDR_VM_BATCH_COUNT_REG:
+            page->batch_count = value;
+            break;
+        case ADDR_VM_BATCH_OUT_STRIDE_REG:
+            page->batch_out_stride = value;
+            break;
+        case ADDR_VM_BATCH_DONE_REG:
+            KS_COPRO_LOG("Write to read-only BATCH_DONE of VM %u ignored", vm_id);
+            break;
+        case ADDR_VM_DATA_BUF_REG:
+            ks_perf_cmd(s, ks_vm_data_buf_set(s, vm_id, value));
+            break;
+        case ADDR_VM_DMA_QUEUE_REG:
+            KS_COPRO_LOG("Write to read-only DMA_QUEUE of VM %u ignored", vm_id);
             break;
-        // SELECTED_VM_* registers are Read-Only by CPU
-        case ADDR_COPRO_VERSION_REG: // Read-Only
-            break; 
         default:
-            if (offset >= ADDR_MAILBOX_DATA_IN_0_REG && offset < (ADDR_MAILBOX_DATA_IN_0_REG + NUM_MAILBOX_REGS_QEMU * 4)) {
-                unsigned mbox_idx = (offset - ADDR_MAILBOX_DATA_IN_0_REG) / 4;
-                if (s->vm_select_id < NUM_VM_SLOTS_QEMU && mbox_idx < NUM_MAILBOX_REGS_QEMU) {
-                    s->vm_mailboxes_in[s->vm_select_id][mbox_idx] = value;
-                    KS_COPRO_LOG("CPU wrote 0x%x to VM%d IN Mailbox[%d]", value, s->vm_select_id, mbox_idx);
-                    // TODO: Potentially signal to the VM model that new data is available in its IN mailbox.
-                } else {
-                    KS_COPRO_LOG("Write to invalid IN Mailbox: vm_id %u, idx %u", s->vm_select_id, mbox_idx);
-                }
-            } else if (offset >= ADDR_MAILBOX_DATA_OUT_0_REG && offset < (ADDR_MAILBOX_DATA_OUT_0_REG + NUM_MAILBOX_REGS_QEMU * 4)) {
-                // CPU typically does not write to OUT mailboxes. This is where VM writes.
-                KS_COPRO_LOG("CPU attempted write to OUT Mailbox offset 0x%02lx (ignored)", offset);
-            } else {
-                KS_COPRO_LOG("Write to undefined CSR offset 0x%02lx, value 0x%08x", offset, value);
-            }
+            ks_copro_vm_reg_write(s, vm_id, reg, value);
             break;
     }
 }
 
-static void ks_copro_update_irq(KeystoneCoproState *s) {
-    bool irq_level = (s->int_status_reg & s->int_enable_reg) != 0;
-    qemu_set_irq(s->irq, irq_level);
-    // KS_COPRO_LOG("IRQ update: status=0x%x, enable=0x%x, level=%d", s->int_status_reg, s->int_enable_reg, irq_level);
+// Slot whose page holds offset, if any: slots 0-7 from 0x100, the rest from 0x1000
+static bool ks_vm_page_decode(KeystoneCoproState *s, hwaddr offset, unsigned *vm_id) {
+    if (offset >= ADDR_VM_PAGE_BASE &&
+        offset < ADDR_VM_PAGE_BASE + MIN(s->num_slots, KS_VM_LEGACY_SLOTS) * KS_VM_PAGE_SIZE) {
+        *vm_id = (offset - ADDR_VM_PAGE_BASE) / KS_VM_PAGE_SIZE;
+        return true;
+    }
+    if (offset >= ADDR_VM_XPAGE_BASE && offset < KS_COPRO_CSR_SIZE(s->num_slots)) {
+        *vm_id = KS_VM_LEGACY_SLOTS + (offset - ADDR_VM_XPAGE_BASE) / KS_VM_PAGE_SIZE;
+        return true;
+    }
+    return false;
 }
 
-static void ks_dma_complete_cb(void *opaque) {
-    KeystoneCoproState *s = KEYSTONE_COPRO(opaque);
-    KS_COPRO_LOG("DMA operation complete. Target VM: %d, Type: %s", 
-                 s->dma_target_vm_id, s->dma_is_prog_load ? "PROG_LOAD" : "DATA_IN_LOAD");
-
-    if (s->dma_active) { // Should always be true if timer fired for DMA
-        // Simulate data transfer
-        if (s->dma_buffer) {
-            // In a real model, this buffer would be filled from guest memory
-            // and then "written" to the conceptual VM program/data memory.
-            // For now, we just log.
-            KS_COPRO_LOG("DMA: conceptually transferred %u bytes from 0x%0lx", s->dma_len, s->dma_src_addr);
-            // Example: If loading program, mark VM as having program loaded
-            if (s->dma_is_prog_load && s->dma_target_vm_id < NUM_VM_SLOTS_QEMU) {
-                // s->vm_contexts[s->dma_target_vm_id].has_program = true; // Add this field to KeystoneVMContext
-                KS_COPRO_LOG("VM %d program memory conceptually loaded.", s->dma_target_vm_id);
-            }
-            g_free(s->dma_buffer);
-            s->dma_buffer = NULL;
-        }
+// VM interrupt block: 64-bit slot masks, each a LOW/HIGH pair accessed by halves
+static uint64_t ks_vm_irq_read(KeystoneCoproState *s, hwaddr offset) {
+    uint64_t val;
 
-        s->dma_active = false;
-        s->int_status_reg |= IRQ_DMA_DONE; // Set DMA done interrupt
-        ks_copro_update_irq(s);
+    switch (offset & ~(hwaddr)4) {
+        case ADDR_VM_CONFIG_REG:
+            return offset & 4 ? 0 : s->num_slots | s->vm_irq_lines << KS_VM_CONFIG_IRQ_LINES_SHIFT;
+        case ADDR_VM_DONE_STATUS_REG:
+            val = s->vm_done_status;
+            break;
+        case ADDR_VM_ERROR_STATUS_REG:
+            val = s->vm_error_status;
+            break;
+        case ADDR_VM_DONE_ENABLE_REG:
+            val = s->vm_done_enable;
+            break;
+        case ADDR_VM_ERROR_ENABLE_REG:
+            val = s->vm_error_enable;
+            break;
+        case ADDR_ACTIVE_VM_MASK_REG:
+            val = ks_active_vm_mask(s);
+            break;
+        default:
+            KS_COPRO_LOG("Read from undefined CSR offset 0x%03lx", offset);
+            return 0;
     }
+    return offset & 4 ? val >> 32 : (uint32_t)val;
 }
 
+static void ks_vm_irq_write(KeystoneCoproState *s, hwaddr offset, uint32_t value) {
+    unsigned shift = offset & 4 ? 32 : 0;
+    uint64_t bits = (uint64_t)value << shift;
+    uint64_t half = (uint64_t)UINT32_MAX << shift;
 
-static void ks_copro_handle_load_prog_cmd(KeystoneCoproState *s) {
-    if (s->dma_active) {
-        KS_COPRO_LOG("DMA busy, LOAD_PROG for VM %u ignored.", s->vm_select_id);
-        s->int_status_reg |= IRQ_DMA_ERROR; // Or some other error indication
-        ks_copro_update_irq(s);
-        return;
-    }
-    if (s->vm_select_id >= NUM_VM_SLOTS_QEMU) {
-        KS_COPRO_LOG("LOAD_PROG: Invalid VM ID %u", s->vm_select_id);
-        s->int_status_reg |= IRQ_DMA_ERROR; // Indicate error
-        ks_copro_update_irq(s);
-        return;
+    switch (offset & ~(hwaddr)4) {
+        case ADDR_VM_DONE_STATUS_REG:
+            s->vm_done_status &= ~bits;
+            break;
+        case ADDR_VM_ERROR_STATUS_REG:
+            s->vm_error_status &= ~bits;
+            break;
+        case ADDR_VM_DONE_ENABLE_REG:
+            s->vm_done_enable = (s->vm_done_enable & ~half) | (bits & ks_slot_mask(s));
+            break;
+        case ADDR_VM_ERROR_ENABLE_REG:
+            s->vm_error_enable = (s->vm_error_enable & ~half) | (bits & ks_slot_mask(s));
+            break;
+        default:
+            KS_COPRO_LOG("Write to read-only or undefined CSR offset 0x%03lx ignored", offset);
+            return;
     }
+    ks_copro_update_irq(s);
+}
 
-    s->dma_active = true;
-    s->dma_target_vm_id = s->vm_select_id;
-    s->dma_src_addr = ((uint64_t)s->prog_addr_high_reg << 32) | s->prog_addr_low_reg;
-    s->dma_len = s->data_len_reg;
-    s->dma_is_prog_load = true;
+// Shared maps, see ADDR_MAP_SELECT_REG. Lowest page-aligned window offset where size bytes fit, or -1.
+static int64_t ks_map_window_place(KeystoneCoproState *s, uint32_t size) {
+    uint64_t off = 0;
+    bool moved;
 
-    KS_COPRO_LOG("LOAD_PROG cmd: VM_ID=%u, Addr=0x%0lx, Len=%u",
-                 s->dma_target_vm_id, s->dma_src_addr, s->dma_len);
+    do {
+        moved = false;
+        for (int i = 0; i < KS_EBPF_MAX_MAPS; i++) {
+            uint64_t start = s->map_win_off[i];
+            uint64_t end = start + ROUND_UP(s->maps[i].data_size, KS_MAP_WINDOW_ALIGN);
 
-    if (s->dma_len == 0) {
-        KS_COPRO_LOG("LOAD_PROG: Zero length, completing immediately.");
-        s->dma_active = false; // No actual DMA
-        s->int_status_reg |= IRQ_DMA_DONE;
-        ks_copro_update_irq(s);
-        return;
+            if (s->maps[i].type && off < end && start < off + size) {
+                off = end;
+                moved = true;
+            }
+        }
+    } while (moved);
+    return off + size <= s->map_window_size ? off : -1;
+}
+
+static int ks_map_create(KeystoneCoproState *s) {
+    KsEbpfMap *m = &s->maps[s->map_select];
+    KsEbpfMap def;
+    int64_t off;
+
+    if (m->type) {
+        KS_COPRO_LOG("MAP_CTRL: map %u already exists", s->map_select);
+        return -EBUSY;
     }
-    
-    // Simulate DMA by reading from guest memory
-    // In a real QEMU model, you'd use AddressSpace and cpu_physical_memory_read
-    // For this stub, we'll just log and simulate delay.
-    s->dma_buffer = g_malloc(s->dma_len);
-    // cpu_physical_memory_read(s->dma_src_addr, s->dma_buffer, s->dma_len);
-    // KS_COPRO_LOG("DMA: Read %d bytes from guest RAM @ 0x%lx (simulated)", s->dma_len, s->dma_src_addr);
-    
-    // Simulate DMA delay
-    timer_mod(&s->dma_timer, qemu_clock_get_ms(QEMU_CLOCK_VIRTUAL) + 1); // 1ms delay
-}
-
-static void ks_copro_handle_load_data_in_cmd(KeystoneCoproState *s) {
-    if (s->dma_active) {
-        KS_COPRO_LOG("DMA busy, LOAD_DATA_IN for VM %u ignored.", s->vm_select_id);
-        s->int_status_reg |= IRQ_DMA_ERROR;
-        ks_copro_update_irq(s);
-        return;
+    if (ks_ebpf_map_define(&def, s->map_type_reg, s->map_key_size_reg, s->map_value_size_reg,
+                           s->map_max_entries_reg,
+                           s->map_type_reg == KS_EBPF_MAP_PERSLOT_ARRAY ? s->num_slots : 1)) {
+        KS_COPRO_LOG("MAP_CTRL: bad definition for map %u (type %u, key %u, value %u, %u entries)",
+                     s->map_select, s->map_type_reg, s->map_key_size_reg, s->map_value_size_reg,
+                     s->map_max_entries_reg);
+        return -EINVAL;
     }
-     if (s->vm_select_id >= NUM_VM_SLOTS_QEMU) {
-        KS_COPRO_LOG("LOAD_DATA_IN: Invalid VM ID %u", s->vm_select_id);
-        s->int_status_reg |= IRQ_DMA_ERROR; // Indicate error
-        ks_copro_update_irq(s);
+    off = ks_map_window_place(s, def.data_size);
+    if (off < 0) {
+        KS_COPRO_LOG("MAP_CTRL: no room for map %u (%u bytes) in the map window", s->map_select, def.data_size);
+        return -ENOSPC;
+    }
+    *m = def;
+    ks_ebpf_map_alloc(m);
+    s->map_win_off[s->map_select] = off;
+    return 0;
+}
+
+static void ks_map_ctrl(KeystoneCoproState *s, uint32_t value) {
+    KsEbpfMap *m = &s->maps[s->map_select];
+
+    if (!(value & (KS_MAP_CTRL_CREATE | KS_MAP_CTRL_DESTROY | KS_MAP_CTRL_CLEAR))) {
+        return;
+    }
+    if (ks_active_vm_mask(s)) {
+        KS_COPRO_LOG("MAP_CTRL: refused while slots run");
+        ks_perf_cmd(s, -EBUSY);
+        return;
+    }
+    if (value & KS_MAP_CTRL_DESTROY) {
+        ks_ebpf_map_free(m);
+        s->map_win_off[s->map_select] = 0;
+    }
+    if (value & KS_MAP_CTRL_CREATE) {
+        ks_perf_cmd(s, ks_map_create(s));
+    }
+    if ((value & KS_MAP_CTRL_CLEAR) && m->type) {
+        ks_ebpf_map_clear(m);
+    }
+}
+
+static uint64_t ks_map_csr_read(KeystoneCoproState *s, hwaddr offset) {
+    KsEbpfMap *m = &s->maps[s->map_select];
+
+    switch (offset) {
+        case ADDR_MAP_SELECT_REG:
+            return s->map_select;
+        case ADDR_MAP_TYPE_REG:
+            return s->map_type_reg;
+        case ADDR_MAP_KEY_SIZE_REG:
+            return s->map_key_size_reg;
+        case ADDR_MAP_VALUE_SIZE_REG:
+            return s->map_value_size_reg;
+        case ADDR_MAP_MAX_ENTRIES_REG:
+            return s->map_max_entries_reg;
+        case ADDR_MAP_CTRL_REG:
+            return m->type != 0;
+        case ADDR_MAP_WINDOW_OFF_REG:
+            return s->map_win_off[s->map_select];
+        case ADDR_MAP_ENTRY_SIZE_REG:
+            return m->entry_size;
+        case ADDR_MAP_COUNT_REG:
+            return m->type ? ks_ebpf_map_count(m) : 0;
+        case ADDR_MAP_WINDOW_SIZE_REG:
+            return s->map_window_size;
+    }
+    KS_COPRO_LOG("Read from undefined CSR offset 0x%03lx", offset);
+    return 0;
+}
+
+static void ks_map_csr_write(KeystoneCoproState *s, hwaddr offset, uint32_t value) {
+    KsEbpfMap *m;
+
+    switch (offset) {
+        case ADDR_MAP_SELECT_REG:
+            s->map_select = value & KS_MAP_SELECT_MASK;
+            m = &s->maps[s->map_select];
+            s->map_type_reg = m->type;
+            s->map_key_size_reg = m->key_size;
+            s->map_value_size_reg = m->value_size;
+            s->map_max_entries_reg = m->max_entries;
+            break;
+        case ADDR_MAP_TYPE_REG:
+            s->map_type_reg = value;
+            break;
+        case ADDR_MAP_KEY_SIZE_REG:
+            s->map_key_size_reg = value;
+            break;
+        case ADDR_MAP_VALUE_SIZE_REG:
+            s->map_value_size_reg = value;
+            break;
+        case ADDR_MAP_MAX_ENTRIES_REG:
+            s->map_max_entries_reg = value;
+            break;
+        case ADDR_MAP_CTRL_REG:
+            ks_map_ctrl(s, value);
+            break;
+        default:
+            KS_COPRO_LOG("Write to read-only or undefined CSR offset 0x%03lx ignored", offset);
+            break;
+    }
+}
+
+// Map window: each map's image at its offset, the gaps read 0
+static KsEbpfMap *ks_map_window_decode(KeystoneCoproState *s, hwaddr offset, uint32_t *map_off) {
+    for (int i = 0; i < KS_EBPF_MAX_MAPS; i++) {
+        if (s->maps[i].type && offset >= s->map_win_off[i] && offset - s->map_win_off[i] < s->maps[i].data_size) {
+            *map_off = offset - s->map_win_off[i];
+            return &s->maps[i];
+        }
+    }
+    return NULL;
+}
+
+static uint64_t ks_map_window_read(void *opaque, hwaddr offset, unsigned size) {
+    KeystoneCoproState *s = KEYSTONE_COPRO(opaque);
+    uint32_t map_off;
+    KsEbpfMap *m = ks_map_window_decode(s, offset, &map_off);
+
+    return m ? ks_ebpf_map_host_read(m, map_off, size) : 0;
+}
+
+static void ks_map_window_write(void *opaque, hwaddr offset, uint64_t val, unsigned size) {
+    KeystoneCoproState *s = KEYSTONE_COPRO(opaque);
+    uint32_t map_off;
+    KsEbpfMap *m = ks_map_window_decode(s, offset, &map_off);
+
+    if (m) {
+        ks_ebpf_map_host_write(m, map_off, val, size);
+    }
+}
+
+static void ks_map_destroy_all(KeystoneCoproState *s) {
+    for (int i = 0; i < KS_EBPF_MAX_MAPS; i++) {
+        ks_ebpf_map_free(&s->maps[i]);
+        s->map_win_off[i] = 0;
+    }
+}
+
+// DMA channel block; CHAN_DONE/CHAN_ERROR only say which channel, DMA_DONE/DMA_ERROR still interrupt
+static uint64_t ks_dma_chan_csr_read(KeystoneCoproState *s, hwaddr offset) {
+    switch (offset) {
+        case ADDR_DMA_CHAN_CONFIG_REG:
+            return s->dma_channels | (KS_DMA_QUEUE_DEPTH << KS_DMA_CHAN_CONFIG_DEPTH_SHIFT);
+        case ADDR_DMA_CHAN_BUSY_REG:
+            return ks_dma_busy_mask(s);
+        case ADDR_DMA_CHAN_DONE_REG:
+            return s->dma_chan_done;
+        case ADDR_DMA_CHAN_ERROR_REG:
+            return s->dma_chan_error;
+    }
+    KS_COPRO_LOG("Read from undefined CSR offset 0x%03lx", offset);
+    return 0;
+}
+
+static void ks_dma_chan_csr_write(KeystoneCoproState *s, hwaddr offset, uint32_t value) {
+    switch (offset) {
+        case ADDR_DMA_CHAN_DONE_REG:
+            s->dma_chan_done &= ~value;
+            break;
+        case ADDR_DMA_CHAN_ERROR_REG:
+            s->dma_chan_error &= ~value;
+            break;
+        default:
+            KS_COPRO_LOG("Write to read-only or undefined CSR offset 0x%03lx ignored", offset);
+            break;
+    }
+}
+
+static uint64_t ks_copro_csr_read(KeystoneCoproState *s, hwaddr offset) {
+    uint64_t val = 0;
+    unsigned vm_id;
+
+    if (ks_vm_page_decode(s, offset, &vm_id)) {
+        return ks_vm_page_read(s, vm_id, offset % KS_VM_PAGE_SIZE);
+    }
+    if (offset >= ADDR_VM_PAGE_BASE) {
+        if (offset >= ADDR_PERF_CTRL_REG && offset < KS_PERF_BLOCK_END) {
+            return ks_perf_read(s, offset);
+        }
+        if (offset >= ADDR_VM_CONFIG_REG && offset < KS_VM_IRQ_BLOCK_END) {
+            return ks_vm_irq_read(s, offset);
+        }
+        if (offset >= ADDR_MAP_SELECT_REG && offset < KS_MAP_BLOCK_END) {
+            return ks_map_csr_read(s, offset);
+        }
+        if (offset >= ADDR_DMA_CHAN_CONFIG_REG && offset < KS_DMA_CHAN_BLOCK_END) {
+            return ks_dma_chan_csr_read(s, offset);
+        }
+        KS_COPRO_LOG("Read from undefined CSR offset 0x%03lx", offset);
+        return 0;
+    }
+
+    switch (offset) {
+        case ADDR_COPRO_CMD_REG:
+            val = s->copro_cmd_reg; // SC bits are already cleared by write logic conceptually
+            break;
+        case ADDR_VM_SELECT_REG:
+            val = s->vm_select_id;
+            break;
+        case ADDR_COPRO_STATUS_REG:
+            // Reconstruct on read; slots past 7 only show in ACTIVE_VM_MASK_REG and BUSY
+            s->copro_busy_status = ks_dma_busy_mask(s) || ks_active_vm_mask(s) != 0;
+            val = ((s->active_vm_mask & 0xFF) << 8) | (s->copro_busy_status & 0x1);
+            break;
+        case ADDR_PROG_ADDR_LOW_REG:
+            val = s->prog_addr_low_reg;
+            break;
+        case ADDR_PROG_ADDR_HIGH_REG:
+            val = s->prog_addr_high_reg;
+            break;
+        case ADDR_DATA_IN_ADDR_LOW_REG:
+            val = s->data_in_addr_low_reg;
+            break;
+        case ADDR_DATA_IN_ADDR_HIGH_REG:
+            val = s->data_in_addr_high_reg;
+            break;
+        case ADDR_DATA_OUT_ADDR_LOW_REG:
+            val = s->data_out_addr_low_reg;
+            break;
+        case ADDR_DATA_OUT_ADDR_HIGH_REG:
+            val = s->data_out_addr_high_reg;
+            break;
+        case ADDR_DATA_LEN_REG:
+            val = s->data_len_reg;
+            break;
+        case ADDR_DATA_OUT_LEN_REG:
+            val = s->data_out_len_reg;
+            break;
+        case ADDR_INT_STATUS_REG:
+            val = ks_int_status(s);
+            // RC behavior: reading clears the readable bits that were set
+            // Assuming CPU reads the register and then writes back to clear specific bits.
+            // True RC (clear on read) means after this read, bits should be cleared.
+            // However, typical implementations require a write-to-clear for specific bits.
+            // For now, we model W1C in the write function. If pure RC is needed:
+            // s->int_status_reg = 0; // Or clear only bits that were read (val)
+            // ks_copro_update_irq(s);
+            break;
+        case ADDR_INT_ENABLE_REG:
+            val = ks_int_enable(s);
+            break;
+        case ADDR_SELECTED_VM_STATUS_REG:
+        case ADDR_SELECTED_VM_PC_REG:
+        case ADDR_SELECTED_VM_DATA_OUT_ADDR_REG:
+        case ADDR_SELECTED_VM_RETVAL_REG:
+        case ADDR_SELECTED_VM_DATA_OUT_LEN_REG:
+            val = ks_copro_vm_reg_read(s, s->vm_select_id, offset);
+            break;
+        case ADDR_DMA_RING_BASE_LOW_REG:
+            val = s->dma_ring_base_low_reg;
+            break;
+        case ADDR_DMA_RING_BASE_HIGH_REG:
+            val = s->dma_ring_base_high_reg;
+            break;
+        case ADDR_DMA_RING_SIZE_REG:
+            val = s->dma_ring_size;
+            break;
+        case ADDR_DMA_RING_HEAD_REG:
+            val = s->dma_ring_head;
+            break;
+        case ADDR_DMA_RING_TAIL_REG:
+            val = s->dma_ring_tail;
+            break;
+        case ADDR_SQ_BASE_LOW_REG:
+            val = s->sq_base_low_reg;
+            break;
+        case ADDR_SQ_BASE_HIGH_REG:
+            val = s->sq_base_high_reg;
+            break;
+        case ADDR_CQ_BASE_LOW_REG:
+            val = s->cq_base_low_reg;
+            break;
+        case ADDR_CQ_BASE_HIGH_REG:
+            val = s->cq_base_high_reg;
+            break;
+        case ADDR_QUEUE_SIZE_REG:
+            val = s->queue_size;
+            break;
+        case ADDR_SQ_TAIL_REG:
+            val = s->sq_tail;
+            break;
+        case ADDR_SQ_HEAD_REG:
+            val = s->sq_head;
+            break;
+        case ADDR_CQ_HEAD_REG:
+            val = s->cq_head;
+            break;
+        case ADDR_CQ_TAIL_REG:
+            val = s->cq_tail;
+            break;
+        case ADDR_IRQ_MOD_VM_DONE_REG:
+        case ADDR_IRQ_MOD_VM_ERROR_REG:
+        case ADDR_IRQ_MOD_DMA_REG:
+            val = s->irq_mod_reg[(offset - ADDR_IRQ_MOD_VM_DONE_REG) / 4];
+            break;
+        case ADDR_IRQ_MOD_CTRL_REG:
+            val = s->irq_mod_ctrl;
+            break;
+        case ADDR_PROG_CACHE_STATUS_REG:
+            val = (s->prog_cache_size << 16) | s->prog_cache_used;
+            break;
+        case ADDR_PROG_CACHE_HITS_REG:
+            val = (uint32_t)s->prog_cache_hits;
+            break;
+        case ADDR_PROG_CACHE_MISSES_REG:
+            val = (uint32_t)s->prog_cache_misses;
+            break;
+        case ADDR_COPRO_VERSION_REG:
+            val = 0x00010000; // Example Version 1.0.0
+            break;
+        default:
+            // Mailboxes of the selected VM
+            val = ks_copro_vm_reg_read(s, s->vm_select_id, offset);
+            break;
+    }
+    return val;
+}
+
+uint64_t keystone_copro_read(void *opaque, hwaddr offset, unsigned size) {
+    uint64_t val = ks_copro_csr_read(KEYSTONE_COPRO(opaque), offset);
+
+    trace_keystone_copro_read(offset, size, val);
+    return val;
+}
+
+void keystone_copro_write(void *opaque, hwaddr offset, uint64_t val, unsigned size) {
+    KeystoneCoproState *s = KEYSTONE_COPRO(opaque);
+    uint32_t value = val; // Assuming 32-bit writes
+    unsigned vm_id;
+
+    trace_keystone_copro_write(offset, size, value);
+
+    if (ks_vm_page_decode(s, offset, &vm_id)) {
+        ks_vm_page_write(s, vm_id, offset % KS_VM_PAGE_SIZE, value);
+        return;
+    }
+    if (offset >= ADDR_VM_PAGE_BASE) {
+        if (offset >= ADDR_PERF_CTRL_REG && offset < KS_PERF_BLOCK_END) {
+            ks_perf_write(s, offset, value);
+        } else if (offset >= ADDR_VM_CONFIG_REG && offset < KS_VM_IRQ_BLOCK_END) {
+            ks_vm_irq_write(s, offset, value);
+        } else if (offset >= ADDR_MAP_SELECT_REG && offset < KS_MAP_BLOCK_END) {
+            ks_map_csr_write(s, offset, value);
+        } else if (offset >= ADDR_DMA_CHAN_CONFIG_REG && offset < KS_DMA_CHAN_BLOCK_END) {
+            ks_dma_chan_csr_write(s, offset, value);
+        } else {
+            KS_COPRO_LOG("Write to undefined CSR offset 0x%03lx, value 0x%08x", offset, value);
+        }
+        return;
+    }
+
+    switch (offset) {
+        case ADDR_COPRO_CMD_REG:
+            ks_copro_run_cmd(s, s->vm_select_id, value,
+                             ((uint64_t)s->prog_addr_high_reg << 32) | s->prog_addr_low_reg,
+                             ((uint64_t)s->data_in_addr_high_reg << 32) | s->data_in_addr_low_reg,
+                             s->data_len_reg,
+                             ((uint64_t)s->data_out_addr_high_reg << 32) | s->data_out_addr_low_reg,
+                             s->data_out_len_reg);
+            // Command bits are SC; other bits in command_reg remain until changed.
+            s->copro_cmd_reg = value & ~KS_CMD_SC_MASK;
+            break;
+        case ADDR_VM_SELECT_REG:
+            if ((value & KS_VM_SELECT_MASK) >= s->num_slots) {
+                KS_COPRO_LOG("VM_SELECT: no VM %u in %u slots", value & KS_VM_SELECT_MASK, s->num_slots);
+                break;
+            }
+            s->vm_select_id = value & KS_VM_SELECT_MASK;
+            break;
+        // COPRO_STATUS_REG is Read-Only
+        case ADDR_PROG_ADDR_LOW_REG:
+            s->prog_addr_low_reg = value;
+            break;
+        case ADDR_PROG_ADDR_HIGH_REG:
+            s->prog_addr_high_reg = value;
+            break;
+        case ADDR_DATA_IN_ADDR_LOW_REG:
+            s->data_in_addr_low_reg = value;
+            break;
+        case ADDR_DATA_IN_ADDR_HIGH_REG:
+            s->data_in_addr_high_reg = value;
+            break;
+        case ADDR_DATA_OUT_ADDR_LOW_REG:
+            s->data_out_addr_low_reg = value;
+            break;
+        case ADDR_DATA_OUT_ADDR_HIGH_REG:
+            s->data_out_addr_high_reg = value;
+            break;
+        case ADDR_DATA_LEN_REG:
+            s->data_len_reg = value;
+            break;
+        case ADDR_DATA_OUT_LEN_REG:
+            s->data_out_len_reg = value;
+            break;
+        case ADDR_INT_STATUS_REG:
+            // W1C (Write-1-to-Clear) behavior; [15:0] clear slots 0-7 in the VM interrupt block
+            s->int_status_reg &= ~value;
+            s->vm_done_status &= ~(uint64_t)(value & IRQ_VM_DONE_MASK);
+            s->vm_error_status &= ~(uint64_t)((value & IRQ_VM_ERROR_MASK) >> IRQ_VM_ERROR_SHIFT);
+            ks_copro_update_irq(s);
+            break;
+        case ADDR_INT_ENABLE_REG:
+            s->int_enable_reg = value & IRQ_ALL_MASK & ~(IRQ_VM_DONE_MASK | IRQ_VM_ERROR_MASK);
+            s->vm_done_enable = (s->vm_done_enable & ~(uint64_t)0xFF) |
+                                (value & IRQ_VM_DONE_MASK & ks_slot_mask(s));
+            s->vm_error_enable = (s->vm_error_enable & ~(uint64_t)0xFF) |
+                                 ((value & IRQ_VM_ERROR_MASK) >> IRQ_VM_ERROR_SHIFT & ks_slot_mask(s));
+            ks_copro_update_irq(s);
+            break;
+        case ADDR_DMA_RING_BASE_LOW_REG:
+        case ADDR_DMA_RING_BASE_HIGH_REG:
+        case ADDR_DMA_RING_SIZE_REG:
+            ks_dma_ring_setup_write(s, offset, value);
+            break;
+        case ADDR_DMA_RING_TAIL_REG: // Doorbell
+            if (value >= s->dma_ring_size) { // Also rejects any doorbell while the ring is disabled
+                KS_COPRO_LOG("DMA ring: tail %u out of range for %u entries", value, s->dma_ring_size);
+                break;
+            }
+            s->dma_ring_tail = value;
+            ks_dma_kick(s);
+            break;
+        case ADDR_SQ_BASE_LOW_REG:
+        case ADDR_SQ_BASE_HIGH_REG:
+        case ADDR_CQ_BASE_LOW_REG:
+        case ADDR_CQ_BASE_HIGH_REG:
+        case ADDR_QUEUE_SIZE_REG:
+            ks_queue_setup_write(s, offset, value);
+            break;
+        case ADDR_SQ_TAIL_REG: // Doorbell
+        case ADDR_CQ_HEAD_REG: // Completions consumed, which may let held-back submissions go
+            if (value >= s->queue_size) {
+                KS_COPRO_LOG("Queue index %u at 0x%02lx out of range for %u entries", value, offset, s->queue_size);
+                break;
+            }
+            if (offset == ADDR_SQ_TAIL_REG) {
+                s->sq_tail = value;
+            } else {
+                s->cq_head = value;
+            }
+            ks_dma_kick(s);
+            break;
+        // New limits apply from the next event; a class already past them fires now
+        case ADDR_IRQ_MOD_VM_DONE_REG:
+        case ADDR_IRQ_MOD_VM_ERROR_REG:
+        case ADDR_IRQ_MOD_DMA_REG:
+            s->irq_mod_reg[(offset - ADDR_IRQ_MOD_VM_DONE_REG) / 4] = value;
+            ks_copro_update_irq(s);
+            break;
+        case ADDR_IRQ_MOD_CTRL_REG:
+            s->irq_mod_ctrl = value & KS_IRQ_MOD_CTRL_ERR_BYPASS;
+            ks_copro_update_irq(s);
+            break;
+        case ADDR_PROG_CACHE_STATUS_REG:
+            if (value & KS_PROG_CACHE_CTRL_FLUSH) {
+                ks_prog_cache_flush(s);
+            }
+            if (value & KS_PROG_CACHE_CTRL_CLEAR_STATS) {
+                s->prog_cache_hits = 0;
+                s->prog_cache_misses = 0;
+            }
+            break;
+        // SELECTED_VM_* registers, DMA_RING_HEAD_REG, SQ_HEAD_REG, CQ_TAIL_REG and the cache counters are Read-Only by CPU
+        case ADDR_COPRO_VERSION_REG: // Read-Only
+            break; 
+        default:
+            // Mailboxes of the selected VM
+            ks_copro_vm_reg_write(s, s->vm_select_id, offset, value);
+            break;
+    }
+}
+
+/*
+ * Whether a moderation class has pending, enabled events: VMi_DONE of any
+ * slot, CQ and MBOX, VMi_ERROR of any slot, or the DMA bits. *error is set if an
+ * error is among them.
+ */
+static bool ks_irq_class_pending(KeystoneCoproState *s, int c, bool *error) {
+    uint32_t pending = s->int_status_reg & s->int_enable_reg;
+
+    switch (c) {
+        case KS_IRQ_CLASS_VM_DONE:
+            *error = false;
+            return (s->vm_done_status & s->vm_done_enable) || (pending & IRQ_CQ) ||
+                   ((s->int_enable_reg & IRQ_MBOX) && s->mbox_pending);
+        case KS_IRQ_CLASS_VM_ERROR:
+            *error = true;
+            return s->vm_error_status & s->vm_error_enable;
+        default:
+            *error = pending & IRQ_DMA_ERROR;
+            return pending & (IRQ_DMA_DONE | IRQ_DMA_ERROR);
+    }
+}
+
+// Count one event against a moderation class, arming its timeout on the first
+static void ks_irq_mod_event(KeystoneCoproState *s, int c) {
+    uint32_t timeout_us = s->irq_mod_reg[c] >> KS_IRQ_MOD_TIMEOUT_SHIFT;
+
+    if (s->irq_mod_count[c]++ == 0 && timeout_us) {
+        s->irq_mod_deadline[c] = qemu_clock_get_ns(QEMU_CLOCK_VIRTUAL) + (int64_t)timeout_us * SCALE_US;
+    }
+}
+
+/*
+ * Drive the lines from the pending, enabled INT_STATUS bits through the
+ * moderation classes. Bits that became pending without an event (INT_ENABLE
+ * set over them) count as one.
+ */
+static void ks_copro_update_irq(KeystoneCoproState *s) {
+    int64_t now = qemu_clock_get_ns(QEMU_CLOCK_VIRTUAL);
+    int64_t next = INT64_MAX;
+    bool irq_level = false;
+    uint64_t vm_irq_levels = 0;
+
+    for (int c = 0; c < KS_IRQ_NUM_CLASSES; c++) {
+        bool error;
+
+        if (!ks_irq_class_pending(s, c, &error)) {
+            s->irq_mod_count[c] = 0;
+            s->irq_mod_deadline[c] = 0;
+            s->irq_mod_fired[c] = false;
+            continue;
+        }
+        if (s->irq_mod_count[c] == 0) {
+            ks_irq_mod_event(s, c);
+        }
+        if (s->irq_mod_count[c] >= MAX(s->irq_mod_reg[c] & KS_IRQ_MOD_COUNT_MASK, 1)) {
+            s->irq_mod_fired[c] = true;
+        }
+        if ((s->irq_mod_ctrl & KS_IRQ_MOD_CTRL_ERR_BYPASS) && error) {
+            s->irq_mod_fired[c] = true;
+        }
+        if (s->irq_mod_deadline[c] && now >= s->irq_mod_deadline[c]) {
+            s->irq_mod_fired[c] = true;
+        }
+        if (s->irq_mod_fired[c]) {
+            irq_level = true;
+        } else if (s->irq_mod_deadline[c]) {
+            next = MIN(next, s->irq_mod_deadline[c]);
+        }
+    }
+    if (next != INT64_MAX) {
+        timer_mod(&s->irq_mod_timer, next);
+    } else {
+        timer_del(&s->irq_mod_timer);
+    }
+    // Steer the fired VM events to their slot's line; the unnamed one keeps the rest
+    if (s->vm_irq_lines) {
+        uint64_t vm_pending = 0;
+
+        if (s->irq_mod_fired[KS_IRQ_CLASS_VM_DONE]) {
+            vm_pending |= s->vm_done_status & s->vm_done_enable;
+            if (s->int_enable_reg & IRQ_MBOX) {
+                vm_pending |= s->mbox_pending;
+            }
+        }
+        if (s->irq_mod_fired[KS_IRQ_CLASS_VM_ERROR]) {
+            vm_pending |= s->vm_error_status & s->vm_error_enable;
+        }
+        for (uint64_t m = vm_pending; m; m &= m - 1) {
+            vm_irq_levels |= 1ULL << (ctz64(m) % s->vm_irq_lines);
+        }
+        irq_level = s->irq_mod_fired[KS_IRQ_CLASS_DMA] ||
+                    (s->irq_mod_fired[KS_IRQ_CLASS_VM_DONE] && (s->int_status_reg & s->int_enable_reg & IRQ_CQ));
+    }
+    if (irq_level && !s->irq_level) {
+        s->perf.irq_asserts++;
+    }
+    s->perf.irq_asserts += ctpop64(vm_irq_levels & ~s->vm_irq_levels);
+    for (uint64_t m = vm_irq_levels ^ s->vm_irq_levels; m; m &= m - 1) {
+        int g = ctz64(m);
+
+        trace_keystone_copro_vm_irq(g, (vm_irq_levels >> g) & 1);
+        qemu_set_irq(s->vm_irq[g], (vm_irq_levels >> g) & 1);
+    }
+    s->vm_irq_levels = vm_irq_levels;
+    s->irq_level = irq_level;
+    trace_keystone_copro_irq(ks_int_status(s), ks_int_enable(s), irq_level);
+    qemu_set_irq(s->irq, irq_level);
+}
+
+/*
+ * Latch global INT_STATUS bits and the VMi_DONE / VMi_ERROR bits of the
+ * slots in done / error, for one event of each class they belong to
+ */
+static void ks_copro_raise(KeystoneCoproState *s, uint32_t bits, uint64_t done, uint64_t error) {
+    uint32_t enabled = bits & s->int_enable_reg;
+
+    s->perf.irq_events += ctpop32(bits & ~s->int_status_reg) + ctpop64(done & ~s->vm_done_status) +
+                          ctpop64(error & ~s->vm_error_status);
+    s->int_status_reg |= bits;
+    s->vm_done_status |= done;
+    s->vm_error_status |= error;
+    if ((done & s->vm_done_enable) || (enabled & IRQ_CQ)) {
+        ks_irq_mod_event(s, KS_IRQ_CLASS_VM_DONE);
+    }
+    if (error & s->vm_error_enable) {
+        ks_irq_mod_event(s, KS_IRQ_CLASS_VM_ERROR);
+    }
+    if (enabled & (IRQ_DMA_DONE | IRQ_DMA_ERROR)) {
+        ks_irq_mod_event(s, KS_IRQ_CLASS_DMA);
+    }
+    ks_copro_update_irq(s);
+    ks_vm_wait_wake(s, done | error);
+}
+
+static void ks_copro_raise_irq(KeystoneCoproState *s, uint32_t bits) {
+    ks_copro_raise(s, bits, 0, 0);
+}
+
+static void ks_copro_raise_vm_irq(KeystoneCoproState *s, unsigned vm_id, bool error) {
+    ks_copro_raise(s, 0, error ? 0 : 1ULL << vm_id, error ? 1ULL << vm_id : 0);
+}
+
+static void ks_irq_mod_timer_cb(void *opaque) {
+    ks_copro_update_irq(KEYSTONE_COPRO(opaque));
+}
+
+/*
+ * Copy len bytes of guest memory at addr straight into slot memory.
+ * Guest RAM is mapped through the device AddressSpace and copied in place,
+ * so no intermediate heap buffer is involved. A mapping can come back
+ * shorter than requested (e.g. at a RAM block boundary), hence the loop.
+ */
+static bool ks_dma_read_to_slot(KeystoneCoproState *s, uint64_t addr, uint8_t *dst, uint32_t len) {
+    while (len > 0) {
+        dma_addr_t xfer = len;
+        void *src = dma_memory_map(&s->dma_as, addr, &xfer, DMA_DIRECTION_TO_DEVICE,
+                                   MEMTXATTRS_UNSPECIFIED);
+        if (!src) {
+            // Not directly mappable (e.g. MMIO source): let the memory API do the access.
+            return dma_memory_read(&s->dma_as, addr, dst, len, MEMTXATTRS_UNSPECIFIED) == MEMTX_OK;
+        }
+        memcpy(dst, src, xfer);
+        dma_memory_unmap(&s->dma_as, src, xfer, DMA_DIRECTION_TO_DEVICE, xfer);
+        addr += xfer;
+        dst += xfer;
+        len -= xfer;
+    }
+    return true;
+}
+
+// Counterpart of ks_dma_read_to_slot: copy slot memory out to guest memory at addr
+static bool ks_dma_write_from_slot(KeystoneCoproState *s, uint64_t addr, const uint8_t *src, uint32_t len) {
+    while (len > 0) {
+        dma_addr_t xfer = len;
+        void *dst = dma_memory_map(&s->dma_as, addr, &xfer, DMA_DIRECTION_FROM_DEVICE,
+                                   MEMTXATTRS_UNSPECIFIED);
+        if (!dst) {
+            return dma_memory_write(&s->dma_as, addr, src, len, MEMTXATTRS_UNSPECIFIED) == MEMTX_OK;
+        }
+        memcpy(dst, src, xfer);
+        dma_memory_unmap(&s->dma_as, dst, xfer, DMA_DIRECTION_FROM_DEVICE, xfer);
+        addr += xfer;
+        src += xfer;
+        len -= xfer;
+    }
+    return true;
+}
+
+// Program cache key; whole instructions only, the length is mixed in
+static uint64_t ks_prog_hash(const uint8_t *code, uint32_t len) {
+    uint64_t h = 0xcbf29ce484222325ULL ^ len;
+
+    for (uint32_t i = 0; i < len; i += KS_VM_INSN_SIZE) {
+        h = (h ^ ldq_le_p(code + i)) * 0x100000001b3ULL;
+        h ^= h >> 29;
+    }
+    return h;
+}
+
+static void ks_prog_entry_free(KsProgCacheEntry *e) {
+    ks_ebpf_jit_free(e->jit);
+    ks_ebpf_prog_free(e->prog);
+    g_free(e->code);
+    g_free(e);
+}
+
+// A slot lets go of its program
+static void ks_prog_entry_put(KsProgCacheEntry *e) {
+    if (e && --e->refs == 0 && !e->cached) {
+        ks_prog_entry_free(e);
+    }
+}
+
+static void ks_prog_cache_remove(KeystoneCoproState *s, uint32_t idx) {
+    KsProgCacheEntry *e = s->prog_cache[idx];
+
+    s->prog_cache[idx] = NULL;
+    s->prog_cache_used--;
+    e->cached = false;
+    if (!e->refs) {
+        ks_prog_entry_free(e);
+    }
+}
+
+// Handles already given out stop resolving; programs in slots stay loaded
+static void ks_prog_cache_flush(KeystoneCoproState *s) {
+    for (uint32_t i = 0; i < s->prog_cache_size; i++) {
+        if (s->prog_cache[i]) {
+            ks_prog_cache_remove(s, i);
+        }
+    }
+}
+
+// Decode, verify and (in exec-mode=jit) compile len bytes of program code
+static KsProgCacheEntry *ks_prog_entry_new(KeystoneCoproState *s, const uint8_t *code, uint32_t len,
+                                           uint64_t hash) {
+    KsProgCacheEntry *e = g_new0(KsProgCacheEntry, 1);
+
+    e->hash = hash;
+    e->code = g_memdup2(code, len);
+    e->len = len;
+    e->prog = ks_ebpf_prog_new(e->code, len);
+    if (ks_ebpf_verify(e->prog, KS_VM_DATA_MEM_SIZE) != KS_VM_ERR_NONE) {
+        KS_COPRO_LOG("Program rejected by the verifier at instruction %u", e->prog->verify_pc);
+    } else if (s->use_jit) {
+        e->jit = ks_ebpf_jit_compile(e->prog);
+        if (!e->jit) {
+            KS_COPRO_LOG("JIT unavailable, using the interpreter");
+        }
+    }
+    return e;
+}
+
+/*
+ * Return the prepared form of len bytes of program code with a slot
+ * reference taken: the cached entry on a hit, otherwise a freshly decoded,
+ * verified (and compiled) one, which is cached in a free or evicted slot.
+ * Rejected programs are cached too, so reloading them fails just as fast.
+ */
+static KsProgCacheEntry *ks_prog_cache_get(KeystoneCoproState *s, const uint8_t *code, uint32_t len) {
+    uint64_t hash = ks_prog_hash(code, len);
+    int64_t free_idx = -1, victim = -1;
+    KsProgCacheEntry *e;
+
+    for (uint32_t i = 0; i < s->prog_cache_size; i++) {
+        e = s->prog_cache[i];
+        if (!e) {
+            if (free_idx < 0) {
+                free_idx = i;
+            }
+            continue;
+        }
+        if (e->hash == hash && e->len == len && !memcmp(e->code, code, len)) {
+            s->prog_cache_hits++;
+            e->last_use = ++s->prog_cache_clock;
+            e->refs++;
+            return e;
+        }
+        // Least recently used, among unreferenced entries if there are any
+        if (victim < 0 || (!e->refs && s->prog_cache[victim]->refs) ||
+            (!e->refs == !s->prog_cache[victim]->refs && e->last_use < s->prog_cache[victim]->last_use)) {
+            victim = i;
+        }
+    }
+
+    e = ks_prog_entry_new(s, code, len, hash);
+    e->refs = 1;
+    if (!s->prog_cache_size) {
+        return e;
+    }
+
+    s->prog_cache_misses++;
+    if (free_idx < 0) {
+        free_idx = victim;
+        ks_prog_cache_remove(s, victim);
+    }
+    if (++s->prog_cache_next_handle == 0) { // 0 means no handle
+        s->prog_cache_next_handle = 1;
+    }
+    e->handle = s->prog_cache_next_handle;
+    e->cached = true;
+    e->last_use = ++s->prog_cache_clock;
+    s->prog_cache[free_idx] = e;
+    s->prog_cache_used++;
+    return e;
+}
+
+/*
+ * Install a program (with its slot reference already taken) whose code is in
+ * prog_mem. A program the verifier rejected stays loaded but puts the slot
+ * in error with KS_VM_ERR_VERIFY, now and on every START_VM.
+ */
+static void ks_copro_vm_set_prog(KeystoneCoproState *s, unsigned vm_id, KsProgCacheEntry *e) {
+    KeystoneVMContext *vm = &s->vm_contexts[vm_id];
+
+    // Window stores up to now are in the code just prepared, or overwritten by it
+    ks_vm_mem_sync(s, vm_id);
+    vm->prog_stale = false;
+    vm->prog_entry = e;
+    vm->prog = e->prog;
+    vm->jit = e->jit;
+    vm->prog_len = e->len;
+    vm->has_program = true;
+    if (e->prog->verify_err) {
+        vm->done = false;
+        vm->error_state = true;
+        vm->error_code = KS_VM_ERR_VERIFY;
+        vm->pc = e->prog->verify_pc;
+        ks_copro_raise_vm_irq(s, vm_id, true);
+    }
+}
+
+/*
+ * len bytes have landed in slot memory (or, for a program, 0 to unload it
+ * after an empty or failed transfer). A program is prepared once here, or
+ * taken from the program cache, so START_VM runs straight from the result.
+ */
+static void ks_copro_vm_loaded(KeystoneCoproState *s, unsigned vm_id, bool is_prog, uint32_t len) {
+    KeystoneVMContext *vm = &s->vm_contexts[vm_id];
+
+    if (!is_prog) {
+        if (ks_vm_data_pingpong(vm)) {
+            vm->data_fill_len = len; // Swapped in at the next START
+            vm->data_ready = true;
+        } else {
+            vm->data_len = len;
+        }
+        return;
+    }
+    ks_copro_vm_drop_prog(vm);
+    vm->prog_len = 0;
+    vm->has_program = false;
+    if (len == 0) {
+        return;
+    }
+    ks_copro_vm_set_prog(s, vm_id, ks_prog_cache_get(s, vm->prog_mem, len));
+    KS_COPRO_LOG("VM %u program memory loaded (%u instructions, handle %u).", vm_id, len / KS_VM_INSN_SIZE,
+                 vm->prog_entry->handle);
+}
+
+// Bus time of len bytes: per burst of up to dma-burst-len beats, the setup
+// latency, then one beat per cycle
+static int64_t ks_dma_time_ns(KeystoneCoproState *s, uint64_t len) {
+    uint64_t beats = DIV_ROUND_UP(len * 8, s->dma_bus_width);
+    uint64_t bursts = DIV_ROUND_UP(beats, s->dma_burst_len);
+
+    if (s->dma_zero_latency) {
+        return 0;
+    }
+    return bursts * s->dma_setup_ns + beats * 1000 / s->dma_clock_mhz;
+}
+
+// Arm ch's timer for its next step: ns of bus time on the AXI master, after
+// whatever the other channels already asked it to move
+static void ks_dma_schedule(KeystoneCoproState *s, KsDmaChannel *ch, int64_t ns) {
+    int64_t now = qemu_clock_get_ns(QEMU_CLOCK_VIRTUAL);
+    int64_t end = MAX(now, s->dma_bus_free_at) + ns;
+
+    s->dma_bus_free_at = end;
+    s->perf.dma_busy_ns += ns;
+    s->perf.dma_chan_busy_ns[ch->id] += end - now;
+    timer_mod(&ch->timer, end);
+}
+
+// Start an empty transfer between guest memory and one of vm_id's memories
+static void ks_dma_begin(KsDmaChannel *ch, unsigned vm_id, bool is_prog, bool is_out) {
+    ch->target_vm_id = vm_id;
+    ch->is_prog_load = is_prog;
+    ch->is_out = is_out;
+    ch->seg_count = 0;
+    ch->seg_idx = 0;
+    ch->seg_off = 0;
+    ch->moved = 0;
+}
+
+static void ks_dma_add_seg(KsDmaChannel *ch, uint64_t addr, uint32_t len) {
+    ch->seg_addr[ch->seg_count] = addr;
+    ch->seg_len[ch->seg_count] = len;
+    ch->seg_count++;
+}
+
+// Bytes the next step moves: the rest of the segment, at most one full
+// burst. 0 once every segment is done.
+static uint32_t ks_dma_next_chunk(KeystoneCoproState *s, KsDmaChannel *ch) {
+    uint32_t burst = s->dma_zero_latency ? UINT32_MAX : s->dma_bus_width / 8 * s->dma_burst_len;
+
+    while (ch->seg_idx < ch->seg_count && ch->seg_off == ch->seg_len[ch->seg_idx]) {
+        ch->seg_idx++;
+        ch->seg_off = 0;
+    }
+    if (ch->seg_idx == ch->seg_count) {
+        return 0;
+    }
+    return MIN(ch->seg_len[ch->seg_idx] - ch->seg_off, burst);
+}
+
+// Whether a channel is moving data for vm_id
+static bool ks_dma_slot_held(KeystoneCoproState *s, unsigned vm_id) {
+    for (uint32_t c = 0; c < s->dma_channels; c++) {
+        KsDmaChannel *ch = &s->dma_chan[c];
+
+        if (ch->active && ch->fetched && ch->target_vm_id == vm_id) {
+            return true;
+        }
+    }
+    return false;
+}
+
+// Whether a channel is on the SQ, or else on the descriptor ring
+static bool ks_dma_serving(KeystoneCoproState *s, bool sq) {
+    for (uint32_t c = 0; c < s->dma_channels; c++) {
+        KsDmaChannel *ch = &s->dma_chan[c];
+
+        if (ch->active && (sq ? ch->for_sq : ch->from_ring)) {
+            return true;
+        }
+    }
+    return false;
+}
+
+// CHAN_BUSY_REG: bit c set while channel c has a transfer
+static uint32_t ks_dma_busy_mask(KeystoneCoproState *s) {
+    uint32_t mask = 0;
+
+    for (uint32_t c = 0; c < s->dma_channels; c++) {
+        mask |= (uint32_t)s->dma_chan[c].active << c;
+    }
+    return mask;
+}
+
+/*
+ * Move the next chunk of the transfer. Returns a KS_DMA_DESC_* status; a
+ * slot started since the transfer began has its memories in use, so they
+ * are left alone from then on.
+ */
+static uint32_t ks_dma_step(KeystoneCoproState *s, KsDmaChannel *ch) {
+    KeystoneVMContext *vm = &s->vm_contexts[ch->target_vm_id];
+    bool fill = !ch->is_prog_load && !ch->is_out;
+    uint8_t *mem = (ch->is_prog_load ? vm->prog_mem : fill ? ks_vm_data_fill_buf(vm) : vm->data_mem) +
+                   ch->moved;
+    uint32_t n = ks_dma_next_chunk(s, ch);
+    uint64_t addr = ch->seg_addr[ch->seg_idx] + ch->seg_off;
+    bool ok;
+
+    if (vm->running && !(fill && ks_vm_data_pingpong(vm))) {
+        KS_COPRO_LOG("DMA: VM %u was started during the transfer", ch->target_vm_id);
+        return KS_DMA_DESC_ERR_BUSY;
+    }
+    if (fill && ch->moved == 0) {
+        vm->data_ready = false; // Being overwritten: a START now must not swap to it
+    }
+    ok = ch->is_out ? ks_dma_write_from_slot(s, addr, mem, n) : ks_dma_read_to_slot(s, addr, mem, n);
+    if (!ok) {
+        KS_COPRO_LOG("DMA: bus error on %u bytes at 0x%" PRIx64 " for VM %u", n, addr, ch->target_vm_id);
+        return KS_DMA_DESC_ERR_BUS;
+    }
+    if (!ch->is_out) {
+        ks_vm_mem_dirty(s, ch->target_vm_id, ch->is_prog_load);
+    }
+    ch->seg_off += n;
+    ch->moved += n;
+    s->perf.dma_bytes += n;
+    s->vm_perf[ch->target_vm_id].dma_bytes += n;
+    return KS_DMA_DESC_OK;
+}
+
+static uint64_t ks_dma_ring_desc_addr(KeystoneCoproState *s) {
+    uint64_t base = ((uint64_t)s->dma_ring_base_high_reg << 32) | s->dma_ring_base_low_reg;
+
+    return base + (uint64_t)s->dma_ring_head * sizeof(KsDmaDesc);
+}
+
+/*
+ * Read the descriptor at the ring head and its scatter-gather list, and
+ * check them all before slot memory is touched. Returns a KS_DMA_DESC_*
+ * status, with the segments set up on KS_DMA_DESC_OK. *write_back is
+ * cleared if the descriptor itself could not be read.
+ */
+static uint32_t ks_dma_ring_fetch(KeystoneCoproState *s, KsDmaChannel *ch, bool *write_back) {
+    uint64_t desc_addr = ks_dma_ring_desc_addr(s);
+    KsDmaSgEntry sg[KS_DMA_MAX_SG];
+    KsDmaDesc desc;
+    unsigned sg_count;
+    uint64_t sg_addr;
+    bool is_prog;
+    uint32_t mem_size, total = 0;
+
+    if (dma_memory_read(&s->dma_as, desc_addr, &desc, sizeof(desc), MEMTXATTRS_UNSPECIFIED) != MEMTX_OK) {
+        KS_COPRO_LOG("DMA ring: bus error reading descriptor %u at 0x%" PRIx64, s->dma_ring_head, desc_addr);
+        *write_back = false;
+        return KS_DMA_DESC_ERR_BUS;
+    }
+    sg_count = le16_to_cpu(desc.sg_count);
+    sg_addr = le64_to_cpu(desc.sg_addr);
+    is_prog = desc.op == KS_DMA_OP_PROG;
+    if (desc.vm_id >= s->num_slots || desc.op < KS_DMA_OP_PROG || desc.op > KS_DMA_OP_DATA_OUT ||
+        sg_count > KS_DMA_MAX_SG) {
+        KS_COPRO_LOG("DMA ring: bad descriptor (VM %u, op %u, %u SG entries)", desc.vm_id, desc.op, sg_count);
+        return KS_DMA_DESC_ERR_DESC;
+    }
+    if (s->vm_contexts[desc.vm_id].running &&
+        !(desc.op == KS_DMA_OP_DATA_IN && ks_vm_data_pingpong(&s->vm_contexts[desc.vm_id]))) {
+        KS_COPRO_LOG("DMA ring: VM %u is running", desc.vm_id);
+        return KS_DMA_DESC_ERR_BUSY;
+    }
+    if (ks_dma_slot_held(s, desc.vm_id)) {
+        KS_COPRO_LOG("DMA ring: VM %u is being loaded by another channel", desc.vm_id);
+        return KS_DMA_DESC_ERR_BUSY;
+    }
+    mem_size = is_prog ? KS_VM_PROG_MEM_SIZE : KS_VM_DATA_MEM_SIZE;
+
+    if (sg_count && dma_memory_read(&s->dma_as, sg_addr, sg, sg_count * sizeof(sg[0]),
+                                    MEMTXATTRS_UNSPECIFIED) != MEMTX_OK) {
+        KS_COPRO_LOG("DMA ring: bus error reading SG list at 0x%" PRIx64, sg_addr);
+        return KS_DMA_DESC_ERR_BUS;
+    }
+    for (unsigned i = 0; i < sg_count; i++) {
+        uint32_t seg = le32_to_cpu(sg[i].len);
+
+        if (seg > mem_size - total) {
+            KS_COPRO_LOG("DMA ring: SG list exceeds %u byte slot memory of VM %u", mem_size, desc.vm_id);
+            return KS_DMA_DESC_ERR_DESC;
+        }
+        total += seg;
+    }
+    if (is_prog && (total % KS_VM_INSN_SIZE) != 0) {
+        KS_COPRO_LOG("DMA ring: program length %u for VM %u is not a multiple of %u",
+                     total, desc.vm_id, KS_VM_INSN_SIZE);
+        return KS_DMA_DESC_ERR_DESC;
+    }
+
+    ks_dma_begin(ch, desc.vm_id, is_prog, desc.op == KS_DMA_OP_DATA_OUT);
+    for (unsigned i = 0; i < sg_count; i++) {
+        ks_dma_add_seg(ch, le64_to_cpu(sg[i].addr), le32_to_cpu(sg[i].len));
+    }
+    return KS_DMA_DESC_OK;
+}
+
+// The descriptor at the ring head is finished: write len/status back and advance HEAD
+static void ks_dma_ring_done(KeystoneCoproState *s, KsDmaChannel *ch, uint32_t status, bool write_back) {
+    uint64_t desc_addr = ks_dma_ring_desc_addr(s);
+
+    if (write_back) {
+        // len lands before status, so a driver that sees the status also sees the length
+        uint32_t len = cpu_to_le32(ch->moved);
+        uint32_t st = cpu_to_le32(status);
+
+        dma_memory_write(&s->dma_as, desc_addr + offsetof(KsDmaDesc, len), &len, sizeof(len),
+                         MEMTXATTRS_UNSPECIFIED);
+        dma_memory_write(&s->dma_as, desc_addr + offsetof(KsDmaDesc, status), &st, sizeof(st),
+                         MEMTXATTRS_UNSPECIFIED);
+    }
+    if (status == KS_DMA_DESC_OK && !ch->is_out) {
+        ks_copro_vm_loaded(s, ch->target_vm_id, ch->is_prog_load, ch->moved);
+    }
+
+    s->dma_ring_head = (s->dma_ring_head + 1) & (s->dma_ring_size - 1);
+    if (status != KS_DMA_DESC_OK) {
+        ks_copro_raise_irq(s, IRQ_DMA_ERROR);
+    }
+    if (s->dma_ring_head == s->dma_ring_tail) {
+        ks_copro_raise_irq(s, IRQ_DMA_DONE); // Once per drained batch, not per descriptor
+    }
+}
+
+// Give ch the next ring descriptor, if there is one and no other channel is on the ring
+static bool ks_dma_grant_ring(KeystoneCoproState *s, KsDmaChannel *ch) {
+    if (s->dma_ring_head == s->dma_ring_tail || ks_dma_serving(s, false)) {
+        return false;
+    }
+    ch->active = true;
+    ch->from_ring = true;
+    ch->fetched = false;
+    ks_dma_begin(ch, 0, false, false);
+    ks_dma_schedule(s, ch, ks_dma_time_ns(s, sizeof(KsDmaDesc)));
+    return true;
+}
+
+// Ring geometry can only change while no descriptors are outstanding
+static void ks_dma_ring_setup_write(KeystoneCoproState *s, hwaddr offset, uint32_t value) {
+    if (s->dma_ring_head != s->dma_ring_tail) {
+        KS_COPRO_LOG("DMA ring busy (head %u, tail %u), write to 0x%02lx ignored",
+                     s->dma_ring_head, s->dma_ring_tail, offset);
+        return;
+    }
+    switch (offset) {
+        case ADDR_DMA_RING_BASE_LOW_REG:
+            s->dma_ring_base_low_reg = value;
+            break;
+        case ADDR_DMA_RING_BASE_HIGH_REG:
+            s->dma_ring_base_high_reg = value;
+            break;
+        case ADDR_DMA_RING_SIZE_REG:
+            if (value != 0 && (value > KS_DMA_RING_MAX_ENTRIES || !is_power_of_2(value))) {
+                KS_COPRO_LOG("DMA ring: invalid size %u (power of two up to %u, or 0)",
+                             value, KS_DMA_RING_MAX_ENTRIES);
+                return;
+            }
+            s->dma_ring_size = value;
+            s->dma_ring_head = 0;
+            s->dma_ring_tail = 0;
+            break;
+    }
+}
+
+// Free CQ entries not yet promised to a dispatched submission
+static uint32_t ks_cq_room(KeystoneCoproState *s) {
+    uint32_t used = (s->cq_tail - s->cq_head) & (s->queue_size - 1);
+
+    return s->queue_size - 1 - used - s->sq_inflight;
+}
+
+static void ks_cq_post(KeystoneCoproState *s, uint64_t cookie, uint8_t status, uint64_t retval, uint32_t out_len) {
+    uint64_t base = ((uint64_t)s->cq_base_high_reg << 32) | s->cq_base_low_reg;
+    uint64_t addr = base + (uint64_t)s->cq_tail * sizeof(KsCqEntry);
+    KsCqEntry cqe = {
+        .cookie = cpu_to_le64(cookie),
+        .retval = cpu_to_le32(retval),
+        .out_len = cpu_to_le16(out_len),
+        .status = status,
+        .flags = s->cq_phase,
+    };
+
+    // The phase bit goes last, so a driver polling it sees a complete entry
+    if (dma_memory_write(&s->dma_as, addr, &cqe, offsetof(KsCqEntry, flags), MEMTXATTRS_UNSPECIFIED) != MEMTX_OK ||
+        dma_memory_write(&s->dma_as, addr + offsetof(KsCqEntry, flags), &cqe.flags, sizeof(cqe.flags),
+                         MEMTXATTRS_UNSPECIFIED) != MEMTX_OK) {
+        KS_COPRO_LOG("CQ: bus error writing entry %u at 0x%" PRIx64, s->cq_tail, addr);
+    }
+    s->cq_tail = (s->cq_tail + 1) & (s->queue_size - 1);
+    if (s->cq_tail == 0) {
+        s->cq_phase ^= KS_CQ_FLAG_PHASE;
+    }
+    ks_copro_raise_irq(s, IRQ_CQ);
+}
+
+/*
+ * Give ch the input of the entry at the SQ head. Entries are taken in
+ * order, by one channel at a time: one whose slot is still busy holds back
+ * the rest, and nothing is taken unless its completion is sure to fit in
+ * the CQ.
+ */
+static bool ks_dma_grant_sq(KeystoneCoproState *s, KsDmaChannel *ch) {
+    uint64_t base = ((uint64_t)s->sq_base_high_reg << 32) | s->sq_base_low_reg;
+    uint8_t vm_id;
+
+    if (s->sq_head == s->sq_tail || ks_cq_room(s) == 0 || ks_dma_serving(s, true)) {
+        return false;
+    }
+    // An unreadable entry is reported when it is fetched
+    if (dma_memory_read(&s->dma_as, base + (uint64_t)s->sq_head * sizeof(KsSqEntry), &vm_id, sizeof(vm_id),
+                        MEMTXATTRS_UNSPECIFIED) == MEMTX_OK &&
+        vm_id < s->num_slots && (s->vm_contexts[vm_id].running || ks_dma_slot_held(s, vm_id))) {
+        return false;
+    }
+    ch->active = true;
+    ch->for_sq = true;
+    ch->fetched = false;
+    ks_dma_schedule(s, ch, ks_dma_time_ns(s, sizeof(KsSqEntry)));
+    return true;
+}
+
+/*
+ * Take the entry at the SQ head and set its input up as ch's transfer.
+ * Returns a KS_DMA_DESC_* status; an entry that cannot run is completed
+ * here.
+ */
+static uint32_t ks_sq_fetch(KeystoneCoproState *s, KsDmaChannel *ch) {
+    uint64_t base = ((uint64_t)s->sq_base_high_reg << 32) | s->sq_base_low_reg;
+    uint64_t addr = base + (uint64_t)s->sq_head * sizeof(KsSqEntry);
+    KsSqEntry sqe;
+    uint64_t cookie;
+    uint16_t in_len, out_len;
+
+    s->sq_head = (s->sq_head + 1) & (s->queue_size - 1);
+
+    if (dma_memory_read(&s->dma_as, addr, &sqe, sizeof(sqe), MEMTXATTRS_UNSPECIFIED) != MEMTX_OK) {
+        KS_COPRO_LOG("SQ: bus error reading entry at 0x%" PRIx64, addr);
+        ks_cq_post(s, 0, KS_SQ_ST_BUS_ERROR, 0, 0);
+        return KS_DMA_DESC_ERR_BUS;
+    }
+    cookie = le64_to_cpu(sqe.cookie);
+    in_len = le16_to_cpu(sqe.in_len);
+    out_len = le16_to_cpu(sqe.out_len);
+    if (sqe.vm_id >= s->num_slots || in_len > KS_VM_DATA_MEM_SIZE || out_len > KS_VM_DATA_MEM_SIZE) {
+        KS_COPRO_LOG("SQ: bad entry (VM %u, in %u, out %u bytes)", sqe.vm_id, in_len, out_len);
+        ks_cq_post(s, cookie, KS_SQ_ST_BAD_ENTRY, 0, 0);
+        return KS_DMA_DESC_ERR_DESC;
+    }
+    if (s->vm_contexts[sqe.vm_id].running || ks_dma_slot_held(s, sqe.vm_id)) {
+        KS_COPRO_LOG("SQ: VM %u was started or given another transfer meanwhile", sqe.vm_id);
+        ks_cq_post(s, cookie, KS_SQ_ST_BUSY, 0, 0);
+        return KS_DMA_DESC_ERR_BUSY;
+    }
+    ks_dma_begin(ch, sqe.vm_id, false, false);
+    ks_dma_add_seg(ch, le64_to_cpu(sqe.in_addr), in_len);
+    ch->sq_cookie = cookie;
+    ch->sq_out_addr = le64_to_cpu(sqe.out_addr);
+    ch->sq_out_len = out_len;
+    return KS_DMA_DESC_OK;
+}
+
+// The entry's input is in data memory: start the slot
+static void ks_sq_load_done(KeystoneCoproState *s, KsDmaChannel *ch, uint32_t status) {
+    unsigned vm_id = ch->target_vm_id;
+    KeystoneVMContext *vm = &s->vm_contexts[vm_id];
+
+    if (status != KS_DMA_DESC_OK) {
+        KS_COPRO_LOG("SQ: failed to load %u bytes for VM %u", ch->seg_len[0], vm_id);
+        ks_cq_post(s, ch->sq_cookie, status == KS_DMA_DESC_ERR_BUSY ? KS_SQ_ST_BUSY : KS_SQ_ST_BUS_ERROR, 0, 0);
+        return;
+    }
+    ks_copro_vm_loaded(s, vm_id, false, ch->moved);
+    vm->sq_owned = true;
+    vm->sq_cookie = ch->sq_cookie;
+    vm->out_addr = ch->sq_out_addr;
+    vm->out_max = ch->sq_out_len;
+    s->sq_inflight++;
+    ks_copro_vm_start(s, vm_id);
+}
+
+// A submission's run is over and its output written back (BQL held): post the completion
+static void ks_sq_complete(KeystoneCoproState *s, unsigned vm_id, uint8_t status, uint64_t retval) {
+    KeystoneVMContext *vm = &s->vm_contexts[vm_id];
+
+    if (status == KS_VM_ERR_DATA_OUT) {
+        status = KS_SQ_ST_BUS_ERROR;
+    }
+    vm->sq_owned = false;
+    s->sq_inflight--;
+    ks_cq_post(s, vm->sq_cookie, status, status == KS_VM_ERR_NONE ? retval : 0, vm->out_len);
+    ks_dma_kick(s); // The slot may be what the next entry waits for
+}
+
+// Queue geometry can only change while both queues are idle
+static void ks_queue_setup_write(KeystoneCoproState *s, hwaddr offset, uint32_t value) {
+    if (s->sq_head != s->sq_tail || s->sq_inflight || ks_dma_serving(s, true)) {
+        KS_COPRO_LOG("Queues busy (SQ head %u, tail %u, %u in flight), write to 0x%02lx ignored",
+                     s->sq_head, s->sq_tail, s->sq_inflight, offset);
+        return;
+    }
+    switch (offset) {
+        case ADDR_SQ_BASE_LOW_REG:
+            s->sq_base_low_reg = value;
+            break;
+        case ADDR_SQ_BASE_HIGH_REG:
+            s->sq_base_high_reg = value;
+            break;
+        case ADDR_CQ_BASE_LOW_REG:
+            s->cq_base_low_reg = value;
+            break;
+        case ADDR_CQ_BASE_HIGH_REG:
+            s->cq_base_high_reg = value;
+            break;
+        case ADDR_QUEUE_SIZE_REG:
+            if (value != 0 && (value > KS_QUEUE_MAX_ENTRIES || !is_power_of_2(value))) {
+                KS_COPRO_LOG("Invalid queue size %u (power of two up to %u, or 0)", value, KS_QUEUE_MAX_ENTRIES);
+                return;
+            }
+            s->queue_size = value;
+            s->sq_head = 0;
+            s->sq_tail = 0;
+            s->cq_head = 0;
+            s->cq_tail = 0;
+            s->cq_phase = KS_CQ_FLAG_PHASE;
+            break;
+    }
+}
+
+/*
+ * Give ch the oldest request in vm_id's DMA queue, unless another channel
+ * is loading the slot. A zero-length request has nothing to move and
+ * completes at once, leaving ch free.
+ */
+static bool ks_dma_grant_slot(KeystoneCoproState *s, KsDmaChannel *ch, unsigned vm_id) {
+    KeystoneVMContext *vm = &s->vm_contexts[vm_id];
+    KsDmaReq req;
+
+    if (!vm->dma_queue_count || ks_dma_slot_held(s, vm_id)) {
+        return false;
+    }
+    req = vm->dma_queue[vm->dma_queue_head];
+    vm->dma_queue_head = (vm->dma_queue_head + 1) % KS_DMA_QUEUE_DEPTH;
+    vm->dma_queue_count--;
+    s->perf.dma_queue_wait_ns += qemu_clock_get_ns(QEMU_CLOCK_VIRTUAL) - req.queued_at;
+
+    KS_COPRO_LOG("DMA channel %u: %s for VM %u, Addr=0x%0lx, Len=%u", ch->id,
+                 req.is_prog ? "LOAD_PROG" : "LOAD_DATA_IN", vm_id, req.addr, req.len);
+    if (req.len == 0) {
+        // As in ks_dma_step: a slot started since the request was queued keeps its memories
+        if (vm->running && !(!req.is_prog && ks_vm_data_pingpong(vm))) {
+            KS_COPRO_LOG("DMA: VM %u was started before its empty %s", vm_id,
+                         req.is_prog ? "LOAD_PROG" : "LOAD_DATA_IN");
+            ks_copro_raise_irq(s, IRQ_DMA_ERROR);
+            return true;
+        }
+        ks_copro_vm_loaded(s, vm_id, req.is_prog, 0);
+        ks_copro_raise_irq(s, IRQ_DMA_DONE);
+        return true;
+    }
+    ch->active = true;
+    ch->src_addr = req.addr;
+    ch->len = req.len;
+    // Guest memory is read into the slot a burst at a time, each after its bus time
+    ks_dma_begin(ch, vm_id, req.is_prog, false);
+    ks_dma_add_seg(ch, req.addr, req.len);
+    ch->fetched = true;
+    ks_dma_schedule(s, ch, ks_dma_time_ns(s, ks_dma_next_chunk(s, ch)));
+    return true;
+}
+
+static KsDmaChannel *ks_dma_free_channel(KeystoneCoproState *s) {
+    for (uint32_t c = 0; c < s->dma_channels; c++) {
+        if (!s->dma_chan[c].active) {
+            return &s->dma_chan[c];
+        }
+    }
+    return NULL;
+}
+
+/*
+ * Hand free channels to waiting requesters, round robin from dma_rr over
+ * the slot queues, the descriptor ring and the SQ, so that no requester
+ * waits behind more than one transfer of each of the others.
+ */
+static void ks_dma_kick(KeystoneCoproState *s) {
+    uint32_t n = s->num_slots + 2;
+    KsDmaChannel *ch;
+
+    while ((ch = ks_dma_free_channel(s)) != NULL) {
+        bool granted = false;
+
+        for (uint32_t i = 0; i < n && !granted; i++) {
+            uint32_t r = (s->dma_rr + i) % n;
+
+            if (r < s->num_slots) {
+                granted = ks_dma_grant_slot(s, ch, r);
+            } else if (r == s->num_slots) {
+                granted = ks_dma_grant_ring(s, ch);
+            } else {
+                granted = ks_dma_grant_sq(s, ch);
+            }
+            if (granted) {
+                s->dma_rr = (r + 1) % n;
+            }
+        }
+        if (!granted) {
+            return;
+        }
+    }
+}
+
+/*
+ * LOAD_PROG/LOAD_DATA_IN: queue the transfer on the slot, behind any it
+ * already has, and start it if a channel is free. Fails only if the queue
+ * is full.
+ */
+static int ks_dma_queue_load(KeystoneCoproState *s, unsigned vm_id, bool is_prog, uint64_t addr, uint32_t len) {
+    KeystoneVMContext *vm = &s->vm_contexts[vm_id];
+    KsDmaReq *req;
+
+    if (vm->dma_queue_count == KS_DMA_QUEUE_DEPTH) {
+        KS_COPRO_LOG("DMA queue of VM %u full, %s ignored.", vm_id, is_prog ? "LOAD_PROG" : "LOAD_DATA_IN");
+        ks_copro_raise_irq(s, IRQ_DMA_ERROR);
+        return -EBUSY;
+    }
+    req = &vm->dma_queue[(vm->dma_queue_head + vm->dma_queue_count) % KS_DMA_QUEUE_DEPTH];
+    req->addr = addr;
+    req->len = len;
+    req->is_prog = is_prog;
+    req->queued_at = qemu_clock_get_ns(QEMU_CLOCK_VIRTUAL);
+    vm->dma_queue_count++;
+
+    // A zero-length request with nothing ahead of it needs no channel
+    if (len == 0 && vm->dma_queue_count == 1 && !ks_dma_slot_held(s, vm_id)) {
+        KS_COPRO_LOG("%s: Zero length, completing immediately.", is_prog ? "LOAD_PROG" : "LOAD_DATA_IN");
+        vm->dma_queue_count = 0;
+        ks_copro_vm_loaded(s, vm_id, is_prog, 0);
+        ks_copro_raise_irq(s, IRQ_DMA_DONE);
+        return 0;
+    }
+    ks_dma_kick(s);
+    if (vm->dma_queue_count) { // Still there: every channel is busy, or one is loading this slot
+        s->perf.dma_queued++;
+        s->perf.dma_queue_peak = MAX(s->perf.dma_queue_peak, vm->dma_queue_count);
+    }
+    return 0;
+}
+
+// A LOAD_PROG/LOAD_DATA_IN transfer is over
+static void ks_dma_load_done(KeystoneCoproState *s, KsDmaChannel *ch, uint32_t status) {
+    KS_COPRO_LOG("DMA channel %u complete. Target VM: %d, Type: %s", ch->id,
+                 ch->target_vm_id, ch->is_prog_load ? "PROG_LOAD" : "DATA_IN_LOAD");
+    if (status == KS_DMA_DESC_OK) {
+        KS_COPRO_LOG("DMA: transferred %u bytes from 0x%0lx", ch->len, ch->src_addr);
+        ks_copro_vm_loaded(s, ch->target_vm_id, ch->is_prog_load, ch->len);
+        ks_copro_raise_irq(s, IRQ_DMA_DONE);
+    } else {
+        KS_COPRO_LOG("DMA: failed to transfer %u bytes from 0x%0lx into VM %d%s", ch->len,
+                     ch->src_addr, ch->target_vm_id, status == KS_DMA_DESC_ERR_BUSY ? " (VM running)" : "");
+        ks_copro_raise_irq(s, IRQ_DMA_ERROR);
+    }
+}
+
+// ch's transfer is over (status KS_DMA_DESC_*): free the channel and report it
+static void ks_dma_finish(KeystoneCoproState *s, KsDmaChannel *ch, uint32_t status, bool write_back) {
+    bool from_ring = ch->from_ring, for_sq = ch->for_sq, fetched = ch->fetched;
+
+    s->perf.dma_xfers++;
+    ch->active = false;
+    ch->from_ring = false;
+    ch->for_sq = false;
+    ch->fetched = false;
+    if (status == KS_DMA_DESC_OK) {
+        s->dma_chan_done |= 1u << ch->id;
+    } else {
+        s->dma_chan_error |= 1u << ch->id;
+    }
+    // A running slot still holds the program it was started with
+    if (status == KS_DMA_DESC_ERR_BUS && fetched && ch->is_prog_load &&
+        !s->vm_contexts[ch->target_vm_id].running) {
+        ks_copro_vm_loaded(s, ch->target_vm_id, true, 0); // prog_mem is partly overwritten
+    }
+    if (from_ring) {
+        ks_dma_ring_done(s, ch, status, write_back);
+    } else if (for_sq) {
+        if (fetched) { // Otherwise the entry is already completed
+            ks_sq_load_done(s, ch, status);
+        }
+    } else {
+        ks_dma_load_done(s, ch, status);
+    }
+}
+
+/*
+ * One step of a DMA channel: fetch the ring descriptor or SQ entry, or
+ * move the next chunk of data, then wait out the bus time of the step
+ * after it.
+ */
+static void ks_dma_complete_cb(void *opaque) {
+    KsDmaChannel *ch = opaque;
+    KeystoneCoproState *s = ch->owner;
+    bool write_back = true;
+    int64_t fetch_ns = 0;
+    uint32_t status, chunk;
+
+    if (!ch->active) {
+        return;
+    }
+    if (!ch->fetched) {
+        status = ch->from_ring ? ks_dma_ring_fetch(s, ch, &write_back) : ks_sq_fetch(s, ch);
+        ch->fetched = status == KS_DMA_DESC_OK;
+        // The SG list was read along with the descriptor; its bus time goes before the first chunk
+        if (ch->from_ring) {
+            fetch_ns = ks_dma_time_ns(s, ch->seg_count * sizeof(KsDmaSgEntry));
+        }
+    } else {
+        status = ks_dma_step(s, ch);
+    }
+    if (status == KS_DMA_DESC_OK && (chunk = ks_dma_next_chunk(s, ch)) != 0) {
+        ks_dma_schedule(s, ch, fetch_ns + ks_dma_time_ns(s, chunk));
+        return;
+    }
+    ks_dma_finish(s, ch, status, write_back);
+
+    // Whatever waited for a channel goes next, in round-robin order
+    ks_dma_kick(s);
+}
+
+
+static int ks_copro_handle_load_prog_cmd(KeystoneCoproState *s, unsigned vm_id, uint64_t addr, uint32_t len) {
+    if (vm_id >= s->num_slots) {
+        KS_COPRO_LOG("LOAD_PROG: Invalid VM ID %u", vm_id);
+        ks_copro_raise_irq(s, IRQ_DMA_ERROR); // Indicate error
+        return -EINVAL;
+    }
+    if (s->vm_contexts[vm_id].running) {
+        KS_COPRO_LOG("LOAD_PROG: VM %u is running", vm_id);
+        ks_copro_raise_irq(s, IRQ_DMA_ERROR);
+        return -EBUSY;
+    }
+
+    // Program memory holds KS_VM_PROG_MAX_INSNS whole 64-bit instructions
+    if (len > KS_VM_PROG_MEM_SIZE || (len % KS_VM_INSN_SIZE) != 0) {
+        KS_COPRO_LOG("LOAD_PROG: Invalid length %u for VM %u (max %u, multiple of %u)",
+                     len, vm_id, KS_VM_PROG_MEM_SIZE, KS_VM_INSN_SIZE);
+        ks_copro_raise_irq(s, IRQ_DMA_ERROR);
+        return -EINVAL;
+    }
+
+    KS_COPRO_LOG("LOAD_PROG cmd: VM_ID=%u, Addr=0x%0lx, Len=%u", vm_id, addr, len);
+    return ks_dma_queue_load(s, vm_id, true, addr, len);
+}
+
+// Load a cached program by handle: no guest-memory DMA, so neither the engine nor its delay is involved
+static int ks_copro_handle_load_prog_handle_cmd(KeystoneCoproState *s, unsigned vm_id, uint32_t handle) {
+    KsProgCacheEntry *e = NULL;
+    KeystoneVMContext *vm;
+
+    if (vm_id >= s->num_slots) {
+        KS_COPRO_LOG("LOAD_PROG_HANDLE: Invalid VM ID %u", vm_id);
+        ks_copro_raise_irq(s, IRQ_DMA_ERROR);
+        return -EINVAL;
+    }
+    vm = &s->vm_contexts[vm_id];
+    if (vm->running) {
+        KS_COPRO_LOG("LOAD_PROG_HANDLE: VM %u is running", vm_id);
+        ks_copro_raise_irq(s, IRQ_DMA_ERROR);
+        return -EBUSY;
+    }
+
+    for (uint32_t i = 0; handle && i < s->prog_cache_size; i++) {
+        if (s->prog_cache[i] && s->prog_cache[i]->handle == handle) {
+            e = s->prog_cache[i];
+            break;
+        }
+    }
+    if (!e) {
+        // Evicted, flushed or never issued; the slot keeps what it had
+        KS_COPRO_LOG("LOAD_PROG_HANDLE: handle %u not cached (VM %u)", handle, vm_id);
+        s->prog_cache_misses++;
+        ks_copro_raise_irq(s, IRQ_DMA_ERROR);
+        return -ENOENT;
+    }
+    s->prog_cache_hits++;
+    e->last_use = ++s->prog_cache_clock;
+    e->refs++;
+    ks_copro_vm_drop_prog(vm);
+    memcpy(vm->prog_mem, e->code, e->len);
+    ks_vm_mem_dirty(s, vm_id, true);
+    ks_copro_vm_set_prog(s, vm_id, e);
+    KS_COPRO_LOG("LOAD_PROG_HANDLE: VM %u loaded handle %u (%u instructions)", vm_id, handle,
+                 e->len / KS_VM_INSN_SIZE);
+    ks_copro_raise_irq(s, IRQ_DMA_DONE);
+    return 0;
+}
+
+static int ks_copro_handle_load_data_in_cmd(KeystoneCoproState *s, unsigned vm_id, uint64_t addr, uint32_t len) {
+    if (vm_id >= s->num_slots) {
+        KS_COPRO_LOG("LOAD_DATA_IN: Invalid VM ID %u", vm_id);
+        ks_copro_raise_irq(s, IRQ_DMA_ERROR); // Indicate error
+        return -EINVAL;
+    }
+    if (s->vm_contexts[vm_id].running && !ks_vm_data_pingpong(&s->vm_contexts[vm_id])) {
+        KS_COPRO_LOG("LOAD_DATA_IN: VM %u is running", vm_id);
+        ks_copro_raise_irq(s, IRQ_DMA_ERROR);
+        return -EBUSY;
+    }
+
+    if (len > KS_VM_DATA_MEM_SIZE) {
+        KS_COPRO_LOG("LOAD_DATA_IN: Length %u exceeds %u byte slot memory of VM %u",
+                     len, KS_VM_DATA_MEM_SIZE, vm_id);
+        ks_copro_raise_irq(s, IRQ_DMA_ERROR);
+        return -EINVAL;
+    }
+
+    // Same timing as LOAD_PROG, into the slot's data memory
+    KS_COPRO_LOG("LOAD_DATA_IN cmd: VM_ID=%u, Addr=0x%0lx, Len=%u", vm_id, addr, len);
+    return ks_dma_queue_load(s, vm_id, false, addr, len);
+}
+
+static void ks_copro_vm_drop_prog(KeystoneVMContext *vm) {
+    ks_prog_entry_put(vm->prog_entry);
+    vm->prog_entry = NULL;
+    vm->jit = NULL;
+    vm->prog = NULL;
+}
+
+static void ks_prof_prog_free(gpointer data) {
+    KsProfProg *p = data;
+
+    g_free(p->ops);
+    g_free(p->hits);
+    g_free(p);
+}
+
+// Fold the hits of the slot's last run into its program's counts (BQL held)
+static void ks_prof_account(KeystoneCoproState *s, KeystoneVMContext *vm) {
+    KsProgCacheEntry *e = vm->prog_entry;
+    KsProfProg *p;
+
+    if (!vm->run.prof || !vm->run.icount) {
+        return;
+    }
+    vm->prof_left = vm->run.prof_left;
+    p = g_hash_table_lookup(s->prof_progs, &e->hash);
+    if (!p) {
+        p = g_new0(KsProfProg, 1);
+        p->hash = e->hash;
+        p->len = e->prog->len;
+        p->ops = g_new(uint8_t, p->len);
+        p->hits = g_new0(uint64_t, p->len);
+        for (uint32_t i = 0; i < p->len; i++) {
+            p->ops[i] = e->prog->insns[i].op;
+        }
+        g_hash_table_insert(s->prof_progs, &p->hash, p);
+    } else if (p->len != e->prog->len) {
+        return; // Another program with the same hash got there first
+    }
+    for (uint32_t i = 0; i < p->len; i++) {
+        p->hits[i] += vm->prof_hits[i];
+    }
+}
+
+static bool ks_prof_write(KeystoneCoproState *s, const char *path, Error **errp) {
+    g_autoptr(GString) out = g_string_new(NULL);
+    g_autoptr(GError) err = NULL;
+    GHashTableIter iter;
+    gpointer value;
+
+    g_hash_table_iter_init(&iter, s->prof_progs);
+    while (g_hash_table_iter_next(&iter, NULL, &value)) {
+        KsProfProg *p = value;
+
+        for (uint32_t i = 0; i < p->len; i++) {
+            if (p->hits[i]) {
+                g_string_append_printf(out, "ks-prog-%016" PRIx64 ";%u:%s %" PRIu64 "\n", p->hash, i,
+                                       ks_ebpf_op_names[p->ops[i]], p->hits[i]);
+            }
+        }
+    }
+    if (!g_file_set_contents(path, out->str, out->len, &err)) {
+        error_setg(errp, "cannot write the profile to '%s': %s", path, err->message);
+        return false;
+    }
+    return true;
+}
+
+// "profile-dump": qom-set it to a host path to write the profile there now
+static void ks_prof_dump_set(Object *obj, const char *path, Error **errp) {
+    KeystoneCoproState *s = KEYSTONE_COPRO(obj);
+
+    if (!s->prof_progs) {
+        error_setg(errp, "profiling is off, see the 'profile' property");
+        return;
+    }
+    ks_prof_write(s, path, errp);
+}
+
+static void ks_prof_exit_notify(Notifier *n, void *data) {
+    KeystoneCoproState *s = container_of(n, KeystoneCoproState, prof_exit);
+    Error *err = NULL;
+
+    if (!ks_prof_write(s, s->profile_file, &err)) {
+        error_report_err(err);
+    }
+}
+
+/*
+ * Batch record mode, on the run's thread: both arrays are mapped, so a
+ * record costs one copy in and one store out, and the decoded program (and
+ * its host code) serves every record with no exit to the device in between.
+ * The next record is prefetched while the current one runs. On return
+ * vm->run holds the last record's run, with icount summed over the batch.
+ */
+static void ks_copro_batch_exec(KeystoneVMContext *vm) {
+    KsEbpfRunCtx *run = &vm->run;
+    const uint8_t *rec = vm->batch_in;
+    uint32_t size = vm->batch_rec_size;
+    uint64_t icount = 0;
+
+    for (uint32_t i = 0; i < vm->batch_count; i++, rec += size) {
+        if (qatomic_read(&vm->stop_req)) {
+            vm->run_err = KS_VM_ERR_STOPPED;
+            break;
+        }
+        memcpy(vm->data_mem, rec, size);
+        if (i + 1 < vm->batch_count) {
+            for (uint32_t off = 0; off < size; off += 64) {
+                __builtin_prefetch(rec + size + off);
+            }
+        }
+        vm->run_err = vm->jit && !run->prof ? ks_ebpf_run_jit(vm->jit, run) : ks_ebpf_run_interp(vm->prog, run);
+        icount += run->icount;
+        if (vm->run_err != KS_VM_ERR_NONE) {
+            break;
+        }
+        if (vm->batch_out) {
+            stq_le_p(vm->batch_out + (uint64_t)i * vm->batch_out_stride, run->retval);
+        }
+        qatomic_set(&vm->batch_done, i + 1);
+    }
+    run->icount = icount;
+}
+
+// Run the slot's program to completion. Called on a worker thread, or inline
+// with worker-threads=0; touches nothing but vm->run, vm->run_err, the slot
+// memories and a batch's arrays. Profiled runs always take the interpreter.
+static void ks_copro_vm_exec(KeystoneCoproState *s, unsigned vm_id) {
+    KeystoneVMContext *vm = &s->vm_contexts[vm_id];
+
+    if (vm->batch_count) {
+        ks_copro_batch_exec(vm);
+        return;
+    }
+    vm->run_err = vm->jit && !vm->run.prof ? ks_ebpf_run_jit(vm->jit, &vm->run)
+                                           : ks_ebpf_run_interp(vm->prog, &vm->run);
+}
+
+// Map one of a batch's arrays for the whole run (BQL held); NULL unless all of it is RAM
+static void *ks_batch_map(KeystoneCoproState *s, uint64_t addr, uint64_t len, DMADirection dir) {
+    dma_addr_t xfer = len;
+    void *p = dma_memory_map(&s->dma_as, addr, &xfer, dir, MEMTXATTRS_UNSPECIFIED);
+
+    if (p && xfer < len) {
+        dma_memory_unmap(&s->dma_as, p, xfer, dir, 0);
+        p = NULL;
+    }
+    return p;
+}
+
+// End the slot's batch, if any (BQL held): unmap its arrays, the results stored so far dirty
+static void ks_batch_release(KeystoneCoproState *s, KeystoneVMContext *vm) {
+    if (vm->batch_in) {
+        dma_memory_unmap(&s->dma_as, vm->batch_in, vm->batch_in_len, DMA_DIRECTION_TO_DEVICE, vm->batch_in_len);
+        vm->batch_in = NULL;
+    }
+    if (vm->batch_out) {
+        dma_memory_unmap(&s->dma_as, vm->batch_out, vm->batch_out_len, DMA_DIRECTION_FROM_DEVICE,
+                         MIN((uint64_t)vm->batch_done * vm->batch_out_stride, vm->batch_out_len));
+        vm->batch_out = NULL;
+    }
+    vm->batch_count = 0;
+}
+
+/*
+ * Publish the outcome of the last run (BQL held): write its output back, then
+ * VMi_DONE on EXIT, VMi_ERROR with error_code set otherwise, or a CQ entry
+ * for a submission. An abandoned run just leaves
+ * the slot stopped.
+ */
+static void ks_copro_vm_finish(KeystoneCoproState *s, unsigned vm_id) {
+    KeystoneVMContext *vm = &s->vm_contexts[vm_id];
+    KsEbpfRunCtx *run = &vm->run;
+    KsVmPerf *perf = &s->vm_perf[vm_id];
+
+    vm->running = false;
+    ks_vm_mem_lock(s, vm_id, false);
+    vm->pc = run->pc;
+    perf->insns += run->icount;
+    ks_prof_account(s, vm);
+    if (vm->batch_count) {
+        // Records in, results out, as the hardware's DMA engine would have moved them
+        uint64_t moved = (uint64_t)vm->batch_done *
+                         (vm->batch_rec_size + (vm->batch_out ? KS_BATCH_RETVAL_SIZE : 0));
+
+        perf->dma_bytes += moved;
+        s->perf.dma_bytes += moved;
+        ks_batch_release(s, vm);
+    }
+    ks_vm_mem_dirty(s, vm_id, false); // Stack and output
+    // Straight from slot memory into the mapped destination, before DONE is visible
+    if (vm->run_err == KS_VM_ERR_NONE && run->out_len) {
+        if (ks_dma_write_from_slot(s, vm->out_addr, vm->data_mem, run->out_len)) {
+            vm->out_len = run->out_len;
+            perf->dma_bytes += run->out_len;
+            s->perf.dma_bytes += run->out_len;
+        } else {
+            KS_COPRO_LOG("VM %u: bus error writing %u bytes of output to 0x%" PRIx64, vm_id, run->out_len,
+                         vm->out_addr);
+            vm->run_err = KS_VM_ERR_DATA_OUT;
+        }
+    }
+    if (vm->run_err == KS_VM_ERR_STOPPED) {
+        KS_COPRO_LOG("VM %u stopped at pc %u", vm_id, run->pc);
+    } else if (vm->run_err != KS_VM_ERR_NONE) {
+        KS_COPRO_LOG("VM %u error %d at pc %u after %" PRIu64 " insns", vm_id, vm->run_err, run->pc, run->icount);
+        vm->error_state = true;
+        vm->error_code = vm->run_err;
+        perf->errors++;
+    } else {
+        vm->done = true;
+        vm->retval = run->retval;
+    }
+    if (vm->sq_owned) {
+        // Submission queue runs complete through the CQ instead of the per-VM bits
+        ks_sq_complete(s, vm_id, vm->run_err, run->retval);
+    } else if (vm->run_err != KS_VM_ERR_STOPPED) { // Nothing for a stopped run
+        ks_copro_raise_vm_irq(s, vm_id, vm->run_err != KS_VM_ERR_NONE);
+    }
+}
+
+static void *ks_copro_worker_thread(void *opaque) {
+    KeystoneCoproState *s = opaque;
+
+    qemu_mutex_lock(&s->run_lock);
+    while (!s->run_shutdown) {
+        unsigned vm_id;
+
+        if (!s->run_queued) {
+            qemu_cond_wait(&s->run_cond, &s->run_lock);
+            continue;
+        }
+        vm_id = ctz64(s->run_queued);
+        s->run_queued &= ~(1ULL << vm_id);
+        s->run_busy |= 1ULL << vm_id;
+        qemu_mutex_unlock(&s->run_lock);
+
+        ks_copro_vm_exec(s, vm_id);
+
+        qemu_mutex_lock(&s->run_lock);
+        s->run_busy &= ~(1ULL << vm_id);
+        s->run_done |= 1ULL << vm_id;
+        qemu_cond_broadcast(&s->idle_cond);
+        qemu_bh_schedule(s->run_bh);
+    }
+    qemu_mutex_unlock(&s->run_lock);
+    return NULL;
+}
+
+static void ks_copro_run_bh(void *opaque) {
+    KeystoneCoproState *s = opaque;
+    uint64_t done;
+
+    qemu_mutex_lock(&s->run_lock);
+    done = s->run_done;
+    s->run_done = 0;
+    qemu_mutex_unlock(&s->run_lock);
+
+    while (done) {
+        unsigned vm_id = ctz64(done);
+
+        done &= done - 1;
+        ks_copro_vm_finish(s, vm_id);
+    }
+}
+
+/*
+ * Take the slot back from the pool (BQL held): drop it if still queued,
+ * otherwise abandon the run in progress and wait for its worker to let go.
+ * Returns true if a finished run is left in vm->run that has not been
+ * published yet; it is no longer owed to run_bh.
+ */
+static bool ks_copro_vm_quiesce(KeystoneCoproState *s, unsigned vm_id) {
+    KeystoneVMContext *vm = &s->vm_contexts[vm_id];
+    uint64_t bit = 1ULL << vm_id;
+    bool finished;
+
+    if (!s->worker_threads) {
+        return false;
+    }
+    qemu_mutex_lock(&s->run_lock);
+    s->run_queued &= ~bit;
+    if (s->run_busy & bit) {
+        qatomic_set(&vm->stop_req, true);
+        while (s->run_busy & bit) {
+            qemu_cond_wait(&s->idle_cond, &s->run_lock);
+        }
+        qatomic_set(&vm->stop_req, false);
+    }
+    finished = s->run_done & bit;
+    s->run_done &= ~bit;
+    qemu_mutex_unlock(&s->run_lock);
+    return finished;
+}
+
+// Let every started slot finish and publish its outcome (BQL held)
+static void ks_copro_drain(KeystoneCoproState *s) {
+    if (!s->worker_threads) {
         return;
     }
+    qemu_mutex_lock(&s->run_lock);
+    while (s->run_queued || s->run_busy) {
+        qemu_cond_wait(&s->idle_cond, &s->run_lock);
+    }
+    qemu_mutex_unlock(&s->run_lock);
+    ks_copro_run_bh(s);
+}
+
+// Run the slot's program on its current data memory (BQL held); the outcome
+// is published by ks_copro_vm_finish, inline or from run_bh
+static void ks_copro_vm_start(KeystoneCoproState *s, unsigned vm_id) {
+    KeystoneVMContext *vm = &s->vm_contexts[vm_id];
+
+    ks_vm_mem_sync(s, vm_id);
+    if (vm->prog_stale && vm->has_program) {
+        // Stored to through the window: prepare what is there now, at the same length
+        ks_copro_vm_loaded(s, vm_id, true, vm->prog_len);
+    }
+    if (vm->data_ready && !vm->batch_count) {
+        // Ping-pong swap: the filled buffer is used, the one just used is free for the next fill
+        vm->data_active ^= 1;
+        vm->data_mem = vm->data_bufs[vm->data_active];
+        vm->data_len = vm->data_fill_len;
+        vm->data_ready = false;
+    }
+    ks_vm_mem_lock(s, vm_id, vm->mem_ctrl & KS_VM_MEM_CTRL_WRITE_LOCK);
+    vm->error_state = false;
+    vm->error_code = 0;
+    vm->done = false;
+    vm->pc = 0; // Reset PC on start
+    vm->out_len = 0;
+    vm->running = true;
+    s->vm_perf[vm_id].runs++;
+    vm->run = (KsEbpfRunCtx) {
+        .mem = vm->data_mem,
+        .mem_size = KS_VM_DATA_MEM_SIZE,
+        .data_len = vm->batch_count ? vm->batch_rec_size : vm->data_len,
+        .mbox_in = s->vm_mailboxes_in[vm_id],
+        .mbox_out = s->vm_mailboxes_out[vm_id],
+        .num_mbox = NUM_MAILBOX_REGS_QEMU,
+        .maps = s->maps,
+        .num_maps = KS_EBPF_MAX_MAPS,
+        .slot = vm_id,
+        .insn_limit = s->max_insns,
+        .stop = &vm->stop_req,
+        .out_max = vm->out_max,
+    };
+    if (s->vm_mbox[vm_id].ctrl & KS_MBOX_FIFO_EN) {
+        vm->run.fifo_in = &s->vm_mbox[vm_id].in;
+        vm->run.fifo_out = &s->vm_mbox[vm_id].out;
+        vm->run.fifo_kick = ks_mbox_kick;
+        vm->run.fifo_opaque = &s->vm_mbox[vm_id];
+    }
+    if (s->prof_period && vm->prog) {
+        memset(vm->prof_hits, 0, (vm->prog->len + 1) * sizeof(uint64_t));
+        vm->run.prof = vm->prof_hits;
+        vm->run.prof_period = s->prof_period;
+        vm->run.prof_left = vm->prof_left;
+    }
+    if (!vm->has_program || !vm->prog) {
+        KS_COPRO_LOG("START_VM: VM %u has no program loaded", vm_id);
+        vm->run_err = KS_VM_ERR_NO_PROGRAM;
+        ks_copro_vm_finish(s, vm_id);
+    } else if (vm->prog->verify_err) {
+        KS_COPRO_LOG("START_VM: VM %u program was rejected by the verifier", vm_id);
+        vm->run_err = KS_VM_ERR_VERIFY;
+        vm->run.pc = vm->prog->verify_pc;
+        ks_copro_vm_finish(s, vm_id);
+    } else if (vm->batch_count && (!vm->batch_in || (vm->batch_out_stride && !vm->batch_out))) {
+        vm->run_err = KS_VM_ERR_BATCH;
+        ks_copro_vm_finish(s, vm_id);
+    } else if (!s->worker_threads) {
+        ks_copro_vm_exec(s, vm_id);
+        ks_copro_vm_finish(s, vm_id);
+    } else {
+        qemu_mutex_lock(&s->run_lock);
+        s->run_queued |= 1ULL << vm_id;
+        qemu_cond_signal(&s->run_cond);
+        qemu_mutex_unlock(&s->run_lock);
+    }
+}
+
+static int ks_copro_handle_start_vm_cmd(KeystoneCoproState *s, unsigned vm_id, uint64_t out_addr, uint32_t out_len) {
+    int ret = 0;
+
+    if (vm_id < s->num_slots) {
+        KeystoneVMContext *vm = &s->vm_contexts[vm_id];
+
+        KS_COPRO_LOG("START_VM cmd: VM_ID=%u", vm_id);
+        if (vm->running) {
+            KS_COPRO_LOG("START_VM: VM %u is already running", vm_id);
+            return -EBUSY;
+        }
+        vm->out_addr = out_addr;
+        vm->out_max = MIN(out_len, KS_VM_DATA_MEM_SIZE);
+        ks_copro_vm_start(s, vm_id);
+    } else {
+        KS_COPRO_LOG("START_VM cmd: Invalid VM_ID=%u", vm_id);
+        ret = -EINVAL;
+    }
+    ks_copro_update_irq(s); // Update busy status
+    return ret;
+}
+
+/*
+ * START_BATCH: run the program over the page's BATCH_COUNT records. Both
+ * arrays are mapped here, once; if either is not RAM the slot still starts,
+ * to fail at once with KS_VM_ERR_BATCH, and finish unmaps the other.
+ */
+static int ks_copro_handle_start_batch_cmd(KeystoneCoproState *s, unsigned vm_id, uint64_t in_addr, uint64_t out_addr) {
+    KsVmPageRegs *page;
+    KeystoneVMContext *vm;
+
+    if (vm_id >= s->num_slots) {
+        KS_COPRO_LOG("START_BATCH cmd: Invalid VM_ID=%u", vm_id);
+        return -EINVAL;
+    }
+    page = &s->vm_pages[vm_id];
+    vm = &s->vm_contexts[vm_id];
+    KS_COPRO_LOG("START_BATCH cmd: VM_ID=%u, %u records of %u bytes", vm_id, page->batch_count,
+                 page->batch_rec_size);
+    if (vm->running) {
+        KS_COPRO_LOG("START_BATCH: VM %u is already running", vm_id);
+        return -EBUSY;
+    }
+    if (!page->batch_rec_size || page->batch_rec_size > KS_VM_DATA_MEM_SIZE ||
+        !page->batch_count || page->batch_count > KS_BATCH_MAX_RECORDS ||
+        (page->batch_out_stride && page->batch_out_stride < KS_BATCH_RETVAL_SIZE)) {
+        KS_COPRO_LOG("START_BATCH: Invalid record size, count or stride for VM %u", vm_id);
+        return -EINVAL;
+    }
+    vm->out_addr = 0;
+    vm->out_max = 0; // Results go to the output array only
+    vm->batch_count = page->batch_count;
+    vm->batch_rec_size = page->batch_rec_size;
+    vm->batch_out_stride = page->batch_out_stride;
+    vm->batch_done = 0;
+    vm->batch_in_len = (uint64_t)vm->batch_count * vm->batch_rec_size;
+    vm->batch_in = ks_batch_map(s, in_addr, vm->batch_in_len, DMA_DIRECTION_TO_DEVICE);
+    if (vm->batch_out_stride) {
+        vm->batch_out_len = (uint64_t)(vm->batch_count - 1) * vm->batch_out_stride + KS_BATCH_RETVAL_SIZE;
+        vm->batch_out = ks_batch_map(s, out_addr, vm->batch_out_len, DMA_DIRECTION_FROM_DEVICE);
+    }
+    if (!vm->batch_in || (vm->batch_out_stride && !vm->batch_out)) {
+        KS_COPRO_LOG("START_BATCH: VM %u record array 0x%" PRIx64 " or result array 0x%" PRIx64 " is not RAM",
+                     vm_id, in_addr, out_addr);
+    }
+    ks_copro_vm_start(s, vm_id);
+    ks_copro_update_irq(s); // Update busy status
+    return 0;
+}
 
-    s->dma_active = true;
-    s->dma_target_vm_id = s->vm_select_id;
-    s->dma_src_addr = ((uint64_t)s->data_in_addr_high_reg << 32) | s->data_in_addr_low_reg;
-    s->dma_len = s->data_len_reg;
-    s->dma_is_prog_load = false;
+static int ks_copro_handle_stop_vm_cmd(KeystoneCoproState *s, unsigned vm_id) {
+    int ret = 0;
 
-    KS_COPRO_LOG("LOAD_DATA_IN cmd: VM_ID=%u, Addr=0x%0lx, Len=%u",
-                 s->dma_target_vm_id, s->dma_src_addr, s->dma_len);
-    
-    // Simulate DMA (similar to LOAD_PROG)
-    s->dma_buffer = g_malloc(s->dma_len);
-    // cpu_physical_memory_read(s->dma_src_addr, s->dma_buffer, s->dma_len);
-    // KS_COPRO_LOG("DMA: Read %d bytes for DATA_IN from guest RAM @ 0x%lx (simulated)", s->dma_len, s->dma_src_addr);
+    if (vm_id < s->num_slots) {
+        KeystoneVMContext *vm = &s->vm_contexts[vm_id];
 
-    timer_mod(&s->dma_timer, qemu_clock_get_ms(QEMU_CLOCK_VIRTUAL) + 1); // 1ms delay
+        KS_COPRO_LOG("STOP_VM cmd: VM_ID=%u", vm_id);
+        // Synchronous: the slot is idle when the write returns. A run that
+        // completed before the stop landed still reports DONE/ERROR.
+        if (ks_copro_vm_quiesce(s, vm_id)) {
+            ks_copro_vm_finish(s, vm_id);
+        } else if (vm->running) {
+            // Still queued for a worker: finish it as stopped, so a submission gets its completion
+            vm->run_err = KS_VM_ERR_STOPPED;
+            ks_copro_vm_finish(s, vm_id);
+        }
+    } else {
+        KS_COPRO_LOG("STOP_VM cmd: Invalid VM_ID=%u", vm_id);
+        ret = -EINVAL;
+    }
+    ks_copro_update_irq(s); // Update busy status
+    return ret;
 }
 
-static void ks_copro_handle_start_vm_cmd(KeystoneCoproState *s) {
-    if (s->vm_select_id < NUM_VM_SLOTS_QEMU) {
-        KeystoneVMContext *vm = &s->vm_contexts[s->vm_select_id];
-        // TODO: Check if program is loaded before starting
-        vm->running = true;
+static int ks_copro_handle_reset_vm_cmd(KeystoneCoproState *s, unsigned vm_id) {
+    int ret = 0;
+
+    if (vm_id < s->num_slots) {
+        KeystoneVMContext *vm = &s->vm_contexts[vm_id];
+        ks_copro_vm_quiesce(s, vm_id); // Outcome of an interrupted run is dropped
+        if (vm->sq_owned) {
+            ks_sq_complete(s, vm_id, KS_VM_ERR_STOPPED, 0); // Except that a submission still completes
+        }
+        ks_batch_release(s, vm);
+        vm->batch_done = 0;
+        vm->running = false;
         vm->error_state = false;
         vm->error_code = 0;
-        vm->pc = 0; // Reset PC on start
-        KS_COPRO_LOG("START_VM cmd: VM_ID=%u", s->vm_select_id);
-        // In a more complex model, this would trigger the PicoRV32 model to start execution.
-        // For now, it just sets a flag. We can simulate VM completion via a timer or mailbox write.
+        vm->pc = 0;
+        vm->done = false;
+        vm->retval = 0;
+        vm->out_addr = 0;
+        vm->out_max = 0;
+        vm->out_len = 0;
+        vm->has_program = false;
+        vm->prog_len = 0;
+        vm->data_len = 0;
+        ks_copro_vm_drop_prog(vm);
+        ks_vm_mem_lock(s, vm_id, false); // MEM_CTRL is kept
+        ks_vm_mem_sync(s, vm_id);
+        vm->prog_stale = false;
+        memset(vm->prog_mem, 0, KS_VM_PROG_MEM_SIZE);
+        ks_vm_data_bufs_reset(vm); // DATA_BUF PINGPONG is kept
+        ks_vm_mem_dirty(s, vm_id, true);
+        ks_vm_mem_dirty(s, vm_id, false);
+        for (int j = 0; j < NUM_MAILBOX_REGS_QEMU; j++) {
+            s->vm_mailboxes_in[vm_id][j] = 0;
+            s->vm_mailboxes_out[vm_id][j] = 0;
+        }
+        ks_mbox_set_ctrl(s, vm_id, s->vm_mbox[vm_id].ctrl); // FIFO mode is kept, emptied
+        KS_COPRO_LOG("RESET_VM cmd: VM_ID=%u", vm_id);
     } else {
-        KS_COPRO_LOG("START_VM cmd: Invalid VM_ID=%u", s->vm_select_id);
+        KS_COPRO_LOG("RESET_VM cmd: Invalid VM_ID=%u", vm_id);
+        ret = -EINVAL;
+    }
+    ks_copro_update_irq(s); // Update busy status
+    return ret;
+}
+
+int keystone_copro_set_len(KeystoneCoproState *s, unsigned vm, uint32_t len) {
+    if (vm >= s->num_slots) {
+        return -EINVAL;
+    }
+    s->vm_pages[vm].data_len = len;
+    return 0;
+}
+
+int keystone_copro_vm_load_prog(KeystoneCoproState *s, unsigned vm, uint64_t addr) {
+    if (vm >= s->num_slots) {
+        return ks_perf_cmd(s, -EINVAL);
+    }
+    return ks_perf_cmd(s, ks_copro_handle_load_prog_cmd(s, vm, addr, s->vm_pages[vm].data_len));
+}
+
+int keystone_copro_vm_start(KeystoneCoproState *s, unsigned vm) {
+    KsVmPageRegs *page;
+
+    if (vm >= s->num_slots) {
+        return ks_perf_cmd(s, -EINVAL);
+    }
+    page = &s->vm_pages[vm];
+    return ks_perf_cmd(s, ks_copro_handle_start_vm_cmd(s, vm,
+                                                       ((uint64_t)page->data_out_addr_high << 32) |
+                                                       page->data_out_addr_low, page->data_out_len));
+}
+
+int keystone_copro_vm_stop(KeystoneCoproState *s, unsigned vm) {
+    return ks_perf_cmd(s, ks_copro_handle_stop_vm_cmd(s, vm));
+}
+
+int keystone_copro_vm_reset(KeystoneCoproState *s, unsigned vm) {
+    return ks_perf_cmd(s, ks_copro_handle_reset_vm_cmd(s, vm));
+}
+
+int keystone_copro_vm_status(KeystoneCoproState *s, unsigned vm, uint32_t *status) {
+    if (vm >= s->num_slots) {
+        return -EINVAL;
+    }
+    *status = ks_copro_vm_status_byte(&s->vm_contexts[vm]);
+    return 0;
+}
+
+int keystone_copro_mbox_send(KeystoneCoproState *s, unsigned vm, unsigned idx, uint32_t val) {
+    if (vm >= s->num_slots || idx >= NUM_MAILBOX_REGS_QEMU) {
+        return -EINVAL;
+    }
+    if (s->vm_mbox[vm].ctrl & KS_MBOX_FIFO_EN) {
+        if (!ks_mbox_fifo_push(&s->vm_mbox[vm].in, val)) {
+            return -EAGAIN;
+        }
+        ks_mbox_update(s, vm);
+        ks_copro_update_irq(s);
+        return 0;
+    }
+    qatomic_set(&s->vm_mailboxes_in[vm][idx], val);
+    return 0;
+}
+
+int keystone_copro_mbox_recv(KeystoneCoproState *s, unsigned vm, unsigned idx, uint32_t *val) {
+    if (vm >= s->num_slots || idx >= NUM_MAILBOX_REGS_QEMU) {
+        return -EINVAL;
     }
-    ks_copro_update_irq(s); // Update busy status
+    if (s->vm_mbox[vm].ctrl & KS_MBOX_FIFO_EN) {
+        if (!ks_mbox_fifo_pop(&s->vm_mbox[vm].out, val)) {
+            return -EAGAIN;
+        }
+        ks_mbox_update(s, vm);
+        ks_copro_update_irq(s);
+        return 0;
+    }
+    *val = qatomic_read(&s->vm_mailboxes_out[vm][idx]);
+    return 0;
 }
 
-static void ks_copro_handle_stop_vm_cmd(KeystoneCoproState *s) {
-    if (s->vm_select_id < NUM_VM_SLOTS_QEMU) {
-        s->vm_contexts[s->vm_select_id].running = false;
-        KS_COPRO_LOG("STOP_VM cmd: VM_ID=%u", s->vm_select_id);
-        // This could also set a 'done' flag if stop implies completion.
-        // s->int_status_reg |= (IRQ_VM0_DONE << s->vm_select_id);
-    } else {
-        KS_COPRO_LOG("STOP_VM cmd: Invalid VM_ID=%u", s->vm_select_id);
+// Resume the harts waiting on any of slots; they re-execute BPF.VM.WAIT
+static void ks_vm_wait_wake(KeystoneCoproState *s, uint64_t slots) {
+    for (int i = 0; i < KS_VM_WAIT_MAX_HARTS; i++) {
+        KsVmWaiter *w = &s->vm_waiters[i];
+
+        if (w->cpu && (slots & w->mask)) {
+            w->cpu->halted = 0;
+            qemu_cpu_kick(w->cpu);
+            w->cpu = NULL;
+        }
     }
-    ks_copro_update_irq(s); // Update busy status
 }
 
-static void ks_copro_handle_reset_vm_cmd(KeystoneCoproState *s) {
-    if (s->vm_select_id < NUM_VM_SLOTS_QEMU) {
-        KeystoneVMContext *vm = &s->vm_contexts[s->vm_select_id];
-        vm->running = false;
-        vm->error_state = false;
-        vm->error_code = 0;
-        vm->pc = 0;
-        // TODO: Clear VM's program memory, stack, mailboxes if applicable in a full model.
-        KS_COPRO_LOG("RESET_VM cmd: VM_ID=%u", s->vm_select_id);
-    } else {
-        KS_COPRO_LOG("RESET_VM cmd: Invalid VM_ID=%u", s->vm_select_id);
+int keystone_copro_vm_wait(KeystoneCoproState *s, uint64_t mask, CPUState *cs) {
+    uint64_t pending;
+    KsVmWaiter *w = NULL;
+    unsigned vm;
+
+    if (!mask || (mask & ~ks_slot_mask(s))) {
+        return -EINVAL;
     }
-    ks_copro_update_irq(s); // Update busy status
+    pending = (s->vm_done_status | s->vm_error_status) & mask;
+    if (pending) {
+        vm = ctz64(pending);
+        s->vm_done_status &= ~(1ULL << vm);
+        s->vm_error_status &= ~(1ULL << vm);
+        ks_copro_update_irq(s);
+        return vm;
+    }
+    // A hart woken by an interrupt instead is still listed; it keeps its entry
+    for (int i = 0; i < KS_VM_WAIT_MAX_HARTS; i++) {
+        if (s->vm_waiters[i].cpu == cs || (!w && !s->vm_waiters[i].cpu)) {
+            w = &s->vm_waiters[i];
+        }
+    }
+    if (!w) {
+        return -EBUSY;
+    }
+    w->cpu = cs;
+    w->mask = mask;
+    // Halted here, under the BQL, so a completion before the hart stops cannot be missed
+    cs->halted = 1;
+    return -EAGAIN;
 }
 
 
@@ -386,6 +2923,17 @@ static const MemoryRegionOps keystone_copro_ops = {
     },
 };
 
+// Map images are little-endian byte arrays
+static const MemoryRegionOps ks_map_window_ops = {
+    .read = ks_map_window_read,
+    .write = ks_map_window_write,
+    .endianness = DEVICE_LITTLE_ENDIAN,
+    .valid = {
+        .min_access_size = 4,
+        .max_access_size = 8,
+    },
+};
+
 static void keystone_copro_reset(DeviceState *dev) {
     KeystoneCoproState *s = KEYSTONE_COPRO(dev);
     KS_COPRO_LOG("Resetting Keystone Coprocessor");
@@ -399,31 +2947,119 @@ static void keystone_copro_reset(DeviceState *dev) {
     s->data_out_addr_low_reg = 0;
     s->data_out_addr_high_reg = 0;
     s->data_len_reg = 0;
+    s->data_out_len_reg = 0;
+    memset(s->vm_pages, 0, sizeof(s->vm_pages));
     s->int_status_reg = 0;
     s->int_enable_reg = 0;
+    s->vm_done_status = 0;
+    s->vm_error_status = 0;
+    s->vm_done_enable = 0;
+    s->vm_error_enable = 0;
+    for (int c = 0; c < KS_IRQ_NUM_CLASSES; c++) {
+        s->irq_mod_reg[c] = 0;
+        s->irq_mod_count[c] = 0;
+        s->irq_mod_deadline[c] = 0;
+        s->irq_mod_fired[c] = false;
+    }
+    s->irq_mod_ctrl = KS_IRQ_MOD_CTRL_ERR_BYPASS;
+    timer_del(&s->irq_mod_timer);
+    memset(s->vm_waiters, 0, sizeof(s->vm_waiters)); // The harts are reset with the machine
 
-    s->dma_active = false;
-    s->dma_src_addr = 0;
-    s->dma_len = 0;
-    s->dma_target_vm_id = 0;
-    s->dma_is_prog_load = false;
-    if (s->dma_buffer) {
-        g_free(s->dma_buffer);
-        s->dma_buffer = NULL;
+    for (int c = 0; c < KS_DMA_MAX_CHANNELS; c++) {
+        KsDmaChannel *ch = &s->dma_chan[c];
+
+        timer_del(&ch->timer);
+        ch->active = false;
+        ch->src_addr = 0;
+        ch->len = 0;
+        ch->target_vm_id = 0;
+        ch->is_prog_load = false;
+        ch->from_ring = false;
+        ch->for_sq = false;
+        ch->fetched = false;
+        ch->is_out = false;
+        ch->seg_count = 0;
+        ch->seg_idx = 0;
+        ch->seg_off = 0;
+        ch->moved = 0;
+        ch->sq_cookie = 0;
+        ch->sq_out_addr = 0;
+        ch->sq_out_len = 0;
     }
-    timer_del(&s->dma_timer);
+    s->dma_rr = 0;
+    s->dma_bus_free_at = 0;
+    s->dma_chan_done = 0;
+    s->dma_chan_error = 0;
+    s->dma_ring_base_low_reg = 0;
+    s->dma_ring_base_high_reg = 0;
+    s->dma_ring_size = 0;
+    s->dma_ring_head = 0;
+    s->dma_ring_tail = 0;
+    s->sq_base_low_reg = 0;
+    s->sq_base_high_reg = 0;
+    s->cq_base_low_reg = 0;
+    s->cq_base_high_reg = 0;
+    s->queue_size = 0;
+    s->sq_head = 0;
+    s->sq_tail = 0;
+    s->cq_head = 0;
+    s->cq_tail = 0;
+    s->cq_phase = KS_CQ_FLAG_PHASE;
+    s->sq_inflight = 0;
 
 
-    for (int i = 0; i < NUM_VM_SLOTS_QEMU; i++) {
+    for (int i = 0; i < s->num_slots; i++) {
+        ks_copro_vm_quiesce(s, i);
+        ks_batch_release(s, &s->vm_contexts[i]);
+        s->vm_contexts[i].batch_done = 0;
         s->vm_contexts[i].running = false;
         s->vm_contexts[i].error_state = false;
         s->vm_contexts[i].error_code = 0;
         s->vm_contexts[i].pc = 0;
+        s->vm_contexts[i].done = false;
+        s->vm_contexts[i].retval = 0;
+        s->vm_contexts[i].out_addr = 0;
+        s->vm_contexts[i].out_max = 0;
+        s->vm_contexts[i].out_len = 0;
+        s->vm_contexts[i].sq_owned = false;
+        s->vm_contexts[i].dma_queue_head = 0;
+        s->vm_contexts[i].dma_queue_count = 0;
+        ks_copro_vm_drop_prog(&s->vm_contexts[i]);
+        s->vm_contexts[i].has_program = false;
+        s->vm_contexts[i].prog_len = 0;
+        s->vm_contexts[i].data_len = 0;
+        ks_vm_mem_lock(s, i, false);
+        ks_vm_mem_sync(s, i);
+        s->vm_contexts[i].mem_ctrl = 0;
+        s->vm_contexts[i].data_buf_ctrl = 0;
+        s->vm_contexts[i].prog_stale = false;
+        memset(s->vm_contexts[i].prog_mem, 0, KS_VM_PROG_MEM_SIZE);
+        ks_vm_data_bufs_reset(&s->vm_contexts[i]);
+        ks_vm_mem_dirty(s, i, true);
+        ks_vm_mem_dirty(s, i, false);
         for (int j = 0; j < NUM_MAILBOX_REGS_QEMU; j++) {
             s->vm_mailboxes_in[i][j] = 0;
             s->vm_mailboxes_out[i][j] = 0;
         }
+        s->vm_mbox[i].irq_enable = 0;
+        ks_mbox_set_ctrl(s, i, 0);
     }
+    s->mbox_pending = 0;
+    // After the slots: no run is left to use them
+    ks_map_destroy_all(s);
+    s->map_select = 0;
+    s->map_type_reg = 0;
+    s->map_key_size_reg = 0;
+    s->map_value_size_reg = 0;
+    s->map_max_entries_reg = 0;
+    ks_prog_cache_flush(s);
+    s->prog_cache_next_handle = 0;
+    s->prog_cache_clock = 0;
+    s->prog_cache_hits = 0;
+    s->prog_cache_misses = 0;
+    ks_perf_clear(s);
+    s->irq_level = false;
+    s->vm_irq_levels = 0;
     s->active_vm_mask = 0;
     s->copro_busy_status = false;
     ks_copro_update_irq(s);
@@ -434,13 +3070,36 @@ static void keystone_copro_init(Object *obj) {
 
     KS_COPRO_LOG("Initializing Keystone Coprocessor device model");
 
-    memory_region_init_io(&s->iomem, obj, &keystone_copro_ops, s,
-                          TYPE_KEYSTONE_COPRO, KS_COPRO_CSR_SIZE);
-    sysbus_init_mmio(SYS_BUS_DEVICE(obj), &s->iomem);
-
+    // The CSR window is sized by num-slots, so it is set up at realize
     qdev_init_gpio_out(DEVICE(obj), &s->irq, 1);
+    for (int i = 0; i < NUM_VM_SLOTS_QEMU; i++) {
+        s->vm_mbox[i].owner = s;
+        s->vm_mbox[i].vm_id = i;
+        s->vm_mbox[i].in.buf = s->vm_mbox[i].in_buf;
+        s->vm_mbox[i].out.buf = s->vm_mbox[i].out_buf;
+    }
+
+    for (int c = 0; c < KS_DMA_MAX_CHANNELS; c++) {
+        s->dma_chan[c].owner = s;
+        s->dma_chan[c].id = c;
+        timer_init_ns(&s->dma_chan[c].timer, QEMU_CLOCK_VIRTUAL, ks_dma_complete_cb, &s->dma_chan[c]);
+    }
+    timer_init_ns(&s->irq_mod_timer, QEMU_CLOCK_VIRTUAL, ks_irq_mod_timer_cb, s);
 
-    timer_init_ms(&s->dma_timer, QEMU_CLOCK_VIRTUAL, ks_dma_complete_cb, s);
+    object_property_add_uint64_ptr(obj, "prog-cache-hits", &s->prog_cache_hits, OBJ_PROP_FLAG_READ);
+    object_property_add_uint64_ptr(obj, "prog-cache-misses", &s->prog_cache_misses, OBJ_PROP_FLAG_READ);
+    // Performance counters, for qom-get over QMP
+    object_property_add_uint64_ptr(obj, "perf-dma-bytes", &s->perf.dma_bytes, OBJ_PROP_FLAG_READ);
+    object_property_add_uint64_ptr(obj, "perf-dma-busy-ns", &s->perf.dma_busy_ns, OBJ_PROP_FLAG_READ);
+    object_property_add_uint64_ptr(obj, "perf-dma-xfers", &s->perf.dma_xfers, OBJ_PROP_FLAG_READ);
+    object_property_add_uint64_ptr(obj, "perf-cmd-rejected", &s->perf.cmd_rejected, OBJ_PROP_FLAG_READ);
+    object_property_add_uint64_ptr(obj, "perf-irq-events", &s->perf.irq_events, OBJ_PROP_FLAG_READ);
+    object_property_add_uint64_ptr(obj, "perf-irq-asserts", &s->perf.irq_asserts, OBJ_PROP_FLAG_READ);
+    object_property_add_uint64_ptr(obj, "perf-dma-queued", &s->perf.dma_queued, OBJ_PROP_FLAG_READ);
+    object_property_add_uint64_ptr(obj, "perf-dma-queue-wait-ns", &s->perf.dma_queue_wait_ns, OBJ_PROP_FLAG_READ);
+    object_property_add_uint64_ptr(obj, "perf-dma-queue-peak", &s->perf.dma_queue_peak, OBJ_PROP_FLAG_READ);
+    // The vm<n>-perf-* and dma<c>-perf-* ones are added at realize, once num-slots and dma-channels are known
+    object_property_add_str(obj, "profile-dump", NULL, ks_prof_dump_set);
 
     // Initialize VM contexts (done in reset, but good practice)
     for (int i = 0; i < NUM_VM_SLOTS_QEMU; i++) {
@@ -449,14 +3108,724 @@ static void keystone_copro_init(Object *obj) {
          s->vm_contexts[i].error_code = 0;
         s->vm_contexts[i].pc = 0;
     }
-    s->dma_buffer = NULL;
+}
+
+/*
+ * Slot memories migrate in a live section of their own rather than in
+ * vmstate_keystone_copro: setup marks every slot dirty, each pass sends the
+ * prog_mem/data_mem of dirty slots that are not running and clears their
+ * bits, and the final pass settles the runs and sends the rest. A slot that
+ * sits idle is sent once. The stream is a series of (tag, memory) records,
+ * tag = vm_id << 1 | is_data, ended by KS_SLOT_MEM_END. A data record is
+ * buffer A, followed by a KS_SLOT_MEM_DATA_B record with buffer B. Guest
+ * stores through the slot memory window are picked up at each pass. The
+ * section comes before the device state, so post_load finds the programs in
+ * prog_mem.
+ */
+#define KS_SLOT_MEM_END 0xffffffffU
+#define KS_SLOT_MEM_DATA_B (1U << 31)
+
+static void ks_slot_mem_put(QEMUFile *f, KeystoneCoproState *s, uint64_t skip) {
+    uint64_t prog, data;
+
+    for (int i = 0; i < s->num_slots; i++) {
+        ks_vm_mem_sync(s, i);
+    }
+    prog = s->mem_dirty_prog & ~skip;
+    data = s->mem_dirty_data & ~skip;
+    qatomic_and(&s->mem_dirty_prog, ~prog);
+    qatomic_and(&s->mem_dirty_data, ~data);
+    for (; prog; prog &= prog - 1) {
+        qemu_put_be32(f, ctz64(prog) << 1);
+        qemu_put_buffer(f, s->vm_contexts[ctz64(prog)].prog_mem, KS_VM_PROG_MEM_SIZE);
+    }
+    for (; data; data &= data - 1) {
+        qemu_put_be32(f, ctz64(data) << 1 | 1);
+        qemu_put_buffer(f, s->vm_contexts[ctz64(data)].data_bufs[0], KS_VM_DATA_MEM_SIZE);
+        qemu_put_be32(f, KS_SLOT_MEM_DATA_B | ctz64(data) << 1 | 1);
+        qemu_put_buffer(f, s->vm_contexts[ctz64(data)].data_bufs[1], KS_VM_DATA_MEM_SIZE);
+    }
+    qemu_put_be32(f, KS_SLOT_MEM_END);
+}
+
+static int ks_slot_mem_save_setup(QEMUFile *f, void *opaque, Error **errp) {
+    KeystoneCoproState *s = opaque;
+
+    qatomic_set(&s->mem_dirty_prog, ks_slot_mask(s));
+    qatomic_set(&s->mem_dirty_data, ks_slot_mask(s));
+    qemu_put_be32(f, KS_SLOT_MEM_END);
+    return 0;
+}
+
+// Called without the BQL. Memory of a running slot waits for a later pass.
+static int ks_slot_mem_save_iterate(QEMUFile *f, void *opaque) {
+    KeystoneCoproState *s = opaque;
+    int done;
+
+    bql_lock();
+    ks_slot_mem_put(f, s, ks_active_vm_mask(s));
+    done = !(s->mem_dirty_prog | s->mem_dirty_data);
+    bql_unlock();
+    return done;
+}
+
+// Guest stopped, BQL held
+static int ks_slot_mem_save_complete(QEMUFile *f, void *opaque) {
+    KeystoneCoproState *s = opaque;
+
+    ks_copro_drain(s);
+    ks_slot_mem_put(f, s, 0);
+    return 0;
+}
+
+static void ks_slot_mem_pending(void *opaque, uint64_t *must_precopy, uint64_t *can_postcopy) {
+    KeystoneCoproState *s = opaque;
+
+    *must_precopy += ctpop64(qatomic_read(&s->mem_dirty_prog)) * KS_VM_PROG_MEM_SIZE +
+                     ctpop64(qatomic_read(&s->mem_dirty_data)) * KS_VM_DATA_MEM_SIZE * 2;
+}
+
+static int ks_slot_mem_load(QEMUFile *f, void *opaque, int version_id) {
+    KeystoneCoproState *s = opaque;
+
+    for (;;) {
+        uint32_t tag = qemu_get_be32(f);
+        KeystoneVMContext *vm;
+
+        if (qemu_file_get_error(f)) {
+            return qemu_file_get_error(f);
+        }
+        if (tag == KS_SLOT_MEM_END) {
+            return 0;
+        }
+        if (((tag & ~KS_SLOT_MEM_DATA_B) >> 1) >= s->num_slots ||
+            ((tag & KS_SLOT_MEM_DATA_B) && !(tag & 1))) {
+            return -EINVAL;
+        }
+        vm = &s->vm_contexts[(tag & ~KS_SLOT_MEM_DATA_B) >> 1];
+        // Into the buffers themselves; post_load picks the ACTIVE one
+        if (tag & 1) {
+            qemu_get_buffer(f, vm->data_bufs[!!(tag & KS_SLOT_MEM_DATA_B)], KS_VM_DATA_MEM_SIZE);
+        } else {
+            qemu_get_buffer(f, vm->prog_mem, KS_VM_PROG_MEM_SIZE);
+        }
+    }
+}
+
+static const SaveVMHandlers ks_slot_mem_handlers = {
+    .save_setup = ks_slot_mem_save_setup,
+    .save_live_iterate = ks_slot_mem_save_iterate,
+    .save_live_complete_precopy = ks_slot_mem_save_complete,
+    .state_pending_estimate = ks_slot_mem_pending,
+    .state_pending_exact = ks_slot_mem_pending,
+    .load_state = ks_slot_mem_load,
+};
+
+static void keystone_copro_realize(DeviceState *dev, Error **errp) {
+    KeystoneCoproState *s = KEYSTONE_COPRO(dev);
+
+    if (!s->exec_mode || !strcmp(s->exec_mode, "interp")) {
+        s->use_jit = false;
+    } else if (!strcmp(s->exec_mode, "jit")) {
+        s->use_jit = true;
+    } else {
+        error_setg(errp, "exec-mode must be 'interp' or 'jit', not '%s'", s->exec_mode);
+        return;
+    }
+    if (s->num_slots < 1 || s->num_slots > NUM_VM_SLOTS_QEMU) {
+        error_setg(errp, "num-slots must be from 1 to %d", NUM_VM_SLOTS_QEMU);
+        return;
+    }
+    if (s->vm_irq_lines > s->num_slots) {
+        error_setg(errp, "vm-irq-lines must be at most num-slots (%u)", s->num_slots);
+        return;
+    }
+    if (s->worker_threads > NUM_VM_SLOTS_QEMU) {
+        error_setg(errp, "worker-threads must be at most %d", NUM_VM_SLOTS_QEMU);
+        return;
+    }
+    if (s->prog_cache_size > KS_PROG_CACHE_MAX_ENTRIES) {
+        error_setg(errp, "prog-cache-size must be at most %d", KS_PROG_CACHE_MAX_ENTRIES);
+        return;
+    }
+    if (!s->map_window_size || s->map_window_size > KS_MAP_WINDOW_MAX_SIZE ||
+        s->map_window_size % KS_MAP_WINDOW_ALIGN) {
+        error_setg(errp, "map-window-size must be a multiple of %d up to %d", KS_MAP_WINDOW_ALIGN,
+                   KS_MAP_WINDOW_MAX_SIZE);
+        return;
+    }
+    if (s->dma_bus_width < 8 || s->dma_bus_width > 1024 || !is_power_of_2(s->dma_bus_width)) {
+        error_setg(errp, "dma-bus-width must be a power of two from 8 to 1024");
+        return;
+    }
+    if (s->dma_burst_len < 1 || s->dma_burst_len > KS_DMA_MAX_BURST_LEN) {
+        error_setg(errp, "dma-burst-len must be from 1 to %d", KS_DMA_MAX_BURST_LEN);
+        return;
+    }
+    if (!s->dma_clock_mhz) {
+        error_setg(errp, "dma-clock-mhz must not be 0");
+        return;
+    }
+    if (s->dma_channels < 1 || s->dma_channels > KS_DMA_MAX_CHANNELS) {
+        error_setg(errp, "dma-channels must be from 1 to %d", KS_DMA_MAX_CHANNELS);
+        return;
+    }
+    if (!s->profile || !strcmp(s->profile, "off")) {
+        s->prof_period = 0;
+    } else if (!strcmp(s->profile, "sample")) {
+        s->prof_period = s->profile_period;
+    } else if (!strcmp(s->profile, "exact")) {
+        s->prof_period = 1;
+    } else {
+        error_setg(errp, "profile must be 'off', 'sample' or 'exact', not '%s'", s->profile);
+        return;
+    }
+    if (!s->profile_period) {
+        error_setg(errp, "profile-period must not be 0");
+        return;
+    }
+    if (s->profile_file && !s->prof_period) {
+        error_setg(errp, "profile-file needs profile=sample or profile=exact");
+        return;
+    }
+    memory_region_init(&s->slot_mem, OBJECT(s), TYPE_KEYSTONE_COPRO "-slot-mem",
+                       (uint64_t)s->num_slots * KS_VM_MEM_STRIDE);
+    for (int i = 0; i < s->num_slots; i++) {
+        KeystoneVMContext *vm = &s->vm_contexts[i];
+        g_autofree char *prog = g_strdup_printf(TYPE_KEYSTONE_COPRO "-vm%d-prog", i);
+        g_autofree char *data = g_strdup_printf(TYPE_KEYSTONE_COPRO "-vm%d-data", i);
+        g_autofree char *data_b = g_strdup_printf(TYPE_KEYSTONE_COPRO "-vm%d-data-b", i);
+
+        // Not migrated as RAM: ks_slot_mem_handlers sends them
+        if (!memory_region_init_ram_nomigrate(&vm->prog_mr, OBJECT(s), prog, KS_VM_PROG_MEM_SIZE, errp) ||
+            !memory_region_init_ram_nomigrate(&vm->data_mr, OBJECT(s), data, KS_VM_DATA_MEM_SIZE, errp) ||
+            !memory_region_init_ram_nomigrate(&vm->data_b_mr, OBJECT(s), data_b, KS_VM_DATA_MEM_SIZE, errp)) {
+            return;
+        }
+        vm->prog_mem = memory_region_get_ram_ptr(&vm->prog_mr);
+        vm->data_bufs[0] = memory_region_get_ram_ptr(&vm->data_mr);
+        vm->data_bufs[1] = memory_region_get_ram_ptr(&vm->data_b_mr);
+        vm->data_mem = vm->data_bufs[0];
+        // Guest stores are found through the dirty log, see ks_vm_mem_sync
+        memory_region_set_log(&vm->prog_mr, true, DIRTY_MEMORY_VGA);
+        memory_region_set_log(&vm->data_mr, true, DIRTY_MEMORY_VGA);
+        memory_region_set_log(&vm->data_b_mr, true, DIRTY_MEMORY_VGA);
+        memory_region_add_subregion(&s->slot_mem, KS_VM_MEM_WINDOW(i), &vm->prog_mr);
+        memory_region_add_subregion(&s->slot_mem, KS_VM_MEM_WINDOW(i) + KS_VM_MEM_DATA_OFF, &vm->data_mr);
+        memory_region_add_subregion(&s->slot_mem, KS_VM_MEM_WINDOW(i) + KS_VM_MEM_DATA_B_OFF, &vm->data_b_mr);
+    }
+    // A worker per slot at most; more would never find work
+    s->worker_threads = MIN(s->worker_threads, s->num_slots);
+    s->prog_cache = g_new0(KsProgCacheEntry *, s->prog_cache_size);
+
+    memory_region_init_io(&s->iomem, OBJECT(s), &keystone_copro_ops, s,
+                          TYPE_KEYSTONE_COPRO, KS_COPRO_CSR_SIZE(s->num_slots));
+    sysbus_init_mmio(SYS_BUS_DEVICE(s), &s->iomem);
+    memory_region_init_io(&s->map_window, OBJECT(s), &ks_map_window_ops, s,
+                          TYPE_KEYSTONE_COPRO "-maps", s->map_window_size);
+    sysbus_init_mmio(SYS_BUS_DEVICE(s), &s->map_window);
+    sysbus_init_mmio(SYS_BUS_DEVICE(s), &s->slot_mem);
+    if (s->vm_irq_lines) {
+        qdev_init_gpio_out_named(dev, s->vm_irq, "vm-irq", s->vm_irq_lines);
+    }
+    for (int i = 0; i < s->num_slots; i++) {
+        KsVmPerf *perf = &s->vm_perf[i];
+        g_autofree char *runs = g_strdup_printf("vm%d-perf-runs", i);
+        g_autofree char *insns = g_strdup_printf("vm%d-perf-insns", i);
+        g_autofree char *errors = g_strdup_printf("vm%d-perf-errors", i);
+        g_autofree char *dma_bytes = g_strdup_printf("vm%d-perf-dma-bytes", i);
+
+        object_property_add_uint64_ptr(OBJECT(s), runs, &perf->runs, OBJ_PROP_FLAG_READ);
+        object_property_add_uint64_ptr(OBJECT(s), insns, &perf->insns, OBJ_PROP_FLAG_READ);
+        object_property_add_uint64_ptr(OBJECT(s), errors, &perf->errors, OBJ_PROP_FLAG_READ);
+        object_property_add_uint64_ptr(OBJECT(s), dma_bytes, &perf->dma_bytes, OBJ_PROP_FLAG_READ);
+    }
+    for (int c = 0; c < s->dma_channels; c++) {
+        g_autofree char *busy = g_strdup_printf("dma%d-perf-busy-ns", c);
+
+        object_property_add_uint64_ptr(OBJECT(s), busy, &s->perf.dma_chan_busy_ns[c], OBJ_PROP_FLAG_READ);
+    }
+
+    if (s->prof_period) {
+        s->prof_progs = g_hash_table_new_full(g_int64_hash, g_int64_equal, NULL, ks_prof_prog_free);
+        for (int i = 0; i < s->num_slots; i++) {
+            // One more for the trap past the last instruction
+            s->vm_contexts[i].prof_hits = g_new0(uint64_t, KS_VM_PROG_MAX_INSNS + 1);
+            s->vm_contexts[i].prof_left = s->prof_period;
+        }
+        if (s->profile_file) {
+            s->prof_exit.notify = ks_prof_exit_notify;
+            qemu_add_exit_notifier(&s->prof_exit);
+        }
+    }
+
+    // DMA goes through the device's own view of memory; default to the
+    // system bus if the board did not wire up "dma-mr".
+    if (!s->dma_mr) {
+        s->dma_mr = get_system_memory();
+    }
+    address_space_init(&s->dma_as, s->dma_mr, TYPE_KEYSTONE_COPRO "-dma");
+    register_savevm_live(TYPE_KEYSTONE_COPRO "-slot-mem", VMSTATE_INSTANCE_ID_ANY, 1, &ks_slot_mem_handlers, s);
+    s->mbox_bh = qemu_bh_new(ks_mbox_bh, s);
+
+    if (s->worker_threads) {
+        qemu_mutex_init(&s->run_lock);
+        qemu_cond_init(&s->run_cond);
+        qemu_cond_init(&s->idle_cond);
+        s->run_bh = qemu_bh_new(ks_copro_run_bh, s);
+        s->workers = g_new0(QemuThread, s->worker_threads);
+        for (uint32_t i = 0; i < s->worker_threads; i++) {
+            qemu_thread_create(&s->workers[i], "ks-copro-worker", ks_copro_worker_thread,
+                               s, QEMU_THREAD_JOINABLE);
+        }
+    }
+}
+
+static void keystone_copro_unrealize(DeviceState *dev) {
+    KeystoneCoproState *s = KEYSTONE_COPRO(dev);
+
+    if (s->worker_threads) {
+        for (int i = 0; i < s->num_slots; i++) {
+            ks_copro_vm_quiesce(s, i);
+        }
+        qemu_mutex_lock(&s->run_lock);
+        s->run_shutdown = true;
+        qemu_cond_broadcast(&s->run_cond);
+        qemu_mutex_unlock(&s->run_lock);
+        for (uint32_t i = 0; i < s->worker_threads; i++) {
+            qemu_thread_join(&s->workers[i]);
+        }
+        g_free(s->workers);
+        qemu_bh_delete(s->run_bh);
+        qemu_cond_destroy(&s->idle_cond);
+        qemu_cond_destroy(&s->run_cond);
+        qemu_mutex_destroy(&s->run_lock);
+    }
+    qemu_bh_delete(s->mbox_bh);
+    ks_map_destroy_all(s);
+    for (int i = 0; i < s->num_slots; i++) {
+        ks_batch_release(s, &s->vm_contexts[i]);
+        ks_copro_vm_drop_prog(&s->vm_contexts[i]);
+    }
+    ks_prog_cache_flush(s);
+    g_free(s->prog_cache);
+    if (s->prof_progs) {
+        if (s->profile_file) {
+            qemu_remove_exit_notifier(&s->prof_exit);
+        }
+        g_hash_table_destroy(s->prof_progs);
+        for (int i = 0; i < s->num_slots; i++) {
+            g_free(s->vm_contexts[i].prof_hits);
+        }
+    }
+    unregister_savevm(NULL, TYPE_KEYSTONE_COPRO "-slot-mem", s);
+    address_space_destroy(&s->dma_as);
+}
+
+// Slot runs are not part of the migration stream; settle them first
+static int keystone_copro_pre_save(void *opaque) {
+    KeystoneCoproState *s = KEYSTONE_COPRO(opaque);
+
+    // Before draining: a hart woken by a run finishing now was saved as halted
+    for (int i = 0; i < KS_VM_WAIT_MAX_HARTS; i++) {
+        s->vm_wait_saved[i] = s->vm_waiters[i].cpu ? s->vm_waiters[i].cpu->cpu_index + 1 : 0;
+    }
+    ks_copro_drain(s);
+    for (int i = 0; i < s->num_slots; i++) {
+        KeystoneVMContext *vm = &s->vm_contexts[i];
+
+        vm->prog_handle_saved = vm->prog_entry ? vm->prog_entry->handle : 0;
+    }
+    return 0;
+}
+
+// Migrated maps are allocated as they are loaded
+static int keystone_copro_pre_load(void *opaque) {
+    ks_map_destroy_all(KEYSTONE_COPRO(opaque));
+    return 0;
+}
+
+// Check the migrated maps and their window placement, and rebuild their indexes
+static int ks_map_post_load(KeystoneCoproState *s) {
+    for (int i = 0; i < KS_EBPF_MAX_MAPS; i++) {
+        KsEbpfMap *m = &s->maps[i];
+        uint64_t end = (uint64_t)s->map_win_off[i] + ROUND_UP(m->data_size, KS_MAP_WINDOW_ALIGN);
+
+        if (!m->type) {
+            if (m->data_size || s->map_win_off[i]) {
+                return -EINVAL;
+            }
+            continue;
+        }
+        if (s->map_win_off[i] % KS_MAP_WINDOW_ALIGN || end > s->map_window_size ||
+            (m->type == KS_EBPF_MAP_PERSLOT_ARRAY ? m->copies != s->num_slots : m->copies != 1) ||
+            ks_ebpf_map_restore(m)) {
+            return -EINVAL;
+        }
+        for (int j = 0; j < i; j++) {
+            if (s->maps[j].type && s->map_win_off[j] < end &&
+                s->map_win_off[i] < s->map_win_off[j] + s->maps[j].data_size) {
+                return -EINVAL;
+            }
+        }
+    }
+    return s->map_select <= KS_MAP_SELECT_MASK ? 0 : -EINVAL;
+}
+
+/*
+ * Put the migrated program in prog_mem back in the slot: the cache entry
+ * with its handle if the cache still holds it, otherwise a private copy
+ * that keeps reporting the handle, as an evicted entry would.
+ */
+static void ks_copro_vm_restore_prog(KeystoneCoproState *s, unsigned vm_id) {
+    KeystoneVMContext *vm = &s->vm_contexts[vm_id];
+    KsProgCacheEntry *e = NULL;
+
+    for (uint32_t i = 0; vm->prog_handle_saved && i < s->prog_cache_size; i++) {
+        KsProgCacheEntry *c = s->prog_cache[i];
+
+        if (c && c->handle == vm->prog_handle_saved && c->len == vm->prog_len &&
+            !memcmp(c->code, vm->prog_mem, c->len)) {
+            e = c;
+            break;
+        }
+    }
+    if (e) {
+        e->refs++;
+    } else {
+        e = ks_prog_entry_new(s, vm->prog_mem, vm->prog_len, ks_prog_hash(vm->prog_mem, vm->prog_len));
+        e->handle = vm->prog_handle_saved;
+        e->refs = 1;
+    }
+    vm->prog_entry = e;
+    vm->prog = e->prog;
+    vm->jit = e->jit;
+}
+
+static int keystone_copro_post_load(void *opaque, int version_id) {
+    KeystoneCoproState *s = KEYSTONE_COPRO(opaque);
+    KsDmaChannel *ch0 = &s->dma_chan[0];
+    bool on_ring = false, on_sq = false;
+
+    /*
+     * Version 1 streams come from eight-slot, single-line devices with the
+     * VM bits in INT_STATUS, and one DMA engine that ran a LOAD_PROG or
+     * LOAD_DATA_IN transfer in one go; resume that from the start.
+     */
+    if (version_id == 1) {
+        if (s->num_slots != KS_VM_LEGACY_SLOTS || s->vm_irq_lines) {
+            return -EINVAL;
+        }
+        s->vm_done_status = s->int_status_reg & IRQ_VM_DONE_MASK;
+        s->vm_error_status = (s->int_status_reg & IRQ_VM_ERROR_MASK) >> IRQ_VM_ERROR_SHIFT;
+        s->vm_done_enable = s->int_enable_reg & IRQ_VM_DONE_MASK;
+        s->vm_error_enable = (s->int_enable_reg & IRQ_VM_ERROR_MASK) >> IRQ_VM_ERROR_SHIFT;
+        s->int_status_reg &= ~(IRQ_VM_DONE_MASK | IRQ_VM_ERROR_MASK);
+        s->int_enable_reg &= ~(IRQ_VM_DONE_MASK | IRQ_VM_ERROR_MASK);
+        if (ch0->active) {
+            ks_dma_begin(ch0, ch0->target_vm_id, ch0->is_prog_load, false);
+            ks_dma_add_seg(ch0, ch0->src_addr, ch0->len);
+            ch0->fetched = true;
+        }
+    }
+    if (s->vm_select_id >= s->num_slots) {
+        return -EINVAL;
+    }
+    for (uint32_t c = 0; c < s->dma_channels; c++) {
+        KsDmaChannel *ch = &s->dma_chan[c];
+
+        if (ch->target_vm_id >= s->num_slots || ch->seg_count > KS_DMA_MAX_SG || ch->seg_idx > ch->seg_count ||
+            (ch->active && ch->from_ring && (ch->for_sq || on_ring)) || (ch->active && ch->for_sq && on_sq)) {
+            return -EINVAL;
+        }
+        on_ring |= ch->active && ch->from_ring;
+        on_sq |= ch->active && ch->for_sq;
+    }
+    if (s->dma_rr >= s->num_slots + 2 || s->dma_chan_done >> s->dma_channels ||
+        s->dma_chan_error >> s->dma_channels) {
+        return -EINVAL;
+    }
+    for (int i = 0; i < KS_VM_WAIT_MAX_HARTS; i++) {
+        CPUState *cs = s->vm_wait_saved[i] ? qemu_get_cpu(s->vm_wait_saved[i] - 1) : NULL;
+
+        if (cs) {
+            cs->halted = 0; // Back into BPF.VM.WAIT, which halts it again if nothing is pending
+            qemu_cpu_kick(cs);
+        }
+    }
+    if (s->vm_irq_lines < 64 && (s->vm_irq_levels >> s->vm_irq_lines)) {
+        return -EINVAL;
+    }
+    s->mbox_pending = 0;
+    for (int i = 0; i < s->num_slots; i++) {
+        KsVmMbox *mb = &s->vm_mbox[i];
+        uint32_t depth_log2 = (mb->ctrl >> KS_MBOX_FIFO_DEPTH_SHIFT) & KS_MBOX_FIFO_DEPTH_MASK;
+
+        if ((mb->ctrl & ~KS_MBOX_FIFO_CTRL_MASK) || depth_log2 > KS_MBOX_FIFO_MAX_LOG2 ||
+            (mb->irq_enable & ~KS_MBOX_IRQ_MASK)) {
+            return -EINVAL;
+        }
+        mb->in.depth = mb->out.depth = 1u << depth_log2;
+        if (mb->in.tail - mb->in.head > mb->in.depth || mb->out.tail - mb->out.head > mb->out.depth) {
+            return -EINVAL;
+        }
+        mb->cond = ks_mbox_cond(mb);
+        if (mb->cond & mb->irq_enable) {
+            s->mbox_pending |= 1ULL << i;
+        }
+    }
+    // Version 1 streams have no slot state or maps; they stay as reset left them
+    if (version_id == 1) {
+        return 0;
+    }
+    for (int i = 0; i < s->num_slots; i++) {
+        KeystoneVMContext *vm = &s->vm_contexts[i];
+
+        if (vm->prog_len > KS_VM_PROG_MEM_SIZE || vm->prog_len % KS_VM_INSN_SIZE ||
+            (vm->has_program && !vm->prog_len) || vm->data_len > KS_VM_DATA_MEM_SIZE ||
+            vm->out_max > KS_VM_DATA_MEM_SIZE || vm->out_len > vm->out_max ||
+            (vm->mem_ctrl & ~KS_VM_MEM_CTRL_WRITE_LOCK) || vm->batch_done > KS_BATCH_MAX_RECORDS ||
+            (vm->data_buf_ctrl & ~KS_VM_DATA_BUF_PINGPONG) || vm->data_active > 1 ||
+            vm->data_fill_len > KS_VM_DATA_MEM_SIZE || (vm->data_ready && !ks_vm_data_pingpong(vm)) ||
+            vm->dma_queue_head >= KS_DMA_QUEUE_DEPTH || vm->dma_queue_count > KS_DMA_QUEUE_DEPTH) {
+            return -EINVAL;
+        }
+        for (int q = 0; q < vm->dma_queue_count; q++) {
+            KsDmaReq *req = &vm->dma_queue[(vm->dma_queue_head + q) % KS_DMA_QUEUE_DEPTH];
+
+            if (req->is_prog ? req->len > KS_VM_PROG_MEM_SIZE || req->len % KS_VM_INSN_SIZE
+                             : req->len > KS_VM_DATA_MEM_SIZE) {
+                return -EINVAL;
+            }
+        }
+        vm->data_mem = vm->data_bufs[vm->data_active];
+        ks_copro_vm_drop_prog(vm);
+        if (vm->has_program) {
+            ks_copro_vm_restore_prog(s, i);
+        }
+    }
+    return ks_map_post_load(s);
+}
+
+/*
+ * Program cache contents: entry count, then handle, last_use, length and
+ * code of each entry. Entries are decoded, verified and compiled again on
+ * load; any beyond this side's prog-cache-size are dropped, as an eviction
+ * would.
+ */
+static int ks_prog_cache_save(QEMUFile *f, void *pv, size_t size, const VMStateField *field, JSONWriter *vmdesc) {
+    KeystoneCoproState *s = container_of(pv, KeystoneCoproState, prog_cache);
+
+    qemu_put_be32(f, s->prog_cache_used);
+    for (uint32_t i = 0; i < s->prog_cache_size; i++) {
+        KsProgCacheEntry *e = s->prog_cache[i];
+
+        if (e) {
+            qemu_put_be32(f, e->handle);
+            qemu_put_be64(f, e->last_use);
+            qemu_put_be32(f, e->len);
+            qemu_put_buffer(f, e->code, e->len);
+        }
+    }
+    return 0;
+}
+
+static int ks_prog_cache_load(QEMUFile *f, void *pv, size_t size, const VMStateField *field) {
+    KeystoneCoproState *s = container_of(pv, KeystoneCoproState, prog_cache);
+    uint32_t count = qemu_get_be32(f);
+    g_autofree uint8_t *code = g_malloc(KS_VM_PROG_MEM_SIZE);
+
+    if (count > KS_PROG_CACHE_MAX_ENTRIES) {
+        return -EINVAL;
+    }
+    ks_prog_cache_flush(s);
+    for (uint32_t n = 0; n < count; n++) {
+        uint32_t handle = qemu_get_be32(f);
+        uint64_t last_use = qemu_get_be64(f);
+        uint32_t len = qemu_get_be32(f);
+        KsProgCacheEntry *e;
+
+        if (!len || len > KS_VM_PROG_MEM_SIZE || len % KS_VM_INSN_SIZE) {
+            return -EINVAL;
+        }
+        qemu_get_buffer(f, code, len);
+        if (s->prog_cache_used == s->prog_cache_size) {
+            continue;
+        }
+        e = ks_prog_entry_new(s, code, len, ks_prog_hash(code, len));
+        e->handle = handle;
+        e->last_use = last_use;
+        e->cached = true;
+        s->prog_cache[s->prog_cache_used++] = e;
+    }
+    return qemu_file_get_error(f);
+}
+
+static const VMStateInfo vmstate_info_ks_prog_cache = {
+    .name = "keystone-copro-prog-cache",
+    .get = ks_prog_cache_load,
+    .put = ks_prog_cache_save,
+};
+
+static const VMStateDescription vmstate_ks_dma_req = {
+    .name = TYPE_KEYSTONE_COPRO "/dma-req",
+    .version_id = 1,
+    .minimum_version_id = 1,
+    .fields = (VMStateField[]) {
+        VMSTATE_UINT64(addr, KsDmaReq),
+        VMSTATE_UINT32(len, KsDmaReq),
+        VMSTATE_BOOL(is_prog, KsDmaReq),
+        VMSTATE_INT64(queued_at, KsDmaReq),
+        VMSTATE_END_OF_LIST()
+    }
+};
+
+// Slot state outside the memories, which have their own live section
+static const VMStateDescription vmstate_ks_vm_context = {
+    .name = TYPE_KEYSTONE_COPRO "/vm-context",
+    .version_id = 1,
+    .minimum_version_id = 1,
+    .fields = (VMStateField[]) {
+        VMSTATE_BOOL(error_state, KeystoneVMContext),
+        VMSTATE_UINT32(error_code, KeystoneVMContext),
+        VMSTATE_UINT32(pc, KeystoneVMContext),
+        VMSTATE_BOOL(done, KeystoneVMContext),
+        VMSTATE_UINT64(retval, KeystoneVMContext),
+        VMSTATE_BOOL(has_program, KeystoneVMContext),
+        VMSTATE_UINT32(prog_len, KeystoneVMContext),
+        VMSTATE_UINT32(prog_handle_saved, KeystoneVMContext),
+        VMSTATE_UINT32(data_len, KeystoneVMContext),
+        VMSTATE_UINT64(out_addr, KeystoneVMContext),
+        VMSTATE_UINT32(out_max, KeystoneVMContext),
+        VMSTATE_UINT32(out_len, KeystoneVMContext),
+        VMSTATE_BOOL(sq_owned, KeystoneVMContext),
+        VMSTATE_UINT64(sq_cookie, KeystoneVMContext),
+        VMSTATE_UINT32(mem_ctrl, KeystoneVMContext),
+        VMSTATE_BOOL(prog_stale, KeystoneVMContext),
+        VMSTATE_UINT32(batch_done, KeystoneVMContext),
+        VMSTATE_UINT32(data_buf_ctrl, KeystoneVMContext),
+        VMSTATE_UINT8(data_active, KeystoneVMContext),
+        VMSTATE_BOOL(data_ready, KeystoneVMContext),
+        VMSTATE_UINT32(data_fill_len, KeystoneVMContext),
+        VMSTATE_STRUCT_ARRAY(dma_queue, KeystoneVMContext, KS_DMA_QUEUE_DEPTH, 0, vmstate_ks_dma_req, KsDmaReq),
+        VMSTATE_UINT8(dma_queue_head, KeystoneVMContext),
+        VMSTATE_UINT8(dma_queue_count, KeystoneVMContext),
+        VMSTATE_END_OF_LIST()
+    }
+};
+
+static const VMStateDescription vmstate_ks_vm_page = {
+    .name = TYPE_KEYSTONE_COPRO "/vm-page",
+    .version_id = 1,
+    .minimum_version_id = 1,
+    .fields = (VMStateField[]) {
+        VMSTATE_UINT32(prog_addr_low, KsVmPageRegs),
+        VMSTATE_UINT32(prog_addr_high, KsVmPageRegs),
+        VMSTATE_UINT32(data_in_addr_low, KsVmPageRegs),
+        VMSTATE_UINT32(data_in_addr_high, KsVmPageRegs),
+        VMSTATE_UINT32(data_out_addr_low, KsVmPageRegs),
+        VMSTATE_UINT32(data_out_addr_high, KsVmPageRegs),
+        VMSTATE_UINT32(data_len, KsVmPageRegs),
+        VMSTATE_UINT32(data_out_len, KsVmPageRegs),
+        VMSTATE_UINT32(batch_rec_size, KsVmPageRegs),
+        VMSTATE_UINT32(batch_count, KsVmPageRegs),
+        VMSTATE_UINT32(batch_out_stride, KsVmPageRegs),
+        VMSTATE_END_OF_LIST()
+    }
+};
+
+static const VMStateDescription vmstate_ks_vm_perf = {
+    .name = TYPE_KEYSTONE_COPRO "/vm-perf",
+    .version_id = 1,
+    .minimum_version_id = 1,
+    .fields = (VMStateField[]) {
+        VMSTATE_UINT64(runs, KsVmPerf),
+        VMSTATE_UINT64(insns, KsVmPerf),
+        VMSTATE_UINT64(errors, KsVmPerf),
+        VMSTATE_UINT64(dma_bytes, KsVmPerf),
+        VMSTATE_END_OF_LIST()
+    }
+};
+
+// Mailbox FIFO mode; the depths follow from ctrl
+static const VMStateDescription vmstate_ks_vm_mbox = {
+    .name = TYPE_KEYSTONE_COPRO "/vm-mbox",
+    .version_id = 1,
+    .minimum_version_id = 1,
+    .fields = (VMStateField[]) {
+        VMSTATE_UINT32(ctrl, KsVmMbox),
+        VMSTATE_UINT32(irq_enable, KsVmMbox),
+        VMSTATE_BOOL(in_overflow, KsVmMbox),
+        VMSTATE_UINT32(in.head, KsVmMbox),
+        VMSTATE_UINT32(in.tail, KsVmMbox),
+        VMSTATE_UINT32(out.head, KsVmMbox),
+        VMSTATE_UINT32(out.tail, KsVmMbox),
+        VMSTATE_UINT32_ARRAY(in_buf, KsVmMbox, KS_MBOX_FIFO_MAX_DEPTH),
+        VMSTATE_UINT32_ARRAY(out_buf, KsVmMbox, KS_MBOX_FIFO_MAX_DEPTH),
+        VMSTATE_END_OF_LIST()
+    }
+};
+
+// Shared map; the index of a hash map is rebuilt from data
+static const VMStateDescription vmstate_ks_map = {
+    .name = TYPE_KEYSTONE_COPRO "/map",
+    .version_id = 1,
+    .minimum_version_id = 1,
+    .fields = (VMStateField[]) {
+        VMSTATE_UINT32(type, KsEbpfMap),
+        VMSTATE_UINT32(key_size, KsEbpfMap),
+        VMSTATE_UINT32(value_size, KsEbpfMap),
+        VMSTATE_UINT32(max_entries, KsEbpfMap),
+        VMSTATE_UINT32(copies, KsEbpfMap),
+        VMSTATE_UINT32(data_size, KsEbpfMap),
+        VMSTATE_VBUFFER_ALLOC_UINT32(data, KsEbpfMap, 0, NULL, data_size),
+        VMSTATE_END_OF_LIST()
+    }
+};
+
+static const VMStateDescription vmstate_ks_dma_chan = {
+    .name = TYPE_KEYSTONE_COPRO "/dma-chan",
+    .version_id = 1,
+    .minimum_version_id = 1,
+    .fields = (VMStateField[]) {
+        VMSTATE_BOOL(active, KsDmaChannel),
+        VMSTATE_UINT64(src_addr, KsDmaChannel),
+        VMSTATE_UINT32(len, KsDmaChannel),
+        VMSTATE_UINT8(target_vm_id, KsDmaChannel),
+        VMSTATE_BOOL(is_prog_load, KsDmaChannel),
+        VMSTATE_BOOL(from_ring, KsDmaChannel),
+        VMSTATE_BOOL(for_sq, KsDmaChannel),
+        VMSTATE_TIMER(timer, KsDmaChannel),
+        VMSTATE_BOOL(fetched, KsDmaChannel),
+        VMSTATE_BOOL(is_out, KsDmaChannel),
+        VMSTATE_UINT32(seg_count, KsDmaChannel),
+        VMSTATE_UINT32(seg_idx, KsDmaChannel),
+        VMSTATE_UINT32(seg_off, KsDmaChannel),
+        VMSTATE_UINT32(moved, KsDmaChannel),
+        VMSTATE_UINT64_ARRAY(seg_addr, KsDmaChannel, KS_DMA_MAX_SG),
+        VMSTATE_UINT32_ARRAY(seg_len, KsDmaChannel, KS_DMA_MAX_SG),
+        VMSTATE_UINT64(sq_cookie, KsDmaChannel),
+        VMSTATE_UINT64(sq_out_addr, KsDmaChannel),
+        VMSTATE_UINT32(sq_out_len, KsDmaChannel),
+        VMSTATE_END_OF_LIST()
+    }
+};
+
+// Version 1 streams carry the single DMA engine of the first device in these fields
+static bool ks_vmstate_v1(void *opaque, int version_id) {
+    return version_id == 1;
 }
 
 static const VMStateDescription vmstate_keystone_copro = {
     .name = TYPE_KEYSTONE_COPRO,
-    .version_id = 1,
+    .version_id = 2,
     .minimum_version_id = 1,
+    .pre_save = keystone_copro_pre_save,
+    .pre_load = keystone_copro_pre_load,
+    .post_load = keystone_copro_post_load,
     .fields = (VMStateField[]) {
+        // First, as it sizes the slot arrays below; version 1 streams are from eight-slot devices
+        VMSTATE_UINT32_EQUAL_V(num_slots, KeystoneCoproState, 2),
         VMSTATE_UINT32(copro_cmd_reg, KeystoneCoproState),
         VMSTATE_UINT32(vm_select_id, KeystoneCoproState),
         VMSTATE_UINT32(prog_addr_low_reg, KeystoneCoproState),
@@ -466,39 +3835,139 @@ static const VMStateDescription vmstate_keystone_copro = {
         VMSTATE_UINT32(data_out_addr_low_reg, KeystoneCoproState),
         VMSTATE_UINT32(data_out_addr_high_reg, KeystoneCoproState),
         VMSTATE_UINT32(data_len_reg, KeystoneCoproState),
+        VMSTATE_UINT32_V(data_out_len_reg, KeystoneCoproState, 2),
         VMSTATE_UINT32(int_status_reg, KeystoneCoproState),
         VMSTATE_UINT32(int_enable_reg, KeystoneCoproState),
 
-        VMSTATE_PARTRAY_OF_UINT32(vm_mailboxes_in, KeystoneCoproState, NUM_VM_SLOTS_QEMU, NUM_MAILBOX_REGS_QEMU),
-        VMSTATE_PARTRAY_OF_UINT32(vm_mailboxes_out, KeystoneCoproState, NUM_VM_SLOTS_QEMU, NUM_MAILBOX_REGS_QEMU),
-        
-        // KeystoneVMContext is simple enough to add directly, or use a sub-vmstate
-        // For now, only saving 'running' and 'error_state' for simplicity. A full VM state would be more complex.
-        // VMSTATE_STRUCT_ARRAY(vm_contexts, KeystoneCoproState, NUM_VM_SLOTS_QEMU, 1, vmstate_keystone_vm_context, KeystoneVMContext),
+        VMSTATE_PARTRAY_OF_UINT32(vm_mailboxes_in, KeystoneCoproState, num_slots, NUM_MAILBOX_REGS_QEMU),
+        VMSTATE_PARTRAY_OF_UINT32(vm_mailboxes_out, KeystoneCoproState, num_slots, NUM_MAILBOX_REGS_QEMU),
 
-        VMSTATE_BOOL(dma_active, KeystoneCoproState),
-        VMSTATE_UINT64(dma_src_addr, KeystoneCoproState),
-        VMSTATE_UINT32(dma_len, KeystoneCoproState),
-        VMSTATE_UINT8(dma_target_vm_id, KeystoneCoproState),
-        VMSTATE_BOOL(dma_is_prog_load, KeystoneCoproState),
-        VMSTATE_TIMER(dma_timer, KeystoneCoproState),
+        // The single DMA engine of version 1, now channel 0
+        VMSTATE_BOOL_TEST(dma_chan[0].active, KeystoneCoproState, ks_vmstate_v1),
+        VMSTATE_SINGLE_TEST(dma_chan[0].src_addr, KeystoneCoproState, ks_vmstate_v1, 0, vmstate_info_uint64, uint64_t),
+        VMSTATE_UINT32_TEST(dma_chan[0].len, KeystoneCoproState, ks_vmstate_v1),
+        VMSTATE_UINT8_TEST(dma_chan[0].target_vm_id, KeystoneCoproState, ks_vmstate_v1),
+        VMSTATE_BOOL_TEST(dma_chan[0].is_prog_load, KeystoneCoproState, ks_vmstate_v1),
+        VMSTATE_TIMER_TEST(dma_chan[0].timer, KeystoneCoproState, ks_vmstate_v1),
+
+        // Interrupts: VM block, lines, moderation, harts waiting in BPF.VM.WAIT
+        VMSTATE_UINT64_V(vm_done_status, KeystoneCoproState, 2),
+        VMSTATE_UINT64_V(vm_error_status, KeystoneCoproState, 2),
+        VMSTATE_UINT64_V(vm_done_enable, KeystoneCoproState, 2),
+        VMSTATE_UINT64_V(vm_error_enable, KeystoneCoproState, 2),
+        VMSTATE_UINT32_EQUAL_V(vm_irq_lines, KeystoneCoproState, 2),
+        VMSTATE_UINT64_V(vm_irq_levels, KeystoneCoproState, 2),
+        VMSTATE_UINT32_ARRAY_V(irq_mod_reg, KeystoneCoproState, KS_IRQ_NUM_CLASSES, 2),
+        VMSTATE_UINT32_V(irq_mod_ctrl, KeystoneCoproState, 2),
+        VMSTATE_UINT32_ARRAY_V(irq_mod_count, KeystoneCoproState, KS_IRQ_NUM_CLASSES, 2),
+        VMSTATE_INT64_ARRAY_V(irq_mod_deadline, KeystoneCoproState, KS_IRQ_NUM_CLASSES, 2),
+        VMSTATE_BOOL_ARRAY_V(irq_mod_fired, KeystoneCoproState, KS_IRQ_NUM_CLASSES, 2),
+        VMSTATE_TIMER_V(irq_mod_timer, KeystoneCoproState, 2),
+        VMSTATE_BOOL_V(irq_level, KeystoneCoproState, 2),
+        VMSTATE_UINT32_ARRAY_V(vm_wait_saved, KeystoneCoproState, KS_VM_WAIT_MAX_HARTS, 2),
+
+        // DMA: descriptor ring, submission/completion queues, channels
+        VMSTATE_UINT32_V(dma_ring_base_low_reg, KeystoneCoproState, 2),
+        VMSTATE_UINT32_V(dma_ring_base_high_reg, KeystoneCoproState, 2),
+        VMSTATE_UINT32_V(dma_ring_size, KeystoneCoproState, 2),
+        VMSTATE_UINT32_V(dma_ring_head, KeystoneCoproState, 2),
+        VMSTATE_UINT32_V(dma_ring_tail, KeystoneCoproState, 2),
+        VMSTATE_UINT32_V(sq_base_low_reg, KeystoneCoproState, 2),
+        VMSTATE_UINT32_V(sq_base_high_reg, KeystoneCoproState, 2),
+        VMSTATE_UINT32_V(cq_base_low_reg, KeystoneCoproState, 2),
+        VMSTATE_UINT32_V(cq_base_high_reg, KeystoneCoproState, 2),
+        VMSTATE_UINT32_V(queue_size, KeystoneCoproState, 2),
+        VMSTATE_UINT32_V(sq_head, KeystoneCoproState, 2),
+        VMSTATE_UINT32_V(sq_tail, KeystoneCoproState, 2),
+        VMSTATE_UINT32_V(cq_head, KeystoneCoproState, 2),
+        VMSTATE_UINT32_V(cq_tail, KeystoneCoproState, 2),
+        VMSTATE_UINT8_V(cq_phase, KeystoneCoproState, 2),
+        VMSTATE_UINT32_V(sq_inflight, KeystoneCoproState, 2),
+        // Before the channels, as it sizes them
+        VMSTATE_UINT32_EQUAL_V(dma_channels, KeystoneCoproState, 2),
+        VMSTATE_STRUCT_VARRAY_UINT32(dma_chan, KeystoneCoproState, dma_channels, 2, vmstate_ks_dma_chan,
+                                     KsDmaChannel),
+        VMSTATE_UINT32_V(dma_rr, KeystoneCoproState, 2),
+        VMSTATE_INT64_V(dma_bus_free_at, KeystoneCoproState, 2),
+        VMSTATE_UINT32_V(dma_chan_done, KeystoneCoproState, 2),
+        VMSTATE_UINT32_V(dma_chan_error, KeystoneCoproState, 2),
+
+        // Slots; runs are settled by pre_save, so no slot is running
+        VMSTATE_STRUCT_VARRAY_UINT32(vm_pages, KeystoneCoproState, num_slots, 2, vmstate_ks_vm_page, KsVmPageRegs),
+        VMSTATE_STRUCT_VARRAY_UINT32(vm_contexts, KeystoneCoproState, num_slots, 2, vmstate_ks_vm_context,
+                                     KeystoneVMContext),
+        VMSTATE_STRUCT_VARRAY_UINT32(vm_mbox, KeystoneCoproState, num_slots, 2, vmstate_ks_vm_mbox, KsVmMbox),
+
+        // Program cache
+        VMSTATE_UINT32_V(prog_cache_next_handle, KeystoneCoproState, 2),
+        VMSTATE_UINT64_V(prog_cache_clock, KeystoneCoproState, 2),
+        VMSTATE_UINT64_V(prog_cache_hits, KeystoneCoproState, 2),
+        VMSTATE_UINT64_V(prog_cache_misses, KeystoneCoproState, 2),
+        VMSTATE_SINGLE(prog_cache, KeystoneCoproState, 2, vmstate_info_ks_prog_cache, KsProgCacheEntry **),
+
+        // Shared maps
+        VMSTATE_UINT32_V(map_select, KeystoneCoproState, 2),
+        VMSTATE_UINT32_V(map_type_reg, KeystoneCoproState, 2),
+        VMSTATE_UINT32_V(map_key_size_reg, KeystoneCoproState, 2),
+        VMSTATE_UINT32_V(map_value_size_reg, KeystoneCoproState, 2),
+        VMSTATE_UINT32_V(map_max_entries_reg, KeystoneCoproState, 2),
+        VMSTATE_UINT32_ARRAY_V(map_win_off, KeystoneCoproState, KS_EBPF_MAX_MAPS, 2),
+        VMSTATE_STRUCT_ARRAY(maps, KeystoneCoproState, KS_EBPF_MAX_MAPS, 2, vmstate_ks_map, KsEbpfMap),
+
+        // Performance counters
+        VMSTATE_UINT64_V(perf.dma_bytes, KeystoneCoproState, 2),
+        VMSTATE_UINT64_V(perf.dma_busy_ns, KeystoneCoproState, 2),
+        VMSTATE_UINT64_V(perf.dma_xfers, KeystoneCoproState, 2),
+        VMSTATE_UINT64_V(perf.dma_queued, KeystoneCoproState, 2),
+        VMSTATE_UINT64_V(perf.dma_queue_wait_ns, KeystoneCoproState, 2),
+        VMSTATE_UINT64_V(perf.dma_queue_peak, KeystoneCoproState, 2),
+        VMSTATE_UINT64_ARRAY_V(perf.dma_chan_busy_ns, KeystoneCoproState, KS_DMA_MAX_CHANNELS, 2),
+        VMSTATE_UINT64_V(perf.cmd_rejected, KeystoneCoproState, 2),
+        VMSTATE_UINT64_V(perf.irq_events, KeystoneCoproState, 2),
+        VMSTATE_UINT64_V(perf.irq_asserts, KeystoneCoproState, 2),
+        VMSTATE_STRUCT_VARRAY_UINT32(vm_perf, KeystoneCoproState, num_slots, 2, vmstate_ks_vm_perf, KsVmPerf),
+        VMSTATE_UINT32_V(perf_high, KeystoneCoproState, 2),
 
         VMSTATE_END_OF_LIST()
     }
 };
 
 
+static Property keystone_copro_properties[] = {
+    DEFINE_PROP_LINK("dma-mr", KeystoneCoproState, dma_mr, TYPE_MEMORY_REGION, MemoryRegion *),
+    DEFINE_PROP_UINT32("num-slots", KeystoneCoproState, num_slots, KS_VM_LEGACY_SLOTS),
+    DEFINE_PROP_UINT32("vm-irq-lines", KeystoneCoproState, vm_irq_lines, 0),
+    DEFINE_PROP_UINT64("max-insns", KeystoneCoproState, max_insns, KS_EBPF_DEFAULT_INSN_LIMIT),
+    DEFINE_PROP_STRING("exec-mode", KeystoneCoproState, exec_mode),
+    DEFINE_PROP_UINT32("worker-threads", KeystoneCoproState, worker_threads, KS_VM_LEGACY_SLOTS),
+    DEFINE_PROP_UINT32("prog-cache-size", KeystoneCoproState, prog_cache_size, KS_PROG_CACHE_DEFAULT_ENTRIES),
+    DEFINE_PROP_UINT32("map-window-size", KeystoneCoproState, map_window_size, KS_MAP_WINDOW_DEFAULT_SIZE),
+    DEFINE_PROP_UINT32("dma-bus-width", KeystoneCoproState, dma_bus_width, KS_DMA_DEFAULT_BUS_WIDTH),
+    DEFINE_PROP_UINT32("dma-burst-len", KeystoneCoproState, dma_burst_len, KS_DMA_DEFAULT_BURST_LEN),
+    DEFINE_PROP_UINT32("dma-clock-mhz", KeystoneCoproState, dma_clock_mhz, KS_DMA_DEFAULT_CLOCK_MHZ),
+    DEFINE_PROP_UINT32("dma-setup-ns", KeystoneCoproState, dma_setup_ns, KS_DMA_DEFAULT_SETUP_NS),
+    DEFINE_PROP_BOOL("dma-zero-latency", KeystoneCoproState, dma_zero_latency, false),
+    DEFINE_PROP_UINT32("dma-channels", KeystoneCoproState, dma_channels, 1),
+    DEFINE_PROP_STRING("profile", KeystoneCoproState, profile),
+    DEFINE_PROP_UINT32("profile-period", KeystoneCoproState, profile_period, KS_PROF_DEFAULT_PERIOD),
+    DEFINE_PROP_STRING("profile-file", KeystoneCoproState, profile_file),
+    DEFINE_PROP_END_OF_LIST(),
+};
+
 static void keystone_copro_class_init(ObjectClass *klass, void *data) {
     DeviceClass *dc = DEVICE_CLASS(klass);
+    dc->realize = keystone_copro_realize;
+    dc->unrealize = keystone_copro_unrealize;
     dc->reset = keystone_copro_reset;
     dc->vmsd = &vmstate_keystone_copro;
-    // dc->props = ...; // For QEMU properties if any
+    device_class_set_props(dc, keystone_copro_properties);
 }
 
 static const TypeInfo keystone_copro_info = {
     .name          = TYPE_KEYSTONE_COPRO,
     .parent        = TYPE_SYS_BUS_DEVICE,
     .instance_size = sizeof(KeystoneCoproState),
+    .instance_align = __alignof__(KeystoneCoproState), // KsVmPerf is cache-line aligned
     .instance_init = keystone_copro_init,
     .class_init    = keystone_copro_class_init,
 };
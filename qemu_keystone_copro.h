@@ -5,13 +5,29 @@
 #include "hw/hw.h"
 #include "qom/object.h"
 #include "exec/memory.h"
+#include "qemu/timer.h"
+#include "qemu/thread.h"
+#include "qemu/notify.h"
+
+#include "qemu_keystone_ebpf.h"
 
 #define TYPE_KEYSTONE_COPRO "keystone-copro"
 OBJECT_DECLARE_SIMPLE_TYPE(KeystoneCoproState, KEYSTONE_COPRO)
 
-#define NUM_VM_SLOTS_QEMU 8
+// Slots per instance: "num-slots", from 1 up to NUM_VM_SLOTS_QEMU. Slots
+// 0-7 (KS_VM_LEGACY_SLOTS) also have INT_STATUS bits and pages at 0x100; a
+// device with more slots is driven through the VM interrupt block and the
+// extended pages.
+#define NUM_VM_SLOTS_QEMU 64
+#define KS_VM_LEGACY_SLOTS 8
 #define NUM_MAILBOX_REGS_QEMU 4
 
+// Per-slot memory sizes, mirroring eBPF_VM_Slot.v
+#define KS_VM_PROG_MAX_INSNS              1024 // NUM_INSTRUCTIONS
+#define KS_VM_INSN_SIZE                   8    // eBPF instructions are 64-bit
+#define KS_VM_PROG_MEM_SIZE               (KS_VM_PROG_MAX_INSNS * KS_VM_INSN_SIZE) // 8 KB
+#define KS_VM_DATA_MEM_SIZE               (4 * 1024) // 4 KB stack memory, also receives DATA_IN
+
 // Mirroring AXI_Lite_Memory_Map.txt offsets
 #define ADDR_COPRO_CMD_REG                0x00
 #define ADDR_VM_SELECT_REG                0x04
@@ -28,11 +44,56 @@ OBJECT_DECLARE_SIMPLE_TYPE(KeystoneCoproState, KEYSTONE_COPRO)
 #define ADDR_SELECTED_VM_STATUS_REG       0x30
 #define ADDR_SELECTED_VM_PC_REG           0x34
 #define ADDR_SELECTED_VM_DATA_OUT_ADDR_REG 0x38
+#define ADDR_SELECTED_VM_RETVAL_REG       0x3C
+#define ADDR_DMA_RING_BASE_LOW_REG        0x40
+#define ADDR_DMA_RING_BASE_HIGH_REG       0x44
+#define ADDR_DMA_RING_SIZE_REG            0x48
+#define ADDR_DMA_RING_HEAD_REG            0x4C
+#define ADDR_DMA_RING_TAIL_REG            0x50
+#define ADDR_SQ_BASE_LOW_REG              0x54
+#define ADDR_SQ_BASE_HIGH_REG             0x58
+#define ADDR_CQ_BASE_LOW_REG              0x5C
+#define ADDR_CQ_BASE_HIGH_REG             0x60
+#define ADDR_QUEUE_SIZE_REG               0x64
+#define ADDR_SQ_TAIL_REG                  0x68
+#define ADDR_SQ_HEAD_REG                  0x6C
+#define ADDR_CQ_HEAD_REG                  0x70
+#define ADDR_CQ_TAIL_REG                  0x74
+#define ADDR_SELECTED_VM_PROG_HANDLE_REG  0x78
+#define ADDR_DATA_OUT_LEN_REG             0x7C
 #define ADDR_MAILBOX_DATA_IN_0_REG        0x80
 #define ADDR_MAILBOX_DATA_OUT_0_REG       0xA0
+#define ADDR_MBOX_FIFO_CTRL_REG           0x90 // See "Mailbox FIFO mode" below
+#define ADDR_MBOX_FIFO_STATUS_REG         0x94
+#define ADDR_MBOX_IRQ_STATUS_REG          0x98
+#define ADDR_MBOX_IRQ_ENABLE_REG          0x9C
+#define ADDR_IRQ_MOD_VM_DONE_REG          0xC0
+#define ADDR_IRQ_MOD_VM_ERROR_REG         0xC4
+#define ADDR_IRQ_MOD_DMA_REG              0xC8
+#define ADDR_IRQ_MOD_CTRL_REG             0xCC
+#define ADDR_PROG_CACHE_STATUS_REG        0xD0
+#define ADDR_PROG_CACHE_HITS_REG          0xD4
+#define ADDR_PROG_CACHE_MISSES_REG        0xD8
+#define ADDR_SELECTED_VM_DATA_OUT_LEN_REG 0xDC
 #define ADDR_COPRO_VERSION_REG            0xFC
 
-#define KS_COPRO_CSR_SIZE                 0x100 // 256 bytes for CSRs
+// Per-VM register pages. Slot N's page at KS_VM_PAGE(N) holds that slot's
+// copy of the per-VM registers at their legacy offsets, addressed directly
+// instead of through VM_SELECT_REG: COPRO_CMD (command bits, always read 0),
+// PROG/DATA_IN/DATA_OUT address pairs, DATA_LEN, DATA_OUT_LEN, SELECTED_VM_*,
+// PROG_HANDLE, mailboxes and the MBOX_* registers.
+// Slots 8 and up have theirs from ADDR_VM_XPAGE_BASE on, past the 4 KB
+// that holds the global CSRs and the first eight pages.
+#define ADDR_VM_PAGE_BASE                 0x100
+#define ADDR_VM_XPAGE_BASE                0x1000
+#define KS_VM_PAGE_SIZE                   0x100
+#define KS_VM_PAGE(id)                    ((id) < KS_VM_LEGACY_SLOTS ? ADDR_VM_PAGE_BASE + (id) * KS_VM_PAGE_SIZE : \
+                                           ADDR_VM_XPAGE_BASE + ((id) - KS_VM_LEGACY_SLOTS) * KS_VM_PAGE_SIZE)
+
+// CSR window: 4 KB up to eight slots, then one more page per slot
+#define KS_COPRO_CSR_SIZE(n)              ((n) <= KS_VM_LEGACY_SLOTS ? 0x1000 : KS_VM_PAGE(n))
+
+#define KS_VM_SELECT_MASK                 0x3F // VM_SELECT_REG[5:0]; IDs past num-slots are ignored
 
 // COPRO_CMD_REG bits
 #define CMD_START_VM        (1 << 0)
@@ -40,6 +101,67 @@ OBJECT_DECLARE_SIMPLE_TYPE(KeystoneCoproState, KEYSTONE_COPRO)
 #define CMD_RESET_VM        (1 << 2)
 #define CMD_LOAD_PROG       (1 << 3)
 #define CMD_LOAD_DATA_IN    (1 << 4)
+#define CMD_LOAD_PROG_HANDLE (1 << 5) // Load the cached program whose handle is in PROG_ADDR_LOW_REG
+#define CMD_START_BATCH     (1 << 6) // Run the program once per record, see Batch record mode
+
+// Output write-back. START_VM latches DATA_OUT_ADDR and DATA_OUT_LEN; when the
+// run ends with EXIT, the first out_len bytes of data memory are written to
+// DATA_OUT_ADDR before VMi_DONE is raised. out_len is DATA_OUT_LEN unless the
+// program picks a shorter length with KS_EBPF_HELPER_SET_OUT_LEN, and is
+// reported in SELECTED_VM_DATA_OUT_LEN_REG. DATA_OUT_LEN 0 disables it; larger
+// values than the data memory are clamped. A bus error raises VMi_ERROR with
+// KS_VM_ERR_DATA_OUT instead.
+
+// Slot memory window, the device's third MMIO region: slot N's prog_mem at
+// KS_VM_MEM_WINDOW(N) and its data memory KS_VM_MEM_DATA_OFF past that, all
+// RAM, so the guest stores a program or a small input with no DMA and no
+// MMIO exit. Writing MEM_PROG_LEN in the slot's page prepares the program
+// stored there, as a LOAD_PROG of that length would; stores to prog_mem
+// after that have it prepared again at the next START_VM. MEM_DATA_LEN
+// sets R2 of the next run, as LOAD_DATA_IN does. Both are refused while the
+// slot runs. With WRITE_LOCK set, the slot's memories are read-only while
+// it runs; without it, stores reach the running program.
+#define ADDR_VM_MEM_PROG_LEN_REG          0x28 // Page offset; bytes of prog_mem holding the program
+#define ADDR_VM_MEM_DATA_LEN_REG          0x2C // Page offset; input bytes in data_mem
+#define ADDR_VM_MEM_CTRL_REG              0x40 // Page offset; KS_VM_MEM_CTRL_*
+#define KS_VM_MEM_CTRL_WRITE_LOCK         (1 << 0)
+#define KS_VM_MEM_STRIDE                  0x4000
+#define KS_VM_MEM_DATA_OFF                KS_VM_PROG_MEM_SIZE
+#define KS_VM_MEM_DATA_B_OFF              (KS_VM_MEM_DATA_OFF + KS_VM_DATA_MEM_SIZE) // Second data-in buffer
+#define KS_VM_MEM_WINDOW(id)              ((id) * KS_VM_MEM_STRIDE)
+
+// Double-buffered data-in: each slot has two data memories, buffer A at
+// KS_VM_MEM_DATA_OFF and buffer B at KS_VM_MEM_DATA_B_OFF of its window.
+// Runs use the ACTIVE one. With PINGPONG set, LOAD_DATA_IN, DMA ring
+// DATA_IN descriptors and MEM_DATA_LEN fill the other one, also while the
+// slot runs; a completed fill shows as READY, and the next START_VM swaps,
+// so the filled buffer becomes ACTIVE with R2 its length and the old one is
+// free for the next fill. A START_VM with nothing READY runs on the ACTIVE
+// buffer again; START_BATCH copies its records into the ACTIVE buffer and
+// leaves a READY fill for the START_VM after it. Without PINGPONG, fills go to the ACTIVE
+// buffer and wait for the slot to be idle, as before. PINGPONG only
+// changes while the slot is idle and no transfer is in flight for it;
+// clearing it drops a READY fill. RESET_VM makes buffer A ACTIVE again.
+#define ADDR_VM_DATA_BUF_REG              0x54 // Page offset; KS_VM_DATA_BUF_*
+#define KS_VM_DATA_BUF_PINGPONG           (1 << 0) // Read/write
+#define KS_VM_DATA_BUF_ACTIVE             (1 << 1) // Read-only: buffer B is ACTIVE
+#define KS_VM_DATA_BUF_READY              (1 << 2) // Read-only: the other buffer is filled, waiting for START
+
+// Batch record mode: START_BATCH runs the slot's program once per record of
+// an array at DATA_IN_ADDR. Record i (BATCH_REC_SIZE bytes at DATA_IN_ADDR +
+// i * BATCH_REC_SIZE) is copied to the start of data memory and run with
+// R2 = BATCH_REC_SIZE; its R0 is stored as a 64-bit little-endian word at
+// DATA_OUT_ADDR + i * BATCH_OUT_STRIDE (nowhere with stride 0). The records
+// run back to back with no exit to the CPU: VMi_DONE is raised once after the
+// last, with RETVAL its R0, and VMi_ERROR stops the batch at the record that
+// faulted. BATCH_DONE counts the records finished so far. Both arrays must be
+// RAM, or the batch fails with KS_VM_ERR_BATCH. DATA_OUT_LEN is not used.
+#define ADDR_VM_BATCH_REC_SIZE_REG        0x44 // Page offset; bytes per record, up to KS_VM_DATA_MEM_SIZE
+#define ADDR_VM_BATCH_COUNT_REG           0x48 // Page offset; records, up to KS_BATCH_MAX_RECORDS
+#define ADDR_VM_BATCH_OUT_STRIDE_REG      0x4C // Page offset; 0, or KS_BATCH_RETVAL_SIZE or more
+#define ADDR_VM_BATCH_DONE_REG            0x50 // Page offset; read-only
+#define KS_BATCH_MAX_RECORDS              65536
+#define KS_BATCH_RETVAL_SIZE              8
 
 // INT_STATUS_REG / INT_ENABLE_REG bits (example)
 #define IRQ_VM0_DONE        (1 << 0)
@@ -50,27 +172,448 @@ OBJECT_DECLARE_SIMPLE_TYPE(KeystoneCoproState, KEYSTONE_COPRO)
 #define IRQ_VM7_ERROR       (1 << 15)
 #define IRQ_DMA_DONE        (1 << 16)
 #define IRQ_DMA_ERROR       (1 << 17)
+#define IRQ_CQ              (1 << 18) // Completion queue entries posted
+#define IRQ_MBOX            (1 << 19) // A slot has an enabled MBOX_IRQ_STATUS bit; a level, not W1C
+#define IRQ_ALL_MASK        0x000FFFFF
+#define IRQ_VM_DONE_MASK    0x000000FF // Slots 0-7 of VM_DONE_STATUS
+#define IRQ_VM_ERROR_SHIFT  8          // Slots 0-7 of VM_ERROR_STATUS
+#define IRQ_VM_ERROR_MASK   0x0000FF00
+
+// VM interrupt block. VMi_DONE and VMi_ERROR of every slot, as 64-bit
+// LOW/HIGH register pairs: the status pairs are W1C, the enable pairs gate
+// them into the line like INT_ENABLE_REG. INT_STATUS_REG[15:0] and
+// INT_ENABLE_REG[15:0] are views of bits 7:0 of these; either side clears
+// or enables the same event. Bits of slots past num-slots read 0.
+#define ADDR_VM_CONFIG_REG                0xA00 // (RO) [6:0] num-slots, [14:8] vm-irq-lines
+#define KS_VM_CONFIG_IRQ_LINES_SHIFT      8
+#define ADDR_VM_DONE_STATUS_REG           0xA08 // (W1C) LOW: slots 31:0, HIGH (+4): slots 63:32
+#define ADDR_VM_ERROR_STATUS_REG          0xA10 // (W1C)
+#define ADDR_VM_DONE_ENABLE_REG           0xA18
+#define ADDR_VM_ERROR_ENABLE_REG          0xA20
+#define ADDR_ACTIVE_VM_MASK_REG           0xA28 // (RO) Running slots; COPRO_STATUS_REG[15:8] has slots 0-7
+#define KS_VM_IRQ_BLOCK_END               0xB00
+
+// Shared maps (KsEbpfMap). The driver defines map MAP_SELECT with the
+// definition registers and CTRL, then reads and writes its entries in the
+// map window, the device's second MMIO region, from MAP_WINDOW_OFF on.
+// Programs name maps by ID in the MAP_* helpers. CTRL is refused while any
+// slot runs, so a map never changes shape under a program.
+#define ADDR_MAP_SELECT_REG               0xB00 // [3:0] map ID; writing it loads the definition registers from the map
+#define ADDR_MAP_TYPE_REG                 0xB04 // KS_EBPF_MAP_*
+#define ADDR_MAP_KEY_SIZE_REG             0xB08 // Bytes; 4 for arrays
+#define ADDR_MAP_VALUE_SIZE_REG           0xB0C
+#define ADDR_MAP_MAX_ENTRIES_REG          0xB10
+#define ADDR_MAP_CTRL_REG                 0xB14 // (W) KS_MAP_CTRL_*; reads 1 if the map exists
+#define ADDR_MAP_WINDOW_OFF_REG           0xB18 // (RO) Offset of the map's image in the window
+#define ADDR_MAP_ENTRY_SIZE_REG           0xB1C // (RO) Bytes per entry in the image
+#define ADDR_MAP_COUNT_REG                0xB20 // (RO) Valid entries of a hash map, MAX_ENTRIES of an array
+#define ADDR_MAP_WINDOW_SIZE_REG          0xB24 // (RO) "map-window-size"
+#define KS_MAP_BLOCK_END                  0xB40
+
+#define KS_MAP_SELECT_MASK                0xF
+#define KS_MAP_CTRL_CREATE                (1 << 0) // From the definition registers; zeroed
+#define KS_MAP_CTRL_DESTROY               (1 << 1) // Applied first, so DESTROY | CREATE redefines the map
+#define KS_MAP_CTRL_CLEAR                 (1 << 2) // Zero an array, empty a hash map
+
+// Map window. Maps are placed first fit, each on a 4 KB boundary so that a
+// driver can map one into a process on its own.
+#define KS_MAP_WINDOW_DEFAULT_SIZE        0x400000  // "map-window-size"
+#define KS_MAP_WINDOW_MAX_SIZE            0x4000000
+#define KS_MAP_WINDOW_ALIGN               0x1000
+
+// Mailbox FIFO mode, per slot, through the selected VM's registers or the
+// slot's page. With FIFO_EN, every IN mailbox offset is the push port of a
+// 2^DEPTH_LOG2-word FIFO to the VM (pushes to a full FIFO are dropped and
+// flagged), and every OUT offset the pop port of one from it (reads 0 when
+// empty). The VM pops and pushes the other ends with MBOX_READ/MBOX_WRITE.
+// MBOX_IRQ_STATUS bits are levels that follow the FIFOs; enabled ones of any
+// slot show as IRQ_MBOX, in the VM DONE moderation class. Writing CTRL
+// empties both FIFOs and is refused while the slot runs.
+#define KS_MBOX_FIFO_EN                   (1 << 0)
+#define KS_MBOX_FIFO_DEPTH_SHIFT          8  // CTRL[11:8] DEPTH_LOG2, at most KS_MBOX_FIFO_MAX_LOG2
+#define KS_MBOX_FIFO_DEPTH_MASK           0xF
+#define KS_MBOX_FIFO_IN_WMARK_SHIFT       16 // CTRL[23:16] IN_WMARK
+#define KS_MBOX_FIFO_OUT_WMARK_SHIFT      24 // CTRL[31:24] OUT_WMARK
+#define KS_MBOX_FIFO_CTRL_MASK            0xFFFF0F01
+#define KS_MBOX_FIFO_MAX_LOG2             8
+#define KS_MBOX_FIFO_MAX_DEPTH            (1 << KS_MBOX_FIFO_MAX_LOG2)
+#define KS_MBOX_STATUS_OUT_SHIFT          16 // STATUS: [8:0] IN words queued, [24:16] OUT words queued
+#define KS_MBOX_STATUS_IN_OVERFLOW        (1u << 31)
+#define KS_MBOX_IRQ_IN_SPACE              (1 << 0) // IN FIFO has at least max(IN_WMARK, 1) words free
+#define KS_MBOX_IRQ_OUT_READY             (1 << 1) // OUT FIFO holds at least max(OUT_WMARK, 1) words
+#define KS_MBOX_IRQ_MASK                  0x3
+
+// Interrupt outputs. By default (vm-irq-lines=0) every event drives the one
+// unnamed GPIO line. With vm-irq-lines=G, the named "vm-irq" lines 0..G-1
+// take the VM events instead: slot i's VMi_DONE/VMi_ERROR drive line i % G,
+// so each line can be its own PLIC source, routed to its own hart. The
+// unnamed line keeps DMA_DONE, DMA_ERROR and CQ. Moderation is unchanged:
+// a class that fires delivers its pending events on whichever lines they map to.
+
+// Interrupt moderation. INT_STATUS bits fall into three classes, each with an
+// IRQ_MOD_<class>_REG: the line is asserted for a class once COUNT events of
+// it are pending, or TIMEOUT after the first of them, whichever comes first.
+// COUNT 0 or 1 with TIMEOUT 0 (the reset value) asserts on every event.
+#define KS_IRQ_CLASS_VM_DONE              0 // VMi_DONE and CQ
+#define KS_IRQ_CLASS_VM_ERROR             1 // VMi_ERROR
+#define KS_IRQ_CLASS_DMA                  2 // DMA_DONE and DMA_ERROR
+#define KS_IRQ_NUM_CLASSES                3
+#define KS_IRQ_MOD_COUNT_MASK             0x0000FFFF // Events per interrupt
+#define KS_IRQ_MOD_TIMEOUT_SHIFT          16         // Microseconds after the first event, 0 for none
+#define KS_IRQ_MOD_CTRL_ERR_BYPASS        (1 << 0)   // VMi_ERROR and DMA_ERROR assert the line at once
+
+// DMA timing. Each transfer takes the modelled time of its bus traffic on
+// the CCU's AXI master: per burst, dma-setup-ns of address/first-data
+// latency, then one beat per dma-bus-width bits at dma-clock-mhz. Data moves
+// one burst per step, so a long transfer lets other device activity
+// interleave with it. dma-zero-latency completes every step at the current
+// virtual time. The defaults are the RTL's: 32-bit AXI at 100 MHz, INCR
+// bursts of up to 256 beats.
+#define KS_DMA_DEFAULT_BUS_WIDTH          32  // Bits, as DATA_WIDTH_AXI
+#define KS_DMA_DEFAULT_BURST_LEN          256 // Beats, as the CCU's DMA_CALC_BURST
+#define KS_DMA_MAX_BURST_LEN              256 // AXI4 INCR limit (AxLEN is 8 bits)
+#define KS_DMA_DEFAULT_CLOCK_MHZ          100 // s_axi_aclk
+#define KS_DMA_DEFAULT_SETUP_NS           100 // Interconnect plus memory controller, per burst
+
+// DMA channels. "dma-channels" engines each move one transfer at a time,
+// with their own state, timer and completion bits. They share the AXI
+// master a burst at a time, in the order they ask for it, so a long
+// transfer no longer holds a short one back until it is over. LOAD_PROG and
+// LOAD_DATA_IN are queued on the slot, up to KS_DMA_QUEUE_DEPTH requests,
+// rather than refused while every channel is taken. A free channel takes
+// the next requester round robin: each slot's queue, then the descriptor
+// ring, then the SQ. A slot's requests are moved one at a time and in
+// order, as are the ring's descriptors and the SQ's inputs, so a ring
+// descriptor or SQ entry for a slot that another channel is loading fails
+// as busy. DMA_DONE and DMA_ERROR still report every transfer; CHAN_DONE
+// and CHAN_ERROR tell which channel it was on.
+#define ADDR_DMA_CHAN_CONFIG_REG          0xB40 // (RO) [3:0] dma-channels, [15:8] KS_DMA_QUEUE_DEPTH
+#define KS_DMA_CHAN_CONFIG_DEPTH_SHIFT    8
+#define ADDR_DMA_CHAN_BUSY_REG            0xB44 // (RO) Bit c: channel c is moving a transfer
+#define ADDR_DMA_CHAN_DONE_REG            0xB48 // (W1C) Bit c: a transfer on channel c completed
+#define ADDR_DMA_CHAN_ERROR_REG           0xB4C // (W1C) Bit c: a transfer on channel c failed
+#define KS_DMA_CHAN_BLOCK_END             0xB60
+#define ADDR_VM_DMA_QUEUE_REG             0x58  // Page offset; (RO) [7:0] queued requests, KS_VM_DMA_QUEUE_LOADING
+#define KS_VM_DMA_QUEUE_LOADING           (1 << 8) // A channel is moving data for the slot
+#define KS_DMA_MAX_CHANNELS               8
+#define KS_DMA_QUEUE_DEPTH                4
+
+// DMA descriptor ring. The driver fills descriptors at DMA_RING_BASE and
+// advances DMA_RING_TAIL (the doorbell); the engine processes them in order,
+// writes len/status back into each one and advances DMA_RING_HEAD. The ring
+// is empty when HEAD == TAIL, so at most SIZE - 1 descriptors are pending.
+#define KS_DMA_RING_MAX_ENTRIES           4096 // DMA_RING_SIZE: 0 (disabled) or a power of two up to this
+#define KS_DMA_MAX_SG                     64   // Scatter-gather entries per descriptor
+
+// KsDmaDesc.op
+#define KS_DMA_OP_PROG                    1 // Gather into prog_mem, as LOAD_PROG
+#define KS_DMA_OP_DATA_IN                 2 // Gather into data_mem, as LOAD_DATA_IN
+#define KS_DMA_OP_DATA_OUT                3 // Scatter data_mem[0..len) out to guest memory
+
+// KsDmaDesc.status, written back by the engine
+#define KS_DMA_DESC_PENDING               0 // Driver writes this before submitting
+#define KS_DMA_DESC_OK                    1
+#define KS_DMA_DESC_ERR_DESC              2 // Bad VM ID, op, SG count or total length
+#define KS_DMA_DESC_ERR_BUS               3 // Bus error on the SG list or a data buffer
+#define KS_DMA_DESC_ERR_BUSY              4 // Target slot was running, or another channel was loading it
+
+// Ring descriptor (32 bytes, little-endian in guest memory)
+typedef struct KsDmaDesc {
+    uint8_t vm_id;
+    uint8_t op;          // KS_DMA_OP_*
+    uint16_t sg_count;   // Entries in the KsDmaSgEntry list at sg_addr
+    uint32_t reserved;
+    uint64_t sg_addr;
+    uint64_t cookie;     // Opaque to the device
+    uint32_t len;        // Written back: total bytes transferred
+    uint32_t status;     // Written back: KS_DMA_DESC_*, after len
+} KsDmaDesc;
+
+// Scatter-gather list entry (16 bytes, little-endian); buffers are consumed
+// back to back starting at offset 0 of the slot memory
+typedef struct KsDmaSgEntry {
+    uint64_t addr;
+    uint32_t len;
+    uint32_t reserved;
+} KsDmaSgEntry;
+
+// Submission/completion queue pair. Each submission runs one packet through
+// a slot without further MMIO: its input is loaded into data memory, the
+// slot's program runs, up to out_len bytes of data memory are written to
+// out_addr as by DATA_OUT write-back, and a completion entry carrying the
+// cookie and the byte count is posted. Entries for
+// different slots run concurrently; completions are posted as runs finish.
+// SQ_TAIL is the doorbell; the driver returns CQ entries by advancing
+// CQ_HEAD. Both rings have QUEUE_SIZE entries.
+#define KS_QUEUE_MAX_ENTRIES              4096 // QUEUE_SIZE: 0 (disabled) or a power of two up to this
+
+// KsCqEntry.status: KS_VM_ERR_* for runs that started, or one of these
+#define KS_SQ_ST_BAD_ENTRY                0x10 // Bad VM ID or length
+#define KS_SQ_ST_BUS_ERROR                0x11 // Submission, input or output transfer failed
+#define KS_SQ_ST_BUSY                     0x12 // Slot was started through COPRO_CMD_REG meanwhile
+
+#define KS_CQ_FLAG_PHASE                  (1 << 0) // Inverted on every pass over the CQ, starting at 1
+
+// Submission entry (32 bytes, little-endian)
+typedef struct KsSqEntry {
+    uint8_t vm_id;
+    uint8_t reserved0;
+    uint16_t in_len;     // Bytes at in_addr loaded into data memory; at most KS_VM_DATA_MEM_SIZE
+    uint16_t out_len;    // Output bytes for out_addr after a successful run; the program may use fewer
+    uint16_t reserved1;
+    uint64_t in_addr;
+    uint64_t out_addr;
+    uint64_t cookie;     // Returned in the completion entry
+} KsSqEntry;
 
+// Completion entry (16 bytes, little-endian)
+typedef struct KsCqEntry {
+    uint64_t cookie;
+    uint32_t retval;     // Low 32 bits of R0, as SELECTED_VM_RETVAL_REG
+    uint16_t out_len;    // Bytes written to out_addr
+    uint8_t status;      // KS_VM_ERR_NONE on success
+    uint8_t flags;       // KS_CQ_FLAG_*; written last
+} KsCqEntry;
+
+// Program cache. Every loaded program is looked up by content; a hit reuses
+// the decoded (and compiled) form instead of preparing it again. Cached
+// programs get a nonzero handle, readable per slot in PROG_HANDLE_REG once
+// the load completes; LOAD_PROG_HANDLE copies a cached program into a slot
+// without any guest-memory DMA, or raises DMA_ERROR if the handle is no
+// longer cached. Least recently used programs are evicted first, preferring
+// ones no slot is holding.
+#define KS_PROG_CACHE_MAX_ENTRIES         256 // "prog-cache-size" limit
+#define KS_PROG_CACHE_DEFAULT_ENTRIES     16
+
+// PROG_CACHE_STATUS_REG: [15:0] entries in use, [31:16] capacity; write these to act
+#define KS_PROG_CACHE_CTRL_FLUSH          (1 << 0) // Drop every entry (slots keep their programs)
+#define KS_PROG_CACHE_CTRL_CLEAR_STATS    (1 << 1) // Zero the hit and miss counters
+
+// Performance counters: free-running 64-bit counts, zeroed by reset or
+// PERF_CTRL_REG. Each reads as a LOW/HIGH register pair; reading LOW latches
+// the counter's upper half, which the following HIGH read returns. Global
+// counters live in their own block, per-VM ones at the end of each slot page.
+// Also readable from the host as the "perf-*" and "vm<n>-perf-*" properties.
+#define ADDR_PERF_CTRL_REG                0x900 // (W) KS_PERF_CTRL_*; reads 0
+#define ADDR_PERF_DMA_BYTES_REG           0x908 // Bytes moved by DMA, output write-back included
+#define ADDR_PERF_DMA_BUSY_NS_REG         0x910 // Modelled bus time of DMA traffic
+#define ADDR_PERF_DMA_XFERS_REG           0x918 // Transfers finished by the DMA engine, failed ones included
+#define ADDR_PERF_CMD_REJECTED_REG        0x920 // Commands refused (DMA busy, slot running, bad ID or length, handle miss)
+#define ADDR_PERF_IRQ_EVENTS_REG          0x928 // INT_STATUS bits that went from 0 to 1
+#define ADDR_PERF_IRQ_ASSERTS_REG         0x930 // Rising edges of the interrupt line
+#define ADDR_PERF_DMA_QUEUED_REG          0x938 // LOAD_PROG/LOAD_DATA_IN requests that waited for a channel
+#define ADDR_PERF_DMA_QUEUE_WAIT_NS_REG   0x940 // Time they spent in their slot's queue
+#define ADDR_PERF_DMA_QUEUE_PEAK_REG      0x948 // Most requests a slot's queue held, not a running count
+#define ADDR_PERF_DMA_CHAN_BUSY_NS_REG    0x980 // Channel c's time with a transfer, bus waits included, at +8c
+#define KS_PERF_BLOCK_END                 0xA00
+#define ADDR_VM_PERF_RUNS_REG             0xE0  // Page offsets: runs started
+#define ADDR_VM_PERF_INSNS_REG            0xE8  // Instructions executed
+#define ADDR_VM_PERF_ERRORS_REG           0xF0  // Runs that ended in an error
+#define ADDR_VM_PERF_DMA_BYTES_REG        0xF8  // DMA bytes into or out of this slot
+
+#define KS_PERF_CTRL_CLEAR                (1 << 0) // Zero every counter
+
+// Every counter is bumped under the BQL, so increments are plain adds. The
+// per-VM sets get a cache line each, so that a slot's counters never share
+// one with another slot's.
+typedef struct QEMU_ALIGNED(64) KsVmPerf {
+    uint64_t runs;
+    uint64_t insns;
+    uint64_t errors;
+    uint64_t dma_bytes;
+} KsVmPerf;
+
+typedef struct KsCoproPerf {
+    uint64_t dma_bytes;
+    uint64_t dma_busy_ns;
+    uint64_t dma_xfers;
+    uint64_t cmd_rejected;
+    uint64_t irq_events;
+    uint64_t irq_asserts;
+    uint64_t dma_queued;
+    uint64_t dma_queue_wait_ns;
+    uint64_t dma_queue_peak;
+    uint64_t dma_chan_busy_ns[KS_DMA_MAX_CHANNELS];
+} KsCoproPerf;
+
+// Profiler ("profile" property): hit counts per instruction of every program
+// run while it is on, keyed by the program cache hash of the code so that
+// they outlive cache eviction. "profile-dump" or "profile-file" write them
+// out as folded stacks, "ks-prog-<hash>;<pc>:<op> <hits>", for flame graph
+// tools. Slot time is its instruction count, so sampling is deterministic.
+#define KS_PROF_DEFAULT_PERIOD            1009 // Prime, so samples do not beat with loop lengths
+
+typedef struct KsProfProg {
+    uint64_t hash;
+    uint32_t len;       // Instructions
+    uint8_t *ops;       // KsEbpfOp of each instruction, for naming the frames
+    uint64_t *hits;     // Samples, or executions in exact mode, per instruction
+} KsProfProg;
+
+typedef struct KsProgCacheEntry {
+    uint64_t hash;
+    uint8_t *code;      // Program bytes; compared on a hash match, copied by LOAD_PROG_HANDLE
+    uint32_t len;
+    uint32_t handle;    // 0 unless the entry went into the cache
+    KsEbpfProg *prog;
+    KsEbpfJit *jit;     // In exec-mode=jit, NULL if compilation failed
+    uint32_t refs;      // Slots holding this program
+    bool cached;        // Listed in prog_cache; freed once neither cached nor referenced
+    uint64_t last_use;  // prog_cache_clock at the last load
+} KsProgCacheEntry;
+
+// Mailbox FIFO mode state of one slot; in and out are only in use with KS_MBOX_FIFO_EN
+typedef struct KsVmMbox {
+    struct KeystoneCoproState *owner; // For fifo_kick on the run's thread
+    uint32_t vm_id;
+    uint32_t ctrl;        // MBOX_FIFO_CTRL_REG
+    uint32_t irq_enable;  // MBOX_IRQ_ENABLE_REG
+    bool in_overflow;     // A CPU push found the IN FIFO full; cleared by writing CTRL
+    uint32_t cond;        // MBOX_IRQ_STATUS as last seen, from any thread
+    KsMboxFifo in;        // CPU -> VM
+    KsMboxFifo out;       // VM -> CPU
+    uint32_t in_buf[KS_MBOX_FIFO_MAX_DEPTH];
+    uint32_t out_buf[KS_MBOX_FIFO_MAX_DEPTH];
+} KsVmMbox;
+
+// A LOAD_PROG/LOAD_DATA_IN waiting in its slot's DMA queue
+typedef struct KsDmaReq {
+    uint64_t addr;
+    uint32_t len;
+    bool is_prog;
+    int64_t queued_at;   // QEMU_CLOCK_VIRTUAL ns
+} KsDmaReq;
 
 typedef struct KeystoneVMContext {
     bool running;
     bool error_state; // Generic error flag
     uint32_t error_code; // Specific error from VM
-    uint32_t pc;         // Placeholder for VM's Program Counter
-    // Add other VM-specific state if needed by the model
+    uint32_t pc;         // Instruction index of the last exit/fault
+    bool done;           // Last run finished with EXIT
+    uint64_t retval;     // R0 at the last successful EXIT
+    KsProgCacheEntry *prog_entry; // Program loaded by the last LOAD_PROG, shared through the cache
+    uint32_t prog_handle_saved;   // prog_entry->handle, for migration
+    KsEbpfProg *prog;    // prog_entry->prog: pre-decoded form of prog_mem
+    KsEbpfJit *jit;      // prog_entry->jit: host code for prog in exec-mode=jit
+    bool has_program;    // Set once a LOAD_PROG DMA has completed successfully
+    uint32_t prog_len;   // Bytes of prog_mem holding the loaded program
+    uint32_t data_len;   // Bytes of data_mem filled by the last LOAD_DATA_IN
+    // Current run: filled by START_VM, executed on a worker, published by the completion BH
+    KsEbpfRunCtx run;
+    int run_err;
+    bool stop_req;       // Makes the engine abandon the run at its next backward branch
+    // Output destination latched at start, and what the last run wrote there
+    uint64_t out_addr;
+    uint32_t out_max;
+    uint32_t out_len;
+    // Set while the slot runs a submission queue entry; its completion goes to the CQ
+    bool sq_owned;
+    uint64_t sq_cookie;
+    // Profiler: hits of the current run, folded into its KsProfProg when it
+    // is published. KS_VM_PROG_MAX_INSNS + 1 entries, only allocated when on.
+    uint64_t *prof_hits;
+    uint64_t prof_left;
+    // Slot memories (prog_mem / stack_mem in eBPF_VM_Slot.v): the RAM of
+    // prog_mr and data_mr, filled by DMA or by stores through the window.
+    // data_mem is the ACTIVE one of the two data-in buffers.
+    uint8_t *prog_mem;
+    uint8_t *data_mem;
+    uint8_t *data_bufs[2]; // RAM of data_mr (A) and data_b_mr (B)
+    MemoryRegion prog_mr;
+    MemoryRegion data_mr;
+    MemoryRegion data_b_mr;
+    uint32_t data_buf_ctrl; // DATA_BUF_REG PINGPONG
+    uint8_t data_active;    // Index of data_mem in data_bufs
+    bool data_ready;        // The other buffer was filled since the last swap
+    uint32_t data_fill_len; // Bytes in it; data_len once it is swapped in
+    uint32_t mem_ctrl;   // MEM_CTRL_REG
+    bool mem_locked;     // prog_mr/data_mr are read-only for the current run
+    bool prog_stale;     // prog_mem was stored to since the program was prepared
+    // Batch record mode: set up by START_BATCH, the arrays stay mapped until
+    // the run is published. batch_count is 0 outside a batch.
+    uint32_t batch_count;
+    uint32_t batch_rec_size;
+    uint32_t batch_out_stride;
+    uint32_t batch_done;      // BATCH_DONE_REG; advanced by the worker
+    uint8_t *batch_in;
+    uint8_t *batch_out;       // NULL with stride 0
+    uint64_t batch_in_len;
+    uint64_t batch_out_len;
+    // DMA queue: requests not yet taken by a channel, oldest at dma_queue_head
+    KsDmaReq dma_queue[KS_DMA_QUEUE_DEPTH];
+    uint8_t dma_queue_head;
+    uint8_t dma_queue_count;
 } KeystoneVMContext;
 
+// Address and length registers of one slot page; the rest of the page maps to slot state
+typedef struct KsVmPageRegs {
+    uint32_t prog_addr_low;
+    uint32_t prog_addr_high;
+    uint32_t data_in_addr_low;
+    uint32_t data_in_addr_high;
+    uint32_t data_out_addr_low;
+    uint32_t data_out_addr_high;
+    uint32_t data_len;
+    uint32_t data_out_len;
+    uint32_t batch_rec_size;
+    uint32_t batch_count;
+    uint32_t batch_out_stride;
+} KsVmPageRegs;
+
+/*
+ * One DMA channel: a LOAD_PROG/LOAD_DATA_IN, a ring descriptor or an SQ
+ * entry's input. A ring descriptor or SQ entry is read and checked when its
+ * fetch time is up (fetched); then timer moves one chunk of the segments
+ * per expiry, each when its bus time is up.
+ */
+typedef struct KsDmaChannel {
+    KeystoneCoproState *owner;
+    uint8_t id;
+    bool active;
+    uint64_t src_addr;   // LOAD_PROG/LOAD_DATA_IN source
+    uint32_t len;        // LOAD_PROG/LOAD_DATA_IN length
+    uint8_t target_vm_id;
+    bool is_prog_load;   // True if program load, false if data_in load
+    bool from_ring;      // Transfer is the descriptor at dma_ring_head
+    bool for_sq;         // Transfer is the input of the SQ entry taken last
+    QEMUTimer timer;
+    bool fetched;
+    bool is_out;         // Slot memory to guest memory (KS_DMA_OP_DATA_OUT)
+    uint32_t seg_count;
+    uint32_t seg_idx;    // Segment being moved
+    uint32_t seg_off;    // Bytes of it already moved
+    uint32_t moved;      // Bytes moved for the whole transfer, also the slot memory offset
+    uint64_t seg_addr[KS_DMA_MAX_SG];
+    uint32_t seg_len[KS_DMA_MAX_SG];
+    // SQ entry whose input is being loaded
+    uint64_t sq_cookie;
+    uint64_t sq_out_addr;
+    uint32_t sq_out_len;
+} KsDmaChannel;
+
+// A hart halted in BPF.VM.WAIT until a slot in mask signals DONE or ERROR
+#define KS_VM_WAIT_MAX_HARTS 8
+typedef struct KsVmWaiter {
+    CPUState *cpu; // NULL if the entry is free
+    uint64_t mask;
+} KsVmWaiter;
+
 typedef struct KeystoneCoproState {
     /*< private >*/
     SysBusDevice parent_obj;
 
     /*< public >*/
     MemoryRegion iomem; // For AXI-Lite CSR interface
+    // MMIO region 1 is map_window, see ADDR_MAP_SELECT_REG
+    MemoryRegion slot_mem; // MMIO region 2: the slot memories, see ADDR_VM_MEM_PROG_LEN_REG
     qemu_irq irq;       // Interrupt output line
+    qemu_irq vm_irq[NUM_VM_SLOTS_QEMU]; // "vm-irq" lines, vm_irq_lines of them
+    MemoryRegion *dma_mr; // "dma-mr" link: memory seen by the AXI master (DMA) port
+    AddressSpace dma_as;  // Address space built over dma_mr at realize
 
     // CSRs defined in AXI_Lite_Memory_Map.txt
     uint32_t copro_cmd_reg;
-    uint32_t vm_select_id; // Only 3 bits used [2:0]
+    uint32_t vm_select_id; // [5:0], below num_slots
     // COPRO_STATUS_REG is composed of active_vm_mask and busy_status
     // uint32_t copro_status_reg; // Read-only by CPU
     uint32_t prog_addr_low_reg;
@@ -80,33 +623,143 @@ typedef struct KeystoneCoproState {
     uint32_t data_out_addr_low_reg;
     uint32_t data_out_addr_high_reg;
     uint32_t data_len_reg;
-    uint32_t int_status_reg;
+    uint32_t data_out_len_reg;
+    uint32_t int_status_reg; // DMA_DONE, DMA_ERROR and CQ; [15:0] are read from the VM bits below
     uint32_t int_enable_reg;
-    // SELECTED_VM_STATUS_REG, SELECTED_VM_PC_REG, SELECTED_VM_DATA_OUT_ADDR_REG are read-only,
-    // their values are derived from vm_contexts and dma_target_vm_id for selected VM.
+    // VMi_DONE / VMi_ERROR of every slot, see ADDR_VM_DONE_STATUS_REG
+    uint64_t vm_done_status;
+    uint64_t vm_error_status;
+    uint64_t vm_done_enable;
+    uint64_t vm_error_enable;
+    // SELECTED_VM_STATUS_REG, SELECTED_VM_PC_REG, SELECTED_VM_DATA_OUT_ADDR/LEN_REG are read-only,
+    // their values are derived from vm_contexts for selected VM.
+
+    // Per-VM register pages, independent of vm_select_id and the registers above
+    KsVmPageRegs vm_pages[NUM_VM_SLOTS_QEMU];
 
     // Mailbox storage for each VM
     uint32_t vm_mailboxes_in[NUM_VM_SLOTS_QEMU][NUM_MAILBOX_REGS_QEMU];  // CPU writes, VM reads
     uint32_t vm_mailboxes_out[NUM_VM_SLOTS_QEMU][NUM_MAILBOX_REGS_QEMU]; // VM writes, CPU reads
+    KsVmMbox vm_mbox[NUM_VM_SLOTS_QEMU];
+    uint64_t mbox_pending; // Slots with an enabled MBOX_IRQ_STATUS bit
+    QEMUBH *mbox_bh;       // Re-evaluates MBOX_IRQ_STATUS after FIFO moves on a worker
 
     // VM Contexts
     KeystoneVMContext vm_contexts[NUM_VM_SLOTS_QEMU];
 
-    // Internal DMA state variables
-    bool dma_active;
-    uint64_t dma_src_addr; // Assuming system address can be 64-bit
-    uint32_t dma_len;
-    uint8_t dma_target_vm_id; // Which VM this DMA is for
-    bool dma_is_prog_load;   // True if program load, false if data_in load
-    // Potentially a QEMUTimer for DMA delay/completion
-    QEMUTimer dma_timer;
-    // Placeholder for data being DMA'd (e.g., to VM's program memory)
-    // In a real model, this might interact with a representation of VM memory.
-    uint8_t* dma_buffer; // Temporary buffer for DMA data
+    // DMA channels, dma_channels of them in use; see ADDR_DMA_CHAN_CONFIG_REG
+    KsDmaChannel dma_chan[KS_DMA_MAX_CHANNELS];
+    uint32_t dma_rr;          // Requester a free channel looks at first: slot, ring (num_slots) or SQ
+    int64_t dma_bus_free_at;  // QEMU_CLOCK_VIRTUAL ns when the AXI master has moved every burst asked for
+    uint32_t dma_chan_done;   // CHAN_DONE_REG
+    uint32_t dma_chan_error;  // CHAN_ERROR_REG
+
+    // DMA descriptor ring; served by the channels above like the slot queues
+    uint32_t dma_ring_base_low_reg;
+    uint32_t dma_ring_base_high_reg;
+    uint32_t dma_ring_size;  // Entries
+    uint32_t dma_ring_head;  // Next descriptor the engine consumes
+    uint32_t dma_ring_tail;  // One past the last descriptor the driver submitted
+
+    // Submission/completion queues
+    uint32_t sq_base_low_reg;
+    uint32_t sq_base_high_reg;
+    uint32_t cq_base_low_reg;
+    uint32_t cq_base_high_reg;
+    uint32_t queue_size;     // Entries in each queue
+    uint32_t sq_head;
+    uint32_t sq_tail;
+    uint32_t cq_head;
+    uint32_t cq_tail;
+    uint8_t cq_phase;        // KS_CQ_FLAG_PHASE value for the current pass over the CQ
+    uint32_t sq_inflight;    // Entries dispatched to a slot and not yet completed; each has CQ room reserved
+
+    // Interrupt moderation, per KS_IRQ_CLASS_*. A class is armed by its first
+    // enabled event and fires when a limit is hit; it disarms once the guest
+    // has cleared all of its pending bits.
+    uint32_t irq_mod_reg[KS_IRQ_NUM_CLASSES];
+    uint32_t irq_mod_ctrl;
+    uint32_t irq_mod_count[KS_IRQ_NUM_CLASSES];    // Events since the class was armed
+    int64_t irq_mod_deadline[KS_IRQ_NUM_CLASSES];  // QEMU_CLOCK_VIRTUAL ns, 0 if no timeout is running
+    bool irq_mod_fired[KS_IRQ_NUM_CLASSES];        // Line asserted for this class
+    QEMUTimer irq_mod_timer;                       // Earliest pending deadline
+
+    // Harts in BPF.VM.WAIT. Only their cpu_index + 1 is migrated
+    // (vm_wait_saved): the destination wakes them, and each re-executes the
+    // instruction against the migrated INT_STATUS_REG.
+    KsVmWaiter vm_waiters[KS_VM_WAIT_MAX_HARTS];
+    uint32_t vm_wait_saved[KS_VM_WAIT_MAX_HARTS];
+
+    // Program cache, see KsProgCacheEntry
+    KsProgCacheEntry **prog_cache; // prog_cache_size slots, NULL where free
+    uint32_t prog_cache_used;
+    uint32_t prog_cache_next_handle;
+    uint64_t prog_cache_clock;
+    uint64_t prog_cache_hits;      // Also the "prog-cache-hits" property
+    uint64_t prog_cache_misses;    // Also the "prog-cache-misses" property
+
+    // Shared maps, see ADDR_MAP_SELECT_REG
+    KsEbpfMap maps[KS_EBPF_MAX_MAPS];
+    uint32_t map_win_off[KS_EBPF_MAX_MAPS];
+    uint32_t map_select;
+    uint32_t map_type_reg;
+    uint32_t map_key_size_reg;
+    uint32_t map_value_size_reg;
+    uint32_t map_max_entries_reg;
+    MemoryRegion map_window;
+
+    // Performance counters, see ADDR_PERF_CTRL_REG
+    KsCoproPerf perf;
+    KsVmPerf vm_perf[NUM_VM_SLOTS_QEMU];
+    uint32_t perf_high;      // Upper half latched by the last LOW read
+    bool irq_level;          // Line level, for counting its rising edges
+    uint64_t vm_irq_levels;  // "vm-irq" line levels, bit g for line g
+
+    // Profiler, see KsProfProg
+    uint64_t prof_period;    // Instructions between samples, 0 when off
+    GHashTable *prof_progs;  // &KsProfProg.hash -> KsProfProg
+    Notifier prof_exit;      // Writes "profile-file" when QEMU exits
+
+    // Live migration: slots whose prog_mem/data_mem changed since the
+    // last pass over them; see ks_slot_mem_handlers
+    uint64_t mem_dirty_prog;
+    uint64_t mem_dirty_data;
 
     // Derived status for COPRO_STATUS_REG
-    bool copro_busy_status; // True if DMA active or any VM running
-    uint8_t active_vm_mask; // Bitmask of running VMs
+    bool copro_busy_status; // True if a DMA channel or any VM is busy
+    uint64_t active_vm_mask; // Bitmask of running VMs
+
+    // Slot execution pool. START_VM queues a slot, any idle worker runs it and
+    // run_bh posts the outcome under the BQL. Slot fields read by MMIO are only
+    // written under the BQL, so register reads never take run_lock.
+    QemuThread *workers;
+    QemuMutex run_lock;    // Protects run_* masks below
+    QemuCond run_cond;     // Work queued, or shutdown
+    QemuCond idle_cond;    // A slot left run_busy
+    uint64_t run_queued;   // Started, not picked up yet
+    uint64_t run_busy;     // Executing on a worker
+    uint64_t run_done;     // Finished, waiting for run_bh
+    bool run_shutdown;
+    QEMUBH *run_bh;
+
+    // Properties
+    uint32_t num_slots;  // "num-slots": slots in this instance, up to NUM_VM_SLOTS_QEMU
+    uint32_t vm_irq_lines; // "vm-irq-lines": per-slot-group lines, 0 for the single line
+    uint64_t max_insns; // "max-insns": per-run instruction budget
+    uint32_t worker_threads; // "worker-threads": 0 runs slots inline in START_VM
+    char *exec_mode;    // "exec-mode": "interp" (default) or "jit"
+    uint32_t prog_cache_size; // "prog-cache-size": programs kept, 0 disables the cache
+    uint32_t map_window_size; // "map-window-size": bytes of map window, a multiple of 4 KB
+    uint32_t dma_bus_width;   // "dma-bus-width": AXI data width in bits
+    uint32_t dma_burst_len;   // "dma-burst-len": beats per burst
+    uint32_t dma_clock_mhz;   // "dma-clock-mhz": bus clock, one beat per cycle
+    uint32_t dma_setup_ns;    // "dma-setup-ns": latency per burst before its first beat
+    bool dma_zero_latency;    // "dma-zero-latency": no bus time, for functional throughput runs
+    uint32_t dma_channels;    // "dma-channels": DMA channels, up to KS_DMA_MAX_CHANNELS
+    char *profile;            // "profile": "off" (default), "sample" or "exact"
+    uint32_t profile_period;  // "profile-period": instructions between samples
+    char *profile_file;       // "profile-file": written at exit if set
+    bool use_jit;
 
 } KeystoneCoproState;
 
@@ -114,7 +767,31 @@ typedef struct KeystoneCoproState {
 uint64_t keystone_copro_read(void *opaque, hwaddr offset, unsigned size);
 void keystone_copro_write(void *opaque, hwaddr offset, uint64_t val, unsigned size);
 
-// Other function declarations can go here if needed for external interaction,
-// but most will be static within the .c file.
+/*
+ * Direct-call API for the ISA "Y" BPF.VM.* TCG helpers. Each call does what
+ * the instruction's command or register access does through vm's own page,
+ * without MMIO decode and without touching VM_SELECT_REG. Called with the
+ * BQL held, like the MMIO handlers. Returns 0 or a negative errno: -EINVAL
+ * for a bad slot, mailbox index or length, -EBUSY if the slot is running or
+ * its DMA queue is full. Loads only queue the transfer; its outcome is
+ * still reported through DMA_DONE/DMA_ERROR.
+ */
+int keystone_copro_set_len(KeystoneCoproState *s, unsigned vm, uint32_t len);
+int keystone_copro_vm_load_prog(KeystoneCoproState *s, unsigned vm, uint64_t addr); // Length from set_len
+int keystone_copro_vm_start(KeystoneCoproState *s, unsigned vm);
+int keystone_copro_vm_stop(KeystoneCoproState *s, unsigned vm);
+int keystone_copro_vm_reset(KeystoneCoproState *s, unsigned vm);
+int keystone_copro_vm_status(KeystoneCoproState *s, unsigned vm, uint32_t *status); // SELECTED_VM_STATUS_REG
+// In mailbox FIFO mode these push and pop (idx is ignored), and return -EAGAIN if the FIFO is full or empty
+int keystone_copro_mbox_send(KeystoneCoproState *s, unsigned vm, unsigned idx, uint32_t val);
+int keystone_copro_mbox_recv(KeystoneCoproState *s, unsigned vm, unsigned idx, uint32_t *val);
+/*
+ * BPF.VM.WAIT: the lowest slot in mask with DONE or ERROR pending in
+ * VM_DONE_STATUS / VM_ERROR_STATUS, whose two bits are then cleared. If there is none, cs is
+ * marked halted and -EAGAIN returned; the helper leaves the hart at the
+ * instruction, which runs again once one of the slots signals or the hart
+ * takes an interrupt.
+ */
+int keystone_copro_vm_wait(KeystoneCoproState *s, uint64_t mask, CPUState *cs);
 
 #endif // QEMU_KEYSTONE_COPRO_H
@@ -0,0 +1,1511 @@
+#include "qemu/osdep.h"
+#include "qemu/bswap.h"
+#include "qemu/atomic.h"
+#include "qemu/processor.h"
+#include "qemu/host-utils.h"
+
+#include "qemu_keystone_ebpf.h"
+
+// Raw eBPF encoding (include/uapi/linux/bpf.h)
+#define BPF_CLASS(code)   ((code) & 0x07)
+#define BPF_LD            0x00
+#define BPF_LDX           0x01
+#define BPF_ST            0x02
+#define BPF_STX           0x03
+#define BPF_ALU           0x04
+#define BPF_JMP           0x05
+#define BPF_JMP32         0x06
+#define BPF_ALU64         0x07
+
+#define BPF_SIZE(code)    ((code) & 0x18)
+#define BPF_W             0x00
+#define BPF_H             0x08
+#define BPF_B             0x10
+#define BPF_DW            0x18
+
+#define BPF_MODE(code)    ((code) & 0xe0)
+#define BPF_IMM           0x00
+#define BPF_MEM           0x60
+
+#define BPF_OP(code)      ((code) & 0xf0)
+#define BPF_SRC(code)     ((code) & 0x08)
+#define BPF_X             0x08
+
+#define BPF_NEG           0x80
+#define BPF_END           0xd0
+#define BPF_JA            0x00
+#define BPF_CALL          0x80
+#define BPF_EXIT          0x90
+
+const char *const ks_ebpf_op_names[KS_OP__MAX] = {
+#define KS_EBPF_OP_NAME(name) [KS_OP_##name] = #name,
+    KS_EBPF_OPS(KS_EBPF_OP_NAME)
+#undef KS_EBPF_OP_NAME
+};
+
+// BPF_OP >> 4 -> internal _K opcode (64-bit forms). Zero means invalid.
+static const uint8_t ks_ebpf_alu_ops[16] = {
+    KS_OP_ADD64_K, KS_OP_SUB64_K, KS_OP_MUL64_K, KS_OP_DIV64_K,
+    KS_OP_OR64_K,  KS_OP_AND64_K, KS_OP_LSH64_K, KS_OP_RSH64_K,
+    KS_OP_NEG64,   KS_OP_MOD64_K, KS_OP_XOR64_K, KS_OP_MOV64_K,
+    KS_OP_ARSH64_K,
+};
+
+static const uint8_t ks_ebpf_jmp_ops[16] = {
+    KS_OP_JA,      KS_OP_JEQ_K,   KS_OP_JGT_K,   KS_OP_JGE_K,
+    KS_OP_JSET_K,  KS_OP_JNE_K,   KS_OP_JSGT_K,  KS_OP_JSGE_K,
+    KS_OP_CALL,    KS_OP_EXIT,    KS_OP_JLT_K,   KS_OP_JLE_K,
+    KS_OP_JSLT_K,  KS_OP_JSLE_K,
+};
+
+// Indexed by BPF_SIZE >> 3: W, H, B, DW
+static const uint8_t ks_ebpf_ldx_ops[4] = { KS_OP_LDXW, KS_OP_LDXH, KS_OP_LDXB, KS_OP_LDXDW };
+static const uint8_t ks_ebpf_st_ops[4]  = { KS_OP_STW,  KS_OP_STH,  KS_OP_STB,  KS_OP_STDW };
+static const uint8_t ks_ebpf_stx_ops[4] = { KS_OP_STXW, KS_OP_STXH, KS_OP_STXB, KS_OP_STXDW };
+
+static uint8_t ks_ebpf_decode_op(uint8_t code, int32_t imm) {
+    uint8_t op;
+
+    switch (BPF_CLASS(code)) {
+        case BPF_ALU64:
+        case BPF_ALU:
+            if (BPF_OP(code) == BPF_END) {
+                // Byte swaps only exist in the 32-bit class; BPF_X selects to-big-endian
+                if (BPF_CLASS(code) != BPF_ALU) {
+                    return KS_OP_INVALID;
+                }
+                switch (imm) {
+                    case 16: return BPF_SRC(code) ? KS_OP_BE16 : KS_OP_LE16;
+                    case 32: return BPF_SRC(code) ? KS_OP_BE32 : KS_OP_LE32;
+                    case 64: return BPF_SRC(code) ? KS_OP_BE64 : KS_OP_LE64;
+                    default: return KS_OP_INVALID;
+                }
+            }
+            op = ks_ebpf_alu_ops[BPF_OP(code) >> 4];
+            if (op == KS_OP_INVALID || (op == KS_OP_NEG64 && BPF_SRC(code))) {
+                return KS_OP_INVALID;
+            }
+            if (BPF_SRC(code) && op != KS_OP_NEG64) {
+                op += 1; // _X variant
+            }
+            if (BPF_CLASS(code) == BPF_ALU) {
+                op += KS_OP_ADD32_K - KS_OP_ADD64_K;
+            }
+            return op;
+        case BPF_JMP:
+        case BPF_JMP32:
+            op = ks_ebpf_jmp_ops[BPF_OP(code) >> 4];
+            if (op == KS_OP_JA || op == KS_OP_CALL || op == KS_OP_EXIT) {
+                return (BPF_CLASS(code) == BPF_JMP && !BPF_SRC(code)) ? op : KS_OP_INVALID;
+            }
+            if (op == KS_OP_INVALID) {
+                return KS_OP_INVALID;
+            }
+            if (BPF_SRC(code)) {
+                op += 1;
+            }
+            if (BPF_CLASS(code) == BPF_JMP32) {
+                op += KS_OP_JEQ32_K - KS_OP_JEQ_K;
+            }
+            return op;
+        case BPF_LD:
+            return code == (BPF_LD | BPF_IMM | BPF_DW) ? KS_OP_LDDW : KS_OP_INVALID;
+        case BPF_LDX:
+            return BPF_MODE(code) == BPF_MEM ? ks_ebpf_ldx_ops[BPF_SIZE(code) >> 3] : KS_OP_INVALID;
+        case BPF_ST:
+            return BPF_MODE(code) == BPF_MEM ? ks_ebpf_st_ops[BPF_SIZE(code) >> 3] : KS_OP_INVALID;
+        case BPF_STX:
+            return BPF_MODE(code) == BPF_MEM ? ks_ebpf_stx_ops[BPF_SIZE(code) >> 3] : KS_OP_INVALID;
+    }
+    return KS_OP_INVALID;
+}
+
+/*
+ * Decode len bytes of raw eBPF into a KsEbpfProg. Decoding never fails:
+ * anything that cannot be executed (unknown opcode, bad register, unknown
+ * helper, jump outside the program or into the middle of an LDDW) becomes
+ * KS_OP_INVALID and traps with KS_VM_ERR_BAD_INSN only if it is reached.
+ */
+KsEbpfProg *ks_ebpf_prog_new(const uint8_t *code, uint32_t len) {
+    KsEbpfProg *prog = g_new0(KsEbpfProg, 1);
+    uint32_t n = len / 8;
+
+    prog->len = n;
+    prog->insns = g_new0(KsEbpfInsn, n + 1); // insns[n] stays KS_OP_INVALID
+
+    // Pass 1: opcodes, operands, LDDW pairs
+    for (uint32_t i = 0; i < n; i++) {
+        const uint8_t *raw = code + i * 8;
+        KsEbpfInsn *insn = &prog->insns[i];
+        int32_t imm = (int32_t)ldl_le_p(raw + 4);
+
+        insn->op = ks_ebpf_decode_op(raw[0], imm);
+        insn->dst = raw[1] & 0x0f;
+        insn->src = raw[1] >> 4;
+        insn->off = (int16_t)lduw_le_p(raw + 2);
+        insn->imm = (uint64_t)(int64_t)imm;
+
+        if (insn->dst >= KS_EBPF_NUM_REGS || insn->src >= KS_EBPF_NUM_REGS) {
+            insn->op = KS_OP_INVALID;
+        }
+        if (insn->op == KS_OP_CALL && (insn->imm == 0 || insn->imm >= KS_EBPF_HELPER_MAX)) {
+            insn->op = KS_OP_INVALID;
+        }
+        if (insn->op == KS_OP_LDDW) {
+            // Second half carries imm[63:32] and must be an all-zero opcode slot
+            if (i + 1 >= n || code[(i + 1) * 8] != 0) {
+                insn->op = KS_OP_INVALID;
+                continue;
+            }
+            insn->imm = (uint32_t)imm | ((uint64_t)ldl_le_p(code + (i + 1) * 8 + 4) << 32);
+            i++; // insns[i] stays KS_OP_INVALID: jumping into it traps
+        }
+    }
+
+    // Pass 2: resolve branch targets to absolute indices
+    for (uint32_t i = 0; i < n; i++) {
+        KsEbpfInsn *insn = &prog->insns[i];
+        int64_t target;
+
+        if (!ks_ebpf_op_is_jump(insn->op)) {
+            if (insn->op == KS_OP_LDDW) {
+                i++;
+            }
+            continue;
+        }
+        target = (int64_t)i + 1 + insn->off;
+        if (target < 0 || target >= n ||
+            (target > 0 && prog->insns[target - 1].op == KS_OP_LDDW)) {
+            insn->op = KS_OP_INVALID;
+            continue;
+        }
+        insn->off = target;
+    }
+    return prog;
+}
+
+void ks_ebpf_prog_free(KsEbpfProg *prog) {
+    if (prog) {
+        g_free(prog->insns);
+        g_free(prog);
+    }
+}
+
+/*
+ * Load-time verifier: abstract interpretation over the decoded program with
+ * one register state per instruction entry. A register is uninitialised (on
+ * at least one path), unknown, or known to hold a value in [lo, hi] as a
+ * signed 64-bit number. Ranges are kept within +-KS_VERIFY_RANGE_MAX so that
+ * arithmetic on them never overflows; anything wider is unknown.
+ *
+ * A program is rejected (KS_VM_ERR_VERIFY) if a reachable instruction is
+ * invalid or runs off the end, reads a register that may be uninitialised,
+ * writes R10, accesses memory that is outside the slot whatever the register
+ * values, or jumps backward without a proven bound on the loop it closes
+ * (see ks_verify_bounded()). Loads and stores proven to be inside slot memory
+ * become _NC ops; the rest keep their run-time check.
+ */
+#define KS_VERIFY_RANGE_MAX     (1LL << 40)
+#define KS_VERIFY_WIDEN_AFTER   8  // Updates of a loop head before growing ranges become unknown
+#define KS_VERIFY_WIDEN_LIMIT   64 // Same for any other instruction, as a backstop
+
+// Ordered so that merging two states keeps the larger kind
+enum { KS_VREG_RANGE, KS_VREG_UNKNOWN, KS_VREG_UNINIT };
+
+typedef struct KsVreg {
+    uint8_t kind;
+    int64_t lo;
+    int64_t hi;
+} KsVreg;
+
+typedef struct KsVstate {
+    KsVreg r[KS_EBPF_NUM_REGS];
+} KsVstate;
+
+typedef struct KsVerifier {
+    KsEbpfProg *prog;
+    int64_t mem_size;
+    KsVstate *in;       // Entry state per instruction, len + 1 entries
+    bool *seen;         // Reachable
+    uint8_t *updates;
+    bool *loop_head;    // Target of a backward jump
+    uint32_t *work;     // Instructions whose entry state changed
+    bool *queued;
+    uint32_t nwork;
+} KsVerifier;
+
+// Registers passed to each helper
+static const uint8_t ks_ebpf_helper_args[KS_EBPF_HELPER_MAX] = {
+    [KS_EBPF_HELPER_MBOX_READ]  = 1,
+    [KS_EBPF_HELPER_MBOX_WRITE] = 2,
+    [KS_EBPF_HELPER_SET_OUT_LEN] = 1,
+    [KS_EBPF_HELPER_MBOX_STATUS] = 0,
+    [KS_EBPF_HELPER_MAP_LOOKUP] = 3,
+    [KS_EBPF_HELPER_MAP_UPDATE] = 4,
+    [KS_EBPF_HELPER_MAP_DELETE] = 2,
+    [KS_EBPF_HELPER_MAP_ADD]    = 4,
+};
+
+static KsVreg ks_vreg_range(int64_t lo, int64_t hi) {
+    if (lo < -KS_VERIFY_RANGE_MAX || hi > KS_VERIFY_RANGE_MAX) {
+        return (KsVreg){ .kind = KS_VREG_UNKNOWN };
+    }
+    return (KsVreg){ .kind = KS_VREG_RANGE, .lo = lo, .hi = hi };
+}
+
+static KsVreg ks_vreg_const(uint64_t v) {
+    return ks_vreg_range((int64_t)v, (int64_t)v);
+}
+
+static bool ks_vreg_is_const(const KsVreg *r) {
+    return r->kind == KS_VREG_RANGE && r->lo == r->hi;
+}
+
+static bool ks_vreg_nonneg(const KsVreg *r) {
+    return r->kind == KS_VREG_RANGE && r->lo >= 0;
+}
+
+// Result of 64-bit ALU op k (a _K opcode) on ranges d and s
+static KsVreg ks_verify_alu64(unsigned k, const KsVreg *d, const KsVreg *s) {
+    uint64_t a = d->lo, b = s->lo;
+    int64_t hi;
+
+    if (k == KS_OP_MOV64_K) {
+        return *s;
+    }
+    if (d->kind != KS_VREG_RANGE || s->kind != KS_VREG_RANGE) {
+        // A few ops bound their result whatever the other operand is
+        if (k == KS_OP_AND64_K && ks_vreg_nonneg(s)) {
+            return ks_vreg_range(0, s->hi);
+        }
+        if (k == KS_OP_MOD64_K && ks_vreg_is_const(s) && s->lo > 0) {
+            return ks_vreg_range(0, s->lo - 1);
+        }
+        if (k == KS_OP_RSH64_K && ks_vreg_is_const(s) && s->lo >= 24 && s->lo < 64) {
+            return ks_vreg_range(0, (int64_t)(UINT64_MAX >> s->lo));
+        }
+        return (KsVreg){ .kind = KS_VREG_UNKNOWN };
+    }
+    switch (k) {
+        case KS_OP_ADD64_K:
+            return ks_vreg_range(d->lo + s->lo, d->hi + s->hi);
+        case KS_OP_SUB64_K:
+            return ks_vreg_range(d->lo - s->hi, d->hi - s->lo);
+        case KS_OP_AND64_K:
+            if (ks_vreg_is_const(d) && ks_vreg_is_const(s)) {
+                return ks_vreg_const(a & b);
+            }
+            if (ks_vreg_nonneg(s)) {
+                return ks_vreg_range(0, ks_vreg_nonneg(d) ? MIN(d->hi, s->hi) : s->hi);
+            }
+            break;
+        case KS_OP_OR64_K:
+            if (ks_vreg_is_const(d) && ks_vreg_is_const(s)) {
+                return ks_vreg_const(a | b);
+            }
+            break;
+        case KS_OP_XOR64_K:
+            if (ks_vreg_is_const(d) && ks_vreg_is_const(s)) {
+                return ks_vreg_const(a ^ b);
+            }
+            break;
+        case KS_OP_MUL64_K:
+            if (ks_vreg_nonneg(d) && ks_vreg_nonneg(s) && !__builtin_mul_overflow(d->hi, s->hi, &hi)) {
+                return ks_vreg_range(d->lo * s->lo, hi);
+            }
+            break;
+        case KS_OP_DIV64_K:
+            if (ks_vreg_nonneg(d) && ks_vreg_is_const(s) && s->lo > 0) {
+                return ks_vreg_range(d->lo / s->lo, d->hi / s->lo);
+            }
+            break;
+        case KS_OP_MOD64_K:
+            if (ks_vreg_is_const(s) && s->lo > 0) {
+                return ks_vreg_range(0, s->lo - 1);
+            }
+            break;
+        case KS_OP_LSH64_K:
+            if (ks_vreg_nonneg(d) && ks_vreg_is_const(s) && s->lo >= 0 && s->lo < 41 &&
+                d->hi <= (KS_VERIFY_RANGE_MAX >> s->lo)) {
+                return ks_vreg_range(d->lo << s->lo, d->hi << s->lo);
+            }
+            break;
+        case KS_OP_RSH64_K:
+            if (ks_vreg_nonneg(d) && ks_vreg_is_const(s) && s->lo >= 0 && s->lo < 64) {
+                return ks_vreg_range(d->lo >> s->lo, d->hi >> s->lo);
+            }
+            break;
+        case KS_OP_NEG64:
+            return ks_vreg_range(-d->hi, -d->lo);
+    }
+    return (KsVreg){ .kind = KS_VREG_UNKNOWN };
+}
+
+// 32-bit ops zero-extend, so only constants need more than [0, UINT32_MAX]
+static KsVreg ks_verify_alu32(unsigned k, const KsVreg *d, const KsVreg *s) {
+    if (k == KS_OP_MOV64_K && s->kind == KS_VREG_RANGE && s->lo >= 0 && s->hi <= UINT32_MAX) {
+        return *s;
+    }
+    if (k == KS_OP_MOV64_K && ks_vreg_is_const(s)) {
+        return ks_vreg_const((uint32_t)s->lo);
+    }
+    if (k == KS_OP_AND64_K && ks_vreg_is_const(s)) {
+        return ks_vreg_range(0, (uint32_t)s->lo);
+    }
+    return ks_vreg_range(0, UINT32_MAX);
+}
+
+// Merge st into the entry state of instruction t and queue t if that changed it
+static void ks_verify_flow(KsVerifier *v, uint32_t t, const KsVstate *st) {
+    KsVstate *in = &v->in[t];
+    bool changed = false;
+
+    if (!v->seen[t]) {
+        *in = *st;
+        v->seen[t] = true;
+        changed = true;
+    } else {
+        for (int i = 0; i < KS_EBPF_NUM_REGS; i++) {
+            KsVreg *a = &in->r[i];
+            const KsVreg *b = &st->r[i];
+
+            if (b->kind > a->kind) {
+                *a = *b;
+                changed = true;
+            } else if (a->kind == KS_VREG_RANGE && b->kind == KS_VREG_RANGE && (b->lo < a->lo || b->hi > a->hi)) {
+                if (v->updates[t] >= (v->loop_head[t] ? KS_VERIFY_WIDEN_AFTER : KS_VERIFY_WIDEN_LIMIT)) {
+                    a->kind = KS_VREG_UNKNOWN;
+                } else {
+                    a->lo = MIN(a->lo, b->lo);
+                    a->hi = MAX(a->hi, b->hi);
+                }
+                changed = true;
+            }
+        }
+    }
+    if (changed) {
+        if (v->updates[t] < UINT8_MAX) {
+            v->updates[t]++;
+        }
+        if (!v->queued[t]) {
+            v->queued[t] = true;
+            v->work[v->nwork++] = t;
+        }
+    }
+}
+
+// Branch refinement: on this edge, unsigned dst <op> imm holds (op is a 64-bit _K compare)
+static bool ks_verify_refine(KsVreg *r, unsigned op, int64_t imm) {
+    if (!ks_vreg_nonneg(r) || imm < 0) {
+        return true;
+    }
+    switch (op) {
+        case KS_OP_JEQ_K: r->lo = MAX(r->lo, imm); r->hi = MIN(r->hi, imm); break;
+        case KS_OP_JGT_K: r->lo = MAX(r->lo, imm + 1); break;
+        case KS_OP_JGE_K: r->lo = MAX(r->lo, imm); break;
+        case KS_OP_JLT_K: r->hi = MIN(r->hi, imm - 1); break;
+        case KS_OP_JLE_K: r->hi = MIN(r->hi, imm); break;
+    }
+    return r->lo <= r->hi; // False: the edge is never taken
+}
+
+// Compare op that holds on the fall-through edge of op
+static unsigned ks_verify_negate(unsigned op) {
+    switch (op) {
+        case KS_OP_JGT_K: return KS_OP_JLE_K;
+        case KS_OP_JGE_K: return KS_OP_JLT_K;
+        case KS_OP_JLT_K: return KS_OP_JGE_K;
+        case KS_OP_JLE_K: return KS_OP_JGT_K;
+        case KS_OP_JNE_K: return KS_OP_JEQ_K;
+        case KS_OP_JEQ_K: return KS_OP_JNE_K;
+        case KS_OP_JSGT_K: return KS_OP_JSLE_K;
+        case KS_OP_JSGE_K: return KS_OP_JSLT_K;
+        case KS_OP_JSLT_K: return KS_OP_JSGE_K;
+        case KS_OP_JSLE_K: return KS_OP_JSGT_K;
+    }
+    return KS_OP_INVALID; // Nothing learnt
+}
+
+/*
+ * Check instruction i against its entry state. Before the fixpoint is
+ * reached (check == false) this only propagates the state to the
+ * successors; afterwards it returns false if the instruction must be
+ * rejected and marks proven memory accesses in *safe.
+ */
+static bool ks_verify_insn(KsVerifier *v, uint32_t i, bool check, bool *safe) {
+    const KsEbpfInsn *insn = &v->prog->insns[i];
+    KsVstate st = v->in[i];
+    KsVreg *dst = &st.r[insn->dst];
+    KsVreg *src = &st.r[insn->src];
+    unsigned op = insn->op;
+    bool reads_dst = false, reads_src = false, writes_dst = false;
+
+    if (op == KS_OP_INVALID) {
+        return false; // Includes running off the end into insns[len]
+    }
+
+    if (op <= KS_OP_NEG32) {
+        bool w = op < KS_OP_ADD32_K;
+        unsigned k = w ? op : op - (KS_OP_ADD32_K - KS_OP_ADD64_K);
+        bool x = k != KS_OP_NEG64 && ((k - KS_OP_ADD64_K) & 1);
+        KsVreg imm = ks_vreg_const(insn->imm);
+
+        k -= x;
+        reads_dst = k != KS_OP_MOV64_K;
+        reads_src = x;
+        writes_dst = true;
+        *dst = w ? ks_verify_alu64(k, dst, x ? src : &imm) : ks_verify_alu32(k, dst, x ? src : &imm);
+    } else if (op >= KS_OP_LE16 && op <= KS_OP_BE64) {
+        reads_dst = writes_dst = true;
+        *dst = (KsVreg){ .kind = KS_VREG_UNKNOWN };
+    } else if (op >= KS_OP_JEQ_K && op <= KS_OP_JSLE32_X) {
+        reads_dst = true;
+        reads_src = (op - KS_OP_JEQ_K) & 1;
+    } else if (op == KS_OP_CALL) {
+        for (int r = 1; r <= ks_ebpf_helper_args[insn->imm]; r++) {
+            if (check && st.r[r].kind == KS_VREG_UNINIT) {
+                return false;
+            }
+        }
+        st.r[0] = (KsVreg){ .kind = KS_VREG_UNKNOWN };
+    } else if (op == KS_OP_EXIT) {
+        return !check || st.r[0].kind != KS_VREG_UNINIT;
+    } else if (op == KS_OP_LDDW) {
+        writes_dst = true;
+        *dst = ks_vreg_const(insn->imm);
+    } else if (op >= KS_OP_LDXB && op <= KS_OP_STXDW) {
+        static const uint8_t size[] = { 1, 2, 4, 8 };
+        bool ldx = op <= KS_OP_LDXDW;
+        const KsVreg *base = ldx ? src : dst;
+        int64_t sz = size[(op - KS_OP_LDXB) % 4];
+
+        reads_src = ldx || op >= KS_OP_STXB;
+        reads_dst = !ldx;
+        writes_dst = ldx;
+        if (check && base->kind == KS_VREG_RANGE) {
+            int64_t lo = base->lo + insn->off - (int64_t)KS_EBPF_DATA_VA;
+            int64_t hi = base->hi + insn->off - (int64_t)KS_EBPF_DATA_VA;
+
+            if (hi < 0 || lo > v->mem_size - sz) {
+                return false; // Outside slot memory whatever the value
+            }
+            *safe = lo >= 0 && hi <= v->mem_size - sz;
+        }
+        // The handlers must zero-extend narrow loads (ldl_le_p() returns int): the
+        // range below lets "r3 = *(u32 *)r1; r3 >>= 31; r1 += r3; r0 = *(u8 *)r1"
+        // skip the bounds check on its last load
+        if (ldx) {
+            *dst = sz == 8 ? (KsVreg){ .kind = KS_VREG_UNKNOWN } : ks_vreg_range(0, (1LL << (sz * 8)) - 1);
+        }
+    }
+
+    if (check) {
+        return !(reads_dst && v->in[i].r[insn->dst].kind == KS_VREG_UNINIT) &&
+               !(reads_src && v->in[i].r[insn->src].kind == KS_VREG_UNINIT) &&
+               !(writes_dst && insn->dst == 10);
+    }
+
+    // Successors
+    if (ks_ebpf_op_is_jump(op)) {
+        KsVstate fall = st;
+        bool refine = op != KS_OP_JA && op <= KS_OP_JSLE_X && !reads_src;
+
+        if (!refine || ks_verify_refine(&st.r[insn->dst], op, insn->imm)) {
+            ks_verify_flow(v, insn->off, &st);
+        }
+        if (op != KS_OP_JA &&
+            (!refine || ks_verify_refine(&fall.r[insn->dst], ks_verify_negate(op), insn->imm))) {
+            ks_verify_flow(v, i + 1, &fall);
+        }
+    } else {
+        ks_verify_flow(v, i + (op == KS_OP_LDDW ? 2 : 1), &st);
+    }
+    return true;
+}
+
+// Does insn write register r? CALL clobbers R0-R5.
+static bool ks_verify_writes(const KsEbpfInsn *insn, unsigned r) {
+    unsigned op = insn->op;
+
+    if (op == KS_OP_CALL) {
+        return r <= 5;
+    }
+    return insn->dst == r && (op <= KS_OP_BE64 || op == KS_OP_LDDW || (op >= KS_OP_LDXB && op <= KS_OP_LDXDW));
+}
+
+// Inside [h, i], is x on a cycle that does not go through the back-edge i?
+static bool ks_verify_inner(const KsEbpfProg *prog, uint32_t h, uint32_t i, uint32_t x) {
+    for (uint32_t j = x; j < i; j++) {
+        const KsEbpfInsn *insn = &prog->insns[j];
+
+        if (ks_ebpf_op_is_jump(insn->op) && insn->off <= x && insn->off >= h) {
+            return true;
+        }
+    }
+    return false;
+}
+
+// Does every path from h to i inside [h, i] pass through x?
+static bool ks_verify_dominates(const KsEbpfProg *prog, uint32_t h, uint32_t i, uint32_t x, uint32_t *stack,
+                                bool *seen) {
+    uint32_t n = 0;
+    bool reached = false;
+
+    if (x == h || x == i) {
+        return true;
+    }
+    memset(seen + h, 0, i - h + 1);
+    seen[h] = true;
+    stack[n++] = h;
+    while (n && !reached) {
+        uint32_t pc = stack[--n];
+        const KsEbpfInsn *insn = &prog->insns[pc];
+        uint32_t succ[2];
+        int ns = 0;
+
+        if (insn->op == KS_OP_EXIT || insn->op == KS_OP_INVALID) {
+            continue;
+        }
+        if (ks_ebpf_op_is_jump(insn->op)) {
+            succ[ns++] = insn->off;
+        }
+        if (insn->op != KS_OP_JA) {
+            succ[ns++] = pc + (insn->op == KS_OP_LDDW ? 2 : 1);
+        }
+        for (int k = 0; k < ns; k++) {
+            uint32_t t = succ[k];
+
+            if (t == i) {
+                reached = true;
+            } else if (t > h && t < i && t != x && !seen[t]) {
+                seen[t] = true;
+                stack[n++] = t;
+            }
+        }
+    }
+    return !reached;
+}
+
+/*
+ * Is the loop closed by the backward jump at i provably bounded? Once per
+ * iteration, a 64-bit compare of some rX with an immediate, or with a
+ * register the loop leaves alone and whose range is known, must leave [h, i]
+ * when it fails. rX must be written in [h, i] only by one "rX += c" (or "-=")
+ * that also runs once per iteration and moves it towards that exit without
+ * wrapping: up to a "<" or "<=" bound, or down to a ">" or ">=" one. "!=" is
+ * no bound, as rX may step past it. The loop may only be entered through its
+ * head h; loops nested in it are checked against their own back-edges.
+ */
+static bool ks_verify_bounded(KsVerifier *v, uint32_t i) {
+    const KsEbpfProg *prog = v->prog;
+    uint32_t h = prog->insns[i].off;
+
+    for (uint32_t s = 0; s < prog->len; s++) {
+        const KsEbpfInsn *insn = &prog->insns[s];
+
+        if (ks_ebpf_op_is_jump(insn->op) && insn->off > h && insn->off <= i && (s < h || s > i)) {
+            return false; // Entered past its head
+        }
+    }
+    for (uint32_t g = h; g <= i; g++) {
+        const KsEbpfInsn *guard = &prog->insns[g];
+        unsigned x = guard->dst, stay = guard->op, k = 0, writes = 0;
+        bool reg = (stay - KS_OP_JEQ_K) & 1;
+        KsVreg bound = ks_vreg_const(guard->imm);
+        int64_t c = 0;
+        bool ok;
+
+        if (stay < KS_OP_JEQ_K || stay > KS_OP_JSLE_X) {
+            continue; // Not a 64-bit compare
+        }
+        if (reg) {
+            bound = v->in[g].r[guard->src];
+            stay--;
+        }
+        if (g < i) {
+            if (guard->off >= h && guard->off <= i) {
+                continue; // Both edges stay in the loop
+            }
+            stay = ks_verify_negate(stay);
+        }
+        if (bound.kind != KS_VREG_RANGE || ks_verify_inner(prog, h, i, g) ||
+            !ks_verify_dominates(prog, h, i, g, v->work, v->queued)) {
+            continue;
+        }
+        for (uint32_t j = h; j <= i; j++) {
+            if (ks_verify_writes(&prog->insns[j], x)) {
+                k = j;
+                writes++;
+            }
+            if (reg && guard->src != x && ks_verify_writes(&prog->insns[j], guard->src)) {
+                writes = 2; // Moving bound
+            }
+        }
+        if (writes != 1 || ks_verify_inner(prog, h, i, k) ||
+            !ks_verify_dominates(prog, h, i, k, v->work, v->queued)) {
+            continue;
+        }
+        if (prog->insns[k].op == KS_OP_ADD64_K) {
+            c = (int64_t)prog->insns[k].imm;
+        } else if (prog->insns[k].op == KS_OP_SUB64_K) {
+            c = -(int64_t)prog->insns[k].imm;
+        }
+        // Bounds are within +-KS_VERIFY_RANGE_MAX and |c| <= 2^31, so no step overflows past one
+        switch (stay) {
+            case KS_OP_JLT_K:
+            case KS_OP_JLE_K: ok = c > 0 && bound.lo >= 0; break;
+            case KS_OP_JSLT_K:
+            case KS_OP_JSLE_K: ok = c > 0; break;
+            case KS_OP_JGT_K: ok = c < 0 && bound.lo >= 0 && -c <= bound.lo + 1; break;
+            case KS_OP_JGE_K: ok = c < 0 && bound.lo >= 0 && -c <= bound.lo; break;
+            case KS_OP_JSGT_K:
+            case KS_OP_JSGE_K: ok = c < 0; break;
+            default: ok = false; break;
+        }
+        if (ok) {
+            return true;
+        }
+    }
+    return false;
+}
+
+/*
+ * Verify prog for a slot with mem_size bytes of data memory, entered with
+ * R1 = KS_EBPF_DATA_VA, R2 <= mem_size and R10 = KS_EBPF_DATA_VA + mem_size.
+ * Returns (and records in prog) KS_VM_ERR_NONE or KS_VM_ERR_VERIFY.
+ */
+int ks_ebpf_verify(KsEbpfProg *prog, uint32_t mem_size) {
+    uint32_t n = prog->len;
+    KsVerifier v = {
+        .prog = prog,
+        .mem_size = mem_size,
+        .in = g_new(KsVstate, n + 1),
+        .seen = g_new0(bool, n + 1),
+        .updates = g_new0(uint8_t, n + 1),
+        .loop_head = g_new0(bool, n + 1),
+        .work = g_new(uint32_t, n + 1),
+        .queued = g_new0(bool, n + 1),
+    };
+    bool *safe = g_new0(bool, n + 1);
+    KsVstate entry;
+
+    for (int r = 0; r < KS_EBPF_NUM_REGS; r++) {
+        entry.r[r] = (KsVreg){ .kind = KS_VREG_UNINIT };
+    }
+    entry.r[1] = ks_vreg_const(KS_EBPF_DATA_VA);
+    entry.r[2] = ks_vreg_range(0, mem_size);
+    entry.r[10] = ks_vreg_const(KS_EBPF_DATA_VA + mem_size);
+    // Every cycle passes through the target of a backward jump, so widening
+    // there is enough to terminate and keeps ranges inside loop bodies tight
+    for (uint32_t i = 0; i < n; i++) {
+        if (ks_ebpf_op_is_jump(prog->insns[i].op) && prog->insns[i].off <= i) {
+            v.loop_head[prog->insns[i].off] = true;
+        }
+    }
+    ks_verify_flow(&v, 0, &entry);
+    while (v.nwork) {
+        uint32_t i = v.work[--v.nwork];
+
+        v.queued[i] = false;
+        ks_verify_insn(&v, i, false, NULL);
+    }
+
+    prog->verify_err = KS_VM_ERR_NONE;
+    prog->verified = true;
+    // The work list is empty now: ks_verify_bounded() borrows it and queued as scratch
+    for (uint32_t i = 0; i <= n; i++) {
+        const KsEbpfInsn *insn = &prog->insns[i];
+
+        if (!v.seen[i]) {
+            continue;
+        }
+        if (!ks_verify_insn(&v, i, true, &safe[i]) ||
+            (ks_ebpf_op_is_jump(insn->op) && insn->off <= i && !ks_verify_bounded(&v, i))) {
+            prog->verify_err = KS_VM_ERR_VERIFY;
+            prog->verify_pc = i;
+            prog->verified = false;
+            break;
+        }
+        if (insn->op >= KS_OP_LDXB && insn->op <= KS_OP_STXDW && !safe[i]) {
+            prog->verified = false;
+        }
+    }
+    if (!prog->verify_err) {
+        for (uint32_t i = 0; i < n; i++) {
+            if (safe[i]) {
+                prog->insns[i].op += KS_OP_LDXB_NC - KS_OP_LDXB;
+            }
+        }
+    }
+
+    g_free(safe);
+    g_free(v.queued);
+    g_free(v.work);
+    g_free(v.loop_head);
+    g_free(v.updates);
+    g_free(v.seen);
+    g_free(v.in);
+    return prog->verify_err;
+}
+
+int ks_ebpf_map_define(KsEbpfMap *m, uint32_t type, uint32_t key_size, uint32_t value_size,
+                       uint32_t max_entries, uint32_t copies) {
+    *m = (KsEbpfMap){ 0 };
+    if (value_size < 1 || value_size > KS_EBPF_MAP_MAX_VALUE ||
+        max_entries < 1 || max_entries > KS_EBPF_MAP_MAX_ENTRIES) {
+        return -EINVAL;
+    }
+    m->value_stride = ROUND_UP(value_size, 8);
+    switch (type) {
+        case KS_EBPF_MAP_ARRAY:
+        case KS_EBPF_MAP_PERSLOT_ARRAY:
+            if (key_size != 4 || copies < 1 || (type == KS_EBPF_MAP_ARRAY && copies != 1)) {
+                return -EINVAL;
+            }
+            m->entry_size = copies * m->value_stride;
+            break;
+        case KS_EBPF_MAP_HASH:
+            if (key_size < 1 || key_size > KS_EBPF_MAP_MAX_KEY || copies != 1) {
+                return -EINVAL;
+            }
+            m->key_off = sizeof(KsEbpfMapEntryHdr);
+            m->value_off = m->key_off + ROUND_UP(key_size, 8);
+            m->entry_size = m->value_off + m->value_stride;
+            m->nbuckets = pow2ceil(max_entries);
+            break;
+        default:
+            return -EINVAL;
+    }
+    m->type = type;
+    m->key_size = key_size;
+    m->value_size = value_size;
+    m->max_entries = max_entries;
+    m->copies = copies;
+    m->data_size = max_entries * m->entry_size; // At most 1 GB
+    return 0;
+}
+
+static void ks_ebpf_map_alloc_index(KsEbpfMap *m) {
+    if (m->type == KS_EBPF_MAP_HASH) {
+        m->bucket_seq = g_new0(uint32_t, m->nbuckets);
+        m->bucket_head = g_new0(uint32_t, m->nbuckets);
+        m->next = g_new0(uint32_t, m->max_entries);
+    }
+}
+
+void ks_ebpf_map_alloc(KsEbpfMap *m) {
+    m->data = g_malloc0(m->data_size);
+    ks_ebpf_map_alloc_index(m);
+}
+
+void ks_ebpf_map_free(KsEbpfMap *m) {
+    g_free(m->data);
+    g_free(m->bucket_seq);
+    g_free(m->bucket_head);
+    g_free(m->next);
+    *m = (KsEbpfMap){ 0 };
+}
+
+void ks_ebpf_map_clear(KsEbpfMap *m) {
+    memset(m->data, 0, m->data_size);
+    if (m->type == KS_EBPF_MAP_HASH) {
+        memset(m->bucket_head, 0, m->nbuckets * sizeof(uint32_t));
+        memset(m->next, 0, m->max_entries * sizeof(uint32_t));
+        m->alloc_hint = 0;
+        m->used = 0;
+        m->count = 0;
+    }
+}
+
+uint32_t ks_ebpf_map_count(KsEbpfMap *m) {
+    return m->type == KS_EBPF_MAP_HASH ? qatomic_read(&m->count) : m->max_entries;
+}
+
+static uint32_t ks_ebpf_map_hash(const uint8_t *key, uint32_t len) {
+    uint32_t h = 0x811c9dc5; // FNV-1a
+
+    for (uint32_t i = 0; i < len; i++) {
+        h = (h ^ key[i]) * 0x01000193;
+    }
+    return h ^ (h >> 16);
+}
+
+static KsEbpfMapEntryHdr *ks_map_hdr(KsEbpfMap *m, uint32_t e) {
+    return (KsEbpfMapEntryHdr *)(m->data + (size_t)e * m->entry_size);
+}
+
+static uint8_t *ks_map_key(KsEbpfMap *m, uint32_t e) {
+    return m->data + (size_t)e * m->entry_size + m->key_off;
+}
+
+static uint8_t *ks_map_value(KsEbpfMap *m, uint32_t e) {
+    return m->data + (size_t)e * m->entry_size + m->value_off;
+}
+
+static uint32_t ks_map_bucket(KsEbpfMap *m, uint32_t hash) {
+    return hash & (m->nbuckets - 1);
+}
+
+// Writers take a bucket by making its sequence count odd, and release it by making it even again
+static void ks_map_lock(KsEbpfMap *m, uint32_t b) {
+    for (;;) {
+        uint32_t seq = qatomic_read(&m->bucket_seq[b]);
+
+        if (!(seq & 1) && qatomic_cmpxchg(&m->bucket_seq[b], seq, seq + 1) == seq) {
+            return;
+        }
+        cpu_relax();
+    }
+}
+
+static void ks_map_unlock(KsEbpfMap *m, uint32_t b) {
+    qatomic_store_release(&m->bucket_seq[b], qatomic_read(&m->bucket_seq[b]) + 1);
+}
+
+static uint32_t ks_map_read_begin(KsEbpfMap *m, uint32_t b) {
+    uint32_t seq;
+
+    while ((seq = qatomic_load_acquire(&m->bucket_seq[b])) & 1) {
+        cpu_relax();
+    }
+    return seq;
+}
+
+static bool ks_map_read_retry(KsEbpfMap *m, uint32_t b, uint32_t seq) {
+    smp_rmb();
+    return qatomic_read(&m->bucket_seq[b]) != seq;
+}
+
+/*
+ * Entry of bucket b holding key, or -1. Readers may follow a chain that a
+ * writer is relinking into another bucket, so the walk is bounded; their
+ * sequence check then fails anyway.
+ */
+static int64_t ks_map_find(KsEbpfMap *m, uint32_t b, uint32_t hash, const uint8_t *key) {
+    uint32_t e = qatomic_read(&m->bucket_head[b]);
+
+    for (uint32_t n = 0; e && n < m->max_entries; n++) {
+        if (qatomic_read(&ks_map_hdr(m, e - 1)->hash) == hash && !memcmp(ks_map_key(m, e - 1), key, m->key_size)) {
+            return e - 1;
+        }
+        e = qatomic_read(&m->next[e - 1]);
+    }
+    return -1;
+}
+
+// Claim a free entry for a slot (KS_EBPF_MAP_ENT_BUSY) or the host, zeroing its key and value
+static int64_t ks_map_claim(KsEbpfMap *m, uint32_t state) {
+    if (qatomic_fetch_inc(&m->used) >= m->max_entries) {
+        qatomic_dec(&m->used);
+        return -1;
+    }
+    // Every claimant has counted itself in used first, so a free entry is left for this one
+    for (uint32_t i = qatomic_fetch_inc(&m->alloc_hint);; i++) {
+        uint32_t e = i % m->max_entries;
+        KsEbpfMapEntryHdr *h = ks_map_hdr(m, e);
+
+        if (qatomic_read(&h->state) == KS_EBPF_MAP_ENT_FREE &&
+            qatomic_cmpxchg(&h->state, KS_EBPF_MAP_ENT_FREE, state) == KS_EBPF_MAP_ENT_FREE) {
+            qatomic_set(&m->alloc_hint, i + 1);
+            memset(ks_map_key(m, e), 0, m->entry_size - m->key_off);
+            return e;
+        }
+    }
+}
+
+static void ks_map_release(KsEbpfMap *m, uint32_t e) {
+    qatomic_store_release(&ks_map_hdr(m, e)->state, KS_EBPF_MAP_ENT_FREE);
+    qatomic_dec(&m->used);
+}
+
+// Bucket b held: make entry e, with its key filled in, the valid one for its key
+static void ks_map_link(KsEbpfMap *m, uint32_t b, uint32_t e, uint32_t hash) {
+    qatomic_set(&ks_map_hdr(m, e)->hash, hash);
+    qatomic_set(&m->next[e], m->bucket_head[b]);
+    qatomic_set(&m->bucket_head[b], e + 1);
+    qatomic_set(&ks_map_hdr(m, e)->state, KS_EBPF_MAP_ENT_VALID);
+    qatomic_inc(&m->count);
+}
+
+// Bucket b held: take e out of it and free it
+static void ks_map_unlink(KsEbpfMap *m, uint32_t b, uint32_t e) {
+    uint32_t *link = &m->bucket_head[b];
+
+    while (*link != e + 1) {
+        link = &m->next[*link - 1];
+    }
+    qatomic_set(link, m->next[e]);
+    qatomic_dec(&m->count);
+    ks_map_release(m, e);
+}
+
+int ks_ebpf_map_restore(KsEbpfMap *m) {
+    KsEbpfMap def;
+    uint8_t *data = m->data;
+
+    if (ks_ebpf_map_define(&def, m->type, m->key_size, m->value_size, m->max_entries, m->copies) ||
+        def.data_size != m->data_size || !data) {
+        return -EINVAL;
+    }
+    *m = def;
+    m->data = data;
+    ks_ebpf_map_alloc_index(m);
+    for (uint32_t e = 0; m->type == KS_EBPF_MAP_HASH && e < m->max_entries; e++) {
+        KsEbpfMapEntryHdr *h = ks_map_hdr(m, e);
+        uint32_t hash = ks_ebpf_map_hash(ks_map_key(m, e), m->key_size);
+
+        switch (h->state) {
+            case KS_EBPF_MAP_ENT_FREE:
+                break;
+            case KS_EBPF_MAP_ENT_HOST:
+                m->used++;
+                break;
+            case KS_EBPF_MAP_ENT_VALID:
+                if (h->hash != hash || ks_map_find(m, ks_map_bucket(m, hash), hash, ks_map_key(m, e)) >= 0) {
+                    return -EINVAL;
+                }
+                m->used++;
+                ks_map_link(m, ks_map_bucket(m, hash), e, hash);
+                break;
+            default: // Runs are settled before saving, so nothing is BUSY
+                return -EINVAL;
+        }
+    }
+    return 0;
+}
+
+// Add to a little-endian 64-bit word that others may update at the same time
+static uint64_t ks_map_add64(uint8_t *p, uint64_t delta) {
+    uint64_t *w = (uint64_t *)p;
+
+    for (;;) {
+        uint64_t old = qatomic_read(w);
+        uint64_t sum = le64_to_cpu(old) + delta;
+
+        if (qatomic_cmpxchg(w, old, cpu_to_le64(sum)) == old) {
+            return sum;
+        }
+    }
+}
+
+uint64_t ks_ebpf_map_host_read(KsEbpfMap *m, uint32_t off, unsigned size) {
+    uint8_t *p = m->data + off;
+
+    if (off >= m->data_size || size > m->data_size - off) {
+        return 0;
+    }
+    if (m->type == KS_EBPF_MAP_HASH && off % m->entry_size < sizeof(KsEbpfMapEntryHdr)) {
+        KsEbpfMapEntryHdr *h = ks_map_hdr(m, off / m->entry_size);
+        uint64_t hdr = qatomic_read(&h->state) | (uint64_t)qatomic_read(&h->hash) << 32;
+
+        return size == 8 ? hdr : (uint32_t)(hdr >> (off % 8 * 8));
+    }
+    return size == 8 ? le64_to_cpu(qatomic_read((uint64_t *)p)) : le32_to_cpu(qatomic_read((uint32_t *)p));
+}
+
+static void ks_map_host_store(uint8_t *p, uint64_t val, unsigned size) {
+    if (size == 8) {
+        qatomic_set((uint64_t *)p, cpu_to_le64(val));
+    } else {
+        qatomic_set((uint32_t *)p, cpu_to_le32(val));
+    }
+}
+
+// A host write to the state word of hash entry e
+static void ks_map_host_set_state(KsEbpfMap *m, uint32_t e, uint32_t state) {
+    KsEbpfMapEntryHdr *h = ks_map_hdr(m, e);
+    uint32_t old = qatomic_read(&h->state);
+    uint32_t hash, b;
+    int64_t dup;
+
+    if (state == KS_EBPF_MAP_ENT_HOST && old == KS_EBPF_MAP_ENT_FREE) {
+        if (qatomic_fetch_inc(&m->used) >= m->max_entries ||
+            qatomic_cmpxchg(&h->state, KS_EBPF_MAP_ENT_FREE, KS_EBPF_MAP_ENT_HOST) != KS_EBPF_MAP_ENT_FREE) {
+            qatomic_dec(&m->used);
+            return;
+        }
+        memset(ks_map_key(m, e), 0, m->entry_size - m->key_off);
+    } else if (state == KS_EBPF_MAP_ENT_FREE && old == KS_EBPF_MAP_ENT_HOST) {
+        ks_map_release(m, e);
+    } else if (state == KS_EBPF_MAP_ENT_FREE && old == KS_EBPF_MAP_ENT_VALID) {
+        b = ks_map_bucket(m, qatomic_read(&h->hash));
+        ks_map_lock(m, b);
+        // A slot may have deleted it meanwhile, and even reused it in another bucket
+        if (qatomic_read(&h->state) == KS_EBPF_MAP_ENT_VALID && ks_map_bucket(m, qatomic_read(&h->hash)) == b) {
+            ks_map_unlink(m, b, e);
+        }
+        ks_map_unlock(m, b);
+    } else if (state == KS_EBPF_MAP_ENT_VALID && old == KS_EBPF_MAP_ENT_HOST) {
+        hash = ks_ebpf_map_hash(ks_map_key(m, e), m->key_size);
+        b = ks_map_bucket(m, hash);
+        ks_map_lock(m, b);
+        dup = ks_map_find(m, b, hash, ks_map_key(m, e));
+        if (dup >= 0) {
+            // The key is there already: it takes the new value and this entry goes back
+            memcpy(ks_map_value(m, dup), ks_map_value(m, e), m->value_size);
+            ks_map_release(m, e);
+        } else {
+            ks_map_link(m, b, e, hash);
+        }
+        ks_map_unlock(m, b);
+    }
+}
+
+void ks_ebpf_map_host_write(KsEbpfMap *m, uint32_t off, uint64_t val, unsigned size) {
+    uint32_t e, part, b;
+    KsEbpfMapEntryHdr *h;
+
+    if (off >= m->data_size || size > m->data_size - off) {
+        return;
+    }
+    if (m->type != KS_EBPF_MAP_HASH) {
+        ks_map_host_store(m->data + off, val, size);
+        return;
+    }
+    e = off / m->entry_size;
+    part = off % m->entry_size;
+    h = ks_map_hdr(m, e);
+    if (part < sizeof(KsEbpfMapEntryHdr)) {
+        if (part == 0) {
+            ks_map_host_set_state(m, e, (uint32_t)val); // The hash is read-only
+        }
+    } else if (qatomic_read(&h->state) == KS_EBPF_MAP_ENT_HOST) {
+        ks_map_host_store(m->data + off, val, size);
+    } else if (qatomic_read(&h->state) == KS_EBPF_MAP_ENT_VALID && part >= m->value_off) {
+        // Under the bucket lock, so that lookups never return half of it
+        b = ks_map_bucket(m, qatomic_read(&h->hash));
+        ks_map_lock(m, b);
+        if (qatomic_read(&h->state) == KS_EBPF_MAP_ENT_VALID && ks_map_bucket(m, qatomic_read(&h->hash)) == b) {
+            ks_map_host_store(m->data + off, val, size);
+        }
+        ks_map_unlock(m, b);
+    }
+}
+
+// Mailboxes are shared with guest MMIO while the VM runs on a worker thread
+static uint64_t ks_ebpf_helper_mbox_read(KsEbpfRunCtx *ctx, uint64_t r1, uint64_t r2,
+                                         uint64_t r3, uint64_t r4, uint64_t r5) {
+    uint32_t val;
+
+    if (ctx->fifo_in) {
+        if (!ks_mbox_fifo_pop(ctx->fifo_in, &val)) {
+            return (uint64_t)-1;
+        }
+        ctx->fifo_kick(ctx->fifo_opaque);
+        return val;
+    }
+    return r1 < ctx->num_mbox ? qatomic_read(&ctx->mbox_in[r1]) : 0;
+}
+
+static uint64_t ks_ebpf_helper_mbox_write(KsEbpfRunCtx *ctx, uint64_t r1, uint64_t r2,
+                                          uint64_t r3, uint64_t r4, uint64_t r5) {
+    if (ctx->fifo_in) {
+        if (!ks_mbox_fifo_push(ctx->fifo_out, (uint32_t)r2)) {
+            return (uint64_t)-1;
+        }
+        ctx->fifo_kick(ctx->fifo_opaque);
+        return 0;
+    }
+    if (r1 >= ctx->num_mbox) {
+        return (uint64_t)-1;
+    }
+    qatomic_set(&ctx->mbox_out[r1], (uint32_t)r2);
+    return 0;
+}
+
+static uint64_t ks_ebpf_helper_mbox_status(KsEbpfRunCtx *ctx, uint64_t r1, uint64_t r2,
+                                           uint64_t r3, uint64_t r4, uint64_t r5) {
+    if (!ctx->fifo_in) {
+        return 0;
+    }
+    return ks_mbox_fifo_count(ctx->fifo_in) |
+           (uint64_t)(ctx->fifo_out->depth - ks_mbox_fifo_count(ctx->fifo_out)) << 32;
+}
+
+static uint64_t ks_ebpf_helper_set_out_len(KsEbpfRunCtx *ctx, uint64_t r1, uint64_t r2,
+                                           uint64_t r3, uint64_t r4, uint64_t r5) {
+    if (r1 > ctx->out_max) {
+        return (uint64_t)-1;
+    }
+    ctx->out_len = r1;
+    return 0;
+}
+
+// Slot memory at va, len bytes of it, or NULL if any of it is outside
+static uint8_t *ks_ebpf_mem(KsEbpfRunCtx *ctx, uint64_t va, uint32_t len) {
+    uint64_t off = va - KS_EBPF_DATA_VA;
+
+    return len <= ctx->mem_size && off <= ctx->mem_size - len ? ctx->mem + off : NULL;
+}
+
+static KsEbpfMap *ks_ebpf_map_get(KsEbpfRunCtx *ctx, uint64_t id) {
+    KsEbpfMap *m = id < ctx->num_maps ? &ctx->maps[id] : NULL;
+
+    return m && m->type ? m : NULL;
+}
+
+// This run's value of key in an array map, or NULL
+static uint8_t *ks_map_array_value(KsEbpfMap *m, KsEbpfRunCtx *ctx, const uint8_t *key) {
+    uint32_t idx = ldl_le_p(key);
+    uint32_t copy = m->type == KS_EBPF_MAP_PERSLOT_ARRAY ? ctx->slot : 0;
+
+    if (idx >= m->max_entries || copy >= m->copies) {
+        return NULL;
+    }
+    return m->data + (size_t)idx * m->entry_size + copy * m->value_stride;
+}
+
+static uint64_t ks_ebpf_helper_map_lookup(KsEbpfRunCtx *ctx, uint64_t r1, uint64_t r2,
+                                          uint64_t r3, uint64_t r4, uint64_t r5) {
+    KsEbpfMap *m = ks_ebpf_map_get(ctx, r1);
+    uint8_t *key = m ? ks_ebpf_mem(ctx, r2, m->key_size) : NULL;
+    uint8_t *out = m ? ks_ebpf_mem(ctx, r3, m->value_size) : NULL;
+    uint8_t val[KS_EBPF_MAP_MAX_VALUE];
+    const uint8_t *src;
+    uint32_t hash, b, seq;
+    int64_t e;
+
+    if (!key || !out) {
+        return (uint64_t)-1;
+    }
+    if (m->type != KS_EBPF_MAP_HASH) {
+        src = ks_map_array_value(m, ctx, key);
+        if (!src) {
+            return (uint64_t)-1;
+        }
+        memcpy(out, src, m->value_size);
+        return 0;
+    }
+    hash = ks_ebpf_map_hash(key, m->key_size);
+    b = ks_map_bucket(m, hash);
+    do {
+        seq = ks_map_read_begin(m, b);
+        e = ks_map_find(m, b, hash, key);
+        if (e >= 0) {
+            memcpy(val, ks_map_value(m, e), m->value_size);
+        }
+    } while (ks_map_read_retry(m, b, seq));
+    if (e < 0) {
+        return (uint64_t)-1;
+    }
+    memcpy(out, val, m->value_size);
+    return 0;
+}
+
+static uint64_t ks_ebpf_helper_map_update(KsEbpfRunCtx *ctx, uint64_t r1, uint64_t r2,
+                                          uint64_t r3, uint64_t r4, uint64_t r5) {
+    KsEbpfMap *m = ks_ebpf_map_get(ctx, r1);
+    uint8_t *key = m ? ks_ebpf_mem(ctx, r2, m->key_size) : NULL;
+    uint8_t *val = m ? ks_ebpf_mem(ctx, r3, m->value_size) : NULL;
+    uint8_t *dst;
+    uint32_t hash, b;
+    int64_t e;
+
+    if (!key || !val || r4 > KS_EBPF_MAP_UPDATE_EXIST) {
+        return (uint64_t)-1;
+    }
+    if (m->type != KS_EBPF_MAP_HASH) {
+        dst = ks_map_array_value(m, ctx, key);
+        if (!dst || r4 == KS_EBPF_MAP_UPDATE_NOEXIST) {
+            return (uint64_t)-1;
+        }
+        memcpy(dst, val, m->value_size);
+        return 0;
+    }
+    hash = ks_ebpf_map_hash(key, m->key_size);
+    b = ks_map_bucket(m, hash);
+    ks_map_lock(m, b);
+    e = ks_map_find(m, b, hash, key);
+    if (e >= 0 ? r4 == KS_EBPF_MAP_UPDATE_NOEXIST : r4 == KS_EBPF_MAP_UPDATE_EXIST) {
+        ks_map_unlock(m, b);
+        return (uint64_t)-1;
+    }
+    if (e < 0) {
+        e = ks_map_claim(m, KS_EBPF_MAP_ENT_BUSY);
+        if (e < 0) {
+            ks_map_unlock(m, b);
+            return (uint64_t)-1;
+        }
+        memcpy(ks_map_key(m, e), key, m->key_size);
+        memcpy(ks_map_value(m, e), val, m->value_size);
+        ks_map_link(m, b, e, hash);
+    } else {
+        memcpy(ks_map_value(m, e), val, m->value_size);
+    }
+    ks_map_unlock(m, b);
+    return 0;
+}
+
+static uint64_t ks_ebpf_helper_map_delete(KsEbpfRunCtx *ctx, uint64_t r1, uint64_t r2,
+                                          uint64_t r3, uint64_t r4, uint64_t r5) {
+    KsEbpfMap *m = ks_ebpf_map_get(ctx, r1);
+    uint8_t *key = m ? ks_ebpf_mem(ctx, r2, m->key_size) : NULL;
+    uint32_t hash, b;
+    int64_t e;
+
+    if (!key || m->type != KS_EBPF_MAP_HASH) {
+        return (uint64_t)-1;
+    }
+    hash = ks_ebpf_map_hash(key, m->key_size);
+    b = ks_map_bucket(m, hash);
+    ks_map_lock(m, b);
+    e = ks_map_find(m, b, hash, key);
+    if (e >= 0) {
+        ks_map_unlink(m, b, e);
+    }
+    ks_map_unlock(m, b);
+    return e >= 0 ? 0 : (uint64_t)-1;
+}
+
+static uint64_t ks_ebpf_helper_map_add(KsEbpfRunCtx *ctx, uint64_t r1, uint64_t r2,
+                                       uint64_t r3, uint64_t r4, uint64_t r5) {
+    KsEbpfMap *m = ks_ebpf_map_get(ctx, r1);
+    uint8_t *key = m ? ks_ebpf_mem(ctx, r2, m->key_size) : NULL;
+    uint8_t *val;
+    uint32_t hash, b;
+    uint64_t sum;
+    int64_t e;
+
+    if (!key || m->value_size < 8 || r3 > m->value_size - 8 || r3 % 8) {
+        return (uint64_t)-1;
+    }
+    if (m->type != KS_EBPF_MAP_HASH) {
+        val = ks_map_array_value(m, ctx, key);
+        return val ? ks_map_add64(val + r3, r4) : (uint64_t)-1;
+    }
+    hash = ks_ebpf_map_hash(key, m->key_size);
+    b = ks_map_bucket(m, hash);
+    ks_map_lock(m, b);
+    e = ks_map_find(m, b, hash, key);
+    if (e < 0) {
+        e = ks_map_claim(m, KS_EBPF_MAP_ENT_BUSY);
+        if (e < 0) {
+            ks_map_unlock(m, b);
+            return (uint64_t)-1;
+        }
+        memcpy(ks_map_key(m, e), key, m->key_size);
+        ks_map_link(m, b, e, hash);
+    }
+    sum = ks_map_add64(ks_map_value(m, e) + r3, r4);
+    ks_map_unlock(m, b);
+    return sum;
+}
+
+KsEbpfHelperFn *const ks_ebpf_helpers[KS_EBPF_HELPER_MAX] = {
+    [KS_EBPF_HELPER_MBOX_READ]  = ks_ebpf_helper_mbox_read,
+    [KS_EBPF_HELPER_MBOX_WRITE] = ks_ebpf_helper_mbox_write,
+    [KS_EBPF_HELPER_SET_OUT_LEN] = ks_ebpf_helper_set_out_len,
+    [KS_EBPF_HELPER_MBOX_STATUS] = ks_ebpf_helper_mbox_status,
+    [KS_EBPF_HELPER_MAP_LOOKUP] = ks_ebpf_helper_map_lookup,
+    [KS_EBPF_HELPER_MAP_UPDATE] = ks_ebpf_helper_map_update,
+    [KS_EBPF_HELPER_MAP_DELETE] = ks_ebpf_helper_map_delete,
+    [KS_EBPF_HELPER_MAP_ADD]    = ks_ebpf_helper_map_add,
+};
+
+static const bool ks_ebpf_no_stop;
+
+/*
+ * Run prog to completion. Returns KS_VM_ERR_NONE with ctx->retval = R0 on
+ * EXIT, or a KS_VM_ERR_* code; ctx->pc and ctx->icount are set either way.
+ */
+int ks_ebpf_run_interp(const KsEbpfProg *prog, KsEbpfRunCtx *ctx) {
+    static const void *const dispatch[KS_OP__MAX] = {
+#define KS_EBPF_OP_LABEL(name) [KS_OP_##name] = &&op_##name,
+        KS_EBPF_OPS(KS_EBPF_OP_LABEL)
+#undef KS_EBPF_OP_LABEL
+    };
+    // Profiled runs dispatch every instruction through prof_tick first, so
+    // the handlers themselves are the same either way
+    static const void *const prof_dispatch[KS_OP__MAX] = {
+        [0 ... KS_OP__MAX - 1] = &&prof_tick,
+    };
+    const void *const *table = ctx->prof ? prof_dispatch : dispatch;
+    uint64_t *prof = ctx->prof;
+    uint64_t prof_left = ctx->prof_left;
+    const KsEbpfInsn *insns = prog->insns;
+    const KsEbpfInsn *insn;
+    uint8_t *mem = ctx->mem;
+    const uint64_t mem_size = ctx->mem_size;
+    const uint64_t limit = ctx->insn_limit;
+    const bool *stop = ctx->stop ? ctx->stop : &ks_ebpf_no_stop;
+    uint64_t reg[KS_EBPF_NUM_REGS] = { 0 };
+    uint64_t icount = 0;
+    uint32_t pc = 0;
+    int err = KS_VM_ERR_NONE;
+
+    reg[1] = KS_EBPF_DATA_VA;
+    reg[2] = ctx->data_len;
+    reg[10] = KS_EBPF_DATA_VA + mem_size;
+    ctx->out_len = ctx->out_max;
+
+#define DST reg[insn->dst]
+#define SRC reg[insn->src]
+#define IMM insn->imm
+#define DISPATCH() do { insn = &insns[pc]; icount++; goto *table[insn->op]; } while (0)
+#define NEXT(n) do { pc += (n); DISPATCH(); } while (0)
+// Every taken branch is a potential loop edge, so the budget is checked there.
+// Only backward ones can loop forever, so a stop request is polled on those.
+#define BRANCH_IF(cond) do { \
+        if (cond) { \
+            if (unlikely(icount >= limit)) { \
+                goto insn_limit; \
+            } \
+            if (insn->off <= pc && unlikely(qatomic_read(stop))) { \
+                goto stopped; \
+            } \
+            pc = insn->off; \
+            DISPATCH(); \
+        } \
+        NEXT(1); \
+    } while (0)
+// Host pointer for a size-byte access at slot address base + off, or fault
+#define MEM(base, size) ({ \
+        uint64_t _o = (base) + (int64_t)insn->off - KS_EBPF_DATA_VA; \
+        if (unlikely(_o > mem_size - (size))) { \
+            goto mem_fault; \
+        } \
+        mem + _o; \
+    })
+// Same for an access ks_ebpf_verify() proved to be inside slot memory
+#define MEM_NC(base) (mem + ((base) + (int64_t)insn->off - KS_EBPF_DATA_VA))
+
+#define ALU(name, OP) \
+    op_##name##64_K: DST = DST OP IMM; NEXT(1); \
+    op_##name##64_X: DST = DST OP SRC; NEXT(1); \
+    op_##name##32_K: DST = (uint32_t)((uint32_t)DST OP (uint32_t)IMM); NEXT(1); \
+    op_##name##32_X: DST = (uint32_t)((uint32_t)DST OP (uint32_t)SRC); NEXT(1);
+#define JMP(name, OP, T64, T32) \
+    op_##name##_K:   BRANCH_IF((T64)DST OP (T64)IMM); \
+    op_##name##_X:   BRANCH_IF((T64)DST OP (T64)SRC); \
+    op_##name##32_K: BRANCH_IF((T32)DST OP (T32)IMM); \
+    op_##name##32_X: BRANCH_IF((T32)DST OP (T32)SRC);
+
+    DISPATCH();
+
+prof_tick:
+    if (--prof_left == 0) {
+        prof[pc]++;
+        qatomic_set(&ctx->prof_pc, pc);
+        prof_left = ctx->prof_period;
+    }
+    goto *dispatch[insn->op];
+
+    ALU(ADD, +)
+    ALU(SUB, -)
+    ALU(MUL, *)
+    ALU(OR, |)
+    ALU(AND, &)
+    ALU(XOR, ^)
+
+    // Division by zero yields 0 and modulo by zero leaves dst, as in Linux
+    op_DIV64_K: DST = IMM ? DST / IMM : 0; NEXT(1);
+    op_DIV64_X: DST = SRC ? DST / SRC : 0; NEXT(1);
+    op_DIV32_K: DST = (uint32_t)IMM ? (uint32_t)DST / (uint32_t)IMM : 0; NEXT(1);
+    op_DIV32_X: DST = (uint32_t)SRC ? (uint32_t)DST / (uint32_t)SRC : 0; NEXT(1);
+    op_MOD64_K: DST = IMM ? DST % IMM : DST; NEXT(1);
+    op_MOD64_X: DST = SRC ? DST % SRC : DST; NEXT(1);
+    op_MOD32_K: DST = (uint32_t)IMM ? (uint32_t)DST % (uint32_t)IMM : (uint32_t)DST; NEXT(1);
+    op_MOD32_X: DST = (uint32_t)SRC ? (uint32_t)DST % (uint32_t)SRC : (uint32_t)DST; NEXT(1);
+
+    op_LSH64_K: DST <<= IMM & 63; NEXT(1);
+    op_LSH64_X: DST <<= SRC & 63; NEXT(1);
+    op_LSH32_K: DST = (uint32_t)DST << (IMM & 31); NEXT(1);
+    op_LSH32_X: DST = (uint32_t)DST << (SRC & 31); NEXT(1);
+    op_RSH64_K: DST >>= IMM & 63; NEXT(1);
+    op_RSH64_X: DST >>= SRC & 63; NEXT(1);
+    op_RSH32_K: DST = (uint32_t)DST >> (IMM & 31); NEXT(1);
+    op_RSH32_X: DST = (uint32_t)DST >> (SRC & 31); NEXT(1);
+    op_ARSH64_K: DST = (int64_t)DST >> (IMM & 63); NEXT(1);
+    op_ARSH64_X: DST = (int64_t)DST >> (SRC & 63); NEXT(1);
+    op_ARSH32_K: DST = (uint32_t)((int32_t)DST >> (IMM & 31)); NEXT(1);
+    op_ARSH32_X: DST = (uint32_t)((int32_t)DST >> (SRC & 31)); NEXT(1);
+
+    op_NEG64: DST = -DST; NEXT(1);
+    op_NEG32: DST = (uint32_t)-DST; NEXT(1);
+    op_MOV64_K: DST = IMM; NEXT(1);
+    op_MOV64_X: DST = SRC; NEXT(1);
+    op_MOV32_K: DST = (uint32_t)IMM; NEXT(1);
+    op_MOV32_X: DST = (uint32_t)SRC; NEXT(1);
+
+    op_LE16: DST = cpu_to_le16((uint16_t)DST); NEXT(1);
+    op_LE32: DST = cpu_to_le32((uint32_t)DST); NEXT(1);
+    op_LE64: DST = cpu_to_le64(DST); NEXT(1);
+    op_BE16: DST = cpu_to_be16((uint16_t)DST); NEXT(1);
+    op_BE32: DST = cpu_to_be32((uint32_t)DST); NEXT(1);
+    op_BE64: DST = cpu_to_be64(DST); NEXT(1);
+
+    JMP(JEQ, ==, uint64_t, uint32_t)
+    JMP(JNE, !=, uint64_t, uint32_t)
+    JMP(JGT, >, uint64_t, uint32_t)
+    JMP(JGE, >=, uint64_t, uint32_t)
+    JMP(JLT, <, uint64_t, uint32_t)
+    JMP(JLE, <=, uint64_t, uint32_t)
+    JMP(JSET, &, uint64_t, uint32_t)
+    JMP(JSGT, >, int64_t, int32_t)
+    JMP(JSGE, >=, int64_t, int32_t)
+    JMP(JSLT, <, int64_t, int32_t)
+    JMP(JSLE, <=, int64_t, int32_t)
+    op_JA: BRANCH_IF(true);
+
+    op_CALL:
+        reg[0] = ks_ebpf_helpers[IMM](ctx, reg[1], reg[2], reg[3], reg[4], reg[5]);
+        NEXT(1);
+    op_EXIT:
+        ctx->retval = reg[0];
+        goto out;
+    op_LDDW: DST = IMM; NEXT(2);
+
+    op_LDXB:  DST = ldub_p(MEM(SRC, 1)); NEXT(1);
+    op_LDXH:  DST = lduw_le_p(MEM(SRC, 2)); NEXT(1);
+    op_LDXW:  DST = (uint32_t)ldl_le_p(MEM(SRC, 4)); NEXT(1);
+    op_LDXDW: DST = ldq_le_p(MEM(SRC, 8)); NEXT(1);
+    op_STB:   stb_p(MEM(DST, 1), IMM); NEXT(1);
+    op_STH:   stw_le_p(MEM(DST, 2), IMM); NEXT(1);
+    op_STW:   stl_le_p(MEM(DST, 4), IMM); NEXT(1);
+    op_STDW:  stq_le_p(MEM(DST, 8), IMM); NEXT(1);
+    op_STXB:  stb_p(MEM(DST, 1), SRC); NEXT(1);
+    op_STXH:  stw_le_p(MEM(DST, 2), SRC); NEXT(1);
+    op_STXW:  stl_le_p(MEM(DST, 4), SRC); NEXT(1);
+    op_STXDW: stq_le_p(MEM(DST, 8), SRC); NEXT(1);
+
+    op_LDXB_NC:  DST = ldub_p(MEM_NC(SRC)); NEXT(1);
+    op_LDXH_NC:  DST = lduw_le_p(MEM_NC(SRC)); NEXT(1);
+    op_LDXW_NC:  DST = (uint32_t)ldl_le_p(MEM_NC(SRC)); NEXT(1);
+    op_LDXDW_NC: DST = ldq_le_p(MEM_NC(SRC)); NEXT(1);
+    op_STB_NC:   stb_p(MEM_NC(DST), IMM); NEXT(1);
+    op_STH_NC:   stw_le_p(MEM_NC(DST), IMM); NEXT(1);
+    op_STW_NC:   stl_le_p(MEM_NC(DST), IMM); NEXT(1);
+    op_STDW_NC:  stq_le_p(MEM_NC(DST), IMM); NEXT(1);
+    op_STXB_NC:  stb_p(MEM_NC(DST), SRC); NEXT(1);
+    op_STXH_NC:  stw_le_p(MEM_NC(DST), SRC); NEXT(1);
+    op_STXW_NC:  stl_le_p(MEM_NC(DST), SRC); NEXT(1);
+    op_STXDW_NC: stq_le_p(MEM_NC(DST), SRC); NEXT(1);
+
+op_INVALID:
+    err = KS_VM_ERR_BAD_INSN;
+    goto out;
+mem_fault:
+    err = KS_VM_ERR_MEM_FAULT;
+    goto out;
+insn_limit:
+    err = KS_VM_ERR_INSN_LIMIT;
+    goto out;
+stopped:
+    err = KS_VM_ERR_STOPPED;
+out:
+    ctx->pc = pc;
+    ctx->icount = icount;
+    ctx->prof_left = prof_left;
+    return err;
+
+#undef DST
+#undef SRC
+#undef IMM
+#undef DISPATCH
+#undef NEXT
+#undef BRANCH_IF
+#undef MEM
+#undef MEM_NC
+#undef ALU
+#undef JMP
+}
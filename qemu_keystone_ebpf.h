@@ -0,0 +1,280 @@
+#ifndef QEMU_KEYSTONE_EBPF_H
+#define QEMU_KEYSTONE_EBPF_H
+
+// Host-side execution engine for the Keystone Coprocessor eBPF VM slots.
+//
+// Programs are decoded once, when LOAD_PROG completes, from the 64-bit eBPF
+// encoding into KsEbpfInsn: each instruction carries the index of its
+// handler, its operands and, for branches, the absolute target index. The
+// interpreter then dispatches through a computed-goto table with no opcode
+// decoding on the hot path. The engine has no dependency on the device
+// model; everything a run needs is passed in a KsEbpfRunCtx.
+//
+// After decoding, ks_ebpf_verify() checks the program once. It rejects code
+// that can only go wrong, and it rewrites each load or store proven to stay
+// inside slot memory to an _NC ("no check") op that skips the bounds check.
+
+#define KS_EBPF_NUM_REGS            11 // R0-R9 + R10 (read-only frame pointer)
+#define KS_EBPF_DEFAULT_INSN_LIMIT  (1ULL << 24) // Runaway-loop guard per run
+
+// Slot-local address of data_mem[0] as seen by eBPF programs.
+// On entry R1 = KS_EBPF_DATA_VA (input data), R2 = input length and
+// R10 = KS_EBPF_DATA_VA + data memory size (stack grows down from the top).
+#define KS_EBPF_DATA_VA             0x10000000ULL
+
+// VM error codes, reported in SELECTED_VM_STATUS_REG[7:4]
+#define KS_VM_ERR_NONE              0
+#define KS_VM_ERR_NO_PROGRAM        1 // START_VM without a loaded program
+#define KS_VM_ERR_BAD_INSN          2 // Invalid opcode/register/helper, bad jump, fell off the end
+#define KS_VM_ERR_MEM_FAULT         3 // Load/store outside slot data memory
+#define KS_VM_ERR_INSN_LIMIT        4 // Instruction budget exhausted
+#define KS_VM_ERR_STOPPED           5 // Run abandoned on request (KsEbpfRunCtx.stop); never reported to the guest
+#define KS_VM_ERR_VERIFY            6 // Program rejected by ks_ebpf_verify()
+#define KS_VM_ERR_DATA_OUT          7 // Bus error writing the output back; set by the device, not the engine
+#define KS_VM_ERR_BATCH             8 // Batch record or result array not in RAM; set by the device
+
+// Helper IDs for eBPF "call imm"
+#define KS_EBPF_HELPER_MBOX_READ    1 // r0 = IN mailbox[r1]; FIFO mode: pops the next IN word, -1 if empty
+#define KS_EBPF_HELPER_MBOX_WRITE   2 // OUT mailbox[r1] = r2; r0 = 0, or -1 for a bad index; FIFO mode: pushes r2, -1 if full
+#define KS_EBPF_HELPER_SET_OUT_LEN  3 // Output is the first r1 bytes of data memory; r0 = 0, or -1 if r1 > out_max
+#define KS_EBPF_HELPER_MBOX_STATUS  4 // FIFO mode: r0 = IN words queued | OUT words free << 32; 0 otherwise
+// Shared maps: r1 is the map ID, key and value pointers are slot addresses.
+// Each returns -1 for a bad map, pointer or offset, besides the cases given.
+#define KS_EBPF_HELPER_MAP_LOOKUP   5 // Copy the value of key r2 to r3; r0 = 0, or -1 if there is none
+#define KS_EBPF_HELPER_MAP_UPDATE   6 // Set key r2 to the value at r3 as flags r4 allow; r0 = 0 or -1 (also: map full)
+#define KS_EBPF_HELPER_MAP_DELETE   7 // Hash maps only; r0 = 0, or -1 if key r2 was absent
+#define KS_EBPF_HELPER_MAP_ADD      8 // Atomically add r4 to the 64-bit word at byte r3 of key r2's
+                                      // value, inserting a zero value first in a hash map; r0 = the sum
+#define KS_EBPF_HELPER_MAX          9
+
+// Internal opcodes. Order matters: every _X variant directly follows its _K
+// variant, the 32-bit ALU/JMP groups mirror the 64-bit ones and the _NC
+// memory ops mirror LDXB..STXDW.
+#define KS_EBPF_OPS(X) \
+    X(INVALID) \
+    X(ADD64_K) X(ADD64_X) X(SUB64_K) X(SUB64_X) X(MUL64_K) X(MUL64_X) \
+    X(DIV64_K) X(DIV64_X) X(OR64_K) X(OR64_X) X(AND64_K) X(AND64_X) \
+    X(LSH64_K) X(LSH64_X) X(RSH64_K) X(RSH64_X) X(MOD64_K) X(MOD64_X) \
+    X(XOR64_K) X(XOR64_X) X(MOV64_K) X(MOV64_X) X(ARSH64_K) X(ARSH64_X) \
+    X(NEG64) \
+    X(ADD32_K) X(ADD32_X) X(SUB32_K) X(SUB32_X) X(MUL32_K) X(MUL32_X) \
+    X(DIV32_K) X(DIV32_X) X(OR32_K) X(OR32_X) X(AND32_K) X(AND32_X) \
+    X(LSH32_K) X(LSH32_X) X(RSH32_K) X(RSH32_X) X(MOD32_K) X(MOD32_X) \
+    X(XOR32_K) X(XOR32_X) X(MOV32_K) X(MOV32_X) X(ARSH32_K) X(ARSH32_X) \
+    X(NEG32) \
+    X(LE16) X(LE32) X(LE64) X(BE16) X(BE32) X(BE64) \
+    X(JEQ_K) X(JEQ_X) X(JGT_K) X(JGT_X) X(JGE_K) X(JGE_X) \
+    X(JSET_K) X(JSET_X) X(JNE_K) X(JNE_X) X(JSGT_K) X(JSGT_X) \
+    X(JSGE_K) X(JSGE_X) X(JLT_K) X(JLT_X) X(JLE_K) X(JLE_X) \
+    X(JSLT_K) X(JSLT_X) X(JSLE_K) X(JSLE_X) \
+    X(JEQ32_K) X(JEQ32_X) X(JGT32_K) X(JGT32_X) X(JGE32_K) X(JGE32_X) \
+    X(JSET32_K) X(JSET32_X) X(JNE32_K) X(JNE32_X) X(JSGT32_K) X(JSGT32_X) \
+    X(JSGE32_K) X(JSGE32_X) X(JLT32_K) X(JLT32_X) X(JLE32_K) X(JLE32_X) \
+    X(JSLT32_K) X(JSLT32_X) X(JSLE32_K) X(JSLE32_X) \
+    X(JA) X(CALL) X(EXIT) X(LDDW) \
+    X(LDXB) X(LDXH) X(LDXW) X(LDXDW) \
+    X(STB) X(STH) X(STW) X(STDW) \
+    X(STXB) X(STXH) X(STXW) X(STXDW) \
+    X(LDXB_NC) X(LDXH_NC) X(LDXW_NC) X(LDXDW_NC) \
+    X(STB_NC) X(STH_NC) X(STW_NC) X(STDW_NC) \
+    X(STXB_NC) X(STXH_NC) X(STXW_NC) X(STXDW_NC)
+
+typedef enum KsEbpfOp {
+#define KS_EBPF_OP_ENUM(name) KS_OP_##name,
+    KS_EBPF_OPS(KS_EBPF_OP_ENUM)
+#undef KS_EBPF_OP_ENUM
+    KS_OP__MAX
+} KsEbpfOp;
+
+extern const char *const ks_ebpf_op_names[KS_OP__MAX]; // "ADD64_K", ...
+
+static inline bool ks_ebpf_op_is_jump(uint8_t op) {
+    return op == KS_OP_JA || (op >= KS_OP_JEQ_K && op <= KS_OP_JSLE32_X);
+}
+
+// Pre-decoded instruction (16 bytes)
+typedef struct KsEbpfInsn {
+    uint8_t op;     // KsEbpfOp
+    uint8_t dst;
+    uint8_t src;
+    uint8_t pad;
+    int32_t off;    // Memory offset, or absolute target index for jumps
+    uint64_t imm;   // Sign-extended immediate; full 64-bit value for LDDW
+} KsEbpfInsn;
+
+typedef struct KsEbpfProg {
+    KsEbpfInsn *insns; // len + 1 entries; insns[len] traps running off the end
+    uint32_t len;      // In 64-bit instruction slots
+    // Set by ks_ebpf_verify()
+    int verify_err;    // KS_VM_ERR_NONE, or KS_VM_ERR_VERIFY if rejected
+    uint32_t verify_pc; // Offending instruction of a rejected program
+    bool verified;     // Every reachable memory access runs unchecked
+} KsEbpfProg;
+
+// Mailbox FIFO with one producer and one consumer, each of which may be on
+// any thread: only the producer moves tail and only the consumer moves head.
+// Both run freely and index buf modulo depth, a power of two.
+typedef struct KsMboxFifo {
+    uint32_t *buf;
+    uint32_t depth;
+    uint32_t head;  // Next word to pop
+    uint32_t tail;  // Next word to push
+} KsMboxFifo;
+
+static inline uint32_t ks_mbox_fifo_count(KsMboxFifo *f) {
+    uint32_t head = qatomic_load_acquire(&f->head);
+
+    // head is read first, so the count can only be too high if a pop raced
+    return MIN(qatomic_load_acquire(&f->tail) - head, f->depth);
+}
+
+static inline bool ks_mbox_fifo_push(KsMboxFifo *f, uint32_t val) {
+    uint32_t tail = f->tail;
+
+    if (tail - qatomic_load_acquire(&f->head) >= f->depth) {
+        return false;
+    }
+    f->buf[tail & (f->depth - 1)] = val;
+    qatomic_store_release(&f->tail, tail + 1);
+    return true;
+}
+
+static inline bool ks_mbox_fifo_pop(KsMboxFifo *f, uint32_t *val) {
+    uint32_t head = f->head;
+
+    if (qatomic_load_acquire(&f->tail) == head) {
+        return false;
+    }
+    *val = f->buf[head & (f->depth - 1)];
+    qatomic_store_release(&f->head, head + 1);
+    return true;
+}
+
+/*
+ * Shared map: max_entries values of value_size bytes, reached by every slot's
+ * program through the MAP_* helpers and by the host through a flat image
+ * (data) of entry_size bytes per entry, each part of it padded to 8 bytes.
+ *
+ * - ARRAY: the key is a 32-bit index below max_entries. An entry is its value.
+ * - PERSLOT_ARRAY: the same, but each entry holds one value per slot
+ *   (copies); a program only sees its own slot's, so slots never contend.
+ * - HASH: up to max_entries keys of key_size bytes. An entry is a
+ *   KsEbpfMapEntryHdr, the key and the value. Lookups take no lock: each
+ *   bucket has a sequence count, odd while a writer holds the bucket, and a
+ *   reader that saw it change retries. Writers to different buckets never
+ *   wait for each other.
+ *
+ * A value may be read while another slot writes it, and then mix old and new
+ * bytes; counters that must not lose updates use MAP_ADD.
+ */
+#define KS_EBPF_MAX_MAPS            16
+#define KS_EBPF_MAP_ARRAY           1
+#define KS_EBPF_MAP_HASH            2
+#define KS_EBPF_MAP_PERSLOT_ARRAY   3
+#define KS_EBPF_MAP_MAX_KEY         64
+#define KS_EBPF_MAP_MAX_VALUE       256
+#define KS_EBPF_MAP_MAX_ENTRIES     65536
+
+// MAP_UPDATE flags, as BPF_ANY, BPF_NOEXIST and BPF_EXIST
+#define KS_EBPF_MAP_UPDATE_ANY      0
+#define KS_EBPF_MAP_UPDATE_NOEXIST  1 // Fail if the key is present (always, in an array)
+#define KS_EBPF_MAP_UPDATE_EXIST    2 // Fail if the key is absent
+
+// KsEbpfMapEntryHdr.state
+#define KS_EBPF_MAP_ENT_FREE        0
+#define KS_EBPF_MAP_ENT_BUSY        1 // Being filled by a slot
+#define KS_EBPF_MAP_ENT_HOST        2 // Reserved by the host, which is filling it
+#define KS_EBPF_MAP_ENT_VALID       3 // Linked into its bucket
+
+typedef struct KsEbpfMapEntryHdr {
+    uint32_t state;     // KS_EBPF_MAP_ENT_*
+    uint32_t hash;      // Of the key; picks the bucket
+} KsEbpfMapEntryHdr;
+
+typedef struct KsEbpfMap {
+    uint32_t type;          // KS_EBPF_MAP_*, 0 if the map does not exist
+    uint32_t key_size;
+    uint32_t value_size;
+    uint32_t max_entries;
+    uint32_t copies;        // Values per entry: slots for PERSLOT_ARRAY, else 1
+    uint32_t entry_size;    // Bytes per entry in data
+    uint32_t key_off;       // Of the key in a hash entry
+    uint32_t value_off;     // Of the (first) value in an entry
+    uint32_t value_stride;  // value_size padded to 8
+    uint32_t data_size;     // max_entries * entry_size
+    uint8_t *data;
+    // Hash maps
+    uint32_t nbuckets;      // Power of two
+    uint32_t *bucket_seq;
+    uint32_t *bucket_head;  // First entry + 1, 0 for an empty bucket
+    uint32_t *next;         // Next entry + 1 in the same bucket
+    uint32_t alloc_hint;    // Where the next search for a free entry starts
+    uint32_t used;          // Entries claimed, at most max_entries; an entry is freed before it is unclaimed
+    uint32_t count;         // KS_EBPF_MAP_ENT_VALID entries
+} KsEbpfMap;
+
+// Fill in the definition and layout, without allocating; -EINVAL if it is not a valid map
+int ks_ebpf_map_define(KsEbpfMap *m, uint32_t type, uint32_t key_size, uint32_t value_size,
+                       uint32_t max_entries, uint32_t copies);
+void ks_ebpf_map_alloc(KsEbpfMap *m);  // Zeroed data, empty index
+int ks_ebpf_map_restore(KsEbpfMap *m); // Check a migrated definition and data, and rebuild the index
+void ks_ebpf_map_free(KsEbpfMap *m);   // Back to no map
+void ks_ebpf_map_clear(KsEbpfMap *m);  // Not while programs run
+uint32_t ks_ebpf_map_count(KsEbpfMap *m); // Valid hash entries, or max_entries
+// Host access to the image, 4 or 8 bytes naturally aligned; see the HASH
+// entry rules in AXI_Lite_Memory_Map.txt. Safe while programs run.
+uint64_t ks_ebpf_map_host_read(KsEbpfMap *m, uint32_t off, unsigned size);
+void ks_ebpf_map_host_write(KsEbpfMap *m, uint32_t off, uint64_t val, unsigned size);
+
+// Per-run inputs and outputs
+typedef struct KsEbpfRunCtx {
+    uint8_t *mem;            // Slot data memory
+    uint32_t mem_size;
+    uint32_t data_len;       // Valid input bytes at the start of mem
+    uint32_t *mbox_in;       // NUM_MAILBOX_REGS_QEMU words, CPU -> VM
+    uint32_t *mbox_out;      // NUM_MAILBOX_REGS_QEMU words, VM -> CPU
+    uint32_t num_mbox;
+    // Mailbox FIFO mode, if fifo_in is set: MBOX_READ pops fifo_in, MBOX_WRITE
+    // pushes fifo_out, and each calls fifo_kick(fifo_opaque) after a pop or push
+    KsMboxFifo *fifo_in;     // CPU -> VM
+    KsMboxFifo *fifo_out;    // VM -> CPU
+    void (*fifo_kick)(void *opaque);
+    void *fifo_opaque;
+    KsEbpfMap *maps;         // num_maps maps for the MAP_* helpers, shared with other runs
+    uint32_t num_maps;
+    uint32_t slot;           // Value copy of a PERSLOT_ARRAY this run sees
+    uint64_t insn_limit;
+    const bool *stop;        // Optional; polled on backward branches from any thread
+    uint32_t out_max;        // Output bytes the caller will take, at most mem_size
+    // Profiling (interpreter only). Every prof_period instructions, the
+    // instruction about to execute gets a hit in prof[pc] and is published
+    // in prof_pc. prof_left carries the countdown from one run to the next.
+    uint64_t *prof;          // Optional; one count per instruction of the program
+    uint64_t prof_period;    // 1 counts every instruction
+    uint64_t prof_left;      // In/out: instructions until the next sample, at least 1
+    uint32_t prof_pc;        // Last sampled instruction; read from any thread
+    // Outputs
+    uint32_t out_len;        // Output bytes at the start of mem: out_max unless set by SET_OUT_LEN
+    uint32_t pc;             // Instruction index of the exit or faulting instruction
+    uint64_t icount;         // Instructions executed
+    uint64_t retval;         // R0 at exit
+} KsEbpfRunCtx;
+
+typedef uint64_t KsEbpfHelperFn(KsEbpfRunCtx *ctx, uint64_t r1, uint64_t r2,
+                                uint64_t r3, uint64_t r4, uint64_t r5);
+extern KsEbpfHelperFn *const ks_ebpf_helpers[KS_EBPF_HELPER_MAX];
+
+KsEbpfProg *ks_ebpf_prog_new(const uint8_t *code, uint32_t len);
+void ks_ebpf_prog_free(KsEbpfProg *prog);
+int ks_ebpf_verify(KsEbpfProg *prog, uint32_t mem_size);
+int ks_ebpf_run_interp(const KsEbpfProg *prog, KsEbpfRunCtx *ctx);
+
+// Host-code backend (qemu_keystone_ebpf_jit.c), x86-64 hosts only.
+// ks_ebpf_jit_compile() returns NULL where it is unavailable.
+typedef struct KsEbpfJit KsEbpfJit;
+
+KsEbpfJit *ks_ebpf_jit_compile(const KsEbpfProg *prog);
+void ks_ebpf_jit_free(KsEbpfJit *jit);
+int ks_ebpf_run_jit(const KsEbpfJit *jit, KsEbpfRunCtx *ctx);
+
+#endif // QEMU_KEYSTONE_EBPF_H
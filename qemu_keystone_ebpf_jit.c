@@ -0,0 +1,719 @@
+#include "qemu/osdep.h"
+#include "qemu/bswap.h"
+
+#include "qemu_keystone_ebpf.h"
+
+// x86-64 backend for the Keystone eBPF engine.
+//
+// Each KsEbpfProg is translated once into a single host function that runs
+// the whole program. Results are bit-for-bit those of ks_ebpf_run_interp():
+// same R0, same error code, same faulting pc and the same instruction count,
+// so the two modes can be swapped freely. Instructions are counted per basic
+// block on entry; exits in the middle of a block subtract what was not run.
+
+#if defined(__x86_64__) && !defined(_WIN32)
+
+#include <sys/mman.h>
+
+// Host register numbers
+enum {
+    RAX, RCX, RDX, RBX, RSP, RBP, RSI, RDI,
+    R8, R9, R10, R11, R12, R13, R14, R15,
+};
+
+// eBPF R0-R10 -> host. R1-R5 live in SysV argument registers so a helper
+// call only needs to rotate them by one to make room for ctx.
+static const uint8_t ks_jit_reg[KS_EBPF_NUM_REGS] = {
+    RAX, RDI, RSI, RDX, RCX, R8, RBX, R13, R14, R15, RBP,
+};
+#define REG_MEM     R12 // Host address of slot data memory
+#define REG_COUNT   R9  // Instructions executed minus the budget (negative while within it)
+#define REG_TMP     R10 // Slot offset of memory accesses; pc on exit
+#define REG_TMP2    R11 // Divisor, saved rcx, call target; error code on exit
+
+// x86 condition codes. cc ^ 1 is the inverse condition.
+enum {
+    CC_B = 0x2, CC_AE = 0x3, CC_E = 0x4, CC_NE = 0x5, CC_BE = 0x6, CC_A = 0x7,
+    CC_NS = 0x9, CC_L = 0xc, CC_GE = 0xd, CC_LE = 0xe, CC_G = 0xf,
+};
+
+// Indexed by (op - KS_OP_JEQ_K) / 2, in the order of KS_EBPF_OPS
+static const uint8_t ks_jit_jcc[] = {
+    CC_E, CC_A, CC_AE, CC_NE /* JSET */, CC_NE, CC_G, CC_GE, CC_B, CC_BE, CC_L, CC_LE,
+};
+
+// In/out block shared with the generated code
+typedef struct KsJitFrame {
+    KsEbpfRunCtx *ctx;
+    uint8_t *mem;
+    uint64_t r1;
+    uint64_t r2;
+    uint64_t r10;
+    int64_t count;       // In: -insn_limit. Out: icount - insn_limit
+    const bool *stop;
+    uint64_t bound[4];   // mem_size - 1, 2, 4, 8: highest valid offset per access size
+    uint64_t retval;
+    uint32_t pc;
+    int32_t err;
+} KsJitFrame;
+
+// Stack frame of the generated function below the saved registers
+#define FRAME_BOUNDS    0  // Copy of KsJitFrame.bound, for cmp reg, [rsp + disp8]
+#define FRAME_STOP      32 // Copy of KsJitFrame.stop
+#define FRAME_STATE     48 // KsJitFrame *
+#define FRAME_SIZE      56
+
+struct KsEbpfJit {
+    void *code;
+    size_t size;
+};
+
+typedef struct KsJitFixup {
+    uint32_t pos;       // rel32 field
+    uint32_t target;    // Instruction index
+} KsJitFixup;
+
+typedef struct KsJitStub {
+    uint32_t pos;       // rel32 field of the branch to the stub
+    uint32_t pc;
+    uint32_t adj;       // Counted instructions of the block that did not run
+    int err;
+} KsJitStub;
+
+typedef struct KsJitCtx {
+    uint8_t *code;
+    size_t len;
+    size_t cap;
+    uint32_t *insn_off; // Code offset of each instruction
+    uint32_t *rem;      // Instructions after each one up to the end of its block
+    bool *leader;
+    KsJitFixup *fixups;
+    uint32_t nfixups;
+    KsJitStub *stubs;
+    uint32_t nstubs;
+} KsJitCtx;
+
+static void emit1(KsJitCtx *j, uint8_t b) {
+    if (j->len == j->cap) {
+        j->cap = j->cap ? j->cap * 2 : 4096;
+        j->code = g_realloc(j->code, j->cap);
+    }
+    j->code[j->len++] = b;
+}
+
+static void emit2(KsJitCtx *j, uint16_t v) {
+    emit1(j, v);
+    emit1(j, v >> 8);
+}
+
+static void emit4(KsJitCtx *j, uint32_t v) {
+    emit2(j, v);
+    emit2(j, v >> 16);
+}
+
+static void emit8(KsJitCtx *j, uint64_t v) {
+    emit4(j, v);
+    emit4(j, v >> 32);
+}
+
+static void emit_rex(KsJitCtx *j, bool w, int reg, int index, int rm, bool force) {
+    uint8_t rex = 0x40 | (w << 3) | ((reg >> 3) << 2) | ((index >> 3) << 1) | (rm >> 3);
+
+    if (rex != 0x40 || force) {
+        emit1(j, rex);
+    }
+}
+
+// One- or two-byte (0x0f xx) opcode
+static void emit_opc(KsJitCtx *j, uint32_t opc) {
+    if (opc > 0xff) {
+        emit1(j, opc >> 8);
+    }
+    emit1(j, opc);
+}
+
+// opc with ModRM reg = reg (or /digit), rm = register rm
+static void emit_rr(KsJitCtx *j, bool w, uint32_t opc, int reg, int rm) {
+    emit_rex(j, w, reg, 0, rm, false);
+    emit_opc(j, opc);
+    emit1(j, 0xc0 | ((reg & 7) << 3) | (rm & 7));
+}
+
+// opc with ModRM reg = reg, rm = [base + disp]
+static void emit_mem(KsJitCtx *j, bool w, uint32_t opc, int reg, int base, int32_t disp) {
+    int mod = (disp == 0 && (base & 7) != RBP) ? 0 : disp == (int8_t)disp ? 1 : 2;
+
+    emit_rex(j, w, reg, 0, base, false);
+    emit_opc(j, opc);
+    emit1(j, (mod << 6) | ((reg & 7) << 3) | (base & 7));
+    if ((base & 7) == RSP) {
+        emit1(j, 0x24); // SIB: base only
+    }
+    if (mod == 1) {
+        emit1(j, disp);
+    } else if (mod == 2) {
+        emit4(j, disp);
+    }
+}
+
+// opc with ModRM reg = reg, rm = [REG_MEM + REG_TMP]. force_rex selects
+// sil/dil/bpl over dh/bh/ch for byte stores.
+static void emit_slot_mem(KsJitCtx *j, bool w, bool force_rex, uint32_t opc, int reg) {
+    emit_rex(j, w, reg, REG_TMP, REG_MEM, force_rex);
+    emit_opc(j, opc);
+    emit1(j, ((reg & 7) << 3) | 4);
+    emit1(j, ((REG_TMP & 7) << 3) | (REG_MEM & 7));
+}
+
+static void emit_push(KsJitCtx *j, int reg) {
+    emit_rex(j, false, 0, 0, reg, false);
+    emit1(j, 0x50 + (reg & 7));
+}
+
+static void emit_pop(KsJitCtx *j, int reg) {
+    emit_rex(j, false, 0, 0, reg, false);
+    emit1(j, 0x58 + (reg & 7));
+}
+
+static void emit_mov_imm(KsJitCtx *j, int reg, uint64_t imm) {
+    if (imm == (uint32_t)imm) {
+        emit_rex(j, false, 0, 0, reg, false); // mov r32, imm32 zero-extends
+        emit1(j, 0xb8 + (reg & 7));
+        emit4(j, imm);
+    } else if (imm == (uint64_t)(int64_t)(int32_t)imm) {
+        emit_rr(j, true, 0xc7, 0, reg);
+        emit4(j, imm);
+    } else {
+        emit_rex(j, true, 0, 0, reg, false);
+        emit1(j, 0xb8 + (reg & 7));
+        emit8(j, imm);
+    }
+}
+
+static uint32_t emit_jcc32(KsJitCtx *j, int cc) {
+    emit1(j, 0x0f);
+    emit1(j, 0x80 | cc);
+    emit4(j, 0);
+    return j->len - 4;
+}
+
+static uint32_t emit_jmp32(KsJitCtx *j) {
+    emit1(j, 0xe9);
+    emit4(j, 0);
+    return j->len - 4;
+}
+
+static uint32_t emit_jcc8(KsJitCtx *j, int cc) {
+    emit1(j, 0x70 | cc);
+    emit1(j, 0);
+    return j->len - 1;
+}
+
+static uint32_t emit_jmp8(KsJitCtx *j) {
+    emit1(j, 0xeb);
+    emit1(j, 0);
+    return j->len - 1;
+}
+
+// Point the rel8 at pos to the current end of code
+static void patch_rel8(KsJitCtx *j, uint32_t pos) {
+    size_t rel = j->len - (pos + 1);
+
+    assert(rel <= INT8_MAX);
+    j->code[pos] = rel;
+}
+
+static void patch_rel32(KsJitCtx *j, uint32_t pos, uint32_t dest) {
+    stl_le_p(j->code + pos, dest - (pos + 4));
+}
+
+static void add_stub(KsJitCtx *j, uint32_t pos, uint32_t pc, int err) {
+    j->stubs[j->nstubs++] = (KsJitStub){ .pos = pos, .pc = pc, .adj = j->rem[pc], .err = err };
+}
+
+// Leave the program with REG_TMP = pc and REG_TMP2 = err; jumps to the epilogue
+static uint32_t emit_exit(KsJitCtx *j, uint32_t pc, uint32_t adj, int err) {
+    emit_mov_imm(j, REG_TMP, pc);
+    emit_mov_imm(j, REG_TMP2, err);
+    if (adj) {
+        emit_rr(j, true, 0x81, 5, REG_COUNT); // sub
+        emit4(j, adj);
+    }
+    return emit_jmp32(j);
+}
+
+// dst = src ? dst / src : 0, or dst = src ? dst % src : dst, with src in REG_TMP2
+static void emit_div(KsJitCtx *j, bool w, bool is_mod, int dst) {
+    uint32_t jz, jdone;
+
+    emit_rr(j, w, 0x85, REG_TMP2, REG_TMP2);
+    jz = emit_jcc8(j, CC_E);
+    emit_push(j, RAX);
+    emit_push(j, RDX);
+    emit_rr(j, w, 0x89, dst, RAX);
+    emit_rr(j, false, 0x31, RDX, RDX);
+    emit_rr(j, w, 0xf7, 6, REG_TMP2);
+    emit_rr(j, w, 0x89, is_mod ? RDX : RAX, REG_TMP2);
+    emit_pop(j, RDX);
+    emit_pop(j, RAX);
+    emit_rr(j, w, 0x89, REG_TMP2, dst);
+    jdone = emit_jmp8(j);
+    patch_rel8(j, jz);
+    if (!is_mod) {
+        emit_rr(j, false, 0x31, dst, dst);
+    } else if (!w) {
+        emit_rr(j, false, 0x89, dst, dst); // Zero-extend
+    }
+    patch_rel8(j, jdone);
+}
+
+// shl/shr/sar dst, src: the count has to be in cl, which is eBPF R4
+static void emit_shift_x(KsJitCtx *j, bool w, int digit, int dst, int src) {
+    if (src == RCX) {
+        emit_rr(j, w, 0xd3, digit, dst);
+        return;
+    }
+    emit_rr(j, true, 0x89, RCX, REG_TMP2);
+    emit_rr(j, true, 0x89, src, RCX);
+    emit_rr(j, w, 0xd3, digit, dst == RCX ? REG_TMP2 : dst);
+    emit_rr(j, true, 0x89, REG_TMP2, RCX);
+}
+
+static void emit_alu(KsJitCtx *j, const KsEbpfInsn *insn) {
+    bool w = insn->op < KS_OP_ADD32_K;
+    unsigned op = w ? insn->op : insn->op - (KS_OP_ADD32_K - KS_OP_ADD64_K);
+    bool x = op != KS_OP_NEG64 && ((op - KS_OP_ADD64_K) & 1);
+    int dst = ks_jit_reg[insn->dst];
+    int src = ks_jit_reg[insn->src];
+    uint32_t imm = insn->imm;
+    int digit;
+
+    switch (op - x) {
+        case KS_OP_ADD64_K: digit = 0; goto arith;
+        case KS_OP_OR64_K:  digit = 1; goto arith;
+        case KS_OP_AND64_K: digit = 4; goto arith;
+        case KS_OP_SUB64_K: digit = 5; goto arith;
+        case KS_OP_XOR64_K: digit = 6;
+        arith:
+            if (x) {
+                emit_rr(j, w, 0x01 | (digit << 3), src, dst);
+            } else {
+                emit_rr(j, w, 0x81, digit, dst);
+                emit4(j, imm);
+            }
+            break;
+        case KS_OP_MOV64_K:
+            if (x) {
+                emit_rr(j, w, 0x89, src, dst);
+            } else {
+                emit_mov_imm(j, dst, w ? insn->imm : imm);
+            }
+            break;
+        case KS_OP_MUL64_K:
+            if (x) {
+                emit_rr(j, w, 0x0faf, dst, src);
+            } else {
+                emit_rr(j, w, 0x69, dst, dst);
+                emit4(j, imm);
+            }
+            break;
+        case KS_OP_DIV64_K:
+        case KS_OP_MOD64_K:
+            if (x) {
+                emit_rr(j, true, 0x89, src, REG_TMP2);
+            } else {
+                emit_mov_imm(j, REG_TMP2, w ? insn->imm : imm);
+            }
+            emit_div(j, w, op - x == KS_OP_MOD64_K, dst);
+            break;
+        case KS_OP_LSH64_K:  digit = 4; goto shift;
+        case KS_OP_RSH64_K:  digit = 5; goto shift;
+        case KS_OP_ARSH64_K: digit = 7;
+        shift:
+            if (x) {
+                emit_shift_x(j, w, digit, dst, src);
+            } else {
+                emit_rr(j, w, 0xc1, digit, dst);
+                emit1(j, imm & (w ? 63 : 31));
+            }
+            break;
+        case KS_OP_NEG64:
+            emit_rr(j, w, 0xf7, 3, dst);
+            break;
+        default:
+            g_assert_not_reached();
+    }
+}
+
+static void emit_endian(KsJitCtx *j, const KsEbpfInsn *insn) {
+    int dst = ks_jit_reg[insn->dst];
+
+    switch (insn->op) {
+        case KS_OP_BE16:
+            emit1(j, 0x66); // ror r16, 8
+            emit_rr(j, false, 0xc1, 1, dst);
+            emit1(j, 8);
+            /* fall through */
+        case KS_OP_LE16:
+            emit_rr(j, false, 0x0fb7, dst, dst); // movzx r32, r16
+            break;
+        case KS_OP_LE32:
+            emit_rr(j, false, 0x89, dst, dst);
+            break;
+        case KS_OP_LE64:
+            break;
+        case KS_OP_BE32:
+        case KS_OP_BE64:
+            emit_rex(j, insn->op == KS_OP_BE64, 0, 0, dst, false);
+            emit1(j, 0x0f);
+            emit1(j, 0xc8 + (dst & 7)); // bswap
+            break;
+    }
+}
+
+// Taken-branch tail: check the budget and, on backward branches, the stop
+// request as the interpreter does, then jump
+static void emit_taken(KsJitCtx *j, uint32_t pc, uint32_t target) {
+    emit_rr(j, true, 0x85, REG_COUNT, REG_COUNT);
+    add_stub(j, emit_jcc32(j, CC_NS), pc, KS_VM_ERR_INSN_LIMIT);
+    if (target <= pc) {
+        emit_mem(j, true, 0x8b, REG_TMP2, RSP, FRAME_STOP);
+        emit_mem(j, false, 0x80, 7, REG_TMP2, 0); // cmp byte [r11], 0
+        emit1(j, 0);
+        add_stub(j, emit_jcc32(j, CC_NE), pc, KS_VM_ERR_STOPPED);
+    }
+    j->fixups[j->nfixups++] = (KsJitFixup){ .pos = emit_jmp32(j), .target = target };
+}
+
+static void emit_branch(KsJitCtx *j, const KsEbpfInsn *insn, uint32_t pc) {
+    bool w = insn->op < KS_OP_JEQ32_K;
+    unsigned op = w ? insn->op : insn->op - (KS_OP_JEQ32_K - KS_OP_JEQ_K);
+    bool x = (op - KS_OP_JEQ_K) & 1;
+    int dst = ks_jit_reg[insn->dst];
+    int src = ks_jit_reg[insn->src];
+    uint32_t skip;
+
+    if (op - x == KS_OP_JSET_K) {
+        if (x) {
+            emit_rr(j, w, 0x85, src, dst);
+        } else {
+            emit_rr(j, w, 0xf7, 0, dst);
+            emit4(j, insn->imm);
+        }
+    } else if (x) {
+        emit_rr(j, w, 0x39, src, dst);
+    } else {
+        emit_rr(j, w, 0x81, 7, dst);
+        emit4(j, insn->imm);
+    }
+    skip = emit_jcc8(j, ks_jit_jcc[(op - KS_OP_JEQ_K) / 2] ^ 1);
+    emit_taken(j, pc, insn->off);
+    patch_rel8(j, skip);
+}
+
+// REG_TMP = slot offset of the access, or leave through a MEM_FAULT stub
+static void emit_addr(KsJitCtx *j, const KsEbpfInsn *insn, int base, int size_log2, uint32_t pc) {
+    emit_mem(j, true, 0x8d, REG_TMP, base, insn->off - (int32_t)KS_EBPF_DATA_VA);
+    if (insn->op >= KS_OP_LDXB_NC) {
+        return; // Proven in bounds by the verifier
+    }
+    emit_mem(j, true, 0x3b, REG_TMP, RSP, FRAME_BOUNDS + size_log2 * 8);
+    add_stub(j, emit_jcc32(j, CC_A), pc, KS_VM_ERR_MEM_FAULT);
+}
+
+static void emit_call(KsJitCtx *j, uint32_t helper) {
+    static const uint8_t args[] = { RDI, RSI, RDX, RCX, R8, R9 };
+    int i;
+
+    // R1-R5 survive calls in the interpreter, so they do here too
+    for (i = 0; i < ARRAY_SIZE(args); i++) {
+        emit_push(j, args[i]);
+    }
+    for (i = ARRAY_SIZE(args) - 1; i > 0; i--) {
+        emit_rr(j, true, 0x89, args[i - 1], args[i]);
+    }
+    emit_mem(j, true, 0x8b, RDI, RSP, ARRAY_SIZE(args) * 8 + FRAME_STATE);
+    emit_mem(j, true, 0x8b, RDI, RDI, offsetof(KsJitFrame, ctx));
+    emit_mov_imm(j, REG_TMP2, (uintptr_t)ks_ebpf_helpers[helper]);
+    emit_rr(j, false, 0xff, 2, REG_TMP2);
+    for (i = ARRAY_SIZE(args) - 1; i >= 0; i--) {
+        emit_pop(j, args[i]);
+    }
+}
+
+static void emit_insn(KsJitCtx *j, const KsEbpfInsn *insn, uint32_t pc) {
+    int dst = ks_jit_reg[insn->dst];
+    int src = ks_jit_reg[insn->src];
+    // _NC memory ops are emitted as their checked form minus the check
+    unsigned op = insn->op >= KS_OP_LDXB_NC ? insn->op - (KS_OP_LDXB_NC - KS_OP_LDXB) : insn->op;
+
+    switch (op) {
+        case KS_OP_ADD64_K ... KS_OP_NEG32:
+            emit_alu(j, insn);
+            break;
+        case KS_OP_LE16 ... KS_OP_BE64:
+            emit_endian(j, insn);
+            break;
+        case KS_OP_JEQ_K ... KS_OP_JSLE32_X:
+            emit_branch(j, insn, pc);
+            break;
+        case KS_OP_JA:
+            emit_taken(j, pc, insn->off);
+            break;
+        case KS_OP_CALL:
+            emit_call(j, insn->imm);
+            break;
+        case KS_OP_LDDW:
+            emit_mov_imm(j, dst, insn->imm);
+            break;
+        case KS_OP_LDXB:
+            emit_addr(j, insn, src, 0, pc);
+            emit_slot_mem(j, false, false, 0x0fb6, dst);
+            break;
+        case KS_OP_LDXH:
+            emit_addr(j, insn, src, 1, pc);
+            emit_slot_mem(j, false, false, 0x0fb7, dst);
+            break;
+        case KS_OP_LDXW:
+            emit_addr(j, insn, src, 2, pc);
+            emit_slot_mem(j, false, false, 0x8b, dst);
+            break;
+        case KS_OP_LDXDW:
+            emit_addr(j, insn, src, 3, pc);
+            emit_slot_mem(j, true, false, 0x8b, dst);
+            break;
+        case KS_OP_STB:
+            emit_addr(j, insn, dst, 0, pc);
+            emit_slot_mem(j, false, false, 0xc6, 0);
+            emit1(j, insn->imm);
+            break;
+        case KS_OP_STH:
+            emit_addr(j, insn, dst, 1, pc);
+            emit1(j, 0x66);
+            emit_slot_mem(j, false, false, 0xc7, 0);
+            emit2(j, insn->imm);
+            break;
+        case KS_OP_STW:
+        case KS_OP_STDW:
+            emit_addr(j, insn, dst, op == KS_OP_STDW ? 3 : 2, pc);
+            emit_slot_mem(j, op == KS_OP_STDW, false, 0xc7, 0);
+            emit4(j, insn->imm);
+            break;
+        case KS_OP_STXB:
+            emit_addr(j, insn, dst, 0, pc);
+            emit_slot_mem(j, false, true, 0x88, src);
+            break;
+        case KS_OP_STXH:
+            emit_addr(j, insn, dst, 1, pc);
+            emit1(j, 0x66);
+            emit_slot_mem(j, false, false, 0x89, src);
+            break;
+        case KS_OP_STXW:
+        case KS_OP_STXDW:
+            emit_addr(j, insn, dst, op == KS_OP_STXDW ? 3 : 2, pc);
+            emit_slot_mem(j, op == KS_OP_STXDW, false, 0x89, src);
+            break;
+        default:
+            g_assert_not_reached();
+    }
+}
+
+// Basic blocks: leaders, and per instruction how many counted instructions follow it in its block
+static void ks_jit_find_blocks(KsJitCtx *j, const KsEbpfProg *prog) {
+    uint32_t n = prog->len;
+    uint32_t *order = g_new(uint32_t, n + 1);
+    uint32_t norder = 0;
+
+    j->leader[0] = true;
+    for (uint32_t i = 0; i <= n; i++) {
+        uint8_t op = prog->insns[i].op;
+        uint32_t next = i + (op == KS_OP_LDDW ? 2 : 1);
+
+        order[norder++] = i;
+        if (i == n) {
+            break;
+        }
+        if (ks_ebpf_op_is_jump(op)) {
+            j->leader[prog->insns[i].off] = true;
+        }
+        if (ks_ebpf_op_is_jump(op) || op == KS_OP_EXIT || op == KS_OP_INVALID) {
+            j->leader[next] = true;
+        }
+        i = next - 1;
+    }
+    for (uint32_t k = norder; k-- > 0;) {
+        bool last = k + 1 == norder || j->leader[order[k + 1]];
+
+        j->rem[order[k]] = last ? 0 : j->rem[order[k + 1]] + 1;
+    }
+    g_free(order);
+}
+
+static void ks_jit_emit_prologue(KsJitCtx *j) {
+    static const uint8_t zero[] = { RAX, RCX, RDX, RBX, R8, R13, R14, R15 };
+    int i;
+
+    emit_push(j, RBX);
+    emit_push(j, RBP);
+    emit_push(j, R12);
+    emit_push(j, R13);
+    emit_push(j, R14);
+    emit_push(j, R15);
+    emit_push(j, RDI);
+    emit_rr(j, true, 0x81, 5, RSP); // sub rsp, FRAME_STATE; rsp is now 16-byte aligned
+    emit4(j, FRAME_STATE);
+    for (i = 0; i < 4; i++) {
+        emit_mem(j, true, 0x8b, REG_TMP, RDI, offsetof(KsJitFrame, bound) + i * 8);
+        emit_mem(j, true, 0x89, REG_TMP, RSP, FRAME_BOUNDS + i * 8);
+    }
+    emit_mem(j, true, 0x8b, REG_TMP, RDI, offsetof(KsJitFrame, stop));
+    emit_mem(j, true, 0x89, REG_TMP, RSP, FRAME_STOP);
+    emit_mem(j, true, 0x8b, REG_MEM, RDI, offsetof(KsJitFrame, mem));
+    emit_mem(j, true, 0x8b, REG_COUNT, RDI, offsetof(KsJitFrame, count));
+    emit_mem(j, true, 0x8b, ks_jit_reg[2], RDI, offsetof(KsJitFrame, r2));
+    emit_mem(j, true, 0x8b, ks_jit_reg[10], RDI, offsetof(KsJitFrame, r10));
+    emit_mem(j, true, 0x8b, ks_jit_reg[1], RDI, offsetof(KsJitFrame, r1));
+    for (i = 0; i < ARRAY_SIZE(zero); i++) {
+        emit_rr(j, false, 0x31, zero[i], zero[i]);
+    }
+}
+
+static void ks_jit_emit_epilogue(KsJitCtx *j) {
+    emit_mem(j, true, 0x8b, RDI, RSP, FRAME_STATE);
+    emit_mem(j, true, 0x89, RAX, RDI, offsetof(KsJitFrame, retval));
+    emit_mem(j, true, 0x89, REG_COUNT, RDI, offsetof(KsJitFrame, count));
+    emit_mem(j, false, 0x89, REG_TMP, RDI, offsetof(KsJitFrame, pc));
+    emit_mem(j, false, 0x89, REG_TMP2, RDI, offsetof(KsJitFrame, err));
+    emit_rr(j, true, 0x81, 0, RSP); // add
+    emit4(j, FRAME_SIZE);
+    emit_pop(j, R15);
+    emit_pop(j, R14);
+    emit_pop(j, R13);
+    emit_pop(j, R12);
+    emit_pop(j, RBP);
+    emit_pop(j, RBX);
+    emit1(j, 0xc3);
+}
+
+/*
+ * Translate prog to host code. Returns NULL when the host cannot run it
+ * (executable mappings refused); callers then use the interpreter.
+ */
+KsEbpfJit *ks_ebpf_jit_compile(const KsEbpfProg *prog) {
+    uint32_t n = prog->len;
+    KsJitCtx j = {
+        .insn_off = g_new0(uint32_t, n + 1),
+        .rem = g_new0(uint32_t, n + 1),
+        .leader = g_new0(bool, n + 1),
+        .fixups = g_new(KsJitFixup, n + 1),
+        .stubs = g_new(KsJitStub, 2 * (n + 1)), // Backward branches have two
+    };
+    uint32_t epilogue;
+    KsEbpfJit *jit = NULL;
+    void *code;
+
+    ks_jit_find_blocks(&j, prog);
+    ks_jit_emit_prologue(&j);
+
+    for (uint32_t i = 0; i <= n; i++) {
+        const KsEbpfInsn *insn = &prog->insns[i];
+
+        j.insn_off[i] = j.len;
+        if (j.leader[i]) {
+            emit_rr(&j, true, 0x81, 0, REG_COUNT); // add
+            emit4(&j, j.rem[i] + 1);
+        }
+        if (insn->op == KS_OP_INVALID) {
+            add_stub(&j, emit_jmp32(&j), i, KS_VM_ERR_BAD_INSN);
+        } else if (insn->op == KS_OP_EXIT) {
+            add_stub(&j, emit_jmp32(&j), i, KS_VM_ERR_NONE);
+        } else {
+            emit_insn(&j, insn, i);
+        }
+        if (insn->op == KS_OP_LDDW) {
+            j.insn_off[++i] = j.len; // Second half: never a jump target
+        }
+    }
+
+    epilogue = j.len;
+    ks_jit_emit_epilogue(&j);
+    for (uint32_t k = 0; k < j.nstubs; k++) {
+        KsJitStub *stub = &j.stubs[k];
+
+        patch_rel32(&j, stub->pos, j.len);
+        patch_rel32(&j, emit_exit(&j, stub->pc, stub->adj, stub->err), epilogue);
+    }
+    for (uint32_t k = 0; k < j.nfixups; k++) {
+        patch_rel32(&j, j.fixups[k].pos, j.insn_off[j.fixups[k].target]);
+    }
+
+    code = mmap(NULL, j.len, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (code != MAP_FAILED) {
+        memcpy(code, j.code, j.len);
+        if (mprotect(code, j.len, PROT_READ | PROT_EXEC) == 0) {
+            jit = g_new0(KsEbpfJit, 1);
+            jit->code = code;
+            jit->size = j.len;
+        } else {
+            munmap(code, j.len);
+        }
+    }
+
+    g_free(j.code);
+    g_free(j.insn_off);
+    g_free(j.rem);
+    g_free(j.leader);
+    g_free(j.fixups);
+    g_free(j.stubs);
+    return jit;
+}
+
+void ks_ebpf_jit_free(KsEbpfJit *jit) {
+    if (jit) {
+        munmap(jit->code, jit->size);
+        g_free(jit);
+    }
+}
+
+// Same contract as ks_ebpf_run_interp()
+int ks_ebpf_run_jit(const KsEbpfJit *jit, KsEbpfRunCtx *ctx) {
+    static const bool no_stop;
+    // The budget is kept as a negative count; clamping is harmless at 2^63 insns
+    const uint64_t limit = MIN(ctx->insn_limit, (uint64_t)INT64_MAX);
+    const uint64_t mem_size = ctx->mem_size;
+    KsJitFrame f = {
+        .ctx = ctx,
+        .mem = ctx->mem,
+        .r1 = KS_EBPF_DATA_VA,
+        .r2 = ctx->data_len,
+        .r10 = KS_EBPF_DATA_VA + mem_size,
+        .count = -(int64_t)limit,
+        .stop = ctx->stop ? ctx->stop : &no_stop,
+        .bound = { mem_size - 1, mem_size - 2, mem_size - 4, mem_size - 8 },
+    };
+
+    ctx->out_len = ctx->out_max;
+    ((void (*)(KsJitFrame *))jit->code)(&f);
+
+    ctx->pc = f.pc;
+    ctx->icount = f.count + limit;
+    if (f.err == KS_VM_ERR_NONE) {
+        ctx->retval = f.retval;
+    }
+    return f.err;
+}
+
+#else
+
+KsEbpfJit *ks_ebpf_jit_compile(const KsEbpfProg *prog) {
+    return NULL;
+}
+
+void ks_ebpf_jit_free(KsEbpfJit *jit) {
+}
+
+int ks_ebpf_run_jit(const KsEbpfJit *jit, KsEbpfRunCtx *ctx) {
+    g_assert_not_reached();
+}
+
+#endif
@@ -1,5 +1,7 @@
 #include "qemu/osdep.h"
 #include "qemu/error-report.h"
+#include "qapi/error.h"
+#include "qapi/visitor.h"
 #include "hw/riscv/riscv.h"       // For RISC-V CPU stuff
 #include "hw/riscv/htif.h"        // If using HTIF console (less likely for full SoC)
 #include "hw/char/serial.h"       // For serial UART
@@ -23,6 +25,15 @@ OBJECT_DECLARE_SIMPLE_TYPE(KeystoneSoCMachineState, KEYSTONE_SOC_MACHINE)
 // #define BOOT_ROM_BASE_ADDR_QEMU      0x00010000UL // If CVA6 boot vector is here
 // #define BOOT_ROM_SIZE_QEMU           (64 * 1024)
 #define KEYSTONE_COPRO_CSR_BASE_ADDR_QEMU 0x10000000UL
+// Coprocessor n sits at base + n * stride; the stride fits a 64-slot CSR window
+#define KEYSTONE_COPRO_CSR_STRIDE_QEMU  0x00010000UL
+#define KEYSTONE_COPRO_MAX_INSTANCES_QEMU 8
+// Coprocessor n's shared-map window; the stride fits the largest "map-window-size"
+#define KEYSTONE_COPRO_MAP_WINDOW_BASE_ADDR_QEMU 0x20000000UL
+#define KEYSTONE_COPRO_MAP_WINDOW_STRIDE_QEMU  0x04000000UL
+// Coprocessor n's slot memory window; the stride fits 64 slots
+#define KEYSTONE_COPRO_SLOT_MEM_BASE_ADDR_QEMU 0x11000000UL
+#define KEYSTONE_COPRO_SLOT_MEM_STRIDE_QEMU    0x00100000UL
 #define PERIPHERALS_BASE_ADDR_QEMU      0x02000000UL // Base for generic peripherals
 #define UART_MM_OFFSET_QEMU             0x0000 // UART within peripheral region
 #define UART_BASE_ADDR_QEMU             (PERIPHERALS_BASE_ADDR_QEMU + UART_MM_OFFSET_QEMU)
@@ -33,7 +44,16 @@ OBJECT_DECLARE_SIMPLE_TYPE(KeystoneSoCMachineState, KEYSTONE_SOC_MACHINE)
 // Interrupt Numbers for PLIC
 // These are the "sources" for the PLIC.
 #define UART0_IRQ_NUM_QEMU              1  // Example PLIC source ID for UART
-#define KEYSTONE_COPRO_IRQ_NUM_QEMU     2  // Example PLIC source ID for Keystone Copro
+#define KEYSTONE_COPRO_IRQ_NUM_QEMU     2  // Example PLIC source ID for Keystone Copro; coprocessor n uses this + n
+// With copro-irq-lines=G, "vm-irq" line g of coprocessor n is source this + n * NUM_VM_SLOTS_QEMU + g
+#define KEYSTONE_COPRO_VM_IRQ_BASE_QEMU 32
+#define PLIC_NUM_SOURCES_QEMU           (KEYSTONE_COPRO_VM_IRQ_BASE_QEMU + \
+                                         KEYSTONE_COPRO_MAX_INSTANCES_QEMU * NUM_VM_SLOTS_QEMU)
+
+// Harts. Each has its own CLINT timer/software interrupt and its own S-mode
+// PLIC context (context i targets hart i), so the guest can route each PLIC
+// source, and with it each coprocessor line, to a different hart.
+#define KEYSTONE_SOC_MAX_HARTS_QEMU     8
 
 // Default CVA6 CPU type with "Y" extension (to be defined in QEMU CPU model)
 #define DEFAULT_CPU_TYPE RISCV_CPU_TYPE_NAME("rv64gcsu-cva6-y")
@@ -43,19 +63,25 @@ struct KeystoneSoCMachineState {
     MachineState parent_obj;
 
     /*< public >*/
-    RISCVCPU *cpu;
+    RISCVCPU *cpus[KEYSTONE_SOC_MAX_HARTS_QEMU];
     DeviceState *plic;
     DeviceState *clint;
-    DeviceState *keystone_copro;
+    DeviceState *keystone_copro[KEYSTONE_COPRO_MAX_INSTANCES_QEMU];
     DeviceState *uart0;
 
     MemoryRegion ram;
+
+    // Properties
+    uint32_t num_copros;  // "coprocessors": instances at strided CSR bases, each with its own PLIC source
+    uint32_t copro_slots; // "copro-slots": "num-slots" of every instance
+    uint32_t copro_irq_lines; // "copro-irq-lines": "vm-irq-lines" of every instance
     // MemoryRegion boot_rom; // If explicitly loading a ROM file for CVA6 boot
 };
 
 static void keystone_soc_init(MachineState *machine) {
     KeystoneSoCMachineState *s = KEYSTONE_SOC_MACHINE(machine);
     MemoryRegion *system_memory = get_system_memory();
+    unsigned int num_harts = machine->smp.cpus;
     Error *errp = NULL; // For error reporting
 
     qemu_log_mask(LOG_TRACE, "[%s] Initializing machine\n", machine->type_name);
@@ -75,16 +101,19 @@ static void keystone_soc_init(MachineState *machine) {
                   machine->type_name, MAIN_MEM_BASE_ADDR_QEMU, machine->ram_size / MiB);
 
 
-    // 2. Create CPU
+    // 2. Create CPUs, one per hart (-smp N)
     if (machine->cpu_type == NULL) {
         machine->cpu_type = DEFAULT_CPU_TYPE;
         qemu_log_mask(LOG_TRACE, "[%s] CPU type not specified, using default: %s\n",
                       machine->type_name, machine->cpu_type);
     }
-    s->cpu = cpu_riscv_init(machine->cpu_type);
-    if (s->cpu == NULL) {
-        error_setg(&errp, "Unable to initialize CPU %s", machine->cpu_type);
-        goto error_out;
+    for (unsigned int i = 0; i < num_harts; i++) {
+        s->cpus[i] = cpu_riscv_init(machine->cpu_type);
+        if (s->cpus[i] == NULL) {
+            error_setg(&errp, "Unable to initialize CPU %s", machine->cpu_type);
+            goto error_out;
+        }
+        s->cpus[i]->env.mhartid = i;
     }
     // Configure CPU features (MISA, priv spec)
     // Example: RV64GC + Supervisor mode. The "Y" extension would be part of the CPU type.
@@ -93,42 +122,73 @@ static void keystone_soc_init(MachineState *machine) {
     // riscv_cpu_set_priv_spec(s->cpu, PRIV_SPEC_VERSION_1_11);
     // uint64_t misa = riscv_cpu_misa_from_str(s->cpu, "rv64gcsu"); // Check if "Y" needs to be in MISA string
     // riscv_cpu_set_misa(s->cpu, misa);
-    qemu_log_mask(LOG_TRACE, "[%s] CPU initialized: %s\n", machine->type_name, machine->cpu_type);
+    qemu_log_mask(LOG_TRACE, "[%s] %u CPUs initialized: %s\n", machine->type_name, num_harts, machine->cpu_type);
 
 
     // 3. PLIC (Platform-Level Interrupt Controller)
     s->plic = qdev_new(TYPE_RISCV_PLIC);
     // Define number of sources, priority levels, etc.
-    // qdev_prop_set_uint32(DEVICE(s->plic), "num_sources", NUM_PLIC_SOURCES_QEMU);
+    qdev_prop_set_uint32(DEVICE(s->plic), "num_sources", PLIC_NUM_SOURCES_QEMU);
+    qdev_prop_set_uint32(DEVICE(s->plic), "num_harts", num_harts);
     // qdev_prop_set_uint32(DEVICE(s->plic), "num_priorities", NUM_PLIC_PRIORITIES_QEMU);
     sysbus_realize_and_unref(SYS_BUS_DEVICE(s->plic), &errp);
     if (errp) goto error_out;
     sysbus_mmio_map(SYS_BUS_DEVICE(s->plic), 0, PLIC_BASE_ADDR_QEMU);
-    qdev_connect_gpio_out(DEVICE(s->plic), 0, s->cpu->env.irq[IRQ_S_EXT]); // Connect PLIC output to CPU S-mode EXT IRQ
+    for (unsigned int i = 0; i < num_harts; i++) {
+        // Context i's output to hart i's S-mode EXT IRQ
+        qdev_connect_gpio_out(DEVICE(s->plic), i, s->cpus[i]->env.irq[IRQ_S_EXT]);
+    }
     // Or IRQ_M_EXT if CPU runs in M-mode primarily for kernel
     qemu_log_mask(LOG_TRACE, "[%s] PLIC initialized at 0x%08lx\n", machine->type_name, PLIC_BASE_ADDR_QEMU);
 
 
     // 4. CLINT (Core Local Interruptor)
     s->clint = qdev_new(TYPE_RISCV_CLINT);
-    // qdev_prop_set_uint32(DEVICE(s->clint), "num_harts", 1); // Assuming 1 hart for now
+    qdev_prop_set_uint32(DEVICE(s->clint), "num_harts", num_harts);
     sysbus_realize_and_unref(SYS_BUS_DEVICE(s->clint), &errp);
     if (errp) goto error_out;
     sysbus_mmio_map(SYS_BUS_DEVICE(s->clint), 0, CLINT_BASE_ADDR_QEMU);
-    qdev_connect_gpio_out_named(DEVICE(s->clint), "mtip", 0, s->cpu->env.irq[IRQ_S_TIMER]); // S-mode timer
-    qdev_connect_gpio_out_named(DEVICE(s->clint), "msip", 0, s->cpu->env.irq[IRQ_S_SOFT]);  // S-mode software
+    for (unsigned int i = 0; i < num_harts; i++) {
+        qdev_connect_gpio_out_named(DEVICE(s->clint), "mtip", i, s->cpus[i]->env.irq[IRQ_S_TIMER]); // S-mode timer
+        qdev_connect_gpio_out_named(DEVICE(s->clint), "msip", i, s->cpus[i]->env.irq[IRQ_S_SOFT]);  // S-mode software
+    }
     // Or M-mode: IRQ_M_TIMER, IRQ_M_SOFT
     qemu_log_mask(LOG_TRACE, "[%s] CLINT initialized at 0x%08lx\n", machine->type_name, CLINT_BASE_ADDR_QEMU);
 
 
-    // 5. Keystone Coprocessor Device
-    s->keystone_copro = qdev_new(TYPE_KEYSTONE_COPRO);
-    sysbus_realize_and_unref(SYS_BUS_DEVICE(s->keystone_copro), &errp);
-    if (errp) goto error_out;
-    sysbus_mmio_map(SYS_BUS_DEVICE(s->keystone_copro), 0, KEYSTONE_COPRO_CSR_BASE_ADDR_QEMU);
-    qdev_connect_gpio_out(DEVICE(s->keystone_copro), 0, qdev_get_gpio_in(DEVICE(s->plic), KEYSTONE_COPRO_IRQ_NUM_QEMU));
-    qemu_log_mask(LOG_TRACE, "[%s] Keystone Coprocessor initialized at 0x%08lx, IRQ connected to PLIC source %d\n",
-                  machine->type_name, KEYSTONE_COPRO_CSR_BASE_ADDR_QEMU, KEYSTONE_COPRO_IRQ_NUM_QEMU);
+    // 5. Keystone Coprocessor Devices
+    for (uint32_t i = 0; i < s->num_copros; i++) {
+        hwaddr base = KEYSTONE_COPRO_CSR_BASE_ADDR_QEMU + i * KEYSTONE_COPRO_CSR_STRIDE_QEMU;
+        int irq = KEYSTONE_COPRO_IRQ_NUM_QEMU + i;
+
+        s->keystone_copro[i] = qdev_new(TYPE_KEYSTONE_COPRO);
+        qdev_prop_set_uint32(s->keystone_copro[i], "num-slots", s->copro_slots);
+        qdev_prop_set_uint32(s->keystone_copro[i], "vm-irq-lines", s->copro_irq_lines);
+        // The coprocessor's AXI master sees the same system bus as the CPU
+        object_property_set_link(OBJECT(s->keystone_copro[i]), "dma-mr", OBJECT(system_memory), &error_abort);
+        sysbus_realize_and_unref(SYS_BUS_DEVICE(s->keystone_copro[i]), &errp);
+        if (errp) goto error_out;
+        sysbus_mmio_map(SYS_BUS_DEVICE(s->keystone_copro[i]), 0, base);
+        sysbus_mmio_map(SYS_BUS_DEVICE(s->keystone_copro[i]), 1,
+                        KEYSTONE_COPRO_MAP_WINDOW_BASE_ADDR_QEMU + i * KEYSTONE_COPRO_MAP_WINDOW_STRIDE_QEMU);
+        sysbus_mmio_map(SYS_BUS_DEVICE(s->keystone_copro[i]), 2,
+                        KEYSTONE_COPRO_SLOT_MEM_BASE_ADDR_QEMU + i * KEYSTONE_COPRO_SLOT_MEM_STRIDE_QEMU);
+        qdev_connect_gpio_out(DEVICE(s->keystone_copro[i]), 0, qdev_get_gpio_in(DEVICE(s->plic), irq));
+        // Slot i's completions on line i % copro-irq-lines, each its own PLIC source
+        for (uint32_t g = 0; g < s->copro_irq_lines; g++) {
+            int vm_irq = KEYSTONE_COPRO_VM_IRQ_BASE_QEMU + i * NUM_VM_SLOTS_QEMU + g;
+
+            qdev_connect_gpio_out_named(DEVICE(s->keystone_copro[i]), "vm-irq", g,
+                                        qdev_get_gpio_in(DEVICE(s->plic), vm_irq));
+        }
+        qemu_log_mask(LOG_TRACE, "[%s] Keystone Coprocessor %u initialized at 0x%08lx, %u slots, IRQ connected to PLIC source %d, "
+                      "%u VM IRQ lines from source %d\n", machine->type_name, i, base, s->copro_slots, irq,
+                      s->copro_irq_lines, KEYSTONE_COPRO_VM_IRQ_BASE_QEMU + (int)(i * NUM_VM_SLOTS_QEMU));
+    }
+    // Each hart's BPF.VM.* helpers call the first device directly (QEMU_CPU_ISA_Y_Mod_Spec.md)
+    for (unsigned int i = 0; i < num_harts; i++) {
+        s->cpus[i]->env.ks_copro = KEYSTONE_COPRO(s->keystone_copro[0]);
+    }
 
 
     // 6. UART (Serial Port)
@@ -152,7 +212,7 @@ static void keystone_soc_init(MachineState *machine) {
     //                        BOOT_ROM_SIZE_QEMU, &errp);
     // if (errp) goto error_out;
     // rom_add_file_fixed(machine->kernel_filename ? machine->kernel_filename : "bootrom.bin", // Or a fixed name
-    //                    &s->boot_rom, BOOT_ROM_SIZE_QEMU, CPU_ADDRESS_SPACE(s->cpu), &errp);
+    //                    &s->boot_rom, BOOT_ROM_SIZE_QEMU, CPU_ADDRESS_SPACE(s->cpus[0]), &errp);
     // if (errp) goto error_out;
     // memory_region_add_subregion(system_memory, BOOT_ROM_BASE_ADDR_QEMU, &s->boot_rom);
     // qemu_log_mask(LOG_TRACE, "[%s] Boot ROM mapped at 0x%08lx\n", machine->type_name, BOOT_ROM_BASE_ADDR_QEMU);
@@ -162,7 +222,7 @@ static void keystone_soc_init(MachineState *machine) {
     // This depends on the CVA6 model's reset behavior.
     // Typically, the CPU model has a default reset vector.
     // If it needs to be overridden by the machine:
-    // s->cpu->env.pc = BOOT_ROM_BASE_ADDR_QEMU; // Or wherever U-Boot/kernel is loaded by QEMU
+    // s->cpus[i]->env.pc = BOOT_ROM_BASE_ADDR_QEMU; // Or wherever U-Boot/kernel is loaded by QEMU
 
     qemu_log_mask(LOG_TRACE, "[%s] Machine initialization complete.\n", machine->type_name);
     return;
@@ -173,6 +233,39 @@ error_out:
     exit(1); // Or handle error more gracefully if possible
 }
 
+static void keystone_soc_get_uint32(Object *obj, Visitor *v, const char *name, void *opaque, Error **errp) {
+    visit_type_uint32(v, name, (uint32_t *)((char *)obj + (uintptr_t)opaque), errp);
+}
+
+static void keystone_soc_set_uint32(Object *obj, Visitor *v, const char *name, void *opaque, Error **errp) {
+    visit_type_uint32(v, name, (uint32_t *)((char *)obj + (uintptr_t)opaque), errp);
+}
+
+static bool keystone_soc_check_copros(KeystoneSoCMachineState *s, Error **errp) {
+    if (s->num_copros < 1 || s->num_copros > KEYSTONE_COPRO_MAX_INSTANCES_QEMU) {
+        error_setg(errp, "coprocessors must be from 1 to %d", KEYSTONE_COPRO_MAX_INSTANCES_QEMU);
+        return false;
+    }
+    return true;
+}
+
+static void keystone_soc_set_copros(Object *obj, Visitor *v, const char *name, void *opaque, Error **errp) {
+    KeystoneSoCMachineState *s = KEYSTONE_SOC_MACHINE(obj);
+    uint32_t old = s->num_copros;
+
+    keystone_soc_set_uint32(obj, v, name, opaque, errp);
+    if (!keystone_soc_check_copros(s, errp)) {
+        s->num_copros = old;
+    }
+}
+
+static void keystone_soc_machine_instance_init(Object *obj) {
+    KeystoneSoCMachineState *s = KEYSTONE_SOC_MACHINE(obj);
+
+    s->num_copros = 1;
+    s->copro_slots = KS_VM_LEGACY_SLOTS;
+}
+
 static void keystone_soc_machine_class_init(ObjectClass *oc, void *data) {
     MachineClass *mc = MACHINE_CLASS(oc);
 
@@ -181,15 +274,29 @@ static void keystone_soc_machine_class_init(ObjectClass *oc, void *data) {
     mc->default_cpu_type = DEFAULT_CPU_TYPE;
     mc->default_ram_size = 1 * GiB; // 1 GB
     mc->min_cpus = 1;
-    mc->max_cpus = 1; // For now, single core CVA6
+    mc->max_cpus = KEYSTONE_SOC_MAX_HARTS_QEMU; // -smp N CVA6 harts
     // mc->default_ram_id = ...; // If needed
     // mc->reset = ...; // If a custom machine reset beyond device resets is needed
+
+    // -machine keystone-soc,coprocessors=N,copro-slots=M,copro-irq-lines=G; the device checks the slot and line counts
+    object_class_property_add(oc, "coprocessors", "uint32", keystone_soc_get_uint32, keystone_soc_set_copros,
+                              NULL, (void *)offsetof(KeystoneSoCMachineState, num_copros));
+    object_class_property_set_description(oc, "coprocessors", "Keystone coprocessor instances (1-8)");
+    object_class_property_add(oc, "copro-slots", "uint32", keystone_soc_get_uint32, keystone_soc_set_uint32,
+                              NULL, (void *)offsetof(KeystoneSoCMachineState, copro_slots));
+    object_class_property_set_description(oc, "copro-slots", "eBPF VM slots per coprocessor (1-64)");
+    object_class_property_add(oc, "copro-irq-lines", "uint32", keystone_soc_get_uint32, keystone_soc_set_uint32,
+                              NULL, (void *)offsetof(KeystoneSoCMachineState, copro_irq_lines));
+    object_class_property_set_description(oc, "copro-irq-lines",
+                                          "Per-slot-group interrupt lines per coprocessor, "
+                                          "each a PLIC source (0 for one line)");
 }
 
 static const TypeInfo keystone_soc_machine_info = {
     .name = TYPE_KEYSTONE_SOC_MACHINE,
     .parent = TYPE_MACHINE,
     .instance_size = sizeof(KeystoneSoCMachineState),
+    .instance_init = keystone_soc_machine_instance_init,
     .class_init = keystone_soc_machine_class_init,
 };
 